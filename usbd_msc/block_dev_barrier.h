@@ -0,0 +1,54 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_BARRIER_H__
+#define BLOCK_DEV_BARRIER_H__
+
+#include <stdint.h>
+
+#include "nrf_block_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_barrier Block device write barrier request
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev ioctl making written blocks durable before the caller goes on.
+ *
+ * Stacked devices which keep metadata (a summary or a mapping table) pointing at
+ * their data issue it on the data before writing the metadata, and on the metadata
+ * before the blocks it no longer points at are reused. Unlike
+ * @ref NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH it is never deferred: it returns once the
+ * blocks are on flash, whatever the cache mode. Devices without a write cache
+ * return NRF_ERROR_NOT_SUPPORTED, which callers ignore.
+ */
+
+/**
+ * @brief Write barrier ioctl request, past the SDK @ref nrf_block_dev_ioctl_req_t values.
+ *
+ * The ioctl data is a @ref block_dev_barrier_req_t, or NULL for the whole device.
+ */
+#define BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER ((nrf_block_dev_ioctl_req_t)0x101)
+
+/**
+ * @brief Write barrier request data.
+ */
+typedef struct
+{
+        uint32_t blk_id;    //!< First block.
+        uint32_t blk_count; //!< Number of blocks.
+} block_dev_barrier_req_t;
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_BARRIER_H__ */
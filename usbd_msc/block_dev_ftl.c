@@ -0,0 +1,951 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "block_dev_ftl.h"
+#include "nrf_assert.h"
+
+#define NRF_LOG_MODULE_NAME block_dev_ftl
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Summary block magic, "FTL1".
+ */
+#define FTL_MAGIC               0x314C5446
+
+/**
+ * @brief Summary words before the per-slot logical block numbers.
+ */
+#define FTL_SUMMARY_HDR_WORDS   2
+
+/**
+ * @brief Unmapped logical block, unused segment or slot.
+ */
+#define FTL_UNMAPPED            0xFFFF
+#define FTL_INVALID             0xFFFFFFFF
+
+/**
+ * @brief Blocks copied per background collection step.
+ */
+#define FTL_GC_STEP_BLOCKS      4
+
+static nrf_block_dev_t const * block_dev_ftl_lower(block_dev_ftl_t const * p_ftl_dev)
+{
+        return &p_ftl_dev->p_qspi_dev->block_dev;
+}
+
+static uint32_t block_dev_ftl_slots(block_dev_ftl_work_t const * p_work)
+{
+        return p_work->seg_blocks - 1;
+}
+
+static uint32_t block_dev_ftl_phys(block_dev_ftl_work_t const * p_work, uint32_t seg, uint32_t slot)
+{
+        return seg * p_work->seg_blocks + 1 + slot;
+}
+
+static void block_dev_ftl_event(block_dev_ftl_t const * p_ftl_dev,
+                                nrf_block_dev_event_type_t ev_type,
+                                ret_code_t result,
+                                nrf_block_req_t const * p_blk)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        if (!p_work->ev_handler)
+        {
+                return;
+        }
+
+        const nrf_block_dev_event_t ev = {
+                ev_type,
+                (result == NRF_SUCCESS) ? NRF_BLOCK_DEV_RESULT_SUCCESS : NRF_BLOCK_DEV_RESULT_IO_ERROR,
+                p_blk,
+                p_work->p_context
+        };
+
+        p_work->ev_handler(&p_ftl_dev->block_dev, &ev);
+}
+
+static ret_code_t block_dev_ftl_lower_read(block_dev_ftl_t const * p_ftl_dev,
+                                           void * p_buff,
+                                           uint32_t blk_id,
+                                           uint32_t blk_count)
+{
+        nrf_block_req_t req = {
+                .p_buff    = p_buff,
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        return nrf_blk_dev_read_req(block_dev_ftl_lower(p_ftl_dev), &req);
+}
+
+static ret_code_t block_dev_ftl_lower_write(block_dev_ftl_t const * p_ftl_dev,
+                                            void const * p_buff,
+                                            uint32_t blk_id,
+                                            uint32_t blk_count)
+{
+        nrf_block_req_t req = {
+                .p_buff    = (void *)p_buff,
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        return nrf_blk_dev_write_req(block_dev_ftl_lower(p_ftl_dev), &req);
+}
+
+/**
+ * @brief Wait until a range of lower blocks is on flash, the whole device with no blocks.
+ */
+static ret_code_t block_dev_ftl_lower_barrier(block_dev_ftl_t const * p_ftl_dev,
+                                              uint32_t blk_id,
+                                              uint32_t blk_count)
+{
+        block_dev_barrier_req_t req = {
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        return nrf_blk_dev_ioctl(block_dev_ftl_lower(p_ftl_dev), BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER,
+                                 blk_count ? &req : NULL);
+}
+
+/**
+ * @brief Drop the old copy of a logical block, free its segment once empty.
+ */
+static void block_dev_ftl_invalidate(block_dev_ftl_work_t * p_work, uint32_t phys)
+{
+        uint32_t seg = phys / p_work->seg_blocks;
+
+        ASSERT(p_work->valid[seg]);
+        if (--p_work->valid[seg] == 0 && seg != p_work->open_seg)
+        {
+                p_work->seg_seq[seg] = 0;
+                p_work->free_segs++;
+        }
+}
+
+/**
+ * @brief Drop the mapping of a logical block range.
+ */
+static void block_dev_ftl_unmap(block_dev_ftl_work_t * p_work, uint32_t lsn, uint32_t blk_count)
+{
+        for (uint32_t i = lsn; i < lsn + blk_count; ++i)
+        {
+                if (p_work->map[i] != FTL_UNMAPPED)
+                {
+                        block_dev_ftl_invalidate(p_work, p_work->map[i]);
+                        p_work->map[i] = FTL_UNMAPPED;
+                        p_work->stats.trim_blocks++;
+                }
+        }
+}
+
+/**
+ * @brief Erase the next free segment and make it the open one.
+ */
+static ret_code_t block_dev_ftl_open(block_dev_ftl_t const * p_ftl_dev)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t seg = p_work->next_seg;
+
+        /* Round-robin over free segments spreads erases over the whole flash */
+        for (uint32_t i = 0; i < p_work->seg_count; ++i)
+        {
+                if (!p_work->seg_seq[seg] && seg != p_work->gc_seg)
+                {
+                        break;
+                }
+                seg = (seg + 1) % p_work->seg_count;
+        }
+
+        if (p_work->seg_seq[seg] || seg == p_work->gc_seg)
+        {
+                return NRF_ERROR_NO_MEM;
+        }
+
+        /* An open segment with all blocks overwritten is free once closed */
+        if (p_work->open_seg != FTL_INVALID && !p_work->valid[p_work->open_seg])
+        {
+                p_work->seg_seq[p_work->open_seg] = 0;
+                p_work->free_segs++;
+        }
+
+        /* Summaries pointing at the new copies of its blocks have to be on flash first */
+        ret_code_t ret = block_dev_ftl_lower_barrier(p_ftl_dev, 0, 0);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        ret = block_dev_qspi_discard(p_ftl_dev->p_qspi_dev,
+                                                seg * p_work->seg_blocks,
+                                                p_work->seg_blocks);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->stats.erases++;
+        p_work->free_segs--;
+        p_work->seg_seq[seg] = ++p_work->seq;
+        p_work->open_seg     = seg;
+        p_work->open_slot    = 0;
+        p_work->next_seg     = (seg + 1) % p_work->seg_count;
+
+        memset(p_work->summary, 0xFF, sizeof(p_work->summary));
+        p_work->summary[0] = FTL_MAGIC;
+        p_work->summary[1] = p_work->seq;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Append a run of logical blocks to the open segment.
+ *
+ * @param lsn       First logical block.
+ * @param blk_count Number of blocks, must fit in the open segment.
+ * @param p_buff    Data.
+ */
+static ret_code_t block_dev_ftl_append(block_dev_ftl_t const * p_ftl_dev,
+                                       uint32_t lsn,
+                                       uint32_t blk_count,
+                                       void const * p_buff)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t phys = block_dev_ftl_phys(p_work, p_work->open_seg, p_work->open_slot);
+
+        ASSERT(p_work->open_slot + blk_count <= block_dev_ftl_slots(p_work));
+
+        ret_code_t ret = block_dev_ftl_lower_write(p_ftl_dev, p_buff, phys, blk_count);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Data on flash first, so a summary entry always points at written data */
+        ret = block_dev_ftl_lower_barrier(p_ftl_dev, phys, blk_count);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                p_work->summary[FTL_SUMMARY_HDR_WORDS + p_work->open_slot + i] = lsn + i;
+        }
+
+        ret = block_dev_ftl_lower_write(p_ftl_dev, p_work->summary,
+                                        p_work->open_seg * p_work->seg_blocks, 1);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                if (p_work->map[lsn + i] != FTL_UNMAPPED)
+                {
+                        block_dev_ftl_invalidate(p_work, p_work->map[lsn + i]);
+                }
+                p_work->map[lsn + i] = phys + i;
+        }
+
+        p_work->valid[p_work->open_seg] += blk_count;
+        p_work->open_slot += blk_count;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Wait until the summaries mapping a logical block range are on flash.
+ *
+ * The data is already there, @ref block_dev_ftl_append orders it before the summary.
+ */
+static ret_code_t block_dev_ftl_barrier(block_dev_ftl_t const * p_ftl_dev,
+                                        uint32_t lsn,
+                                        uint32_t blk_count)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t last_seg = FTL_INVALID;
+
+        for (uint32_t i = lsn; i < lsn + blk_count; ++i)
+        {
+                if (p_work->map[i] == FTL_UNMAPPED)
+                {
+                        continue;
+                }
+
+                uint32_t seg = p_work->map[i] / p_work->seg_blocks;
+                if (seg == last_seg)
+                {
+                        continue;
+                }
+
+                ret_code_t ret = block_dev_ftl_lower_barrier(p_ftl_dev, seg * p_work->seg_blocks, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                last_seg = seg;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Pick the closed segment with the fewest valid blocks.
+ */
+static uint32_t block_dev_ftl_victim(block_dev_ftl_work_t const * p_work)
+{
+        uint32_t victim = FTL_INVALID;
+        uint32_t best   = block_dev_ftl_slots(p_work);
+
+        for (uint32_t seg = 0; seg < p_work->seg_count; ++seg)
+        {
+                if (p_work->seg_seq[seg] && seg != p_work->open_seg && p_work->valid[seg] < best)
+                {
+                        best   = p_work->valid[seg];
+                        victim = seg;
+                }
+        }
+
+        return victim;
+}
+
+/**
+ * @brief Copy up to @p max_blocks valid blocks out of the collected segment.
+ *
+ * @param p_done Set when the collected segment is empty.
+ */
+static ret_code_t block_dev_ftl_gc_step(block_dev_ftl_t const * p_ftl_dev,
+                                        uint32_t max_blocks,
+                                        bool * p_done)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        ret_code_t ret;
+
+        *p_done = false;
+
+        if (p_work->gc_seg == FTL_INVALID)
+        {
+                uint32_t victim = block_dev_ftl_victim(p_work);
+                if (victim == FTL_INVALID)
+                {
+                        *p_done = true;
+                        return NRF_ERROR_NO_MEM;
+                }
+
+                ret = block_dev_ftl_lower_read(p_ftl_dev, p_work->gc_summary,
+                                               victim * p_work->seg_blocks, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                p_work->gc_seg  = victim;
+                p_work->gc_slot = 0;
+        }
+
+        uint32_t slots = block_dev_ftl_slots(p_work);
+
+        while (p_work->gc_slot < slots && p_work->valid[p_work->gc_seg] && max_blocks)
+        {
+                uint32_t slot = p_work->gc_slot;
+                uint32_t lsn  = p_work->gc_summary[FTL_SUMMARY_HDR_WORDS + slot];
+                uint32_t phys = block_dev_ftl_phys(p_work, p_work->gc_seg, slot);
+
+                if (lsn >= p_work->geometry.blk_count || p_work->map[lsn] != phys)
+                {
+                        p_work->gc_slot++;
+                        continue;
+                }
+
+                if (p_work->open_seg == FTL_INVALID || p_work->open_slot == slots)
+                {
+                        /* Collection may use the last free segment */
+                        ret = block_dev_ftl_open(p_ftl_dev);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                }
+
+                ret = block_dev_ftl_lower_read(p_ftl_dev, p_work->buff, phys, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                ret = block_dev_ftl_append(p_ftl_dev, lsn, 1, p_work->buff);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                p_work->stats.gc_blocks++;
+                p_work->gc_slot++;
+                max_blocks--;
+        }
+
+        if (p_work->gc_slot == slots || !p_work->valid[p_work->gc_seg])
+        {
+                /* Last copy freed the segment through block_dev_ftl_invalidate */
+                ASSERT(!p_work->valid[p_work->gc_seg]);
+                p_work->stats.gc_segments++;
+                p_work->gc_seg = FTL_INVALID;
+                *p_done = true;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Slots of the open segment a user write may take.
+ *
+ * Without a free segment, the collection in progress needs the room for the
+ * blocks it still has to copy, or it could never free its segment.
+ */
+static uint32_t block_dev_ftl_user_room(block_dev_ftl_work_t const * p_work)
+{
+        if (p_work->open_seg == FTL_INVALID)
+        {
+                return 0;
+        }
+
+        uint32_t room = block_dev_ftl_slots(p_work) - p_work->open_slot;
+        if (!p_work->free_segs && p_work->gc_seg != FTL_INVALID)
+        {
+                room = (room > p_work->valid[p_work->gc_seg]) ? room - p_work->valid[p_work->gc_seg] : 0;
+        }
+
+        return room;
+}
+
+/**
+ * @brief Make room in the open segment for a user write.
+ */
+static ret_code_t block_dev_ftl_reserve(block_dev_ftl_t const * p_ftl_dev)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        if (block_dev_ftl_user_room(p_work))
+        {
+                return NRF_SUCCESS;
+        }
+
+        /* Background collection took the last free segment, finish it in the room kept for it */
+        if (!p_work->free_segs && p_work->gc_seg != FTL_INVALID)
+        {
+                bool done;
+                ret_code_t ret = block_dev_ftl_gc_step(p_ftl_dev, UINT32_MAX, &done);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (block_dev_ftl_user_room(p_work))
+                {
+                        return NRF_SUCCESS;
+                }
+        }
+
+        /* Keep the last free segment for collection */
+        while (p_work->free_segs <= 1)
+        {
+                bool done;
+                ret_code_t ret = block_dev_ftl_gc_step(p_ftl_dev, UINT32_MAX, &done);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                /* Collection filled the open segment, carry on in the new one */
+                if (block_dev_ftl_user_room(p_work))
+                {
+                        return NRF_SUCCESS;
+                }
+        }
+
+        return block_dev_ftl_open(p_ftl_dev);
+}
+
+static ret_code_t block_dev_ftl_read(block_dev_ftl_t const * p_ftl_dev,
+                                     nrf_block_req_t const * p_blk)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t blk_size = p_work->geometry.blk_size;
+        uint8_t * p_buff  = p_blk->p_buff;
+        uint32_t i = 0;
+
+        while (i < p_blk->blk_count)
+        {
+                uint16_t phys = p_work->map[p_blk->blk_id + i];
+                uint32_t n = 1;
+
+                /* Merge runs stored back to back */
+                while (i + n < p_blk->blk_count &&
+                       ((phys == FTL_UNMAPPED) ?
+                        (p_work->map[p_blk->blk_id + i + n] == FTL_UNMAPPED) :
+                        (p_work->map[p_blk->blk_id + i + n] == phys + n)))
+                {
+                        n++;
+                }
+
+                if (phys == FTL_UNMAPPED)
+                {
+                        memset(p_buff + i * blk_size, 0xFF, n * blk_size);
+                }
+                else
+                {
+                        ret_code_t ret = block_dev_ftl_lower_read(p_ftl_dev, p_buff + i * blk_size,
+                                                                  phys, n);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                }
+
+                i += n;
+        }
+
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_ftl_write(block_dev_ftl_t const * p_ftl_dev,
+                                      nrf_block_req_t const * p_blk)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t blk_size     = p_work->geometry.blk_size;
+        uint8_t const * p_buff = p_blk->p_buff;
+        uint32_t i = 0;
+
+        while (i < p_blk->blk_count)
+        {
+                ret_code_t ret = block_dev_ftl_reserve(p_ftl_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                uint32_t n = MIN(p_blk->blk_count - i, block_dev_ftl_user_room(p_work));
+
+                ret = block_dev_ftl_append(p_ftl_dev, p_blk->blk_id + i, n, p_buff + i * blk_size);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                p_work->stats.host_blocks += n;
+                i += n;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Free a segment after a power loss while collection held the last free one.
+ *
+ * Collection then runs in the rest of the newest segment, which the room kept by
+ * @ref block_dev_ftl_user_room makes large enough for the segment with the fewest
+ * valid blocks. Its slots past the last summary entry may hold torn data and are
+ * written again through the QSPI device, which erases what does not program in place.
+ *
+ * @param seg Newest segment.
+ */
+static ret_code_t block_dev_ftl_recover(block_dev_ftl_t const * p_ftl_dev, uint32_t seg)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t slots = block_dev_ftl_slots(p_work);
+
+        ret_code_t ret = block_dev_ftl_lower_read(p_ftl_dev, p_work->summary,
+                                                  seg * p_work->seg_blocks, 1);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->open_seg  = seg;
+        p_work->open_slot = slots;
+        while (p_work->open_slot &&
+               p_work->summary[FTL_SUMMARY_HDR_WORDS + p_work->open_slot - 1] == FTL_INVALID)
+        {
+                p_work->open_slot--;
+        }
+
+        NRF_LOG_WARNING("No free segment, collecting into segment %u from slot %u",
+                        seg, p_work->open_slot);
+
+        bool done = false;
+        while (!done)
+        {
+                ret = block_dev_ftl_gc_step(p_ftl_dev, UINT32_MAX, &done);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Rebuild the mapping from the segment summaries.
+ */
+static ret_code_t block_dev_ftl_mount(block_dev_ftl_t const * p_ftl_dev)
+{
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+        uint32_t slots  = block_dev_ftl_slots(p_work);
+        uint32_t newest = 0;
+
+        memset(p_work->map, 0xFF, sizeof(p_work->map));
+        memset(p_work->valid, 0, sizeof(p_work->valid));
+        memset(p_work->seg_seq, 0, sizeof(p_work->seg_seq));
+        p_work->seq = 0;
+
+        for (uint32_t seg = 0; seg < p_work->seg_count; ++seg)
+        {
+                ret_code_t ret = block_dev_ftl_lower_read(p_ftl_dev, p_work->gc_summary,
+                                                          seg * p_work->seg_blocks, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                uint32_t seq = p_work->gc_summary[1];
+                if (p_work->gc_summary[0] != FTL_MAGIC || !seq || seq == FTL_INVALID)
+                {
+                        continue;
+                }
+
+                p_work->seg_seq[seg] = seq;
+                if (seq > p_work->seq)
+                {
+                        p_work->seq = seq;
+                        newest      = seg;
+                }
+
+                for (uint32_t slot = 0; slot < slots; ++slot)
+                {
+                        uint32_t lsn  = p_work->gc_summary[FTL_SUMMARY_HDR_WORDS + slot];
+                        uint32_t phys = block_dev_ftl_phys(p_work, seg, slot);
+
+                        if (lsn >= p_work->geometry.blk_count)
+                        {
+                                continue;
+                        }
+
+                        uint16_t old = p_work->map[lsn];
+                        if (old != FTL_UNMAPPED)
+                        {
+                                /* Same segment: later slot wins, slots are filled in order */
+                                uint32_t old_seq = p_work->seg_seq[old / p_work->seg_blocks];
+                                if (old_seq > seq)
+                                {
+                                        continue;
+                                }
+                        }
+
+                        p_work->map[lsn] = phys;
+                }
+        }
+
+        for (uint32_t lsn = 0; lsn < p_work->geometry.blk_count; ++lsn)
+        {
+                if (p_work->map[lsn] != FTL_UNMAPPED)
+                {
+                        p_work->valid[p_work->map[lsn] / p_work->seg_blocks]++;
+                }
+        }
+
+        p_work->free_segs = 0;
+        for (uint32_t seg = 0; seg < p_work->seg_count; ++seg)
+        {
+                if (!p_work->valid[seg])
+                {
+                        p_work->seg_seq[seg] = 0;
+                }
+
+                if (!p_work->seg_seq[seg])
+                {
+                        p_work->free_segs++;
+                }
+        }
+
+        /* Never append to a segment left open by a power loss, its slots may be torn */
+        p_work->open_seg  = FTL_INVALID;
+        p_work->open_slot = 0;
+        p_work->next_seg  = (newest + 1) % p_work->seg_count;
+        p_work->gc_seg    = FTL_INVALID;
+
+        if (!p_work->free_segs)
+        {
+                ret_code_t ret = block_dev_ftl_recover(p_ftl_dev, newest);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        NRF_LOG_INFO("Mounted %u segments, %u free, seq %u",
+                     p_work->seg_count, p_work->free_segs, p_work->seq);
+        return NRF_SUCCESS;
+}
+
+ret_code_t block_dev_ftl_format(block_dev_ftl_t const * p_ftl_dev)
+{
+        ASSERT(p_ftl_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        ret_code_t ret = block_dev_qspi_discard(p_ftl_dev->p_qspi_dev, 0,
+                                                p_work->seg_count * p_work->seg_blocks);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        return block_dev_ftl_mount(p_ftl_dev);
+}
+
+bool block_dev_ftl_process(block_dev_ftl_t const * p_ftl_dev)
+{
+        ASSERT(p_ftl_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        /* Refill the spare pool ahead of the writes which would otherwise wait for it */
+        if (!p_work->initialized ||
+            (p_work->gc_seg == FTL_INVALID &&
+             p_work->free_segs + 1 >= BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS))
+        {
+                return false;
+        }
+
+        bool done;
+        ret_code_t ret = block_dev_ftl_gc_step(p_ftl_dev, FTL_GC_STEP_BLOCKS, &done);
+        if (ret != NRF_SUCCESS)
+        {
+                NRF_LOG_WARNING("Collection failed: %u", ret);
+                return false;
+        }
+
+        return !done || p_work->free_segs + 1 < BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS;
+}
+
+block_dev_ftl_stats_t const * block_dev_ftl_stats_get(block_dev_ftl_t const * p_ftl_dev)
+{
+        ASSERT(p_ftl_dev);
+        return &p_ftl_dev->p_work->stats;
+}
+
+static ret_code_t block_dev_ftl_init(nrf_block_dev_t const * p_blk_dev,
+                                     nrf_block_dev_ev_handler ev_handler,
+                                     void const * p_context)
+{
+        ASSERT(p_blk_dev);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        /* One user at a time, as the QSPI device */
+        if (p_work->initialized)
+        {
+                if ((ev_handler != p_work->ev_handler) || (p_context != p_work->p_context))
+                {
+                        return NRF_ERROR_INVALID_STATE;
+                }
+
+                block_dev_ftl_event(p_ftl_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+                return NRF_SUCCESS;
+        }
+
+        /* No handler: requests to the QSPI device complete before returning */
+        ret_code_t ret = nrf_blk_dev_init(block_dev_ftl_lower(p_ftl_dev), NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        nrf_block_dev_geometry_t const * p_geo = nrf_blk_dev_geometry(block_dev_ftl_lower(p_ftl_dev));
+        uint32_t seg_blocks = BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE / p_geo->blk_size;
+        uint32_t seg_count  = MIN(p_geo->blk_count / seg_blocks, BLOCK_DEV_FTL_MAX_SEGMENTS);
+
+        if ((p_geo->blk_size != BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE) ||
+            ((FTL_SUMMARY_HDR_WORDS + seg_blocks - 1) * sizeof(uint32_t) > p_geo->blk_size) ||
+            (seg_count <= BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS))
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(block_dev_ftl_lower(p_ftl_dev)));
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        memset(&p_work->stats, 0, sizeof(p_work->stats));
+        p_work->seg_blocks         = seg_blocks;
+        p_work->seg_count          = seg_count;
+        p_work->geometry.blk_size  = p_geo->blk_size;
+        p_work->geometry.blk_count = (seg_count - BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS) *
+                                     (seg_blocks - 1);
+
+        ret = block_dev_ftl_mount(p_ftl_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(block_dev_ftl_lower(p_ftl_dev)));
+                return ret;
+        }
+
+        p_work->ev_handler  = ev_handler;
+        p_work->p_context   = p_context;
+        p_work->initialized = true;
+
+        block_dev_ftl_event(p_ftl_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_ftl_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        ret_code_t ret = nrf_blk_dev_uninit(block_dev_ftl_lower(p_ftl_dev));
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->initialized = false;
+
+        block_dev_ftl_event(p_ftl_dev, NRF_BLOCK_DEV_EVT_UNINIT, NRF_SUCCESS, NULL);
+        p_work->ev_handler = NULL;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_ftl_read_req(nrf_block_dev_t const * p_blk_dev,
+                                         nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_ftl_read(p_ftl_dev, p_blk);
+
+        block_dev_ftl_event(p_ftl_dev, NRF_BLOCK_DEV_EVT_BLK_READ_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_ftl_write_req(nrf_block_dev_t const * p_blk_dev,
+                                          nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+        block_dev_ftl_work_t * p_work = p_ftl_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_ftl_write(p_ftl_dev, p_blk);
+
+        block_dev_ftl_event(p_ftl_dev, NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_ftl_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                      nrf_block_dev_ioctl_req_t req,
+                                      void * p_data)
+{
+        ASSERT(p_blk_dev);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+
+        /* Not an SDK request value, kept out of the switch */
+        if (req == BLOCK_DEV_IOCTL_REQ_UNMAP)
+        {
+                block_dev_unmap_req_t const * p_unmap = p_data;
+
+                if (p_unmap == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                if (p_unmap->blk_id + p_unmap->blk_count > p_ftl_dev->p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                block_dev_ftl_unmap(p_ftl_dev->p_work, p_unmap->blk_id, p_unmap->blk_count);
+                return NRF_SUCCESS;
+        }
+
+        if (req == BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER)
+        {
+                block_dev_barrier_req_t const * p_barrier = p_data;
+
+                if (p_barrier == NULL)
+                {
+                        return block_dev_ftl_lower_barrier(p_ftl_dev, 0, 0);
+                }
+
+                if (p_barrier->blk_id + p_barrier->blk_count > p_ftl_dev->p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                return block_dev_ftl_barrier(p_ftl_dev, p_barrier->blk_id, p_barrier->blk_count);
+        }
+
+        switch (req)
+        {
+        case NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH:
+                return nrf_blk_dev_ioctl(block_dev_ftl_lower(p_ftl_dev), req, p_data);
+        case NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS:
+        {
+                if (p_data == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                nrf_block_dev_info_strings_t const * * pp_strings = p_data;
+                *pp_strings = &p_ftl_dev->info_strings;
+                return NRF_SUCCESS;
+        }
+        default:
+                break;
+        }
+
+        return NRF_ERROR_NOT_SUPPORTED;
+}
+
+static nrf_block_dev_geometry_t const * block_dev_ftl_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_ftl_t const * p_ftl_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_ftl_t, block_dev);
+
+        return &p_ftl_dev->p_work->geometry;
+}
+
+const nrf_block_dev_ops_t block_dev_ftl_ops = {
+        .init      = block_dev_ftl_init,
+        .uninit    = block_dev_ftl_uninit,
+        .read_req  = block_dev_ftl_read_req,
+        .write_req = block_dev_ftl_write_req,
+        .ioctl     = block_dev_ftl_ioctl,
+        .geometry  = block_dev_ftl_geometry,
+};
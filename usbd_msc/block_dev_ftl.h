@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_FTL_H__
+#define BLOCK_DEV_FTL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_block_dev.h"
+#include "block_dev_unmap.h"
+#include "block_dev_barrier.h"
+#include "block_dev_qspi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_ftl Log-structured flash translation layer
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev which writes out of place on top of @ref block_dev_qspi.
+ *
+ * The flash is split into segments of @ref BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE. Logical
+ * blocks are appended to the open segment, so rewriting the same FAT sector programs
+ * a new block instead of erasing the same erase unit again. The first block of a
+ * segment is its summary: a magic, a sequence number and the logical block number
+ * of every data slot, each programmed (1 to 0) right after its data.
+ *
+ * The QSPI write cache writes lines back in LRU order, so the order is enforced
+ * with @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER: appended data is on flash before its
+ * summary is written, and the whole cache before a free segment is erased for
+ * reuse, so the summaries superseding its blocks cannot be lost with it. A barrier
+ * on a logical range waits for the summaries mapping it.
+ *
+ * Segments whose blocks have all been rewritten are reused; when free segments run
+ * low, the segment with the fewest valid blocks is collected by copying them to the
+ * open segment. Collection runs from @ref block_dev_ftl_process in the background
+ * and in the write path when no free segment is left. Free segments are taken
+ * round-robin to spread erases.
+ *
+ * The mapping is kept in RAM and rebuilt at init from the segment summaries, the
+ * copy in the segment with the highest sequence number wins.
+ *
+ * A @ref BLOCK_DEV_IOCTL_REQ_UNMAP ioctl drops the mapping of the blocks, so
+ * collection no longer copies them. It is not recorded in the summaries: after the
+ * next mount a trimmed block may map to its last copy again, which is harmless as
+ * the user of the range does not read it.
+ *
+ * Requests complete synchronously; the QSPI block device is used without event
+ * handler.
+ */
+
+/**
+ * @brief Segment size, multiple of the erase unit size.
+ */
+#ifndef BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE
+#define BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE (32 * 1024)
+#endif
+
+/**
+ * @brief Number of segments kept out of the logical capacity for garbage collection.
+ */
+#ifndef BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS
+#define BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS 4
+#endif
+
+/**
+ * @brief Block size, must match the underlying QSPI block device.
+ */
+#ifndef BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE
+#define BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE
+#endif
+
+/**
+ * @brief Number of segments tracked.
+ */
+#define BLOCK_DEV_FTL_MAX_SEGMENTS \
+        (BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE / BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE)
+
+/**
+ * @brief Number of logical blocks tracked by the mapping table.
+ */
+#define BLOCK_DEV_FTL_MAX_BLOCKS \
+        (BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE / BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE)
+
+STATIC_ASSERT((BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE % BLOCK_DEV_QSPI_ERASE_UNIT_SIZE) == 0);
+STATIC_ASSERT(BLOCK_DEV_FTL_MAX_BLOCKS < 0xFFFF);
+
+/**
+ * @brief FTL statistics.
+ */
+typedef struct
+{
+        uint32_t host_blocks;   //!< Blocks written by the user.
+        uint32_t gc_blocks;     //!< Blocks copied by garbage collection.
+        uint32_t gc_segments;   //!< Segments collected.
+        uint32_t erases;        //!< Segments erased.
+        uint32_t trim_blocks;   //!< Mapped blocks dropped by an unmap.
+} block_dev_ftl_stats_t;
+
+/**
+ * @brief FTL block device internal work structure.
+ */
+typedef struct
+{
+        nrf_block_dev_geometry_t geometry;      //!< Logical geometry.
+        nrf_block_dev_ev_handler ev_handler;    //!< Block device event handler.
+        void const *             p_context;     //!< Context handle passed to event handler.
+        bool                     initialized;   //!< Device is initialized.
+        uint32_t                 seg_blocks;    //!< Blocks per segment, summary included.
+        uint32_t                 seg_count;     //!< Number of segments.
+        uint32_t                 seq;           //!< Sequence number of the newest segment.
+        uint32_t                 open_seg;      //!< Segment being written.
+        uint32_t                 open_slot;     //!< Next data slot of the open segment.
+        uint32_t                 next_seg;      //!< Where the search for a free segment starts.
+        uint32_t                 free_segs;     //!< Number of free segments.
+        uint32_t                 gc_seg;        //!< Segment being collected.
+        uint32_t                 gc_slot;       //!< Next data slot to check in the collected segment.
+        block_dev_ftl_stats_t    stats;         //!< Statistics.
+        uint32_t                 summary[BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE / sizeof(uint32_t)];    //!< Summary of the open segment.
+        uint32_t                 gc_summary[BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE / sizeof(uint32_t)]; //!< Summary of the collected segment.
+        uint32_t                 buff[BLOCK_DEV_FTL_CONFIG_BLOCK_SIZE / sizeof(uint32_t)];       //!< Block copy buffer.
+        uint32_t                 seg_seq[BLOCK_DEV_FTL_MAX_SEGMENTS]; //!< Segment sequence numbers, 0 for free segments.
+        uint16_t                 valid[BLOCK_DEV_FTL_MAX_SEGMENTS];   //!< Valid blocks per segment.
+        uint16_t                 map[BLOCK_DEV_FTL_MAX_BLOCKS];       //!< Logical to physical block map.
+} block_dev_ftl_work_t;
+
+/**
+ * @brief FTL block device.
+ */
+typedef struct
+{
+        nrf_block_dev_t              block_dev;     //!< Block device.
+        nrf_block_dev_info_strings_t info_strings;  //!< Block device information strings.
+        block_dev_qspi_t const *     p_qspi_dev;    //!< Underlying QSPI block device.
+        block_dev_ftl_work_t *       p_work;        //!< Internal work structure.
+} block_dev_ftl_t;
+
+/**
+ * @brief FTL block device operations.
+ */
+extern const nrf_block_dev_ops_t block_dev_ftl_ops;
+
+/**
+ * @brief Define FTL block device instance.
+ *
+ * @param name     Instance name.
+ * @param qspi_dev Underlying @ref block_dev_qspi_t instance.
+ * @param info     Info strings @ref NFR_BLOCK_DEV_INFO_CONFIG.
+ */
+#define BLOCK_DEV_FTL_DEFINE(name, qspi_dev, info)                      \
+        static block_dev_ftl_work_t CONCAT_2(name, _work);              \
+        static const block_dev_ftl_t name = {                           \
+                .block_dev    = { .p_ops = &block_dev_ftl_ops },        \
+                .info_strings = BRACKET_EXTRACT(info),                  \
+                .p_qspi_dev   = &(qspi_dev),                            \
+                .p_work       = &CONCAT_2(name, _work),                 \
+        }
+
+/**
+ * @brief Erase the whole flash and start with an empty mapping.
+ *
+ * @param p_ftl_dev FTL block device.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_ftl_format(block_dev_ftl_t const * p_ftl_dev);
+
+/**
+ * @brief Run one step of background garbage collection.
+ *
+ * @param p_ftl_dev FTL block device.
+ *
+ * @retval true  More background work is pending.
+ * @retval false Nothing to do.
+ */
+bool block_dev_ftl_process(block_dev_ftl_t const * p_ftl_dev);
+
+/**
+ * @brief Get FTL statistics.
+ *
+ * @param p_ftl_dev FTL block device.
+ */
+block_dev_ftl_stats_t const * block_dev_ftl_stats_get(block_dev_ftl_t const * p_ftl_dev);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_FTL_H__ */
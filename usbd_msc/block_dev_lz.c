@@ -0,0 +1,947 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "block_dev_lz.h"
+#include "app_timer.h"
+#include "nrf_assert.h"
+
+#define NRF_LOG_MODULE_NAME block_dev_lz
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Mapping table header magic, "LZB1".
+ */
+#define LZ_MAGIC        0x31425A4C
+
+/**
+ * @brief No unit held in RAM.
+ */
+#define LZ_NO_UNIT      0xFFFFFFFF
+
+/**
+ * @brief Unmapped entry.
+ */
+#define LZ_UNMAPPED_BLK 0xFFFF
+
+/**
+ * @brief Mapping table header, first lower block.
+ */
+typedef struct
+{
+        uint32_t magic;
+        uint32_t unit_size;
+        uint32_t unit_count;
+        uint32_t blk_size;
+} lz_header_t;
+
+static uint32_t block_dev_lz_unit_blocks(block_dev_lz_work_t const * p_work)
+{
+        return BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / p_work->lower_blk_size;
+}
+
+static uint32_t block_dev_lz_entry_blocks(block_dev_lz_work_t const * p_work,
+                                          block_dev_lz_entry_t const * p_entry)
+{
+        return CEIL_DIV(p_entry->size, p_work->lower_blk_size);
+}
+
+/**
+ * @brief Lower blocks allocated to a stored unit, a whole unit without overcommit.
+ */
+static uint32_t block_dev_lz_alloc_blocks(block_dev_lz_work_t const * p_work,
+                                          block_dev_lz_entry_t const * p_entry)
+{
+        return (BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT <= 100) ? block_dev_lz_unit_blocks(p_work) :
+                                                            block_dev_lz_entry_blocks(p_work, p_entry);
+}
+
+static void block_dev_lz_event(block_dev_lz_t const * p_lz_dev,
+                               nrf_block_dev_event_type_t ev_type,
+                               ret_code_t result,
+                               nrf_block_req_t const * p_blk)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        if (!p_work->ev_handler)
+        {
+                return;
+        }
+
+        const nrf_block_dev_event_t ev = {
+                ev_type,
+                (result == NRF_SUCCESS) ? NRF_BLOCK_DEV_RESULT_SUCCESS : NRF_BLOCK_DEV_RESULT_IO_ERROR,
+                p_blk,
+                p_work->p_context
+        };
+
+        p_work->ev_handler(&p_lz_dev->block_dev, &ev);
+}
+
+static ret_code_t block_dev_lz_lower_read(block_dev_lz_t const * p_lz_dev,
+                                          void * p_buff,
+                                          uint32_t blk_id,
+                                          uint32_t blk_count)
+{
+        nrf_block_req_t req = {
+                .p_buff    = p_buff,
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        return nrf_blk_dev_read_req(p_lz_dev->p_lower, &req);
+}
+
+static ret_code_t block_dev_lz_lower_write(block_dev_lz_t const * p_lz_dev,
+                                           void const * p_buff,
+                                           uint32_t blk_id,
+                                           uint32_t blk_count)
+{
+        nrf_block_req_t req = {
+                .p_buff    = (void *)p_buff,
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        return nrf_blk_dev_write_req(p_lz_dev->p_lower, &req);
+}
+
+/**
+ * @brief Wait until a range of lower blocks is on flash, the whole device with no blocks.
+ *
+ * A lower device without write cache does not support the request, which is fine.
+ */
+static ret_code_t block_dev_lz_lower_barrier(block_dev_lz_t const * p_lz_dev,
+                                             uint32_t blk_id,
+                                             uint32_t blk_count)
+{
+        block_dev_barrier_req_t req = {
+                .blk_id    = blk_id,
+                .blk_count = blk_count,
+        };
+
+        ret_code_t ret = nrf_blk_dev_ioctl(p_lz_dev->p_lower, BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER,
+                                           blk_count ? &req : NULL);
+        return (ret == NRF_ERROR_NOT_SUPPORTED) ? NRF_SUCCESS : ret;
+}
+
+static bool block_dev_lz_used_get(block_dev_lz_work_t const * p_work, uint32_t blk)
+{
+        return (p_work->used[blk / 32] >> (blk % 32)) & 1;
+}
+
+static void block_dev_lz_used_set(block_dev_lz_work_t * p_work, uint32_t blk, uint32_t count, bool used)
+{
+        for (uint32_t i = blk; i < blk + count; ++i)
+        {
+                if (used)
+                {
+                        p_work->used[i / 32] |= 1u << (i % 32);
+                }
+                else
+                {
+                        p_work->used[i / 32] &= ~(1u << (i % 32));
+                }
+        }
+
+        if (used)
+        {
+                p_work->stats.free_blocks -= count;
+        }
+        else
+        {
+                p_work->stats.free_blocks += count;
+        }
+}
+
+/**
+ * @brief Find and allocate a run of free lower blocks.
+ *
+ * @return First block, @ref LZ_UNMAPPED_BLK if no run is long enough.
+ */
+static uint32_t block_dev_lz_alloc(block_dev_lz_work_t * p_work, uint32_t count)
+{
+        uint32_t first = p_work->map_blocks;
+        uint32_t span  = p_work->data_end - first;
+        uint32_t blk   = p_work->alloc_next;
+        uint32_t run   = 0;
+
+        /* Next-fit over the data blocks, one lap plus the length of a run */
+        for (uint32_t i = 0; i < span + count; ++i)
+        {
+                if (blk == p_work->data_end)
+                {
+                        blk = first;
+                        run = 0;
+                }
+
+                run = block_dev_lz_used_get(p_work, blk) ? 0 : run + 1;
+                blk++;
+
+                if (run == count)
+                {
+                        block_dev_lz_used_set(p_work, blk - count, count, true);
+                        p_work->alloc_next = blk;
+                        return blk - count;
+                }
+        }
+
+        return LZ_UNMAPPED_BLK;
+}
+
+/**
+ * @brief Release the blocks of replaced copies once the table no longer pointing at them is on flash.
+ */
+static ret_code_t block_dev_lz_release(block_dev_lz_t const * p_lz_dev)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        if (!p_work->release_count)
+        {
+                return NRF_SUCCESS;
+        }
+
+        ret_code_t ret = block_dev_lz_lower_barrier(p_lz_dev, 0, p_work->map_blocks);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        for (uint32_t i = 0; i < p_work->release_count; ++i)
+        {
+                block_dev_unmap_req_t lower = {
+                        .blk_id    = p_work->released[i].blk,
+                        .blk_count = block_dev_lz_alloc_blocks(p_work, &p_work->released[i]),
+                };
+
+                block_dev_lz_used_set(p_work, lower.blk_id, lower.blk_count, false);
+                UNUSED_RETURN_VALUE(nrf_blk_dev_ioctl(p_lz_dev->p_lower, BLOCK_DEV_IOCTL_REQ_UNMAP, &lower));
+        }
+
+        p_work->release_count = 0;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Make room for a replaced copy, before its new table entry is saved.
+ */
+static ret_code_t block_dev_lz_release_reserve(block_dev_lz_t const * p_lz_dev)
+{
+        if (p_lz_dev->p_work->release_count < BLOCK_DEV_LZ_RELEASE_SLOTS)
+        {
+                return NRF_SUCCESS;
+        }
+
+        return block_dev_lz_release(p_lz_dev);
+}
+
+/**
+ * @brief Write the mapping table block holding the entry of a unit.
+ */
+static ret_code_t block_dev_lz_map_save(block_dev_lz_t const * p_lz_dev, uint32_t unit)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_size = p_work->lower_blk_size;
+        uint8_t * p_buff  = (uint8_t *)p_work->pack_buff;
+        ret_code_t ret;
+
+        if (!p_work->header_valid)
+        {
+                lz_header_t hdr = {
+                        .magic      = LZ_MAGIC,
+                        .unit_size  = BLOCK_DEV_LZ_CONFIG_UNIT_SIZE,
+                        .unit_count = p_work->unit_count,
+                        .blk_size   = blk_size,
+                };
+
+                memset(p_buff, 0xFF, blk_size);
+                memcpy(p_buff, &hdr, sizeof(hdr));
+                ret = block_dev_lz_lower_write(p_lz_dev, p_buff, 0, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                p_work->header_valid = true;
+        }
+
+        uint32_t per_blk = blk_size / sizeof(block_dev_lz_entry_t);
+        uint32_t first   = (unit / per_blk) * per_blk;
+        uint32_t count   = MIN(per_blk, p_work->unit_count - first);
+
+        memset(p_buff, 0xFF, blk_size);
+        memcpy(p_buff, &p_work->map[first], count * sizeof(block_dev_lz_entry_t));
+
+        p_work->stats.stored_bytes += blk_size;
+        return block_dev_lz_lower_write(p_lz_dev, p_buff, 1 + unit / per_blk, 1);
+}
+
+static bool block_dev_lz_unit_blank(block_dev_lz_work_t const * p_work)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->unit_buff); ++i)
+        {
+                if (p_work->unit_buff[i] != 0xFFFFFFFF)
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * @brief Compress the unit held in RAM and write it out of place.
+ */
+static ret_code_t block_dev_lz_unit_store(block_dev_lz_t const * p_lz_dev)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_size = p_work->lower_blk_size;
+        uint32_t unit     = p_work->unit_idx;
+
+        if (!p_work->unit_dirty)
+        {
+                return NRF_SUCCESS;
+        }
+
+        block_dev_lz_entry_t old_entry = p_work->map[unit];
+        block_dev_lz_entry_t new_entry = { .blk = LZ_UNMAPPED_BLK, .size = 0 };
+        uint32_t blocks = 0;
+        uint32_t alloc  = 0;
+
+        ret_code_t ret = block_dev_lz_release_reserve(p_lz_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Blank units are only unmapped */
+        if (!block_dev_lz_unit_blank(p_work))
+        {
+                uint32_t ticks = app_timer_cnt_get();
+                /* Has to save at least one block to be worth decompressing */
+                size_t size = lz_codec_compress(p_work->unit_buff, BLOCK_DEV_LZ_CONFIG_UNIT_SIZE,
+                                                p_work->pack_buff, BLOCK_DEV_LZ_CONFIG_UNIT_SIZE - blk_size,
+                                                p_work->hash);
+                p_work->stats.compress_ticks += app_timer_cnt_diff_compute(app_timer_cnt_get(), ticks);
+
+                void const * p_src = p_work->unit_buff;
+                if (size)
+                {
+                        new_entry.size = (uint16_t)size;
+                        blocks = block_dev_lz_entry_blocks(p_work, &new_entry);
+                        memset((uint8_t *)p_work->pack_buff + size, 0xFF, blocks * blk_size - size);
+                        p_src = p_work->pack_buff;
+                }
+                else
+                {
+                        new_entry.size = BLOCK_DEV_LZ_CONFIG_UNIT_SIZE;
+                        blocks = block_dev_lz_unit_blocks(p_work);
+                        p_work->stats.units_raw++;
+                }
+
+                alloc = block_dev_lz_alloc_blocks(p_work, &new_entry);
+                uint32_t blk = block_dev_lz_alloc(p_work, alloc);
+                if ((blk == LZ_UNMAPPED_BLK) && p_work->release_count)
+                {
+                        ret = block_dev_lz_release(p_lz_dev);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                        blk = block_dev_lz_alloc(p_work, alloc);
+                }
+                if (blk == LZ_UNMAPPED_BLK)
+                {
+                        return NRF_ERROR_NO_MEM;
+                }
+
+                ret = block_dev_lz_lower_write(p_lz_dev, p_src, blk, blocks);
+                if (ret == NRF_SUCCESS)
+                {
+                        ret = block_dev_lz_lower_barrier(p_lz_dev, blk, blocks);
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        block_dev_lz_used_set(p_work, blk, alloc, false);
+                        return ret;
+                }
+                new_entry.blk = (uint16_t)blk;
+        }
+
+        /* Data on flash first: the old copy stays mapped until the table points at the new one */
+        p_work->map[unit] = new_entry;
+        ret = block_dev_lz_map_save(p_lz_dev, unit);
+        if (ret != NRF_SUCCESS)
+        {
+                p_work->map[unit] = old_entry;
+                if (alloc)
+                {
+                        block_dev_lz_used_set(p_work, new_entry.blk, alloc, false);
+                }
+                return ret;
+        }
+
+        if (old_entry.size)
+        {
+                p_work->released[p_work->release_count++] = old_entry;
+        }
+
+        p_work->unit_dirty = false;
+        p_work->stats.units_written++;
+        p_work->stats.host_bytes   += BLOCK_DEV_LZ_CONFIG_UNIT_SIZE;
+        p_work->stats.stored_bytes += blocks * blk_size;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Bring a unit into RAM.
+ *
+ * @param load Read and decompress the stored unit, false when it is overwritten whole.
+ */
+static ret_code_t block_dev_lz_unit_get(block_dev_lz_t const * p_lz_dev, uint32_t unit, bool load)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        block_dev_lz_entry_t const * p_entry = &p_work->map[unit];
+
+        if (p_work->unit_idx == unit)
+        {
+                return NRF_SUCCESS;
+        }
+
+        ret_code_t ret = block_dev_lz_unit_store(p_lz_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->unit_idx = LZ_NO_UNIT;
+
+        if (!load)
+        {
+                /* Contents are replaced by the caller */
+        }
+        else if (!p_entry->size)
+        {
+                memset(p_work->unit_buff, 0xFF, sizeof(p_work->unit_buff));
+        }
+        else if (p_entry->size == BLOCK_DEV_LZ_CONFIG_UNIT_SIZE)
+        {
+                ret = block_dev_lz_lower_read(p_lz_dev, p_work->unit_buff, p_entry->blk,
+                                              block_dev_lz_unit_blocks(p_work));
+        }
+        else
+        {
+                ret = block_dev_lz_lower_read(p_lz_dev, p_work->pack_buff, p_entry->blk,
+                                              block_dev_lz_entry_blocks(p_work, p_entry));
+                if (ret == NRF_SUCCESS)
+                {
+                        uint32_t ticks = app_timer_cnt_get();
+                        size_t size = lz_codec_decompress(p_work->pack_buff, p_entry->size,
+                                                          p_work->unit_buff, sizeof(p_work->unit_buff));
+                        p_work->stats.decompress_ticks += app_timer_cnt_diff_compute(app_timer_cnt_get(), ticks);
+                        p_work->stats.units_read++;
+
+                        if (size != BLOCK_DEV_LZ_CONFIG_UNIT_SIZE)
+                        {
+                                NRF_LOG_ERROR("Unit %u does not decompress", unit);
+                                ret = NRF_ERROR_INTERNAL;
+                        }
+                }
+        }
+
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->unit_idx   = unit;
+        p_work->unit_dirty = false;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_lz_read(block_dev_lz_t const * p_lz_dev,
+                                    nrf_block_req_t const * p_blk)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_un = block_dev_lz_unit_blocks(p_work);
+        uint8_t * p_buff    = p_blk->p_buff;
+
+        for (uint32_t i = 0; i < p_blk->blk_count; ++i)
+        {
+                uint32_t blk_id = p_blk->blk_id + i;
+                ret_code_t ret  = block_dev_lz_unit_get(p_lz_dev, blk_id / blk_per_un, true);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                memcpy(p_buff + i * blk_size,
+                       (uint8_t const *)p_work->unit_buff + (blk_id % blk_per_un) * blk_size,
+                       blk_size);
+        }
+
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_lz_write(block_dev_lz_t const * p_lz_dev,
+                                     nrf_block_req_t const * p_blk)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_size      = p_work->geometry.blk_size;
+        uint32_t blk_per_un    = block_dev_lz_unit_blocks(p_work);
+        uint8_t const * p_buff = p_blk->p_buff;
+
+        for (uint32_t i = 0; i < p_blk->blk_count; ++i)
+        {
+                uint32_t blk_id = p_blk->blk_id + i;
+                uint32_t off    = blk_id % blk_per_un;
+                bool whole      = (off == 0) && (p_blk->blk_count - i >= blk_per_un);
+
+                ret_code_t ret = block_dev_lz_unit_get(p_lz_dev, blk_id / blk_per_un, !whole);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                memcpy((uint8_t *)p_work->unit_buff + off * blk_size, p_buff + i * blk_size, blk_size);
+                p_work->unit_dirty = true;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Unmap the units lying whole in a block range and release their lower blocks.
+ */
+static ret_code_t block_dev_lz_unmap(block_dev_lz_t const * p_lz_dev,
+                                     uint32_t blk_id,
+                                     uint32_t blk_count)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_per_un = block_dev_lz_unit_blocks(p_work);
+        uint32_t unit_end   = (blk_id + blk_count) / blk_per_un;
+
+        for (uint32_t unit = CEIL_DIV(blk_id, blk_per_un); unit < unit_end; ++unit)
+        {
+                block_dev_lz_entry_t old_entry = p_work->map[unit];
+
+                if (p_work->unit_idx == unit)
+                {
+                        p_work->unit_idx   = LZ_NO_UNIT;
+                        p_work->unit_dirty = false;
+                }
+
+                if (!old_entry.size)
+                {
+                        continue;
+                }
+
+                ret_code_t ret = block_dev_lz_release_reserve(p_lz_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                /* Table first, the blocks are only reused once no saved entry points at them */
+                p_work->map[unit].blk  = LZ_UNMAPPED_BLK;
+                p_work->map[unit].size = 0;
+                ret = block_dev_lz_map_save(p_lz_dev, unit);
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->map[unit] = old_entry;
+                        return ret;
+                }
+
+                p_work->released[p_work->release_count++] = old_entry;
+                p_work->stats.units_trimmed++;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Load the mapping table and rebuild the allocation bitmap.
+ */
+static ret_code_t block_dev_lz_mount(block_dev_lz_t const * p_lz_dev)
+{
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t blk_size = p_work->lower_blk_size;
+        uint32_t per_blk  = blk_size / sizeof(block_dev_lz_entry_t);
+        uint32_t dropped  = 0;
+        lz_header_t hdr;
+
+        memset(p_work->used, 0, sizeof(p_work->used));
+        memset(p_work->map, 0xFF, sizeof(p_work->map));
+        for (uint32_t unit = 0; unit < p_work->unit_count; ++unit)
+        {
+                p_work->map[unit].size = 0;
+        }
+        p_work->stats.free_blocks = p_work->data_end - p_work->map_blocks;
+        p_work->alloc_next        = p_work->map_blocks;
+        p_work->unit_idx          = LZ_NO_UNIT;
+        p_work->unit_dirty        = false;
+        p_work->release_count     = 0;
+
+        ret_code_t ret = block_dev_lz_lower_read(p_lz_dev, p_work->pack_buff, 0, 1);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        memcpy(&hdr, p_work->pack_buff, sizeof(hdr));
+        p_work->header_valid = (hdr.magic == LZ_MAGIC) &&
+                               (hdr.unit_size == BLOCK_DEV_LZ_CONFIG_UNIT_SIZE) &&
+                               (hdr.unit_count == p_work->unit_count) &&
+                               (hdr.blk_size == blk_size);
+        if (!p_work->header_valid)
+        {
+                NRF_LOG_INFO("No mapping table, all units blank");
+                return NRF_SUCCESS;
+        }
+
+        for (uint32_t first = 0; first < p_work->unit_count; first += per_blk)
+        {
+                ret = block_dev_lz_lower_read(p_lz_dev, p_work->pack_buff, 1 + first / per_blk, 1);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                block_dev_lz_entry_t const * p_entries = (block_dev_lz_entry_t const *)p_work->pack_buff;
+                for (uint32_t i = 0; (i < per_blk) && (first + i < p_work->unit_count); ++i)
+                {
+                        block_dev_lz_entry_t entry = p_entries[i];
+                        uint32_t blocks = block_dev_lz_alloc_blocks(p_work, &entry);
+
+                        if (!entry.size || (entry.size > BLOCK_DEV_LZ_CONFIG_UNIT_SIZE))
+                        {
+                                continue;
+                        }
+
+                        bool valid = (entry.blk >= p_work->map_blocks) &&
+                                     (entry.blk + blocks <= p_work->data_end);
+                        for (uint32_t blk = entry.blk; valid && (blk < entry.blk + blocks); ++blk)
+                        {
+                                valid = !block_dev_lz_used_get(p_work, blk);
+                        }
+
+                        if (!valid)
+                        {
+                                dropped++;
+                                continue;
+                        }
+
+                        p_work->map[first + i] = entry;
+                        block_dev_lz_used_set(p_work, entry.blk, blocks, true);
+                }
+        }
+
+        if (dropped)
+        {
+                NRF_LOG_WARNING("%u mapping entries dropped", dropped);
+        }
+
+        NRF_LOG_INFO("Mounted %u units, %u of %u blocks free",
+                     p_work->unit_count, p_work->stats.free_blocks,
+                     p_work->data_end - p_work->map_blocks);
+        return NRF_SUCCESS;
+}
+
+ret_code_t block_dev_lz_format(block_dev_lz_t const * p_lz_dev)
+{
+        ASSERT(p_lz_dev);
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+        uint32_t per_blk = p_work->lower_blk_size / sizeof(block_dev_lz_entry_t);
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        memset(p_work->used, 0, sizeof(p_work->used));
+        memset(p_work->map, 0xFF, sizeof(p_work->map));
+        for (uint32_t unit = 0; unit < p_work->unit_count; ++unit)
+        {
+                p_work->map[unit].size = 0;
+        }
+        p_work->stats.free_blocks = p_work->data_end - p_work->map_blocks;
+        p_work->alloc_next        = p_work->map_blocks;
+        p_work->unit_idx          = LZ_NO_UNIT;
+        p_work->unit_dirty        = false;
+        p_work->release_count     = 0;
+        p_work->header_valid      = false;
+
+        for (uint32_t unit = 0; unit < p_work->unit_count; unit += per_blk)
+        {
+                ret_code_t ret = block_dev_lz_map_save(p_lz_dev, unit);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+ret_code_t block_dev_lz_flush(block_dev_lz_t const * p_lz_dev)
+{
+        ASSERT(p_lz_dev);
+
+        if (!p_lz_dev->p_work->initialized)
+        {
+                return NRF_SUCCESS;
+        }
+
+        return block_dev_lz_unit_store(p_lz_dev);
+}
+
+block_dev_lz_stats_t const * block_dev_lz_stats_get(block_dev_lz_t const * p_lz_dev)
+{
+        ASSERT(p_lz_dev);
+        return &p_lz_dev->p_work->stats;
+}
+
+static ret_code_t block_dev_lz_init(nrf_block_dev_t const * p_blk_dev,
+                                    nrf_block_dev_ev_handler ev_handler,
+                                    void const * p_context)
+{
+        ASSERT(p_blk_dev);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        /* One user at a time, as the QSPI device */
+        if (p_work->initialized)
+        {
+                if ((ev_handler != p_work->ev_handler) || (p_context != p_work->p_context))
+                {
+                        return NRF_ERROR_INVALID_STATE;
+                }
+
+                block_dev_lz_event(p_lz_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+                return NRF_SUCCESS;
+        }
+
+        /* No handler: requests to the lower device complete before returning */
+        ret_code_t ret = nrf_blk_dev_init(p_lz_dev->p_lower, NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        nrf_block_dev_geometry_t const * p_geo = nrf_blk_dev_geometry(p_lz_dev->p_lower);
+        uint32_t blk_size  = p_geo->blk_size;
+        uint32_t blk_count = MIN(p_geo->blk_count, BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS);
+
+        if ((blk_size >= BLOCK_DEV_LZ_CONFIG_UNIT_SIZE) ||
+            (BLOCK_DEV_LZ_CONFIG_UNIT_SIZE % blk_size) ||
+            (blk_size % sizeof(block_dev_lz_entry_t)) ||
+            (blk_size < sizeof(lz_header_t)))
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(p_lz_dev->p_lower));
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        /* Table size depends on the unit count, which depends on the data blocks left */
+        uint64_t unit_count = MIN((uint64_t)blk_count * blk_size * BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT /
+                                  100 / BLOCK_DEV_LZ_CONFIG_UNIT_SIZE,
+                                  BLOCK_DEV_LZ_CONFIG_MAX_UNITS);
+        uint32_t map_blocks = 1 + CEIL_DIV((uint32_t)unit_count * sizeof(block_dev_lz_entry_t), blk_size);
+
+        if (blk_count <= map_blocks + BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / blk_size)
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(p_lz_dev->p_lower));
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        unit_count = MIN(unit_count, (uint64_t)(blk_count - map_blocks) * blk_size *
+                                     BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT / 100 / BLOCK_DEV_LZ_CONFIG_UNIT_SIZE);
+
+        /* Without overcommit, a unit being rewritten needs a free unit of blocks besides its old copy */
+        if (BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT <= 100)
+        {
+                unit_count = MIN(unit_count, (blk_count - map_blocks) / (BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / blk_size) - 1);
+        }
+
+        memset(&p_work->stats, 0, sizeof(p_work->stats));
+        p_work->lower_blk_size     = blk_size;
+        p_work->unit_count         = (uint32_t)unit_count;
+        p_work->map_blocks         = map_blocks;
+        p_work->data_end           = blk_count;
+        p_work->geometry.blk_size  = blk_size;
+        p_work->geometry.blk_count = p_work->unit_count * (BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / blk_size);
+
+        ret = block_dev_lz_mount(p_lz_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(p_lz_dev->p_lower));
+                return ret;
+        }
+
+        p_work->ev_handler  = ev_handler;
+        p_work->p_context   = p_context;
+        p_work->initialized = true;
+
+        block_dev_lz_event(p_lz_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_lz_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        ret_code_t ret = block_dev_lz_unit_store(p_lz_dev);
+        if (ret == NRF_SUCCESS)
+        {
+                ret = nrf_blk_dev_uninit(p_lz_dev->p_lower);
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->initialized = false;
+
+        block_dev_lz_event(p_lz_dev, NRF_BLOCK_DEV_EVT_UNINIT, NRF_SUCCESS, NULL);
+        p_work->ev_handler = NULL;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_lz_read_req(nrf_block_dev_t const * p_blk_dev,
+                                        nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_lz_read(p_lz_dev, p_blk);
+
+        block_dev_lz_event(p_lz_dev, NRF_BLOCK_DEV_EVT_BLK_READ_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_lz_write_req(nrf_block_dev_t const * p_blk_dev,
+                                         nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+        block_dev_lz_work_t * p_work = p_lz_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_lz_write(p_lz_dev, p_blk);
+
+        block_dev_lz_event(p_lz_dev, NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_lz_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                     nrf_block_dev_ioctl_req_t req,
+                                     void * p_data)
+{
+        ASSERT(p_blk_dev);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+
+        /* Not an SDK request value, kept out of the switch */
+        if (req == BLOCK_DEV_IOCTL_REQ_UNMAP)
+        {
+                block_dev_unmap_req_t const * p_unmap = p_data;
+
+                if (p_unmap == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                if (p_unmap->blk_id + p_unmap->blk_count > p_lz_dev->p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                return block_dev_lz_unmap(p_lz_dev, p_unmap->blk_id, p_unmap->blk_count);
+        }
+
+        if (req == BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER)
+        {
+                block_dev_barrier_req_t const * p_barrier = p_data;
+
+                if ((p_barrier != NULL) &&
+                    (p_barrier->blk_id + p_barrier->blk_count > p_lz_dev->p_work->geometry.blk_count))
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                /* Unit data is already ordered before its entry, the table is what is left */
+                ret_code_t ret = block_dev_lz_unit_store(p_lz_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                return block_dev_lz_lower_barrier(p_lz_dev, 0, p_lz_dev->p_work->map_blocks);
+        }
+
+        switch (req)
+        {
+        case NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH:
+        {
+                ret_code_t ret = block_dev_lz_unit_store(p_lz_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                return nrf_blk_dev_ioctl(p_lz_dev->p_lower, req, p_data);
+        }
+        case NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS:
+        {
+                if (p_data == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                nrf_block_dev_info_strings_t const * * pp_strings = p_data;
+                *pp_strings = &p_lz_dev->info_strings;
+                return NRF_SUCCESS;
+        }
+        default:
+                break;
+        }
+
+        return NRF_ERROR_NOT_SUPPORTED;
+}
+
+static nrf_block_dev_geometry_t const * block_dev_lz_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_lz_t const * p_lz_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_lz_t, block_dev);
+
+        return &p_lz_dev->p_work->geometry;
+}
+
+const nrf_block_dev_ops_t block_dev_lz_ops = {
+        .init      = block_dev_lz_init,
+        .uninit    = block_dev_lz_uninit,
+        .read_req  = block_dev_lz_read_req,
+        .write_req = block_dev_lz_write_req,
+        .ioctl     = block_dev_lz_ioctl,
+        .geometry  = block_dev_lz_geometry,
+};
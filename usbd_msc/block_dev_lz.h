@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_LZ_H__
+#define BLOCK_DEV_LZ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_block_dev.h"
+#include "block_dev_unmap.h"
+#include "block_dev_barrier.h"
+#include "lz_codec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_lz Compressing block device
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev which stores compressed units on another block device.
+ *
+ * The logical space is split into units of @ref BLOCK_DEV_LZ_CONFIG_UNIT_SIZE. A unit
+ * is compressed with @ref lz_codec and stored in as few lower blocks as it fits in,
+ * allocated anywhere in the lower device; a unit which does not shrink by a block
+ * is stored raw, an all-0xFF unit takes no space. A mapping table (first lower
+ * block and compressed size per unit) is kept in RAM and saved in the first lower
+ * blocks, the block holding an entry rewritten after the unit data.
+ *
+ * Units are rewritten out of place: the new copy is written and mapped before the
+ * old blocks are released. As the lower device may write its cache back in any
+ * order, a @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER puts the new copy on flash before
+ * its table entry is written. The old blocks stay allocated until a barrier on the
+ * table, taken once @ref BLOCK_DEV_LZ_RELEASE_SLOTS copies are waiting or when no
+ * free run is left; they are then released and unmapped in the lower device. A
+ * power loss thus finds either the old or the new copy behind a saved entry.
+ *
+ * The logical capacity is @ref BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT of the lower data
+ * blocks. Up to 100 % every stored unit is allocated a whole unit of blocks, one
+ * unit is kept spare for rewrites, and writes never run out of space: compression
+ * then saves page programs and wear, not capacity. Above 100 % units only take the
+ * blocks they compress to, and the device is overcommitted: once the data does not
+ * compress well enough (or free blocks are too fragmented for a unit), a write fails
+ * with NRF_ERROR_NO_MEM part way, the units before the failing one being written.
+ * FatFS reports this as a disk error, so only use it for known compressible data.
+ *
+ * One unit is held decompressed in RAM. Writes update it and it is compressed and
+ * written when another unit is accessed, on @ref NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH
+ * or @ref block_dev_lz_flush.
+ *
+ * A @ref BLOCK_DEV_IOCTL_REQ_UNMAP ioctl unmaps the units lying whole in the range
+ * and saves their table entries; their blocks are released like those of a
+ * rewritten unit, and passed on to the lower device in an unmap of its own.
+ *
+ * Requests complete synchronously; the lower device is used without event handler,
+ * and its block size has to be smaller than the unit.
+ */
+
+/**
+ * @brief Compression unit size, multiple of the lower block size.
+ */
+#ifndef BLOCK_DEV_LZ_CONFIG_UNIT_SIZE
+#define BLOCK_DEV_LZ_CONFIG_UNIT_SIZE 4096
+#endif
+
+/**
+ * @brief Logical capacity relative to the lower data blocks, in percent.
+ *
+ * Above 100 writes can fail with NRF_ERROR_NO_MEM, see @ref block_dev_lz.
+ */
+#ifndef BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT
+#define BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT 100
+#endif
+
+/**
+ * @brief Number of units tracked by the mapping table.
+ */
+#ifndef BLOCK_DEV_LZ_CONFIG_MAX_UNITS
+#define BLOCK_DEV_LZ_CONFIG_MAX_UNITS 4096
+#endif
+
+/**
+ * @brief Number of lower blocks tracked by the allocation bitmap.
+ */
+#ifndef BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS
+#define BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS 16384
+#endif
+
+/**
+ * @brief Number of replaced units whose blocks are held until the mapping table is on flash.
+ */
+#define BLOCK_DEV_LZ_RELEASE_SLOTS 16
+
+STATIC_ASSERT(BLOCK_DEV_LZ_CONFIG_UNIT_SIZE <= LZ_CODEC_MAX_SIZE);
+STATIC_ASSERT(BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS <= 0xFFFF);
+
+/**
+ * @brief Mapping table entry.
+ */
+typedef struct
+{
+        uint16_t blk;   //!< First lower block.
+        uint16_t size;  //!< Stored size in bytes, @ref BLOCK_DEV_LZ_CONFIG_UNIT_SIZE for a raw unit, 0 when unmapped.
+} block_dev_lz_entry_t;
+
+/**
+ * @brief Compression statistics.
+ */
+typedef struct
+{
+        uint32_t units_written;     //!< Units compressed and written.
+        uint32_t units_raw;         //!< Units stored uncompressed.
+        uint32_t units_read;        //!< Units read and decompressed.
+        uint32_t host_bytes;        //!< Uncompressed bytes of the units written.
+        uint32_t stored_bytes;      //!< Lower block bytes written for them, mapping table included.
+        uint32_t compress_ticks;    //!< Time spent compressing (app_timer ticks).
+        uint32_t decompress_ticks;  //!< Time spent decompressing (app_timer ticks).
+        uint32_t free_blocks;       //!< Lower data blocks not allocated.
+        uint32_t units_trimmed;     //!< Stored units released by an unmap.
+} block_dev_lz_stats_t;
+
+/**
+ * @brief Compressing block device internal work structure.
+ */
+typedef struct
+{
+        nrf_block_dev_geometry_t geometry;      //!< Logical geometry.
+        nrf_block_dev_ev_handler ev_handler;    //!< Block device event handler.
+        void const *             p_context;     //!< Context handle passed to event handler.
+        bool                     initialized;   //!< Device is initialized.
+        bool                     header_valid;  //!< Lower device holds a mapping table header.
+        uint32_t                 lower_blk_size;//!< Lower block size.
+        uint32_t                 unit_count;    //!< Number of units.
+        uint32_t                 map_blocks;    //!< Lower blocks of the mapping table, header included.
+        uint32_t                 data_end;      //!< End of the lower data blocks.
+        uint32_t                 alloc_next;    //!< Where the search for free blocks starts.
+        uint32_t                 unit_idx;      //!< Unit held in @ref unit_buff, UINT32_MAX if none.
+        bool                     unit_dirty;    //!< @ref unit_buff differs from the stored unit.
+        uint32_t                 release_count; //!< Entries in @ref released.
+        block_dev_lz_entry_t     released[BLOCK_DEV_LZ_RELEASE_SLOTS]; //!< Replaced copies, blocks still allocated.
+        block_dev_lz_stats_t     stats;         //!< Statistics.
+        uint32_t                 unit_buff[BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / sizeof(uint32_t)]; //!< Decompressed unit.
+        uint32_t                 pack_buff[BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / sizeof(uint32_t)]; //!< Compressed unit.
+        uint16_t                 hash[LZ_CODEC_HASH_SIZE];                                    //!< Compressor hash table.
+        uint32_t                 used[CEIL_DIV(BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS, 32)];          //!< Allocated lower blocks.
+        block_dev_lz_entry_t     map[BLOCK_DEV_LZ_CONFIG_MAX_UNITS];                          //!< Unit mapping table.
+} block_dev_lz_work_t;
+
+/**
+ * @brief Compressing block device.
+ */
+typedef struct
+{
+        nrf_block_dev_t              block_dev;     //!< Block device.
+        nrf_block_dev_info_strings_t info_strings;  //!< Block device information strings.
+        nrf_block_dev_t const *      p_lower;       //!< Underlying block device.
+        block_dev_lz_work_t *        p_work;        //!< Internal work structure.
+} block_dev_lz_t;
+
+/**
+ * @brief Compressing block device operations.
+ */
+extern const nrf_block_dev_ops_t block_dev_lz_ops;
+
+/**
+ * @brief Define compressing block device instance.
+ *
+ * @param name  Instance name.
+ * @param lower Underlying block device (@ref nrf_block_dev_t pointer).
+ * @param info  Info strings @ref NFR_BLOCK_DEV_INFO_CONFIG.
+ */
+#define BLOCK_DEV_LZ_DEFINE(name, lower, info)                          \
+        static block_dev_lz_work_t CONCAT_2(name, _work);               \
+        static const block_dev_lz_t name = {                            \
+                .block_dev    = { .p_ops = &block_dev_lz_ops },         \
+                .info_strings = BRACKET_EXTRACT(info),                  \
+                .p_lower      = (lower),                                \
+                .p_work       = &CONCAT_2(name, _work),                 \
+        }
+
+/**
+ * @brief Start with an empty mapping table, all units read as 0xFF.
+ *
+ * @param p_lz_dev Compressing block device.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_lz_format(block_dev_lz_t const * p_lz_dev);
+
+/**
+ * @brief Compress and write the unit held in RAM.
+ *
+ * @param p_lz_dev Compressing block device.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_lz_flush(block_dev_lz_t const * p_lz_dev);
+
+/**
+ * @brief Get compression statistics.
+ *
+ * @param p_lz_dev Compressing block device.
+ */
+block_dev_lz_stats_t const * block_dev_lz_stats_get(block_dev_lz_t const * p_lz_dev);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_LZ_H__ */
@@ -0,0 +1,278 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include "block_dev_part.h"
+#include "nrf_assert.h"
+
+#define NRF_LOG_MODULE_NAME block_dev_part
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+static void block_dev_part_event(block_dev_part_t const * p_part_dev,
+                                 nrf_block_dev_event_type_t ev_type,
+                                 ret_code_t result,
+                                 nrf_block_req_t const * p_blk)
+{
+        block_dev_part_work_t * p_work = p_part_dev->p_work;
+
+        if (!p_work->ev_handler)
+        {
+                return;
+        }
+
+        const nrf_block_dev_event_t ev = {
+                ev_type,
+                (result == NRF_SUCCESS) ? NRF_BLOCK_DEV_RESULT_SUCCESS : NRF_BLOCK_DEV_RESULT_IO_ERROR,
+                p_blk,
+                p_work->p_context
+        };
+
+        p_work->ev_handler(&p_part_dev->block_dev, &ev);
+}
+
+/**
+ * @brief Pass a request on to the disk, moved to the partition.
+ */
+static ret_code_t block_dev_part_req(block_dev_part_t const * p_part_dev,
+                                     nrf_block_req_t const * p_blk,
+                                     bool write)
+{
+        block_dev_part_work_t * p_work = p_part_dev->p_work;
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        nrf_block_req_t req = {
+                .p_buff    = p_blk->p_buff,
+                .blk_id    = p_part_dev->blk_first + p_blk->blk_id,
+                .blk_count = p_blk->blk_count,
+        };
+
+        ret_code_t ret = write ? nrf_blk_dev_write_req(p_part_dev->p_disk->p_lower, &req) :
+                                 nrf_blk_dev_read_req(p_part_dev->p_disk->p_lower, &req);
+
+        block_dev_part_event(p_part_dev,
+                             write ? NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE : NRF_BLOCK_DEV_EVT_BLK_READ_DONE,
+                             ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_part_init(nrf_block_dev_t const * p_blk_dev,
+                                      nrf_block_dev_ev_handler ev_handler,
+                                      void const * p_context)
+{
+        ASSERT(p_blk_dev);
+        block_dev_part_t const * p_part_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev);
+        block_dev_part_work_t * p_work = p_part_dev->p_work;
+        block_dev_part_disk_t const * p_disk = p_part_dev->p_disk;
+
+        /* A partition has one user, the disk is shared through the partitions */
+        if (p_work->initialized)
+        {
+                if ((ev_handler != p_work->ev_handler) || (p_context != p_work->p_context))
+                {
+                        return NRF_ERROR_INVALID_STATE;
+                }
+
+                block_dev_part_event(p_part_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+                return NRF_SUCCESS;
+        }
+
+        /* No handler: requests to the disk complete before returning */
+        if (*p_disk->p_users == 0)
+        {
+                ret_code_t ret = nrf_blk_dev_init(p_disk->p_lower, NULL, NULL);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        nrf_block_dev_geometry_t const * p_geo = nrf_blk_dev_geometry(p_disk->p_lower);
+        uint32_t blk_count = p_part_dev->blk_count ? p_part_dev->blk_count :
+                             (p_geo->blk_count > p_part_dev->blk_first) ?
+                             p_geo->blk_count - p_part_dev->blk_first : 0;
+
+        if (!blk_count || (p_part_dev->blk_first + blk_count > p_geo->blk_count))
+        {
+                NRF_LOG_ERROR("Partition at block %u does not fit in %u blocks",
+                              p_part_dev->blk_first, p_geo->blk_count);
+                if (*p_disk->p_users == 0)
+                {
+                        UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(p_disk->p_lower));
+                }
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        (*p_disk->p_users)++;
+        p_work->geometry.blk_size  = p_geo->blk_size;
+        p_work->geometry.blk_count = blk_count;
+        p_work->ev_handler         = ev_handler;
+        p_work->p_context          = p_context;
+        p_work->initialized        = true;
+
+        block_dev_part_event(p_part_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_part_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_part_t const * p_part_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev);
+        block_dev_part_work_t * p_work = p_part_dev->p_work;
+        block_dev_part_disk_t const * p_disk = p_part_dev->p_disk;
+
+        if (!p_work->initialized)
+        {
+                return NRF_SUCCESS;
+        }
+
+        /* Other partitions still use the disk, only its cache is written back */
+        ret_code_t ret = (*p_disk->p_users == 1) ?
+                         nrf_blk_dev_uninit(p_disk->p_lower) :
+                         nrf_blk_dev_ioctl(p_disk->p_lower, NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH, NULL);
+        if ((ret != NRF_SUCCESS) && (ret != NRF_ERROR_NOT_SUPPORTED))
+        {
+                return ret;
+        }
+
+        (*p_disk->p_users)--;
+        p_work->initialized = false;
+
+        block_dev_part_event(p_part_dev, NRF_BLOCK_DEV_EVT_UNINIT, NRF_SUCCESS, NULL);
+        p_work->ev_handler = NULL;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_part_read_req(nrf_block_dev_t const * p_blk_dev,
+                                          nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+
+        return block_dev_part_req(CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev), p_blk, false);
+}
+
+static ret_code_t block_dev_part_write_req(nrf_block_dev_t const * p_blk_dev,
+                                           nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+
+        return block_dev_part_req(CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev), p_blk, true);
+}
+
+static ret_code_t block_dev_part_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                       nrf_block_dev_ioctl_req_t req,
+                                       void * p_data)
+{
+        ASSERT(p_blk_dev);
+        block_dev_part_t const * p_part_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev);
+        block_dev_part_work_t * p_work = p_part_dev->p_work;
+
+        /* Not an SDK request value, kept out of the switch */
+        if (req == BLOCK_DEV_IOCTL_REQ_UNMAP)
+        {
+                block_dev_unmap_req_t const * p_unmap = p_data;
+
+                if (p_unmap == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                if (p_unmap->blk_id + p_unmap->blk_count > p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                block_dev_unmap_req_t unmap = {
+                        .blk_id    = p_part_dev->blk_first + p_unmap->blk_id,
+                        .blk_count = p_unmap->blk_count,
+                };
+                return nrf_blk_dev_ioctl(p_part_dev->p_disk->p_lower, req, &unmap);
+        }
+
+        if (req == BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER)
+        {
+                block_dev_barrier_req_t const * p_barrier = p_data;
+                block_dev_barrier_req_t barrier = {
+                        .blk_id    = p_part_dev->blk_first,
+                        .blk_count = p_work->geometry.blk_count,
+                };
+
+                if (p_barrier != NULL)
+                {
+                        if (p_barrier->blk_id + p_barrier->blk_count > p_work->geometry.blk_count)
+                        {
+                                return NRF_ERROR_INVALID_ADDR;
+                        }
+
+                        barrier.blk_id   += p_barrier->blk_id;
+                        barrier.blk_count = p_barrier->blk_count;
+                }
+                return nrf_blk_dev_ioctl(p_part_dev->p_disk->p_lower, req, &barrier);
+        }
+
+        switch (req)
+        {
+        case NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH:
+        {
+                bool * p_flushing = p_data;
+
+                if (p_part_dev->flags & BLOCK_DEV_PART_FLAG_IGNORE_SYNC)
+                {
+                        if (p_flushing)
+                        {
+                                *p_flushing = false;
+                        }
+                        return NRF_SUCCESS;
+                }
+                return nrf_blk_dev_ioctl(p_part_dev->p_disk->p_lower, req, p_data);
+        }
+        case NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS:
+        {
+                if (p_data == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                nrf_block_dev_info_strings_t const * * pp_strings = p_data;
+                *pp_strings = &p_part_dev->info_strings;
+                return NRF_SUCCESS;
+        }
+        default:
+                break;
+        }
+
+        return NRF_ERROR_NOT_SUPPORTED;
+}
+
+static nrf_block_dev_geometry_t const * block_dev_part_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_part_t const * p_part_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_part_t, block_dev);
+
+        return &p_part_dev->p_work->geometry;
+}
+
+const nrf_block_dev_ops_t block_dev_part_ops = {
+        .init      = block_dev_part_init,
+        .uninit    = block_dev_part_uninit,
+        .read_req  = block_dev_part_read_req,
+        .write_req = block_dev_part_write_req,
+        .ioctl     = block_dev_part_ioctl,
+        .geometry  = block_dev_part_geometry,
+};
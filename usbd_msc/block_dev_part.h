@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_PART_H__
+#define BLOCK_DEV_PART_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_block_dev.h"
+#include "block_dev_unmap.h"
+#include "block_dev_barrier.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_part Partition block device
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev exposing a block range of another block device.
+ *
+ * A disk (@ref BLOCK_DEV_PART_DISK_DEFINE) is split into partitions, each an
+ * independent block device, so one can be a FatFS volume of the application while
+ * another is a USB MSC LUN. The underlying device is initialized with the first
+ * partition and uninitialized with the last one.
+ *
+ * Cache flush ioctls are forwarded to the underlying device, unless the partition
+ * has @ref BLOCK_DEV_PART_FLAG_IGNORE_SYNC; @ref BLOCK_DEV_IOCTL_REQ_UNMAP and
+ * @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER are always forwarded, with the block range
+ * moved to the partition.
+ *
+ * Requests complete synchronously; the underlying device is used without event
+ * handler.
+ */
+
+/**
+ * @brief Ignore @ref NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH of this partition.
+ *
+ * For a partition whose user syncs far more often than the underlying cache needs
+ * to be written back (e.g. FatFS on every f_sync of a log file). Its syncs are then
+ * acknowledged before their data is on flash.
+ */
+#define BLOCK_DEV_PART_FLAG_IGNORE_SYNC (1u << 0)
+
+/**
+ * @brief Partitioned disk.
+ */
+typedef struct
+{
+        nrf_block_dev_t const * p_lower;  //!< Underlying block device.
+        uint32_t *              p_users;  //!< Number of initialized partitions.
+} block_dev_part_disk_t;
+
+/**
+ * @brief Partition block device internal work structure.
+ */
+typedef struct
+{
+        nrf_block_dev_geometry_t geometry;      //!< Partition geometry.
+        nrf_block_dev_ev_handler ev_handler;    //!< Block device event handler.
+        void const *             p_context;     //!< Context handle passed to event handler.
+        bool                     initialized;   //!< Device is initialized.
+} block_dev_part_work_t;
+
+/**
+ * @brief Partition block device.
+ */
+typedef struct
+{
+        nrf_block_dev_t               block_dev;    //!< Block device.
+        nrf_block_dev_info_strings_t  info_strings; //!< Block device information strings.
+        block_dev_part_disk_t const * p_disk;       //!< Disk holding the partition.
+        uint32_t                      blk_first;    //!< First block on the disk.
+        uint32_t                      blk_count;    //!< Number of blocks, 0 up to the end of the disk.
+        uint32_t                      flags;        //!< Partition flags, @ref BLOCK_DEV_PART_FLAG_IGNORE_SYNC.
+        block_dev_part_work_t *       p_work;       //!< Internal work structure.
+} block_dev_part_t;
+
+/**
+ * @brief Partition block device operations.
+ */
+extern const nrf_block_dev_ops_t block_dev_part_ops;
+
+/**
+ * @brief Define a partitioned disk.
+ *
+ * @param name  Disk name.
+ * @param lower Underlying block device (@ref nrf_block_dev_t pointer).
+ */
+#define BLOCK_DEV_PART_DISK_DEFINE(name, lower)                         \
+        static uint32_t CONCAT_2(name, _users);                         \
+        static const block_dev_part_disk_t name = {                     \
+                .p_lower = (lower),                                     \
+                .p_users = &CONCAT_2(name, _users),                     \
+        }
+
+/**
+ * @brief Define partition block device instance.
+ *
+ * @param name       Instance name.
+ * @param disk       Disk defined with @ref BLOCK_DEV_PART_DISK_DEFINE.
+ * @param first      First block on the disk.
+ * @param count      Number of blocks, 0 up to the end of the disk.
+ * @param part_flags Partition flags, @ref BLOCK_DEV_PART_FLAG_IGNORE_SYNC.
+ * @param info       Info strings @ref NFR_BLOCK_DEV_INFO_CONFIG.
+ */
+#define BLOCK_DEV_PART_DEFINE(name, disk, first, count, part_flags, info) \
+        static block_dev_part_work_t CONCAT_2(name, _work);             \
+        static const block_dev_part_t name = {                          \
+                .block_dev    = { .p_ops = &block_dev_part_ops },       \
+                .info_strings = BRACKET_EXTRACT(info),                  \
+                .p_disk       = &(disk),                                \
+                .blk_first    = (first),                                \
+                .blk_count    = (count),                                \
+                .flags        = (part_flags),                           \
+                .p_work       = &CONCAT_2(name, _work),                 \
+        }
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_PART_H__ */
@@ -0,0 +1,3039 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "block_dev_qspi.h"
+#include "qspi_wear.h"
+#include "qspi_remap.h"
+#include "qspi_calib.h"
+#include "crc32_fast.h"
+#include "app_timer.h"
+#include "nrf_assert.h"
+
+#define NRF_LOG_MODULE_NAME block_dev_qspi
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Erase unit index of an empty cache.
+ */
+#define BD_ERASE_UNIT_INVALID_ID 0xFFFFFFFF
+
+/**
+ * @brief Number of blocks in one erase unit.
+ */
+#define BD_BLOCKS_PER_ERASEUNIT(blk_size) (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / (blk_size))
+
+/**
+ * @brief Erase unit holding the given block.
+ */
+#define BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size) \
+        ((blk_id) / BD_BLOCKS_PER_ERASEUNIT(blk_size))
+
+/**
+ * @brief Pages programmed per background step, bounds the main loop stall.
+ */
+#define BD_PROGRAM_STEP_PAGES 4
+
+/**
+ * @brief Journal log entry marking a committed copy, "COMM".
+ */
+#define BD_JOURNAL_COMMIT 0x4D4D4F43
+
+/**
+ * @brief Journal log entry marking a finished write-back.
+ */
+#define BD_JOURNAL_DONE   0x00000000
+
+/**
+ * @brief Journal log entry.
+ *
+ * Fields are programmed in order: target and journal unit, commit once the
+ * journal unit holds the data, done once the target holds it.
+ */
+typedef struct
+{
+        uint32_t eu_idx;        //!< Erase unit written back.
+        uint32_t slot;          //!< Journal unit holding its data.
+        uint32_t seq;           //!< Sequence number.
+        uint32_t commit;        //!< @ref BD_JOURNAL_COMMIT when the copy is complete.
+        uint32_t done;          //!< @ref BD_JOURNAL_DONE when the write-back is complete.
+        uint32_t reserved[3];
+} bd_journal_entry_t;
+
+/**
+ * @brief Number of entries of the journal log.
+ */
+#define BD_JOURNAL_ENTRIES (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / sizeof(bd_journal_entry_t))
+
+/**
+ * @brief CRC log unit header magic, "QCRL".
+ */
+#define BD_CRC_MAGIC   0x4C524351
+
+/**
+ * @brief CRC of a block without a committed CRC log record.
+ */
+#define BD_CRC_UNKNOWN 0xFFFFFFFF
+
+/**
+ * @brief CRC log record marked committed, "CCOM".
+ */
+#define BD_CRC_COMMIT  0x4D4F4343
+
+/**
+ * @brief No CRC log record for an erase unit.
+ */
+#define BD_CRC_NO_RECORD 0xFFFF
+
+/**
+ * @brief CRC log unit header, in the first record slot of the unit.
+ */
+typedef struct
+{
+        uint32_t magic;
+        uint32_t blk_size;
+        uint32_t blk_count;
+        uint32_t seq;           //!< Sequence number of the unit, the highest is the head of the log.
+        uint32_t check;         //!< Inverted sum of the words above.
+} bd_crc_unit_header_t;
+
+/**
+ * @brief CRC log record of a write-back, followed by one CRC per block of the erase unit.
+ *
+ * Programmed before the write-back starts, the commit word once it is done.
+ */
+typedef struct
+{
+        uint32_t commit;        //!< @ref BD_CRC_COMMIT once the erase unit holds the data.
+        uint32_t eu_idx;        //!< Erase unit written back.
+        uint32_t check;         //!< CRC32 of the erase unit index and the block CRCs.
+} bd_crc_record_t;
+
+/**
+ * @brief Result of one step of background work.
+ */
+typedef enum
+{
+        BD_STEP_IDLE,       //!< Nothing to do.
+        BD_STEP_PROGRESS,   //!< Work was done, more may follow.
+        BD_STEP_WAIT,       //!< Waiting for the flash or for a step only done in the background.
+} bd_step_t;
+
+/**
+ * @brief Page sized scratch buffer of the blank-check scan and the write-back diff.
+ */
+static uint32_t m_scan_buff[QSPI_FLASH_PAGE_SIZE / sizeof(uint32_t)];
+
+static bool block_dev_qspi_is_blank(void const * p_buff, size_t size)
+{
+        uint32_t const * p_word = p_buff;
+
+        for (size_t i = 0; i < size / sizeof(uint32_t); ++i)
+        {
+                if (p_word[i] != 0xFFFFFFFF)
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static bool block_dev_qspi_erased_get(block_dev_qspi_work_t const * p_work, uint32_t eu_idx)
+{
+        if (eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS)
+        {
+                return false;
+        }
+
+        return (p_work->erased[eu_idx / 32] & (1u << (eu_idx % 32))) != 0;
+}
+
+static void block_dev_qspi_erased_set(block_dev_qspi_work_t * p_work, uint32_t eu_idx, bool erased)
+{
+        if (eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS)
+        {
+                return;
+        }
+
+        if (erased)
+        {
+                p_work->erased[eu_idx / 32] |= (1u << (eu_idx % 32));
+        }
+        else
+        {
+                p_work->erased[eu_idx / 32] &= ~(1u << (eu_idx % 32));
+        }
+}
+
+static bool block_dev_qspi_trimmed_get(block_dev_qspi_work_t const * p_work, uint32_t blk_id)
+{
+        if (blk_id >= MIN(p_work->geometry.blk_count, BLOCK_DEV_QSPI_MAX_BLOCKS))
+        {
+                return false;
+        }
+
+        return (p_work->trimmed[blk_id / 32] & (1u << (blk_id % 32))) != 0;
+}
+
+static void block_dev_qspi_trimmed_set(block_dev_qspi_work_t * p_work, uint32_t blk_id, bool trimmed)
+{
+        if (blk_id >= BLOCK_DEV_QSPI_MAX_BLOCKS)
+        {
+                return;
+        }
+
+        if (trimmed)
+        {
+                p_work->trimmed[blk_id / 32] |= (1u << (blk_id % 32));
+        }
+        else
+        {
+                p_work->trimmed[blk_id / 32] &= ~(1u << (blk_id % 32));
+        }
+}
+
+/**
+ * @brief Number of program pages in one erase unit.
+ */
+#define BD_PAGES_PER_ERASEUNIT (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / QSPI_FLASH_PAGE_SIZE)
+
+STATIC_ASSERT(BD_PAGES_PER_ERASEUNIT <= 32);
+
+/**
+ * @brief Mask of pages holding data other than 0xFF.
+ */
+static uint32_t block_dev_qspi_used_pages(uint8_t const * p_buff)
+{
+        uint32_t pages = 0;
+
+        for (uint32_t i = 0; i < BD_PAGES_PER_ERASEUNIT; ++i)
+        {
+                if (!block_dev_qspi_is_blank(p_buff + i * QSPI_FLASH_PAGE_SIZE, QSPI_FLASH_PAGE_SIZE))
+                {
+                        pages |= 1u << i;
+                }
+        }
+
+        return pages;
+}
+
+/**
+ * @brief Check whether a page overlaps a dirty block.
+ */
+static bool block_dev_qspi_page_dirty(uint32_t dirty, uint32_t page, uint32_t blk_size)
+{
+        uint32_t first = (page * QSPI_FLASH_PAGE_SIZE) / blk_size;
+        uint32_t last  = ((page + 1) * QSPI_FLASH_PAGE_SIZE - 1) / blk_size;
+
+        for (uint32_t blk = first; blk <= last; ++blk)
+        {
+                if (dirty & (1u << blk))
+                {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * @brief Compare dirty pages of a cache line with the flash contents.
+ *
+ * NOR flash programs bits from 1 to 0 only. If no changed bit has to go from 0 to 1
+ * the changed pages can be programmed in place.
+ *
+ * @param p_line     Cache line.
+ * @param blk_size   Block size.
+ * @param p_pages    Mask of changed pages.
+ * @param p_erase    Set when the erase unit has to be erased.
+ */
+static ret_code_t block_dev_qspi_diff(block_dev_qspi_cache_line_t const * p_line,
+                                      uint32_t blk_size,
+                                      uint32_t * p_pages,
+                                      bool * p_erase)
+{
+        uint32_t addr = p_line->eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+
+        *p_pages = 0;
+        *p_erase = false;
+
+        for (uint32_t i = 0; i < BD_PAGES_PER_ERASEUNIT; ++i)
+        {
+                if (!block_dev_qspi_page_dirty(p_line->dirty, i, blk_size))
+                {
+                        continue;
+                }
+
+                ret_code_t ret = qspi_flash_read(m_scan_buff, addr + i * QSPI_FLASH_PAGE_SIZE,
+                                                 sizeof(m_scan_buff));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                uint32_t const * p_new = &p_line->buff[i * QSPI_FLASH_PAGE_SIZE / sizeof(uint32_t)];
+                bool changed = false;
+
+                for (uint32_t w = 0; w < ARRAY_SIZE(m_scan_buff); ++w)
+                {
+                        if ((m_scan_buff[w] & p_new[w]) != p_new[w])
+                        {
+                                *p_erase = true;
+                                return NRF_SUCCESS;
+                        }
+
+                        changed |= (m_scan_buff[w] != p_new[w]);
+                }
+
+                if (changed)
+                {
+                        *p_pages |= 1u << i;
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Check that an erase unit holds the contents of an erase unit sized buffer.
+ */
+static ret_code_t block_dev_qspi_verify(uint32_t eu_idx, uint32_t const * p_buff, bool * p_ok)
+{
+        uint32_t addr = eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+
+        *p_ok = true;
+        for (uint32_t i = 0; i < BD_PAGES_PER_ERASEUNIT; ++i)
+        {
+                ret_code_t ret = qspi_flash_read(m_scan_buff, addr + i * QSPI_FLASH_PAGE_SIZE,
+                                                 sizeof(m_scan_buff));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (memcmp(m_scan_buff, &p_buff[i * QSPI_FLASH_PAGE_SIZE / sizeof(uint32_t)],
+                           sizeof(m_scan_buff)))
+                {
+                        *p_ok = false;
+                        break;
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+static void block_dev_qspi_event(block_dev_qspi_t const * p_qspi_dev,
+                                 nrf_block_dev_event_type_t ev_type,
+                                 ret_code_t result,
+                                 nrf_block_req_t const * p_blk)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (!p_work->ev_handler)
+        {
+                /* Synchronous caller gets the error from the request call */
+                if (result != NRF_SUCCESS)
+                {
+                        p_work->error = result;
+                }
+                return;
+        }
+
+        const nrf_block_dev_event_t ev = {
+                ev_type,
+                (result == NRF_SUCCESS) ? NRF_BLOCK_DEV_RESULT_SUCCESS : NRF_BLOCK_DEV_RESULT_IO_ERROR,
+                p_blk,
+                p_work->p_context
+        };
+
+        p_work->ev_handler(&p_qspi_dev->block_dev, &ev);
+}
+
+/**
+ * @brief Find the cache line holding an erase unit.
+ */
+static block_dev_qspi_cache_line_t * block_dev_qspi_cache_find(block_dev_qspi_work_t * p_work,
+                                                               uint32_t eu_idx)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                if (p_work->cache[i].eu_idx == eu_idx)
+                {
+                        return &p_work->cache[i];
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Find a cache line holding modified blocks.
+ */
+static block_dev_qspi_cache_line_t * block_dev_qspi_cache_dirty(block_dev_qspi_work_t * p_work)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                if (p_work->cache[i].dirty)
+                {
+                        return &p_work->cache[i];
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Start an erase and remember the erased range for reads from a suspended erase.
+ */
+static ret_code_t block_dev_qspi_erase_start(block_dev_qspi_work_t * p_work,
+                                             uint32_t eu_idx,
+                                             uint32_t size)
+{
+        ret_code_t ret = qspi_flash_erase_start(eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE, size);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->erasing     = true;
+        p_work->erase_eu    = eu_idx;
+        p_work->erase_units = size / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Number of record slots of a CRC log unit, the first one holds the unit header.
+ */
+static uint32_t block_dev_qspi_crc_slots(block_dev_qspi_work_t const * p_work)
+{
+        return BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / p_work->crc_rec_size;
+}
+
+/**
+ * @brief Flash address of a CRC log record slot, numbered across the log units.
+ */
+static uint32_t block_dev_qspi_crc_addr(block_dev_qspi_work_t const * p_work, uint32_t slot)
+{
+        return p_work->crc_base * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE + slot * p_work->crc_rec_size;
+}
+
+/**
+ * @brief CRC32 protecting a CRC log record.
+ */
+static uint32_t block_dev_qspi_crc_record_check(block_dev_qspi_work_t const * p_work,
+                                                bd_crc_record_t const * p_rec)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+
+        return crc32_fast(crc32_fast(0, &p_rec->eu_idx, sizeof(p_rec->eu_idx)),
+                          p_rec + 1, blk_per_eu * sizeof(uint32_t));
+}
+
+/**
+ * @brief Check that a CRC log unit header belongs to the current geometry.
+ */
+static bool block_dev_qspi_crc_unit_valid(block_dev_qspi_work_t const * p_work,
+                                          bd_crc_unit_header_t const * p_hdr)
+{
+        return (p_hdr->magic == BD_CRC_MAGIC) &&
+               (p_hdr->blk_size == p_work->geometry.blk_size) &&
+               (p_hdr->blk_count == p_work->geometry.blk_count) &&
+               (p_hdr->check == ~(p_hdr->magic + p_hdr->blk_size + p_hdr->blk_count + p_hdr->seq));
+}
+
+/**
+ * @brief Erase a CRC log unit unless it is blank already.
+ */
+static ret_code_t block_dev_qspi_crc_unit_clear(block_dev_qspi_work_t * p_work, uint32_t unit)
+{
+        uint32_t addr = (p_work->crc_base + unit) * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+
+        for (uint32_t off = 0; off < BLOCK_DEV_QSPI_ERASE_UNIT_SIZE; off += sizeof(m_scan_buff))
+        {
+                ret_code_t ret = qspi_flash_read(m_scan_buff, addr + off, sizeof(m_scan_buff));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (!block_dev_qspi_is_blank(m_scan_buff, sizeof(m_scan_buff)))
+                {
+                        return qspi_flash_erase(addr, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Move the CRC log head to the next erased unit.
+ *
+ * One erased unit is kept in reserve. When the head takes it, the records of the
+ * oldest unit which are still the latest of their erase unit are copied to the new
+ * head, and the oldest unit is erased as the next reserve. Takes another round
+ * while that fills the head.
+ */
+static ret_code_t block_dev_qspi_crc_advance(block_dev_qspi_work_t * p_work)
+{
+        uint32_t slots = block_dev_qspi_crc_slots(p_work);
+        ret_code_t ret;
+
+        for (uint32_t round = 0; round < p_work->crc_units; ++round)
+        {
+                bd_crc_unit_header_t hdr;
+
+                p_work->crc_head = (p_work->crc_head + 1) % p_work->crc_units;
+                p_work->crc_free--;
+                p_work->crc_slot = 1;
+
+                hdr.magic     = BD_CRC_MAGIC;
+                hdr.blk_size  = p_work->geometry.blk_size;
+                hdr.blk_count = p_work->geometry.blk_count;
+                hdr.seq       = ++p_work->crc_seq;
+                hdr.check     = ~(hdr.magic + hdr.blk_size + hdr.blk_count + hdr.seq);
+                ret = qspi_flash_program(&hdr, block_dev_qspi_crc_addr(p_work, p_work->crc_head * slots),
+                                         sizeof(hdr));
+                if ((ret != NRF_SUCCESS) || p_work->crc_free)
+                {
+                        return ret;
+                }
+
+                uint32_t tail = (p_work->crc_head + 1) % p_work->crc_units;
+                for (uint32_t slot = tail * slots + 1; slot < (tail + 1) * slots; ++slot)
+                {
+                        bd_crc_record_t const * p_rec = (bd_crc_record_t const *)m_scan_buff;
+
+                        ret = qspi_flash_read(m_scan_buff, block_dev_qspi_crc_addr(p_work, slot),
+                                              p_work->crc_rec_size);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+
+                        if ((p_rec->eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS) ||
+                            (p_work->crc_index[p_rec->eu_idx] != slot))
+                        {
+                                continue;
+                        }
+
+                        uint32_t dst = p_work->crc_head * slots + p_work->crc_slot++;
+                        ret = qspi_flash_program(m_scan_buff, block_dev_qspi_crc_addr(p_work, dst),
+                                                 p_work->crc_rec_size);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                        p_work->crc_index[p_rec->eu_idx] = dst;
+                }
+
+                ret = qspi_flash_erase(block_dev_qspi_crc_addr(p_work, tail * slots),
+                                       BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                p_work->crc_free = 1;
+
+                if (p_work->crc_slot < slots)
+                {
+                        return NRF_SUCCESS;
+                }
+        }
+
+        return NRF_ERROR_NO_MEM;
+}
+
+/**
+ * @brief Append the CRCs of a cache line about to be written back to the CRC log.
+ *
+ * The record stays uncommitted until @ref block_dev_qspi_crc_commit, so blocks
+ * of a write-back interrupted by a power loss are not checked against it.
+ */
+static ret_code_t block_dev_qspi_crc_append(block_dev_qspi_work_t * p_work,
+                                            block_dev_qspi_cache_line_t const * p_line)
+{
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(blk_size);
+        uint32_t slots      = block_dev_qspi_crc_slots(p_work);
+        bd_crc_record_t * p_rec = (bd_crc_record_t *)m_scan_buff;
+        uint32_t * p_crc        = (uint32_t *)(p_rec + 1);
+        ret_code_t ret;
+
+        if (p_line->eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS)
+        {
+                return NRF_SUCCESS;
+        }
+
+        if (p_work->crc_slot == slots)
+        {
+                ret = block_dev_qspi_crc_advance(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        p_rec->commit = 0xFFFFFFFF;
+        p_rec->eu_idx = p_line->eu_idx;
+        for (uint32_t i = 0; i < blk_per_eu; ++i)
+        {
+                p_crc[i] = crc32_fast(0, (uint8_t const *)p_line->buff + i * blk_size, blk_size);
+        }
+        p_rec->check = block_dev_qspi_crc_record_check(p_work, p_rec);
+
+        /* Commit word left erased */
+        uint32_t slot = p_work->crc_head * slots + p_work->crc_slot++;
+        ret = qspi_flash_program(&p_rec->eu_idx,
+                                 block_dev_qspi_crc_addr(p_work, slot) + offsetof(bd_crc_record_t, eu_idx),
+                                 sizeof(*p_rec) - offsetof(bd_crc_record_t, eu_idx) +
+                                 blk_per_eu * sizeof(uint32_t));
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->crc_index[p_line->eu_idx] = slot;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Commit the latest CRC log record of an erase unit once the unit holds its data.
+ */
+static ret_code_t block_dev_qspi_crc_commit(block_dev_qspi_work_t * p_work, uint32_t eu_idx)
+{
+        uint32_t commit = BD_CRC_COMMIT;
+
+        if ((eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS) ||
+            (p_work->crc_index[eu_idx] == BD_CRC_NO_RECORD))
+        {
+                return NRF_SUCCESS;
+        }
+
+        return qspi_flash_program(&commit, block_dev_qspi_crc_addr(p_work, p_work->crc_index[eu_idx]),
+                                  sizeof(commit));
+}
+
+/**
+ * @brief Get the committed CRCs of the blocks of an erase unit, unknown without a committed record.
+ */
+static ret_code_t block_dev_qspi_crc_read(block_dev_qspi_work_t * p_work,
+                                          uint32_t eu_idx,
+                                          uint32_t * p_crc)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+        bd_crc_record_t rec;
+
+        if ((eu_idx < BLOCK_DEV_QSPI_MAX_ERASE_UNITS) &&
+            (p_work->crc_index[eu_idx] != BD_CRC_NO_RECORD))
+        {
+                uint32_t addr = block_dev_qspi_crc_addr(p_work, p_work->crc_index[eu_idx]);
+
+                ret_code_t ret = qspi_flash_read(&rec, addr, sizeof(rec));
+                if ((ret != NRF_SUCCESS) || (rec.commit == BD_CRC_COMMIT))
+                {
+                        return (ret != NRF_SUCCESS) ? ret :
+                               qspi_flash_read(p_crc, addr + sizeof(rec), blk_per_eu * sizeof(uint32_t));
+                }
+        }
+
+        for (uint32_t i = 0; i < blk_per_eu; ++i)
+        {
+                p_crc[i] = BD_CRC_UNKNOWN;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Check a block read from flash against its stored CRC.
+ */
+static void block_dev_qspi_crc_verify(block_dev_qspi_work_t * p_work,
+                                      uint32_t blk_id,
+                                      uint32_t stored,
+                                      uint32_t crc,
+                                      bool blank)
+{
+        if ((stored == BD_CRC_UNKNOWN) || (stored == crc) || blank)
+        {
+                return;
+        }
+
+        NRF_LOG_WARNING("Block %u does not match its CRC", blk_id);
+        p_work->stats.crc_errors++;
+}
+
+/**
+ * @brief Check blocks read from flash against their stored CRCs.
+ */
+static ret_code_t block_dev_qspi_crc_check(block_dev_qspi_work_t * p_work,
+                                           uint32_t blk_id,
+                                           uint32_t blk_count,
+                                           uint8_t const * p_data)
+{
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(blk_size);
+
+        while (blk_count)
+        {
+                uint32_t blk_off = blk_id % blk_per_eu;
+                uint32_t count   = MIN(blk_count, blk_per_eu - blk_off);
+                ret_code_t ret   = block_dev_qspi_crc_read(p_work, blk_id / blk_per_eu, m_scan_buff);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                for (uint32_t i = 0; i < count; ++i, p_data += blk_size)
+                {
+                        uint32_t stored = m_scan_buff[blk_off + i];
+                        if (stored == BD_CRC_UNKNOWN)
+                        {
+                                continue;
+                        }
+
+                        /* Blank check only on a mismatch, it is rare */
+                        uint32_t crc = crc32_fast(0, p_data, blk_size);
+                        block_dev_qspi_crc_verify(p_work, blk_id + i, stored, crc,
+                                                  (crc != stored) &&
+                                                  block_dev_qspi_is_blank(p_data, blk_size));
+                }
+
+                blk_id    += count;
+                blk_count -= count;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Rebuild the CRC log index, start an empty log if no unit matches the geometry.
+ *
+ * Units are scanned from the oldest, so the last record of an erase unit is the
+ * latest. Units which do not carry a valid header (interrupted erase or header
+ * program, other geometry) are erased.
+ */
+static ret_code_t block_dev_qspi_crc_mount(block_dev_qspi_work_t * p_work)
+{
+        uint32_t slots = block_dev_qspi_crc_slots(p_work);
+        bd_crc_unit_header_t hdr;
+        uint32_t head = p_work->crc_units;
+        ret_code_t ret;
+
+        memset(p_work->crc_index, 0xFF, sizeof(p_work->crc_index));
+        p_work->crc_seq = 0;
+
+        for (uint32_t unit = 0; unit < p_work->crc_units; ++unit)
+        {
+                ret = qspi_flash_read(&hdr, block_dev_qspi_crc_addr(p_work, unit * slots), sizeof(hdr));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (block_dev_qspi_crc_unit_valid(p_work, &hdr) &&
+                    ((head == p_work->crc_units) || ((int32_t)(hdr.seq - p_work->crc_seq) > 0)))
+                {
+                        head            = unit;
+                        p_work->crc_seq = hdr.seq;
+                }
+        }
+
+        if (head == p_work->crc_units)
+        {
+                /* Blocks get a CRC when next written back */
+                NRF_LOG_INFO("Starting an empty CRC log");
+                for (uint32_t unit = 0; unit < p_work->crc_units; ++unit)
+                {
+                        ret = block_dev_qspi_crc_unit_clear(p_work, unit);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                }
+
+                p_work->crc_head = p_work->crc_units - 1;
+                p_work->crc_slot = slots;
+                p_work->crc_free = p_work->crc_units;
+                return NRF_SUCCESS;
+        }
+
+        /* Erased units follow the head, then the oldest unit */
+        p_work->crc_head = head;
+        p_work->crc_free = 0;
+        bool in_use = false;
+        for (uint32_t i = 1; i <= p_work->crc_units; ++i)
+        {
+                uint32_t unit = (head + i) % p_work->crc_units;
+
+                ret = qspi_flash_read(&hdr, block_dev_qspi_crc_addr(p_work, unit * slots), sizeof(hdr));
+                if ((ret == NRF_SUCCESS) && !block_dev_qspi_crc_unit_valid(p_work, &hdr))
+                {
+                        ret = block_dev_qspi_crc_unit_clear(p_work, unit);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+                        if (!in_use)
+                        {
+                                p_work->crc_free++;
+                        }
+                        continue;
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                in_use = true;
+                p_work->crc_slot = 1;
+                for (uint32_t slot = 1; slot < slots; ++slot)
+                {
+                        bd_crc_record_t const * p_rec = (bd_crc_record_t const *)m_scan_buff;
+
+                        ret = qspi_flash_read(m_scan_buff, block_dev_qspi_crc_addr(p_work, unit * slots + slot),
+                                              p_work->crc_rec_size);
+                        if (ret != NRF_SUCCESS)
+                        {
+                                return ret;
+                        }
+
+                        /* Torn records are skipped, the head appends after the last used slot */
+                        if (block_dev_qspi_is_blank(m_scan_buff, p_work->crc_rec_size))
+                        {
+                                continue;
+                        }
+                        p_work->crc_slot = slot + 1;
+
+                        if ((p_rec->eu_idx < BLOCK_DEV_QSPI_MAX_ERASE_UNITS) &&
+                            (p_rec->check == block_dev_qspi_crc_record_check(p_work, p_rec)))
+                        {
+                                p_work->crc_index[p_rec->eu_idx] = unit * slots + slot;
+                        }
+                }
+        }
+
+        if (p_work->crc_free == 0)
+        {
+                /* No reserve left, drop the oldest unit */
+                uint32_t tail = (head + 1) % p_work->crc_units;
+
+                for (uint32_t eu_idx = 0; eu_idx < BLOCK_DEV_QSPI_MAX_ERASE_UNITS; ++eu_idx)
+                {
+                        if (p_work->crc_index[eu_idx] / slots == tail)
+                        {
+                                p_work->crc_index[eu_idx] = BD_CRC_NO_RECORD;
+                        }
+                }
+
+                p_work->crc_free = 1;
+                return qspi_flash_erase(block_dev_qspi_crc_addr(p_work, tail * slots),
+                                        BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Erase unit of a journal unit.
+ */
+static uint32_t block_dev_qspi_journal_unit(block_dev_qspi_work_t const * p_work, uint32_t slot)
+{
+        return p_work->jrnl_base + 1 + slot;
+}
+
+/**
+ * @brief Address of a journal log entry field.
+ */
+static uint32_t block_dev_qspi_journal_addr(block_dev_qspi_work_t const * p_work,
+                                            uint32_t entry,
+                                            size_t offset)
+{
+        return p_work->jrnl_base * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE +
+               entry * sizeof(bd_journal_entry_t) + offset;
+}
+
+/**
+ * @brief Pick the next journal unit and start its erase.
+ */
+static ret_code_t block_dev_qspi_journal_begin(block_dev_qspi_work_t * p_work)
+{
+        ret_code_t ret;
+
+        if (p_work->jrnl_entry == BD_JOURNAL_ENTRIES)
+        {
+                /* Write-backs are sequential, every entry of a full log is done */
+                ret = qspi_flash_erase(block_dev_qspi_journal_addr(p_work, 0, 0),
+                                       BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                p_work->jrnl_entry = 0;
+        }
+
+        p_work->jrnl_slot = (p_work->jrnl_slot + 1) % BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS;
+
+        /* Erased ahead while the flash was idle */
+        uint32_t eu_idx = block_dev_qspi_journal_unit(p_work, p_work->jrnl_slot);
+        if (block_dev_qspi_erased_get(p_work, eu_idx))
+        {
+                block_dev_qspi_erased_set(p_work, eu_idx, false);
+                return NRF_SUCCESS;
+        }
+
+        return block_dev_qspi_erase_start(p_work, eu_idx, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+}
+
+/**
+ * @brief Record a complete journal copy of an erase unit.
+ */
+static ret_code_t block_dev_qspi_journal_commit(block_dev_qspi_work_t * p_work, uint32_t eu_idx)
+{
+        bd_journal_entry_t entry;
+        uint32_t commit = BD_JOURNAL_COMMIT;
+
+        uint32_t entry_idx = p_work->jrnl_entry++;
+
+        entry.eu_idx = eu_idx;
+        entry.slot   = p_work->jrnl_slot;
+        entry.seq    = ++p_work->jrnl_seq;
+
+        ret_code_t ret = qspi_flash_program(&entry,
+                                            block_dev_qspi_journal_addr(p_work, entry_idx, 0),
+                                            offsetof(bd_journal_entry_t, commit));
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Separate program, a torn entry is never taken as committed */
+        return qspi_flash_program(&commit,
+                                  block_dev_qspi_journal_addr(p_work, entry_idx,
+                                                              offsetof(bd_journal_entry_t, commit)),
+                                  sizeof(commit));
+}
+
+/**
+ * @brief Close the journal entry of a finished write-back.
+ */
+static ret_code_t block_dev_qspi_journal_done(block_dev_qspi_work_t * p_work)
+{
+        uint32_t done = BD_JOURNAL_DONE;
+
+        return qspi_flash_program(&done,
+                                  block_dev_qspi_journal_addr(p_work, p_work->jrnl_entry - 1,
+                                                              offsetof(bd_journal_entry_t, done)),
+                                  sizeof(done));
+}
+
+/**
+ * @brief Finish a write-back interrupted after its journal entry was committed.
+ *
+ * Write-backs are sequential, so only the last committed entry can be pending.
+ * Older entries left open by a failed write-back point at reused journal units.
+ *
+ * @param p_buff Erase unit sized scratch buffer.
+ */
+static ret_code_t block_dev_qspi_journal_replay(block_dev_qspi_work_t * p_work, void * p_buff)
+{
+        uint32_t eu_total = p_work->geometry.blk_count / BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+        bd_journal_entry_t last = {0};
+        uint32_t last_idx = BD_JOURNAL_ENTRIES;
+        uint32_t i;
+        ret_code_t ret;
+
+        p_work->jrnl_seq  = 0;
+        p_work->jrnl_slot = 0;
+
+        for (i = 0; i < BD_JOURNAL_ENTRIES; ++i)
+        {
+                bd_journal_entry_t entry;
+
+                ret = qspi_flash_read(&entry, block_dev_qspi_journal_addr(p_work, i, 0), sizeof(entry));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (entry.eu_idx == 0xFFFFFFFF)
+                {
+                        break;
+                }
+
+                if ((entry.commit == BD_JOURNAL_COMMIT) &&
+                    (entry.eu_idx < eu_total) && (entry.slot < BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS))
+                {
+                        last     = entry;
+                        last_idx = i;
+                }
+        }
+
+        p_work->jrnl_entry = i;
+        if (last_idx == BD_JOURNAL_ENTRIES)
+        {
+                return NRF_SUCCESS;
+        }
+
+        p_work->jrnl_seq  = last.seq;
+        p_work->jrnl_slot = last.slot;
+        if (last.done == BD_JOURNAL_DONE)
+        {
+                return NRF_SUCCESS;
+        }
+
+        uint32_t addr = last.eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        uint32_t done = BD_JOURNAL_DONE;
+
+        ret = qspi_flash_read(p_buff,
+                              block_dev_qspi_journal_unit(p_work, last.slot) * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE,
+                              BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_erase(addr, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+        }
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_program(p_buff, addr, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+        }
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_program(&done,
+                                         block_dev_qspi_journal_addr(p_work, last_idx,
+                                                                     offsetof(bd_journal_entry_t, done)),
+                                         sizeof(done));
+        }
+        if ((ret == NRF_SUCCESS) && p_work->crc)
+        {
+                /* Its CRC record was appended before the journal copy */
+                ret = block_dev_qspi_crc_commit(p_work, last.eu_idx);
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        NRF_LOG_WARNING("Replayed interrupted write-back of erase unit %u", last.eu_idx);
+        p_work->stats.journal_replays++;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Blank the trimmed blocks of a line whose write-back starts from erased flash.
+ *
+ * Their old content is not programmed back, and the flash keeps matching the line.
+ */
+static void block_dev_qspi_trim_fill(block_dev_qspi_work_t * p_work,
+                                     block_dev_qspi_cache_line_t * p_line)
+{
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(blk_size);
+
+        for (uint32_t i = 0; i < blk_per_eu; ++i)
+        {
+                uint8_t * p_blk = (uint8_t *)p_line->buff + i * blk_size;
+
+                if (block_dev_qspi_trimmed_get(p_work, p_line->eu_idx * blk_per_eu + i) &&
+                    !block_dev_qspi_is_blank(p_blk, blk_size))
+                {
+                        memset(p_blk, 0xFF, blk_size);
+                        p_line->dirty &= ~(1u << i);
+                        p_work->stats.trim_drops++;
+                }
+        }
+}
+
+/**
+ * @brief Start writing a dirty cache line back to flash.
+ *
+ * Decides between programming in place and erasing, and starts the erase. Pages
+ * are programmed by @ref block_dev_qspi_flush_continue.
+ */
+static ret_code_t block_dev_qspi_flush_begin(block_dev_qspi_work_t * p_work,
+                                             block_dev_qspi_cache_line_t * p_line)
+{
+        uint8_t const * p_buff = (uint8_t const *)p_line->buff;
+        uint32_t pages;
+        bool erase;
+        ret_code_t ret;
+
+        ASSERT(p_work->p_flush_line == NULL);
+
+        if (block_dev_qspi_erased_get(p_work, p_line->eu_idx))
+        {
+                block_dev_qspi_trim_fill(p_work, p_line);
+                pages = block_dev_qspi_used_pages(p_buff);
+                erase = false;
+        }
+        else
+        {
+                ret = block_dev_qspi_diff(p_line, p_work->geometry.blk_size, &pages, &erase);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if (erase)
+                {
+                        block_dev_qspi_trim_fill(p_work, p_line);
+                }
+        }
+
+        /* CRCs of the final content, before the flash starts to change */
+        if (p_work->crc)
+        {
+                ret = block_dev_qspi_crc_append(p_work, p_line);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        p_work->flush_stage = BLOCK_DEV_QSPI_FLUSH_DIRECT;
+        if (erase && p_work->journal)
+        {
+                /* The target is erased once the journal holds a copy */
+                ret = block_dev_qspi_journal_begin(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                p_work->flush_stage = BLOCK_DEV_QSPI_FLUSH_JOURNAL;
+                pages = block_dev_qspi_used_pages(p_buff);
+        }
+        else if (erase)
+        {
+                ret = block_dev_qspi_erase_start(p_work, p_line->eu_idx, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                pages = block_dev_qspi_used_pages(p_buff);
+        }
+        else
+        {
+                p_work->stats.erase_skips++;
+        }
+
+        /* Unit stays marked as programmed if programming fails half way */
+        block_dev_qspi_erased_set(p_work, p_line->eu_idx, false);
+        p_work->p_flush_line = p_line;
+        p_work->flush_pages  = pages;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Retire the erase unit of a write-back stage which failed the read back.
+ *
+ * A spare takes its place; it is erased and the stage is programmed again.
+ */
+static ret_code_t block_dev_qspi_retire(block_dev_qspi_work_t * p_work, uint32_t eu_idx)
+{
+        NRF_LOG_WARNING("Erase unit %u failed the read back", eu_idx);
+        p_work->stats.verify_errors++;
+
+        ret_code_t ret = qspi_remap_retire(eu_idx);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->flush_pages = block_dev_qspi_used_pages((uint8_t const *)p_work->p_flush_line->buff);
+        return block_dev_qspi_erase_start(p_work, eu_idx, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+}
+
+/**
+ * @brief Program the next run of adjacent pages of the line being written back.
+ *
+ * With read back, the step after the last program checks the unit.
+ */
+static ret_code_t block_dev_qspi_flush_continue(block_dev_qspi_work_t * p_work)
+{
+        block_dev_qspi_cache_line_t * p_line = p_work->p_flush_line;
+        uint32_t pages = p_work->flush_pages;
+        uint32_t dst_eu = (p_work->flush_stage == BLOCK_DEV_QSPI_FLUSH_JOURNAL) ?
+                          block_dev_qspi_journal_unit(p_work, p_work->jrnl_slot) : p_line->eu_idx;
+        ret_code_t ret;
+
+        if (pages)
+        {
+                uint32_t page = 0;
+                while (!(pages & (1u << page)))
+                {
+                        page++;
+                }
+
+                uint32_t end = page + 1;
+                while ((end < BD_PAGES_PER_ERASEUNIT) && (pages & (1u << end)) &&
+                       (end - page < BD_PROGRAM_STEP_PAGES))
+                {
+                        end++;
+                }
+
+                ret = qspi_flash_program((uint8_t const *)p_line->buff + page * QSPI_FLASH_PAGE_SIZE,
+                                         dst_eu * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE +
+                                         page * QSPI_FLASH_PAGE_SIZE,
+                                         (end - page) * QSPI_FLASH_PAGE_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        /* Line stays dirty */
+                        p_work->p_flush_line = NULL;
+                        return ret;
+                }
+
+                p_work->flush_pages &= ~(((1u << (end - page)) - 1) << page);
+                if (p_work->flush_pages || p_work->verify)
+                {
+                        return NRF_SUCCESS;
+                }
+        }
+
+        if (p_work->verify)
+        {
+                bool ok;
+
+                ret = block_dev_qspi_verify(dst_eu, p_line->buff, &ok);
+                if ((ret == NRF_SUCCESS) && !ok)
+                {
+                        ret = block_dev_qspi_retire(p_work, dst_eu);
+                        if (ret == NRF_SUCCESS)
+                        {
+                                return NRF_SUCCESS;
+                        }
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->p_flush_line = NULL;
+                        return ret;
+                }
+        }
+
+        if (p_work->flush_stage == BLOCK_DEV_QSPI_FLUSH_JOURNAL)
+        {
+                /* Copy is complete, from here on a power loss is repaired by a replay */
+                ret = block_dev_qspi_journal_commit(p_work, p_line->eu_idx);
+                if (ret == NRF_SUCCESS)
+                {
+                        ret = block_dev_qspi_erase_start(p_work, p_line->eu_idx,
+                                                         BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->p_flush_line = NULL;
+                        return ret;
+                }
+
+                p_work->flush_stage = BLOCK_DEV_QSPI_FLUSH_COMMITTED;
+                p_work->flush_pages = block_dev_qspi_used_pages((uint8_t const *)p_line->buff);
+                p_work->stats.journal_writes++;
+                return NRF_SUCCESS;
+        }
+
+        if (p_work->flush_stage == BLOCK_DEV_QSPI_FLUSH_COMMITTED)
+        {
+                ret = block_dev_qspi_journal_done(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->p_flush_line = NULL;
+                        return ret;
+                }
+        }
+
+        if (p_work->crc)
+        {
+                ret = block_dev_qspi_crc_commit(p_work, p_line->eu_idx);
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->p_flush_line = NULL;
+                        return ret;
+                }
+        }
+
+        block_dev_qspi_erased_set(p_work, p_line->eu_idx,
+                                  block_dev_qspi_is_blank(p_line->buff, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE));
+        p_line->dirty = 0;
+        p_work->p_flush_line = NULL;
+        p_work->stats.cache_flushes++;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Pick the least recently used cache line, empty lines first.
+ */
+static block_dev_qspi_cache_line_t * block_dev_qspi_cache_victim(block_dev_qspi_work_t * p_work)
+{
+        block_dev_qspi_cache_line_t * p_line = &p_work->cache[0];
+
+        for (size_t i = 1; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                if (p_line->eu_idx == BD_ERASE_UNIT_INVALID_ID)
+                {
+                        break;
+                }
+
+                if ((p_work->cache[i].eu_idx == BD_ERASE_UNIT_INVALID_ID) ||
+                    (p_work->cache[i].lru < p_line->lru))
+                {
+                        p_line = &p_work->cache[i];
+                }
+        }
+
+        return p_line;
+}
+
+/**
+ * @brief Bring an erase unit into a clean cache line.
+ *
+ * @param p_work     QSPI block device work structure.
+ * @param p_line     Clean cache line to reuse.
+ * @param eu_idx     Erase unit index.
+ * @param overwrite  Whole unit is going to be overwritten, skip reading it.
+ */
+static ret_code_t block_dev_qspi_cache_load(block_dev_qspi_work_t * p_work,
+                                            block_dev_qspi_cache_line_t * p_line,
+                                            uint32_t eu_idx,
+                                            bool overwrite)
+{
+        ASSERT(!p_line->dirty);
+
+        p_line->eu_idx = BD_ERASE_UNIT_INVALID_ID;
+        if (!overwrite)
+        {
+                ret_code_t ret = qspi_flash_read(p_line->buff,
+                                                 eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE,
+                                                 BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                block_dev_qspi_erased_set(p_work, eu_idx,
+                                          block_dev_qspi_is_blank(p_line->buff,
+                                                                  BLOCK_DEV_QSPI_ERASE_UNIT_SIZE));
+        }
+
+        p_line->eu_idx = eu_idx;
+        p_work->stats.cache_misses++;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Get the cache line of an erase unit, bringing it into the least recently used line.
+ *
+ * @param p_work     QSPI block device work structure.
+ * @param eu_idx     Erase unit index.
+ * @param overwrite  Whole unit is going to be overwritten, skip reading it.
+ * @param pp_line    Cache line, NULL when the write-back of a dirty line was started
+ *                   instead; call again once it is done.
+ */
+static ret_code_t block_dev_qspi_cache_get(block_dev_qspi_work_t * p_work,
+                                           uint32_t eu_idx,
+                                           bool overwrite,
+                                           block_dev_qspi_cache_line_t * * pp_line)
+{
+        block_dev_qspi_cache_line_t * p_line = block_dev_qspi_cache_find(p_work, eu_idx);
+
+        *pp_line = NULL;
+        if (p_line)
+        {
+                p_work->stats.cache_hits++;
+        }
+        else
+        {
+                p_line = block_dev_qspi_cache_victim(p_work);
+                if (p_line->dirty)
+                {
+                        return block_dev_qspi_flush_begin(p_work, p_line);
+                }
+
+                ret_code_t ret = block_dev_qspi_cache_load(p_work, p_line, eu_idx, overwrite);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        p_line->lru = ++p_work->lru_clock;
+        *pp_line = p_line;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Drop all cache lines. Dirty lines must be flushed before.
+ */
+static void block_dev_qspi_cache_reset(block_dev_qspi_work_t * p_work)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                p_work->cache[i].eu_idx = BD_ERASE_UNIT_INVALID_ID;
+                p_work->cache[i].dirty  = 0;
+                p_work->cache[i].lru    = 0;
+        }
+
+        p_work->lru_clock = 0;
+}
+
+/**
+ * @brief Number of erase units of the block device, including units beyond the bitmap.
+ */
+static uint32_t block_dev_qspi_eu_total(block_dev_qspi_work_t const * p_work)
+{
+        return p_work->geometry.blk_count / BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+}
+
+/**
+ * @brief Number of erase units in a range not known to be blank.
+ */
+static uint32_t block_dev_qspi_programmed_units(block_dev_qspi_work_t const * p_work,
+                                                uint32_t eu_idx,
+                                                uint32_t eu_count)
+{
+        uint32_t count = 0;
+
+        for (uint32_t i = eu_idx; i < eu_idx + eu_count; ++i)
+        {
+                count += !block_dev_qspi_erased_get(p_work, i);
+        }
+
+        return count;
+}
+
+/**
+ * @brief Check whether a larger erase pays off for a run of erase units.
+ *
+ * Block and chip erase take several times as long as a sector erase but far less
+ * than one sector erase per unit, so they are used once more than a quarter of the
+ * covered units actually need erasing.
+ */
+static bool block_dev_qspi_erase_worth(block_dev_qspi_work_t const * p_work,
+                                       uint32_t eu_idx,
+                                       uint32_t eu_count)
+{
+        return block_dev_qspi_programmed_units(p_work, eu_idx, eu_count) > eu_count / 4;
+}
+
+/**
+ * @brief Largest erase to apply at an erase unit without leaving a range.
+ */
+static uint32_t block_dev_qspi_erase_size(block_dev_qspi_work_t const * p_work,
+                                          uint32_t eu_idx,
+                                          uint32_t eu_end)
+{
+        static const uint32_t sizes[] = { QSPI_FLASH_ERASE_SIZE_64K, QSPI_FLASH_ERASE_SIZE_32K };
+        uint32_t erase_sizes = qspi_flash_info_get()->erase_sizes;
+
+        /* Not when the wear counters are saved behind the block device */
+        if ((eu_idx == 0) && (eu_end == block_dev_qspi_eu_total(p_work)) &&
+            qspi_remap_clean(0, qspi_flash_info_get()->size) &&
+            (eu_end * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE == qspi_flash_info_get()->size) &&
+            block_dev_qspi_erase_worth(p_work, 0, eu_end))
+        {
+                return qspi_flash_info_get()->size;
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i)
+        {
+                uint32_t units = sizes[i] / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+
+                /* Retired units are erased one by one, in their spares */
+                if ((erase_sizes & sizes[i]) &&
+                    ((eu_idx % units) == 0) &&
+                    (eu_end - eu_idx >= units) &&
+                    qspi_remap_clean(eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE, sizes[i]) &&
+                    block_dev_qspi_erase_worth(p_work, eu_idx, units))
+                {
+                        return sizes[i];
+                }
+        }
+
+        return BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+}
+
+/**
+ * @brief Drop cached erase units of a range and schedule their erase.
+ *
+ * The run is erased with the fewest erase commands by @ref block_dev_qspi_erase_next:
+ * units known to be blank are skipped, aligned groups of units are erased with
+ * 64 KB / 32 KB block erase and the whole flash with chip erase.
+ */
+static void block_dev_qspi_erase_begin(block_dev_qspi_work_t * p_work,
+                                       uint32_t eu_first,
+                                       uint32_t eu_end)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                block_dev_qspi_cache_line_t * p_line = &p_work->cache[i];
+
+                if ((p_line->eu_idx >= eu_first) && (p_line->eu_idx < eu_end))
+                {
+                        p_line->eu_idx = BD_ERASE_UNIT_INVALID_ID;
+                        p_line->dirty  = 0;
+                        p_line->lru    = 0;
+                }
+        }
+
+        p_work->erase_idx = eu_first;
+        p_work->erase_end = eu_end;
+}
+
+/**
+ * @brief Start the next erase command of the erase run.
+ */
+static ret_code_t block_dev_qspi_erase_next(block_dev_qspi_work_t * p_work)
+{
+        while (p_work->erase_idx < p_work->erase_end)
+        {
+                uint32_t eu_idx = p_work->erase_idx;
+                uint32_t size   = block_dev_qspi_erase_size(p_work, eu_idx, p_work->erase_end);
+                uint32_t units  = size / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+
+                p_work->erase_idx += units;
+                if ((units == 1) && block_dev_qspi_erased_get(p_work, eu_idx))
+                {
+                        continue;
+                }
+
+                ret_code_t ret = block_dev_qspi_erase_start(p_work, eu_idx, size);
+                if (ret != NRF_SUCCESS)
+                {
+                        p_work->erase_idx = p_work->erase_end;
+                        return ret;
+                }
+
+                for (uint32_t i = eu_idx; i < eu_idx + units; ++i)
+                {
+                        block_dev_qspi_erased_set(p_work, i, true);
+                }
+                break;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Check whether all blocks of an erase unit are trimmed.
+ */
+static bool block_dev_qspi_trimmed_whole(block_dev_qspi_work_t const * p_work, uint32_t eu_idx)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+
+        for (uint32_t i = 0; i < blk_per_eu; ++i)
+        {
+                if (!block_dev_qspi_trimmed_get(p_work, eu_idx * blk_per_eu + i))
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * @brief Start the erase of a unit which a coming write-back is going to need.
+ *
+ * In write-back mode, the next units of a sequential write stream which are trimmed
+ * whole and not cached: nothing of value is lost if the erase is interrupted, and
+ * no content is held in RAM for the stream. Units still holding data are left
+ * alone; erasing them ahead would leave their only copy in the cache until the
+ * stream writes them back. Then, with the journal, the journal unit of the next
+ * write-back, once anything was written.
+ *
+ * @retval true An erase was started.
+ */
+static bool block_dev_qspi_erase_ahead(block_dev_qspi_work_t * p_work)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+        uint32_t eu_first;
+        uint32_t eu_end;
+        ret_code_t ret;
+
+        if (!BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD || !p_work->seq_run)
+        {
+                return false;
+        }
+
+        eu_first = CEIL_DIV(p_work->seq_next, blk_per_eu);
+        eu_end   = MIN(MIN(eu_first + BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD, block_dev_qspi_eu_total(p_work)),
+                       p_work->eu_count);
+        if (!p_work->writeback_mode || (p_work->seq_run < 2 * blk_per_eu))
+        {
+                eu_end = eu_first;
+        }
+
+        for (uint32_t eu_idx = eu_first; eu_idx < eu_end; ++eu_idx)
+        {
+                if (block_dev_qspi_erased_get(p_work, eu_idx) || block_dev_qspi_cache_find(p_work, eu_idx) ||
+                    !block_dev_qspi_trimmed_whole(p_work, eu_idx))
+                {
+                        continue;
+                }
+
+                ret = block_dev_qspi_erase_start(p_work, eu_idx, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Erase ahead failed: %u", ret);
+                        return false;
+                }
+
+                block_dev_qspi_erased_set(p_work, eu_idx, true);
+                p_work->stats.erase_aheads++;
+                return true;
+        }
+
+        /* A blank unit is written back without a journal copy, so the journal unit
+         * comes after the trimmed units of the stream */
+        if (p_work->journal)
+        {
+                eu_first = block_dev_qspi_journal_unit(p_work,
+                                                       (p_work->jrnl_slot + 1) % BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS);
+                if ((eu_first >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS) || block_dev_qspi_erased_get(p_work, eu_first))
+                {
+                        return false;
+                }
+
+                ret = block_dev_qspi_erase_start(p_work, eu_first, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Erase ahead failed: %u", ret);
+                        return false;
+                }
+
+                block_dev_qspi_erased_set(p_work, eu_first, true);
+                p_work->stats.erase_aheads++;
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * @brief Blank-check the next erase unit of the background scan.
+ *
+ * Reading stops at the first programmed page, so only blank units are read whole.
+ */
+static void block_dev_qspi_blank_scan(block_dev_qspi_work_t * p_work)
+{
+        uint32_t eu_idx = p_work->scan_idx++;
+
+        /* State of cached units is maintained by the cache */
+        if (block_dev_qspi_cache_find(p_work, eu_idx))
+        {
+                return;
+        }
+
+        uint32_t addr = eu_idx * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        bool blank = true;
+
+        for (uint32_t off = 0; blank && (off < BLOCK_DEV_QSPI_ERASE_UNIT_SIZE); off += sizeof(m_scan_buff))
+        {
+                if (qspi_flash_read(m_scan_buff, addr + off, sizeof(m_scan_buff)) != NRF_SUCCESS)
+                {
+                        blank = false;
+                        break;
+                }
+
+                blank = block_dev_qspi_is_blank(m_scan_buff, sizeof(m_scan_buff));
+        }
+
+        block_dev_qspi_erased_set(p_work, eu_idx, blank);
+
+        if (p_work->scan_idx == p_work->eu_count)
+        {
+                uint32_t count = 0;
+                for (uint32_t i = 0; i < p_work->eu_count; ++i)
+                {
+                        count += block_dev_qspi_erased_get(p_work, i);
+                }
+                NRF_LOG_INFO("Blank-check done: %u of %u erase units blank", count, p_work->eu_count);
+        }
+}
+
+/**
+ * @brief Erase the next erase unit trimmed whole, which is neither cached nor blank.
+ *
+ * @retval true An erase was started.
+ */
+static bool block_dev_qspi_trim_erase(block_dev_qspi_work_t * p_work)
+{
+        while (p_work->trim_idx < p_work->eu_count)
+        {
+                uint32_t eu_idx = p_work->trim_idx++;
+
+                if (!block_dev_qspi_trimmed_whole(p_work, eu_idx) || block_dev_qspi_erased_get(p_work, eu_idx) ||
+                    block_dev_qspi_cache_find(p_work, eu_idx))
+                {
+                        continue;
+                }
+
+                ret_code_t ret = block_dev_qspi_erase_start(p_work, eu_idx, BLOCK_DEV_QSPI_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Trimmed erase failed: %u", ret);
+                        return false;
+                }
+
+                block_dev_qspi_erased_set(p_work, eu_idx, true);
+                p_work->stats.trim_erases++;
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * @brief Verify the blocks of the next erase unit of the scrub pass against their CRCs.
+ */
+static void block_dev_qspi_scrub(block_dev_qspi_work_t * p_work)
+{
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(blk_size);
+        uint32_t chunk      = MIN(blk_size, sizeof(m_scan_buff));
+        uint32_t eu_idx     = p_work->scrub_idx++;
+        uint32_t blk_id     = eu_idx * blk_per_eu;
+        uint32_t crc[32];
+
+        /* Cached units are newer than the flash */
+        if (!block_dev_qspi_cache_find(p_work, eu_idx) &&
+            (block_dev_qspi_crc_read(p_work, eu_idx, crc) == NRF_SUCCESS))
+        {
+                for (uint32_t i = 0; i < blk_per_eu; ++i)
+                {
+                        uint32_t value = 0;
+                        bool blank     = true;
+                        ret_code_t ret = NRF_SUCCESS;
+
+                        for (uint32_t off = 0; (ret == NRF_SUCCESS) && (off < blk_size); off += chunk)
+                        {
+                                ret = qspi_flash_read(m_scan_buff, (blk_id + i) * blk_size + off, chunk);
+                                value = crc32_fast(value, m_scan_buff, chunk);
+                                blank = blank && block_dev_qspi_is_blank(m_scan_buff, chunk);
+                        }
+
+                        if (ret == NRF_SUCCESS)
+                        {
+                                block_dev_qspi_crc_verify(p_work, blk_id + i, crc[i], value, blank);
+                        }
+                }
+        }
+
+        if (p_work->scrub_idx == block_dev_qspi_eu_total(p_work))
+        {
+                p_work->stats.scrub_passes++;
+                p_work->scrub_ticks = app_timer_cnt_get();
+                p_work->scrub_wait  = 0;
+                NRF_LOG_INFO("Scrub pass done, %u CRC errors", p_work->stats.crc_errors);
+        }
+}
+
+/**
+ * @brief Serve a read request. Reads complete in one step.
+ */
+static ret_code_t block_dev_qspi_req_read(block_dev_qspi_work_t * p_work,
+                                          block_dev_qspi_req_t * p_req,
+                                          bool * p_done)
+{
+        uint32_t blk_size = p_work->geometry.blk_size;
+        uint32_t blk_id   = p_req->req.blk_id;
+        uint32_t blk_end  = p_req->req.blk_id + p_req->req.blk_count;
+        uint8_t * p_buff  = p_req->req.p_buff;
+
+        while (blk_id < blk_end)
+        {
+                block_dev_qspi_cache_line_t * p_line =
+                        block_dev_qspi_cache_find(p_work, BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size));
+                if (p_line)
+                {
+                        uint32_t off = (blk_id % BD_BLOCKS_PER_ERASEUNIT(blk_size)) * blk_size;
+                        memcpy(p_buff, (uint8_t *)p_line->buff + off, blk_size);
+                        p_work->stats.cache_hits++;
+                        p_buff += blk_size;
+                        blk_id++;
+                        continue;
+                }
+
+                /* Gather the longest run of blocks not held in the cache */
+                uint32_t run_end = blk_id + 1;
+                while ((run_end < blk_end) &&
+                       !block_dev_qspi_cache_find(p_work, BD_BLOCK_TO_ERASEUNIT(run_end, blk_size)))
+                {
+                        run_end++;
+                }
+
+                uint32_t size = (run_end - blk_id) * blk_size;
+                ret_code_t ret = qspi_flash_read(p_buff, blk_id * blk_size, size);
+                if ((ret == NRF_SUCCESS) && p_work->crc)
+                {
+                        ret = block_dev_qspi_crc_check(p_work, blk_id, run_end - blk_id, p_buff);
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                p_buff += size;
+                blk_id  = run_end;
+        }
+
+        *p_done = true;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Get the whole erase units a write request overwrites, if enough to erase them up front.
+ */
+static bool block_dev_qspi_write_erase_run(block_dev_qspi_work_t const * p_work,
+                                           nrf_block_req_t const * p_blk,
+                                           uint32_t * p_eu_first,
+                                           uint32_t * p_eu_last)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+
+        *p_eu_first = CEIL_DIV(p_blk->blk_id, blk_per_eu);
+        *p_eu_last  = (p_blk->blk_id + p_blk->blk_count) / blk_per_eu;
+        return *p_eu_last >= *p_eu_first + QSPI_FLASH_ERASE_SIZE_32K / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+}
+
+/**
+ * @brief Advance a write request.
+ *
+ * Copies blocks into the cache until a dirty line has to be evicted, then starts
+ * its write-back and returns. Called again once the write-back is done.
+ */
+static ret_code_t block_dev_qspi_req_write(block_dev_qspi_work_t * p_work,
+                                           block_dev_qspi_req_t * p_req,
+                                           bool * p_done)
+{
+        nrf_block_req_t const * p_blk = &p_req->req;
+        uint32_t blk_size   = p_work->geometry.blk_size;
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(blk_size);
+        uint32_t blk_end    = p_blk->blk_id + p_blk->blk_count;
+        ret_code_t ret;
+
+        /* Failed write-back of an earlier request */
+        if (p_work->error != NRF_SUCCESS)
+        {
+                ret = p_work->error;
+                p_work->error = NRF_SUCCESS;
+                return ret;
+        }
+
+        if (!p_req->started)
+        {
+                p_req->started = true;
+
+                /* Units overwritten whole by a long request are erased in as few commands as possible */
+                uint32_t eu_first;
+                uint32_t eu_last;
+                if (block_dev_qspi_write_erase_run(p_work, p_blk, &eu_first, &eu_last))
+                {
+                        block_dev_qspi_erase_begin(p_work, eu_first, eu_last);
+                        return NRF_SUCCESS;
+                }
+        }
+
+        while (p_req->done < p_blk->blk_count)
+        {
+                uint32_t blk_id  = p_blk->blk_id + p_req->done;
+                uint32_t eu_idx  = BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size);
+                uint32_t blk_off = blk_id % blk_per_eu;
+                uint8_t const * p_src = (uint8_t const *)p_blk->p_buff + p_req->done * blk_size;
+                block_dev_qspi_cache_line_t * p_line;
+
+                bool overwrite = (blk_off == 0) && (blk_end - blk_id >= blk_per_eu);
+                ret = block_dev_qspi_cache_get(p_work, eu_idx, overwrite, &p_line);
+                if ((ret != NRF_SUCCESS) || !p_line)
+                {
+                        return ret;
+                }
+
+                memcpy((uint8_t *)p_line->buff + blk_off * blk_size, p_src, blk_size);
+                p_line->dirty |= 1u << blk_off;
+                block_dev_qspi_trimmed_set(p_work, blk_id, false);
+                p_req->done++;
+        }
+
+        if (!p_work->writeback_mode)
+        {
+                block_dev_qspi_cache_line_t * p_line = block_dev_qspi_cache_dirty(p_work);
+                if (p_line)
+                {
+                        return block_dev_qspi_flush_begin(p_work, p_line);
+                }
+        }
+
+        *p_done = true;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Remove a request from the queue and report its completion.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param pos        Position of the request in the queue, 0 for the oldest.
+ * @param ret        Result of the request.
+ */
+static void block_dev_qspi_req_complete(block_dev_qspi_t const * p_qspi_dev, uint32_t pos, ret_code_t ret)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        /* Slot may be reused by a request submitted from the event handler */
+        block_dev_qspi_req_t req = p_work->queue[(p_work->q_head + pos) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+
+        if (!pos)
+        {
+                p_work->q_head = (p_work->q_head + 1) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE;
+        }
+        else
+        {
+                /* Close the gap, requests behind keep their order */
+                for (uint32_t i = pos; i + 1 < p_work->q_count; ++i)
+                {
+                        p_work->queue[(p_work->q_head + i) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE] =
+                                p_work->queue[(p_work->q_head + i + 1) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+                }
+        }
+        p_work->q_count--;
+        p_work->done_seq = req.seq;
+        p_work->done_ret = ret;
+
+        uint32_t ticks  = app_timer_cnt_diff_compute(app_timer_cnt_get(), req.ticks);
+        uint32_t bucket = 0;
+        while ((bucket < BLOCK_DEV_QSPI_LATENCY_BUCKETS - 1) && (ticks >> bucket))
+        {
+                bucket++;
+        }
+
+        if (req.type == BLOCK_DEV_QSPI_REQ_READ)
+        {
+                p_work->stats.read_reqs++;
+                p_work->stats.read_blocks += req.req.blk_count;
+                p_work->stats.read_ticks  += ticks;
+                p_work->stats.read_hist[bucket]++;
+                block_dev_qspi_event(p_qspi_dev, NRF_BLOCK_DEV_EVT_BLK_READ_DONE, ret, &req.req);
+        }
+        else
+        {
+                p_work->stats.write_reqs++;
+                p_work->stats.write_blocks += req.req.blk_count;
+                p_work->stats.write_ticks  += ticks;
+                p_work->stats.write_hist[bucket]++;
+                block_dev_qspi_event(p_qspi_dev, NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE, ret, &req.req);
+        }
+}
+
+/**
+ * @brief Advance the oldest queued request, complete it when done.
+ */
+static void block_dev_qspi_req_step(block_dev_qspi_t const * p_qspi_dev)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        block_dev_qspi_req_t * p_req = &p_work->queue[p_work->q_head];
+        bool done = false;
+        ret_code_t ret;
+
+        if (p_req->type == BLOCK_DEV_QSPI_REQ_READ)
+        {
+                ret = block_dev_qspi_req_read(p_work, p_req, &done);
+        }
+        else
+        {
+                ret = block_dev_qspi_req_write(p_work, p_req, &done);
+        }
+
+        if ((ret == NRF_SUCCESS) && !done)
+        {
+                return;
+        }
+
+        block_dev_qspi_req_complete(p_qspi_dev, 0, ret);
+}
+
+/**
+ * @brief Check that the units of a range which are being erased are held in the cache.
+ */
+static bool block_dev_qspi_erase_cached(block_dev_qspi_work_t * p_work,
+                                        uint32_t eu_first,
+                                        uint32_t eu_end)
+{
+        eu_first = MAX(eu_first, p_work->erase_eu);
+        eu_end   = MIN(eu_end, p_work->erase_eu + p_work->erase_units);
+
+        for (uint32_t eu_idx = eu_first; eu_idx < eu_end; ++eu_idx)
+        {
+                if (!block_dev_qspi_cache_find(p_work, eu_idx))
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * @brief Check whether a queued read can be served while the erase in progress is suspended.
+ *
+ * The read must not depend on an earlier queued write, and the units being erased
+ * must be either outside the read or held in the cache.
+ */
+static bool block_dev_qspi_suspend_read_ok(block_dev_qspi_work_t * p_work, uint32_t pos)
+{
+        block_dev_qspi_req_t const * p_req =
+                &p_work->queue[(p_work->q_head + pos) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+        uint32_t blk_size = p_work->geometry.blk_size;
+        uint32_t blk_id   = p_req->req.blk_id;
+        uint32_t blk_end  = p_req->req.blk_id + p_req->req.blk_count;
+
+        for (uint32_t i = 0; i < pos; ++i)
+        {
+                block_dev_qspi_req_t const * p_prev =
+                        &p_work->queue[(p_work->q_head + i) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+                if ((p_prev->type == BLOCK_DEV_QSPI_REQ_WRITE) &&
+                    (p_prev->req.blk_id < blk_end) &&
+                    (blk_id < p_prev->req.blk_id + p_prev->req.blk_count))
+                {
+                        return false;
+                }
+        }
+
+        return block_dev_qspi_erase_cached(p_work,
+                                           BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size),
+                                           BD_BLOCK_TO_ERASEUNIT(blk_end - 1, blk_size) + 1);
+}
+
+/**
+ * @brief Serve a queued read by suspending the erase in progress.
+ *
+ * @retval true  A read was served.
+ * @retval false No read could be served; the erase is left running.
+ */
+static bool block_dev_qspi_suspend_read(block_dev_qspi_t const * p_qspi_dev)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        uint32_t pos;
+
+        for (pos = 0; pos < p_work->q_count; ++pos)
+        {
+                block_dev_qspi_req_t const * p_req =
+                        &p_work->queue[(p_work->q_head + pos) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+                if ((p_req->type == BLOCK_DEV_QSPI_REQ_READ) &&
+                    block_dev_qspi_suspend_read_ok(p_work, pos))
+                {
+                        break;
+                }
+        }
+
+        if ((pos == p_work->q_count) || (qspi_flash_erase_suspend() != NRF_SUCCESS))
+        {
+                return false;
+        }
+
+        bool done = false;
+        p_work->in_step = true;
+        ret_code_t ret = block_dev_qspi_req_read(p_work,
+                                                 &p_work->queue[(p_work->q_head + pos) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE],
+                                                 &done);
+
+        ret_code_t resume_ret = qspi_flash_erase_resume();
+        if (resume_ret != NRF_SUCCESS)
+        {
+                NRF_LOG_ERROR("Erase resume failed: %u", resume_ret);
+                p_work->error = resume_ret;
+        }
+
+        p_work->stats.suspend_reads++;
+        block_dev_qspi_req_complete(p_qspi_dev, pos, ret);
+        p_work->in_step = false;
+        return true;
+}
+
+/**
+ * @brief Complete the oldest queued request during an erase if it only writes cached units.
+ *
+ * Only in write-back mode, where a write request needs the flash for evictions only.
+ * The line being written back is not modified.
+ *
+ * @retval true A write was completed.
+ */
+static bool block_dev_qspi_erase_write(block_dev_qspi_t const * p_qspi_dev)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        block_dev_qspi_req_t * p_req = &p_work->queue[p_work->q_head];
+        uint32_t blk_size = p_work->geometry.blk_size;
+        uint32_t eu_first;
+        uint32_t eu_last;
+
+        if (!p_work->writeback_mode || !p_work->q_count || (p_req->type != BLOCK_DEV_QSPI_REQ_WRITE) ||
+            (p_work->erase_idx < p_work->erase_end) ||
+            (!p_req->started && block_dev_qspi_write_erase_run(p_work, &p_req->req, &eu_first, &eu_last)))
+        {
+                return false;
+        }
+
+        uint32_t blk_id  = p_req->req.blk_id + p_req->done;
+        uint32_t blk_end = p_req->req.blk_id + p_req->req.blk_count;
+        for (uint32_t i = blk_id; i < blk_end; ++i)
+        {
+                block_dev_qspi_cache_line_t const * p_line =
+                        block_dev_qspi_cache_find(p_work, BD_BLOCK_TO_ERASEUNIT(i, blk_size));
+                if (!p_line || (p_line == p_work->p_flush_line))
+                {
+                        return false;
+                }
+        }
+
+        bool done = false;
+        p_work->in_step = true;
+        ret_code_t ret = block_dev_qspi_req_write(p_work, p_req, &done);
+        ASSERT((ret != NRF_SUCCESS) || done);
+
+        p_work->stats.erase_writes++;
+        block_dev_qspi_req_complete(p_qspi_dev, 0, ret);
+        p_work->in_step = false;
+        return true;
+}
+
+/**
+ * @brief Do one step of work.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param background Called from @ref block_dev_qspi_process or a synchronous call;
+ *                   otherwise page programs and the blank-check scan are left for later.
+ */
+static bd_step_t block_dev_qspi_step_do(block_dev_qspi_t const * p_qspi_dev, bool background)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        ret_code_t ret;
+
+        if (p_work->p_flush_line)
+        {
+                if (!background)
+                {
+                        return BD_STEP_WAIT;
+                }
+
+                ret = block_dev_qspi_flush_continue(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_ERROR("Write-back failed: %u", ret);
+                        p_work->error     = ret;
+                        p_work->flush_all = false;
+                }
+                return BD_STEP_PROGRESS;
+        }
+
+        if (p_work->erase_idx < p_work->erase_end)
+        {
+                ret = block_dev_qspi_erase_next(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_ERROR("Erase failed: %u", ret);
+                        p_work->error = ret;
+                }
+                return BD_STEP_PROGRESS;
+        }
+
+        if (p_work->q_count)
+        {
+                block_dev_qspi_req_step(p_qspi_dev);
+                return BD_STEP_PROGRESS;
+        }
+
+        if (p_work->flush_all)
+        {
+                block_dev_qspi_cache_line_t * p_line = block_dev_qspi_cache_dirty(p_work);
+                if (!p_line)
+                {
+                        p_work->flush_all = false;
+                        return BD_STEP_PROGRESS;
+                }
+
+                ret = block_dev_qspi_flush_begin(p_work, p_line);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_ERROR("Write-back failed: %u", ret);
+                        p_work->error     = ret;
+                        p_work->flush_all = false;
+                }
+                return BD_STEP_PROGRESS;
+        }
+
+        if (background && block_dev_qspi_erase_ahead(p_work))
+        {
+                return BD_STEP_PROGRESS;
+        }
+
+        if (background && (p_work->scan_idx < p_work->eu_count))
+        {
+                block_dev_qspi_blank_scan(p_work);
+                return BD_STEP_PROGRESS;
+        }
+
+        /* After the scan, so units found blank are not erased again */
+        if (background && block_dev_qspi_trim_erase(p_work))
+        {
+                return BD_STEP_PROGRESS;
+        }
+
+        if (background && qspi_wear_save_due())
+        {
+                ret = qspi_wear_save();
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Wear counters not saved: %u", ret);
+                }
+                return BD_STEP_PROGRESS;
+        }
+
+        if (background && (p_work->scrub_idx < block_dev_qspi_eu_total(p_work)))
+        {
+                block_dev_qspi_scrub(p_work);
+                return BD_STEP_PROGRESS;
+        }
+
+        return BD_STEP_IDLE;
+}
+
+static bd_step_t block_dev_qspi_step(block_dev_qspi_t const * p_qspi_dev, bool background)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (p_work->erasing)
+        {
+                if (qspi_flash_busy())
+                {
+                        return (block_dev_qspi_erase_write(p_qspi_dev) ||
+                                block_dev_qspi_suspend_read(p_qspi_dev)) ? BD_STEP_PROGRESS : BD_STEP_WAIT;
+                }
+                p_work->erasing = false;
+        }
+
+        uint32_t ticks = app_timer_cnt_get();
+
+        p_work->in_step = true;
+        bd_step_t result = block_dev_qspi_step_do(p_qspi_dev, background);
+        p_work->in_step = false;
+
+        if (result != BD_STEP_IDLE)
+        {
+                p_work->active_ticks = app_timer_cnt_get();
+        }
+
+        ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), ticks);
+        if (ticks > p_work->stats.step_ticks)
+        {
+                p_work->stats.step_ticks = ticks;
+        }
+
+        return result;
+}
+
+/**
+ * @brief Check whether requests or write-backs are outstanding.
+ */
+static bool block_dev_qspi_busy(block_dev_qspi_work_t const * p_work)
+{
+        return p_work->q_count || p_work->p_flush_line || p_work->erasing || p_work->flush_all ||
+               (p_work->erase_idx < p_work->erase_end);
+}
+
+/**
+ * @brief Complete all outstanding work, except the blank-check scan.
+ *
+ * @return Error of background work.
+ */
+static ret_code_t block_dev_qspi_drain(block_dev_qspi_t const * p_qspi_dev)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (p_work->in_step)
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        while (block_dev_qspi_busy(p_work))
+        {
+                UNUSED_RETURN_VALUE(block_dev_qspi_step(p_qspi_dev, true));
+        }
+
+        ret_code_t ret = p_work->error;
+        p_work->error = NRF_SUCCESS;
+        return ret;
+}
+
+/**
+ * @brief Step until the request submitted without event handler is complete.
+ *
+ * Write-backs and erases started on its behalf are left to @ref block_dev_qspi_process,
+ * unrelated background work is not waited for.
+ *
+ * @return Result of the request.
+ */
+static ret_code_t block_dev_qspi_wait(block_dev_qspi_t const * p_qspi_dev, uint32_t seq)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        while (p_work->done_seq != seq)
+        {
+                UNUSED_RETURN_VALUE(block_dev_qspi_step(p_qspi_dev, true));
+        }
+
+        return p_work->done_ret;
+}
+
+/**
+ * @brief Track sequential write streams.
+ */
+static void block_dev_qspi_seq_track(block_dev_qspi_work_t * p_work, nrf_block_req_t const * p_blk)
+{
+        uint32_t stream_blocks = 2 * BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+        bool stream = (p_blk->blk_id == p_work->seq_next) && (p_work->seq_run >= stream_blocks);
+
+        p_work->seq_run  = (p_blk->blk_id == p_work->seq_next) ? p_work->seq_run + p_blk->blk_count :
+                                                                 p_blk->blk_count;
+        p_work->seq_next = p_blk->blk_id + p_blk->blk_count;
+
+        if (!stream && (p_work->seq_run >= stream_blocks))
+        {
+                p_work->stats.seq_streams++;
+        }
+}
+
+/**
+ * @brief Queue a request and do as much of it as possible without waiting for the flash.
+ */
+static ret_code_t block_dev_qspi_submit(block_dev_qspi_t const * p_qspi_dev,
+                                        block_dev_qspi_req_type_t type,
+                                        nrf_block_req_t const * p_blk)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        if ((p_work->q_count == BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE) ||
+            (!p_work->ev_handler && p_work->in_step))
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        block_dev_qspi_req_t * p_req =
+                &p_work->queue[(p_work->q_head + p_work->q_count) % BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE];
+        p_req->req     = *p_blk;
+        p_req->type    = type;
+        p_req->done    = 0;
+        p_req->ticks   = app_timer_cnt_get();
+        p_req->seq     = ++p_work->req_seq;
+        p_req->started = false;
+        p_work->q_count++;
+
+        if (type == BLOCK_DEV_QSPI_REQ_WRITE)
+        {
+                block_dev_qspi_seq_track(p_work, p_blk);
+        }
+
+        if (!p_work->ev_handler)
+        {
+                return block_dev_qspi_wait(p_qspi_dev, p_req->seq);
+        }
+
+        /* Submitted from an event handler, picked up by the running step */
+        if (!p_work->in_step)
+        {
+                while (block_dev_qspi_step(p_qspi_dev, false) == BD_STEP_PROGRESS)
+                {
+                        /* Until the flash has to be waited for */
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+ret_code_t block_dev_qspi_cache_flush(block_dev_qspi_t const * p_qspi_dev)
+{
+        ASSERT(p_qspi_dev);
+
+        p_qspi_dev->p_work->flush_all = true;
+        return block_dev_qspi_drain(p_qspi_dev);
+}
+
+/**
+ * @brief Write back the dirty lines holding a block range and wait until they are on flash.
+ *
+ * Used for the write barrier, also in @ref BLOCK_DEV_QSPI_FLAG_CACHE_DEFER_SYNC mode.
+ */
+static ret_code_t block_dev_qspi_range_flush(block_dev_qspi_t const * p_qspi_dev,
+                                             uint32_t blk_id,
+                                             uint32_t blk_count)
+{
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        uint32_t blk_size = p_work->geometry.blk_size;
+
+        if (p_work->in_step)
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        if (!blk_count)
+        {
+                return NRF_SUCCESS;
+        }
+
+        uint32_t eu_first = BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size);
+        uint32_t eu_last  = BD_BLOCK_TO_ERASEUNIT(blk_id + blk_count - 1, blk_size);
+
+        for (uint32_t eu_idx = eu_first; eu_idx <= eu_last; ++eu_idx)
+        {
+                block_dev_qspi_cache_line_t * p_line = block_dev_qspi_cache_find(p_work, eu_idx);
+                if (!p_line || !p_line->dirty)
+                {
+                        continue;
+                }
+
+                /* Write-back in progress, possibly of this very line with older data */
+                while (p_work->p_flush_line || p_work->erasing)
+                {
+                        UNUSED_RETURN_VALUE(block_dev_qspi_step(p_qspi_dev, true));
+                }
+
+                ret_code_t ret = block_dev_qspi_flush_begin(p_work, p_line);
+                while ((ret == NRF_SUCCESS) && (p_work->p_flush_line == p_line))
+                {
+                        UNUSED_RETURN_VALUE(block_dev_qspi_step(p_qspi_dev, true));
+                }
+
+                if ((ret == NRF_SUCCESS) && p_line->dirty)
+                {
+                        /* Failed write-back, error left by the step */
+                        ret = (p_work->error != NRF_SUCCESS) ? p_work->error : NRF_ERROR_INTERNAL;
+                        p_work->error = NRF_SUCCESS;
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        return NRF_SUCCESS;
+}
+
+void block_dev_qspi_cache_flush_start(block_dev_qspi_t const * p_qspi_dev)
+{
+        ASSERT(p_qspi_dev);
+
+        p_qspi_dev->p_work->flush_all = true;
+}
+
+/**
+ * @brief Schedule the erase of the erase units lying whole in a block range.
+ */
+static void block_dev_qspi_discard_range(block_dev_qspi_work_t * p_work,
+                                         uint32_t blk_id,
+                                         uint32_t blk_count)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+        uint32_t eu_first   = CEIL_DIV(blk_id, blk_per_eu);
+        uint32_t eu_end     = (blk_id + blk_count) / blk_per_eu;
+
+        if (eu_first < eu_end)
+        {
+                block_dev_qspi_erase_begin(p_work, eu_first, eu_end);
+        }
+}
+
+ret_code_t block_dev_qspi_discard(block_dev_qspi_t const * p_qspi_dev,
+                                  uint32_t blk_id,
+                                  uint32_t blk_count)
+{
+        ASSERT(p_qspi_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        if (blk_id + blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_qspi_drain(p_qspi_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        block_dev_qspi_discard_range(p_work, blk_id, blk_count);
+        return block_dev_qspi_drain(p_qspi_dev);
+}
+
+ret_code_t block_dev_qspi_discard_start(block_dev_qspi_t const * p_qspi_dev,
+                                        uint32_t blk_id,
+                                        uint32_t blk_count)
+{
+        ASSERT(p_qspi_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        if (blk_id + blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        if (p_work->in_step || block_dev_qspi_busy(p_work))
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        block_dev_qspi_discard_range(p_work, blk_id, blk_count);
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Mark a block range trimmed, erase units trimmed whole are erased in the background.
+ */
+static void block_dev_qspi_unmap(block_dev_qspi_work_t * p_work,
+                                 uint32_t blk_id,
+                                 uint32_t blk_count)
+{
+        uint32_t blk_per_eu = BD_BLOCKS_PER_ERASEUNIT(p_work->geometry.blk_size);
+
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                block_dev_qspi_trimmed_set(p_work, blk_id + i, true);
+        }
+
+        p_work->trim_idx = MIN(p_work->trim_idx, blk_id / blk_per_eu);
+        p_work->stats.trim_blocks += blk_count;
+}
+
+ret_code_t block_dev_qspi_map(block_dev_qspi_t const * p_qspi_dev,
+                              uint32_t blk_id,
+                              uint32_t blk_count,
+                              void const * * pp_data)
+{
+        ASSERT(p_qspi_dev);
+        ASSERT(pp_data);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        uint32_t blk_size = p_work->geometry.blk_size;
+
+        if (!p_work->initialized)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        if (!blk_count || (blk_id + blk_count > p_work->geometry.blk_count))
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        void const * p_xip = qspi_flash_xip_get(blk_id * blk_size, blk_count * blk_size);
+        if (!p_xip)
+        {
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        /* Flash has to be idle and hold the latest data of the range */
+        ret_code_t ret = block_dev_qspi_drain(p_qspi_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        uint32_t eu_first = BD_BLOCK_TO_ERASEUNIT(blk_id, blk_size);
+        uint32_t eu_last  = BD_BLOCK_TO_ERASEUNIT(blk_id + blk_count - 1, blk_size);
+
+        for (size_t i = 0; i < ARRAY_SIZE(p_work->cache); ++i)
+        {
+                block_dev_qspi_cache_line_t * p_line = &p_work->cache[i];
+
+                if (!p_line->dirty || (p_line->eu_idx < eu_first) || (p_line->eu_idx > eu_last))
+                {
+                        continue;
+                }
+
+                ret = block_dev_qspi_flush_begin(p_work, p_line);
+                while ((ret == NRF_SUCCESS) && p_work->p_flush_line)
+                {
+                        while (p_work->erasing && qspi_flash_busy())
+                        {
+                                /* Wait for the erase */
+                        }
+                        p_work->erasing = false;
+
+                        ret = block_dev_qspi_flush_continue(p_work);
+                }
+
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        /* Read back of a write-back may have retired a unit of the range */
+        if (!qspi_remap_clean(blk_id * blk_size, blk_count * blk_size))
+        {
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        p_work->active_ticks = app_timer_cnt_get();
+        p_work->stats.xip_maps++;
+        *pp_data = p_xip;
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Put the flash in deep power-down once idle long enough.
+ */
+static void block_dev_qspi_idle(block_dev_qspi_work_t * p_work)
+{
+#if BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS
+        if (qspi_flash_powered_down())
+        {
+                /* Keeps the power-down time accounted across app_timer counter wraps */
+                UNUSED_RETURN_VALUE(qspi_flash_stats_get());
+                return;
+        }
+
+        if (app_timer_cnt_diff_compute(app_timer_cnt_get(), p_work->active_ticks) >=
+            APP_TIMER_TICKS(BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS))
+        {
+                ret_code_t ret = qspi_flash_power_down();
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Deep power-down failed: %u", ret);
+                }
+        }
+#else
+        UNUSED_PARAMETER(p_work);
+#endif
+}
+
+/**
+ * @brief Start a scrub pass once the scrub period has passed since the last one.
+ *
+ * The wait is accumulated on every idle call, which come at least every cache flush
+ * period, well within the app_timer counter range.
+ *
+ * @retval true A scrub pass was started.
+ */
+static bool block_dev_qspi_scrub_schedule(block_dev_qspi_work_t * p_work)
+{
+        if (!p_work->crc || !BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S ||
+            (p_work->scrub_idx < block_dev_qspi_eu_total(p_work)))
+        {
+                return false;
+        }
+
+        uint32_t now = app_timer_cnt_get();
+
+        p_work->scrub_wait += app_timer_cnt_diff_compute(now, p_work->scrub_ticks);
+        p_work->scrub_ticks = now;
+        if (p_work->scrub_wait < APP_TIMER_TICKS(BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S * 1000))
+        {
+                return false;
+        }
+
+        p_work->scrub_idx = 0;
+        return true;
+}
+
+bool block_dev_qspi_process(block_dev_qspi_t const * p_qspi_dev)
+{
+        ASSERT(p_qspi_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        if (!p_work->initialized || p_work->in_step)
+        {
+                return false;
+        }
+
+        if ((block_dev_qspi_step(p_qspi_dev, true) != BD_STEP_IDLE) ||
+            block_dev_qspi_scrub_schedule(p_work))
+        {
+                return true;
+        }
+
+        block_dev_qspi_idle(p_work);
+        return false;
+}
+
+static ret_code_t block_dev_qspi_init(nrf_block_dev_t const * p_blk_dev,
+                                      nrf_block_dev_ev_handler ev_handler,
+                                      void const * p_context)
+{
+        ASSERT(p_blk_dev);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+        block_dev_qspi_config_t const * p_qspi_cfg = &p_qspi_dev->qspi_bdev_config;
+
+        /* Initialized again by its own user only: another one would take the events
+         * of the first, FatFS releases the device before MSC initializes it */
+        if (p_work->initialized)
+        {
+                if ((ev_handler != p_work->ev_handler) || (p_context != p_work->p_context))
+                {
+                        return NRF_ERROR_INVALID_STATE;
+                }
+
+                ret_code_t ret = block_dev_qspi_drain(p_qspi_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                block_dev_qspi_event(p_qspi_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+                return NRF_SUCCESS;
+        }
+
+        uint32_t blk_size = p_qspi_cfg->block_size;
+        if (!blk_size ||
+            (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE % blk_size) ||
+            (BD_BLOCKS_PER_ERASEUNIT(blk_size) > 32))
+        {
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        ret_code_t ret = qspi_flash_init(&p_qspi_cfg->qspi_config);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Wear counters are saved at the end of the flash, out of the block device */
+        uint32_t flash_size = qspi_flash_info_get()->size;
+        uint32_t wear_size  = QSPI_WEAR_CONFIG_PERSIST_ENABLED ?
+                              qspi_wear_region_size(flash_size / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE) : 0;
+
+        ret = qspi_wear_init(flash_size / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE,
+                             flash_size - wear_size, wear_size);
+        if (ret != NRF_SUCCESS)
+        {
+                NRF_LOG_WARNING("Wear counters not loaded: %u", ret);
+        }
+
+        /* Remap table and spare units below, before anything else is read */
+        uint32_t remap_size = (p_qspi_cfg->flags & BLOCK_DEV_QSPI_FLAG_VERIFY) ? qspi_remap_region_size() : 0;
+
+        ret = qspi_remap_init(flash_size - wear_size - remap_size, remap_size);
+        if (ret != NRF_SUCCESS)
+        {
+                qspi_flash_uninit();
+                return ret;
+        }
+
+        /* Journal log and units sit right below, then the timing calibration unit */
+        uint32_t jrnl_size = (p_qspi_cfg->flags & BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL) ?
+                             (BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS + 1) * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE : 0;
+        uint32_t calib_size = QSPI_CALIB_CONFIG_ENABLED ? QSPI_CALIB_REGION_SIZE : 0;
+        uint32_t avail_size = flash_size - wear_size - remap_size - jrnl_size - calib_size;
+
+        if (calib_size)
+        {
+                ret = qspi_calib_run(avail_size);
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("QSPI timing not calibrated: %u", ret);
+                }
+        }
+
+        /* CRC log below the calibration unit, with half again the room of its records */
+        uint32_t crc_size = 0;
+        p_work->crc_rec_size = 32;
+        if (p_qspi_cfg->flags & BLOCK_DEV_QSPI_FLAG_CRC)
+        {
+                while (p_work->crc_rec_size < sizeof(bd_crc_record_t) +
+                                              BD_BLOCKS_PER_ERASEUNIT(blk_size) * sizeof(uint32_t))
+                {
+                        p_work->crc_rec_size *= 2;
+                }
+
+                uint32_t units = CEIL_DIV(MIN(avail_size / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE,
+                                              BLOCK_DEV_QSPI_MAX_ERASE_UNITS),
+                                          BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / p_work->crc_rec_size - 1);
+                p_work->crc_units = units + units / 2 + 2;
+                crc_size = p_work->crc_units * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        }
+
+        memset(&p_work->stats, 0, sizeof(p_work->stats));
+        p_work->geometry.blk_size  = blk_size;
+        p_work->geometry.blk_count = (avail_size - crc_size) / blk_size;
+        p_work->ev_handler         = ev_handler;
+        p_work->p_context          = p_context;
+        p_work->writeback_mode     = (p_qspi_cfg->flags & BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK) != 0;
+        p_work->defer_sync         = p_work->writeback_mode &&
+                                     (p_qspi_cfg->flags & BLOCK_DEV_QSPI_FLAG_CACHE_DEFER_SYNC);
+        p_work->verify             = remap_size != 0;
+        block_dev_qspi_cache_reset(p_work);
+
+        p_work->q_head       = 0;
+        p_work->q_count      = 0;
+        p_work->in_step      = false;
+        p_work->req_seq      = 0;
+        p_work->done_seq     = 0;
+        p_work->erasing      = false;
+        p_work->flush_all    = false;
+        p_work->p_flush_line = NULL;
+        p_work->flush_stage  = BLOCK_DEV_QSPI_FLUSH_DIRECT;
+        p_work->erase_idx    = 0;
+        p_work->erase_end    = 0;
+        p_work->error        = NRF_SUCCESS;
+        p_work->active_ticks = app_timer_cnt_get();
+        p_work->seq_next     = 0;
+        p_work->seq_run      = 0;
+        p_work->crc          = crc_size != 0;
+        p_work->crc_base     = (avail_size - crc_size) / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        p_work->scrub_ticks  = p_work->active_ticks;
+        p_work->scrub_wait   = 0;
+
+        /* Before the replay, which commits the CRCs of the write-back it finishes */
+        if (p_work->crc)
+        {
+                ret = block_dev_qspi_crc_mount(p_work);
+                if (ret != NRF_SUCCESS)
+                {
+                        qspi_flash_uninit();
+                        return ret;
+                }
+        }
+
+        p_work->journal   = jrnl_size != 0;
+        p_work->jrnl_base = (flash_size - wear_size - remap_size - jrnl_size) / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE;
+        if (p_work->journal)
+        {
+                ret = block_dev_qspi_journal_replay(p_work, p_work->cache[0].buff);
+                if (ret != NRF_SUCCESS)
+                {
+                        qspi_flash_uninit();
+                        return ret;
+                }
+        }
+
+        /* Flash may have been written while we were not in control, rescan it */
+        memset(p_work->erased, 0, sizeof(p_work->erased));
+        p_work->eu_count    = MIN(block_dev_qspi_eu_total(p_work), BLOCK_DEV_QSPI_MAX_ERASE_UNITS);
+        p_work->scan_idx    = 0;
+        memset(p_work->trimmed, 0, sizeof(p_work->trimmed));
+        p_work->trim_idx    = p_work->eu_count;
+        p_work->scrub_idx   = (p_work->crc && BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S) ?
+                              0 : block_dev_qspi_eu_total(p_work);
+        p_work->initialized = true;
+
+        block_dev_qspi_event(p_qspi_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_qspi_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        ret_code_t ret = block_dev_qspi_cache_flush(p_qspi_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        if (qspi_wear_unsaved())
+        {
+                UNUSED_RETURN_VALUE(qspi_wear_save());
+        }
+
+        qspi_flash_uninit();
+        block_dev_qspi_cache_reset(p_work);
+        p_work->initialized = false;
+
+        block_dev_qspi_event(p_qspi_dev, NRF_BLOCK_DEV_EVT_UNINIT, NRF_SUCCESS, NULL);
+        p_work->ev_handler = NULL;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_qspi_read_req(nrf_block_dev_t const * p_blk_dev,
+                                          nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+
+        return block_dev_qspi_submit(p_qspi_dev, BLOCK_DEV_QSPI_REQ_READ, p_blk);
+}
+
+static ret_code_t block_dev_qspi_write_req(nrf_block_dev_t const * p_blk_dev,
+                                           nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+
+        return block_dev_qspi_submit(p_qspi_dev, BLOCK_DEV_QSPI_REQ_WRITE, p_blk);
+}
+
+static ret_code_t block_dev_qspi_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                       nrf_block_dev_ioctl_req_t req,
+                                       void * p_data)
+{
+        ASSERT(p_blk_dev);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+        block_dev_qspi_work_t * p_work = p_qspi_dev->p_work;
+
+        /* Not an SDK request value, kept out of the switch */
+        if (req == BLOCK_DEV_IOCTL_REQ_UNMAP)
+        {
+                block_dev_unmap_req_t const * p_unmap = p_data;
+
+                if (p_unmap == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                if (p_unmap->blk_id + p_unmap->blk_count > p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                block_dev_qspi_unmap(p_work, p_unmap->blk_id, p_unmap->blk_count);
+                return NRF_SUCCESS;
+        }
+
+        if (req == BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER)
+        {
+                block_dev_barrier_req_t const * p_barrier = p_data;
+
+                if (p_barrier == NULL)
+                {
+                        return block_dev_qspi_cache_flush(p_qspi_dev);
+                }
+
+                if (p_barrier->blk_id + p_barrier->blk_count > p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                return block_dev_qspi_range_flush(p_qspi_dev, p_barrier->blk_id, p_barrier->blk_count);
+        }
+
+        switch (req)
+        {
+        case NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH:
+        {
+                bool * p_flushing = p_data;
+                ret_code_t ret = NRF_SUCCESS;
+
+                if (p_work->defer_sync)
+                {
+                        /* Owner flushes explicitly */
+                }
+                else if (!p_flushing)
+                {
+                        ret = block_dev_qspi_cache_flush(p_qspi_dev);
+                }
+                else
+                {
+                        /* Caller polls until done, every call advances the write-back */
+                        p_work->flush_all = true;
+                        if (!p_work->in_step)
+                        {
+                                UNUSED_RETURN_VALUE(block_dev_qspi_step(p_qspi_dev, true));
+                        }
+
+                        if (block_dev_qspi_busy(p_work))
+                        {
+                                *p_flushing = true;
+                                return NRF_SUCCESS;
+                        }
+
+                        ret = p_work->error;
+                        p_work->error = NRF_SUCCESS;
+                }
+
+                if (p_flushing)
+                {
+                        *p_flushing = false;
+                }
+                return ret;
+        }
+        case NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS:
+        {
+                if (p_data == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                nrf_block_dev_info_strings_t const * * pp_strings = p_data;
+                *pp_strings = &p_qspi_dev->info_strings;
+                return NRF_SUCCESS;
+        }
+        default:
+                break;
+        }
+
+        return NRF_ERROR_NOT_SUPPORTED;
+}
+
+static nrf_block_dev_geometry_t const * block_dev_qspi_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_qspi_t const * p_qspi_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_qspi_t, block_dev);
+
+        return &p_qspi_dev->p_work->geometry;
+}
+
+block_dev_qspi_stats_t const * block_dev_qspi_stats_get(block_dev_qspi_t const * p_qspi_dev)
+{
+        ASSERT(p_qspi_dev);
+        return &p_qspi_dev->p_work->stats;
+}
+
+uint32_t block_dev_qspi_latency_get(block_dev_qspi_t const * p_qspi_dev, bool write, uint32_t percent)
+{
+        ASSERT(p_qspi_dev);
+        block_dev_qspi_stats_t const * p_stats = &p_qspi_dev->p_work->stats;
+        uint32_t const * p_hist = write ? p_stats->write_hist : p_stats->read_hist;
+        uint32_t total = 0;
+
+        for (uint32_t i = 0; i < BLOCK_DEV_QSPI_LATENCY_BUCKETS; ++i)
+        {
+                total += p_hist[i];
+        }
+
+        uint32_t target = (uint32_t)CEIL_DIV((uint64_t)total * percent, 100);
+        uint32_t count  = 0;
+
+        for (uint32_t i = 0; i < BLOCK_DEV_QSPI_LATENCY_BUCKETS; ++i)
+        {
+                count += p_hist[i];
+                if (count && (count >= target))
+                {
+                        return 1u << i;
+                }
+        }
+
+        return 0;
+}
+
+const nrf_block_dev_ops_t block_dev_qspi_ops = {
+        .init      = block_dev_qspi_init,
+        .uninit    = block_dev_qspi_uninit,
+        .read_req  = block_dev_qspi_read_req,
+        .write_req = block_dev_qspi_write_req,
+        .ioctl     = block_dev_qspi_ioctl,
+        .geometry  = block_dev_qspi_geometry,
+};
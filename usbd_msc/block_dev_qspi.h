@@ -0,0 +1,572 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_QSPI_H__
+#define BLOCK_DEV_QSPI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_block_dev.h"
+#include "block_dev_unmap.h"
+#include "block_dev_barrier.h"
+#include "nrf_drv_qspi.h"
+#include "qspi_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_qspi QSPI block device
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev implementation on QSPI serial NOR flash.
+ *
+ * Drop-in replacement of the SDK nrf_block_dev_qspi. Contiguous blocks of a request
+ * which are not held in the write cache are read in a single QSPI transfer, split
+ * only at the EasyDMA limit (@ref QSPI_FLASH_MAX_XFER_SIZE).
+ *
+ * Writes go through a fully associative LRU cache of @ref BLOCK_DEV_QSPI_CONFIG_CACHE_LINES
+ * erase units, so FAT, directory and data updates do not evict each other.
+ *
+ * A bitmap of erase units known to be blank lets write-back skip the sector erase.
+ * It is rebuilt after every init by a background blank-check scan driven from
+ * @ref block_dev_qspi_process, and updated from every erase unit the cache loads
+ * or writes back. Units not scanned yet are treated as programmed.
+ *
+ * Before erasing a programmed unit, the dirty pages are compared with the flash.
+ * When every changed bit goes from 1 to 0 (appending into 0xFF space, clearing FAT
+ * entries) only the changed pages are programmed and the erase is skipped.
+ *
+ * Runs of whole erase units which are going to be rewritten (a long write request,
+ * or a range passed to @ref block_dev_qspi_discard) are erased up front with the
+ * largest commands that fit: 64 KB / 32 KB block erase on aligned groups, chip
+ * erase for the whole flash.
+ *
+ * Requests are asynchronous. Up to @ref BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE requests are
+ * queued and completed with an @ref nrf_block_dev event. Cache hits and reads complete
+ * inside the request call; erases are only started there, and waiting for them and
+ * programming (a few pages per step) is done by @ref block_dev_qspi_process from the
+ * main loop, so USB and logging are serviced meanwhile. Without an event handler
+ * requests complete synchronously: the call returns as soon as the request itself
+ * is done, write-backs and erases it started are finished in the background.
+ *
+ * With @ref BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL a write-back which needs an erase
+ * first copies the erase unit to a journal unit at the end of the flash and commits
+ * it in a journal log. Write-backs interrupted by a power loss between the erase
+ * and the last page program are replayed from the journal at the next init.
+ * Write-backs which only clear bits are programmed in place without an erase and
+ * are not journaled, they are outside this guarantee: a power loss during one
+ * leaves the pages before the torn one new, those after it old and the torn page a
+ * mix of both, so a changed block may hold neither version. Each of its bits still
+ * reads its old or its new value.
+ *
+ * When the flash supports erase suspend (reported by SFDP), a queued read which
+ * does not touch the erase in progress, or whose erased units are all in the cache,
+ * is served ahead of the queue by suspending the erase, so reads do not wait for a
+ * block erase to finish.
+ *
+ * Write requests whose blocks are all held in the cache are completed during an
+ * erase in write-back mode, without waiting for it. Write requests continuing the
+ * previous one form a sequential stream once they span two erase units. The next
+ * @ref BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD units of a stream which are trimmed whole
+ * (freed by the file system, see below) are then erased from
+ * @ref block_dev_qspi_process while the flash is otherwise idle, so their
+ * write-back is page programs only. Units still holding data are not erased ahead,
+ * which would leave their only copy in RAM; with
+ * @ref BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL the journal unit of the next write-back is
+ * erased ahead instead.
+ *
+ * After @ref BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS without work the flash is put in deep
+ * power-down; the next request wakes it.
+ *
+ * At init the QSPI clock and receive delay are calibrated by @ref qspi_calib, using
+ * one erase unit below the journal.
+ *
+ * With @ref BLOCK_DEV_QSPI_FLAG_CRC a CRC32 of every block is kept in a log below
+ * the calibration unit. Each write-back first appends a record with the CRCs of its
+ * erase unit, and commits the record once the unit holds the data. Records are only
+ * programmed, the log is reclaimed one unit at a time, so the CRCs do not wear a
+ * fixed unit and do not go through the cache or the journal. An index in RAM points
+ * at the latest record of each erase unit and is rebuilt from the log at init.
+ * Blocks read from flash are checked against committed records, and a background
+ * scrub re-reads the whole device every @ref BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S.
+ * A mismatch is logged and counted, and the data is still returned. Blocks of a
+ * write-back interrupted by a power loss are not checked until written back again,
+ * unless the journal replays it. Blocks reading all 0xFF always pass (discarded
+ * ranges are erased without a new record), and reads through the XIP window are
+ * not checked.
+ *
+ * Blocks passed in a @ref BLOCK_DEV_IOCTL_REQ_UNMAP ioctl are marked trimmed until
+ * they are written again. A write-back starting from erased flash leaves trimmed
+ * blocks blank instead of programming their old content back, and erase units
+ * trimmed whole and not cached are erased from @ref block_dev_qspi_process once
+ * the rest of the background work is done. Trimmed blocks are tracked in RAM only,
+ * from @ref BLOCK_DEV_QSPI_MAX_BLOCKS on they are not tracked.
+ *
+ * A @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER ioctl writes back the dirty lines of its
+ * range (of the whole cache without range) and returns once they are on flash, also
+ * with @ref BLOCK_DEV_QSPI_FLAG_CACHE_DEFER_SYNC. Lines are otherwise written back in
+ * LRU order, so stacked devices use it to order their data before their metadata.
+ *
+ * With @ref BLOCK_DEV_QSPI_FLAG_VERIFY every write-back (and journal copy) is read
+ * back once programmed. An erase unit which does not hold the data, because its
+ * erase or a program failed, is retired to a spare unit with @ref qspi_remap and
+ * the write-back is redone there from the cache line, so the failure does not reach
+ * the user. The table of retired units and the spare units sit at the end of the
+ * flash, below the wear counters.
+ *
+ * Read-mostly data can be accessed in place through the QSPI XIP window with
+ * @ref block_dev_qspi_map, without a copy or a DMA transfer per access.
+ */
+
+/**
+ * @brief Erase unit size.
+ */
+#define BLOCK_DEV_QSPI_ERASE_UNIT_SIZE QSPI_FLASH_ERASE_UNIT_SIZE
+
+/**
+ * @brief Number of erase units held in the write cache.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_CACHE_LINES
+#define BLOCK_DEV_QSPI_CONFIG_CACHE_LINES 4
+#endif
+
+/**
+ * @brief Block size, 512 or 4096.
+ *
+ * With 4096 each block is one erase unit: a block write replaces the unit in the
+ * cache without reading it first, and no read-modify-write of the unit is done.
+ * FatFS needs FF_MAX_SS of at least the block size.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE 512
+#endif
+
+STATIC_ASSERT((QSPI_FLASH_ERASE_UNIT_SIZE % BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE) == 0);
+
+/**
+ * @brief Number of requests which can be queued.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE 2
+#endif
+
+/**
+ * @brief Largest supported flash size, dimensions the erased-unit bitmap.
+ *
+ * Erase units beyond this size are always erased before programming.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE (8 * 1024 * 1024)
+#endif
+
+/**
+ * @brief Number of erase units tracked by the erased-unit bitmap.
+ */
+#define BLOCK_DEV_QSPI_MAX_ERASE_UNITS \
+        (BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE)
+
+/**
+ * @brief Number of blocks tracked by the trimmed-block bitmap.
+ */
+#define BLOCK_DEV_QSPI_MAX_BLOCKS \
+        (BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE / BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE)
+
+/**
+ * @brief Number of journal units written alternately by the journaled write-back.
+ *
+ * One more unit holds the journal log.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS
+#define BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS 2
+#endif
+
+/**
+ * @brief Idle time before the flash is put in deep power-down, in milliseconds. 0 disables it.
+ *
+ * Checked by @ref block_dev_qspi_process once no background work is left, so the
+ * flash wakes once for a burst of requests and the write-back that follows it.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS
+#define BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS 1000
+#endif
+
+/**
+ * @brief Time between scrub passes over the whole device, in seconds. 0 disables scrubbing.
+ *
+ * The first pass starts after init. Only used with @ref BLOCK_DEV_QSPI_FLAG_CRC.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S
+#define BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S 3600
+#endif
+
+/**
+ * @brief Number of erase units erased ahead of a sequential write stream. 0 disables it.
+ *
+ * Only units trimmed whole are erased ahead, without loading them in the cache.
+ */
+#ifndef BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD
+#define BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD 2
+#endif
+
+/**
+ * @brief Number of buckets of the request latency histograms.
+ *
+ * Bucket i counts requests completed in less than 2^i app_timer ticks, the last
+ * one also the slower ones.
+ */
+#define BLOCK_DEV_QSPI_LATENCY_BUCKETS 16
+
+/**
+ * @brief Write-back cache mode. Erase unit is written only on eviction or flush.
+ */
+#define BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK (1u << 0)
+
+/**
+ * @brief Ignore @ref NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH in write-back mode.
+ *
+ * FatFS issues a cache flush on every f_sync/f_close which would erase each dirty
+ * erase unit per record. With this flag the owner flushes the cache explicitly
+ * with @ref block_dev_qspi_cache_flush (e.g. periodically and before USB takes over).
+ * A @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER is still honoured. Syncs are then
+ * acknowledged before their data is on flash, a power loss in between loses it.
+ */
+#define BLOCK_DEV_QSPI_FLAG_CACHE_DEFER_SYNC (1u << 1)
+
+/**
+ * @brief Journal write-backs which erase, so that a power loss cannot lose the erase unit.
+ *
+ * Costs an erase and a program of a journal unit per erasing write-back. The block
+ * device is smaller by @ref BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS + 1 erase units.
+ */
+#define BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL (1u << 2)
+
+/**
+ * @brief Keep a CRC32 per block, check it on read and scrub the device in the background.
+ *
+ * The block device is smaller by the CRC log, one and a half record slots per erase
+ * unit (64 bytes a slot with 512 byte blocks), and every write-back costs one more
+ * page program. Erase units from @ref BLOCK_DEV_QSPI_MAX_ERASE_UNITS
+ * on are not checked.
+ */
+#define BLOCK_DEV_QSPI_FLAG_CRC (1u << 3)
+
+/**
+ * @brief Read back write-backs and retire erase units which fail to spare units.
+ *
+ * Costs an erase unit read per write-back. The block device is smaller by the
+ * remap region, @ref qspi_remap_region_size.
+ */
+#define BLOCK_DEV_QSPI_FLAG_VERIFY (1u << 4)
+
+/**
+ * @brief QSPI block device configuration.
+ */
+typedef struct
+{
+        uint32_t              block_size;   //!< Block size.
+        uint32_t              flags;        //!< Block device flags, @ref BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK.
+        nrf_drv_qspi_config_t qspi_config;  //!< QSPI driver configuration.
+} block_dev_qspi_config_t;
+
+/**
+ * @brief Transfer statistics.
+ */
+typedef struct
+{
+        uint32_t read_reqs;     //!< Number of read requests.
+        uint32_t read_blocks;   //!< Number of blocks read.
+        uint32_t read_ticks;    //!< Time spent in read requests (app_timer ticks).
+        uint32_t write_reqs;    //!< Number of write requests.
+        uint32_t write_blocks;  //!< Number of blocks written.
+        uint32_t write_ticks;   //!< Time spent in write requests (app_timer ticks).
+        uint32_t cache_hits;    //!< Block accesses served by a cached erase unit.
+        uint32_t cache_misses;  //!< Erase units brought into the cache.
+        uint32_t cache_flushes; //!< Dirty erase units written back to flash.
+        uint32_t erase_skips;   //!< Write-backs done with page programs only.
+        uint32_t step_ticks;    //!< Longest single step of background work (app_timer ticks).
+        uint32_t xip_maps;      //!< Block ranges mapped through the XIP window.
+        uint32_t journal_writes;  //!< Write-backs copied to the journal first.
+        uint32_t journal_replays; //!< Interrupted write-backs replayed at init.
+        uint32_t suspend_reads;   //!< Read requests served from a suspended erase.
+        uint32_t crc_errors;      //!< Blocks which did not match their CRC, read or scrubbed.
+        uint32_t scrub_passes;    //!< Completed scrub passes.
+        uint32_t seq_streams;     //!< Sequential write streams detected.
+        uint32_t erase_aheads;    //!< Erase units erased ahead of a write-back.
+        uint32_t erase_writes;    //!< Write requests completed from the cache during an erase.
+        uint32_t trim_blocks;     //!< Blocks unmapped.
+        uint32_t trim_drops;      //!< Trimmed blocks left blank by a write-back instead of programmed.
+        uint32_t trim_erases;     //!< Erase units erased because they were trimmed whole.
+        uint32_t verify_errors;   //!< Write-backs and journal copies which failed the read back.
+        uint32_t read_hist[BLOCK_DEV_QSPI_LATENCY_BUCKETS];  //!< Read request latency histogram.
+        uint32_t write_hist[BLOCK_DEV_QSPI_LATENCY_BUCKETS]; //!< Write request latency histogram.
+} block_dev_qspi_stats_t;
+
+/**
+ * @brief Write cache line holding one erase unit.
+ */
+typedef struct
+{
+        uint32_t eu_idx;    //!< Cached erase unit index.
+        uint32_t dirty;     //!< Dirty block mask.
+        uint32_t lru;       //!< Last use stamp.
+        uint32_t buff[BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / sizeof(uint32_t)]; //!< Erase unit data.
+} block_dev_qspi_cache_line_t;
+
+/**
+ * @brief Request type.
+ */
+typedef enum
+{
+        BLOCK_DEV_QSPI_REQ_READ,    //!< Read request.
+        BLOCK_DEV_QSPI_REQ_WRITE,   //!< Write request.
+} block_dev_qspi_req_type_t;
+
+/**
+ * @brief Queued request.
+ */
+typedef struct
+{
+        nrf_block_req_t           req;      //!< Request.
+        block_dev_qspi_req_type_t type;     //!< Request type.
+        uint32_t                  done;     //!< Number of blocks processed.
+        uint32_t                  ticks;    //!< Submission time (app_timer ticks).
+        uint32_t                  seq;      //!< Submission sequence number.
+        bool                      started;  //!< Request processing started.
+} block_dev_qspi_req_t;
+
+/**
+ * @brief Stage of the write-back of a cache line.
+ */
+typedef enum
+{
+        BLOCK_DEV_QSPI_FLUSH_DIRECT,    //!< Programming the erase unit.
+        BLOCK_DEV_QSPI_FLUSH_JOURNAL,   //!< Programming the journal unit.
+        BLOCK_DEV_QSPI_FLUSH_COMMITTED, //!< Programming the erase unit, journal entry to be closed.
+} block_dev_qspi_flush_stage_t;
+
+/**
+ * @brief QSPI block device internal work structure.
+ */
+typedef struct
+{
+        nrf_block_dev_geometry_t    geometry;       //!< Block device geometry.
+        nrf_block_dev_ev_handler    ev_handler;     //!< Block device event handler.
+        void const *                p_context;      //!< Context handle passed to event handler.
+        bool                        initialized;    //!< Device is initialized.
+        bool                        writeback_mode; //!< Write-back cache mode.
+        bool                        defer_sync;     //!< Cache flush ioctl is ignored.
+        uint32_t                    lru_clock;      //!< Cache use counter.
+        uint32_t                    eu_count;       //!< Number of erase units of the flash.
+        uint32_t                    scan_idx;       //!< Next erase unit of the blank-check scan.
+        uint32_t                    erased[CEIL_DIV(BLOCK_DEV_QSPI_MAX_ERASE_UNITS, 32)]; //!< Blank erase unit bitmap.
+        block_dev_qspi_req_t        queue[BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE]; //!< Request queue.
+        uint8_t                     q_head;         //!< Oldest queued request.
+        uint8_t                     q_count;        //!< Number of queued requests.
+        bool                        in_step;        //!< Background step in progress.
+        uint32_t                    req_seq;        //!< Sequence number of the last submitted request.
+        uint32_t                    done_seq;       //!< Sequence number of the last completed request.
+        ret_code_t                  done_ret;       //!< Result of the last completed request.
+        bool                        erasing;        //!< Erase started and not known to be finished.
+        bool                        flush_all;      //!< Write back all dirty lines.
+        block_dev_qspi_cache_line_t * p_flush_line; //!< Line being written back.
+        uint32_t                    flush_pages;    //!< Pages of the line left to program.
+        block_dev_qspi_flush_stage_t flush_stage;   //!< Stage of the write-back.
+        bool                        journal;        //!< Journaled write-back.
+        uint32_t                    jrnl_base;      //!< Erase unit of the journal log, journal units follow.
+        uint32_t                    jrnl_entry;     //!< Next free journal log entry.
+        uint32_t                    jrnl_slot;      //!< Journal unit of the last write-back.
+        uint32_t                    jrnl_seq;       //!< Sequence number of the last journal entry.
+        uint32_t                    erase_idx;      //!< Next erase unit of the erase run.
+        uint32_t                    erase_end;      //!< End of the erase run.
+        uint32_t                    erase_eu;       //!< First erase unit of the erase in progress.
+        uint32_t                    erase_units;    //!< Number of erase units of the erase in progress.
+        uint32_t                    active_ticks;   //!< Time of the last step which did work (app_timer ticks).
+        uint32_t                    seq_next;       //!< Block following the last write request.
+        uint32_t                    seq_run;        //!< Blocks written sequentially up to @ref seq_next, 0 before the first write.
+        bool                        crc;            //!< Block CRCs are kept.
+        uint32_t                    crc_base;       //!< First erase unit of the CRC log.
+        uint32_t                    crc_units;      //!< Number of erase units of the CRC log.
+        uint32_t                    crc_rec_size;   //!< Size of a CRC log record slot.
+        uint32_t                    crc_head;       //!< CRC log unit being appended.
+        uint32_t                    crc_slot;       //!< Next free record slot of the head unit.
+        uint32_t                    crc_free;       //!< Erased CRC log units after the head.
+        uint32_t                    crc_seq;        //!< Sequence number of the head unit.
+        uint16_t                    crc_index[BLOCK_DEV_QSPI_MAX_ERASE_UNITS]; //!< Latest CRC log record slot of each erase unit.
+        uint32_t                    scrub_idx;      //!< Next erase unit of the scrub pass.
+        uint32_t                    scrub_ticks;    //!< Time the scrub wait was last updated (app_timer ticks).
+        uint32_t                    scrub_wait;     //!< Time since the last scrub pass (app_timer ticks).
+        uint32_t                    trim_idx;       //!< Next erase unit checked for a trimmed erase.
+        uint32_t                    trimmed[CEIL_DIV(BLOCK_DEV_QSPI_MAX_BLOCKS, 32)]; //!< Trimmed block bitmap.
+        bool                        verify;         //!< Write-backs are read back.
+        ret_code_t                  error;          //!< Error of background work, reported by the next write request or cache flush.
+        block_dev_qspi_stats_t      stats;          //!< Transfer statistics.
+        block_dev_qspi_cache_line_t cache[BLOCK_DEV_QSPI_CONFIG_CACHE_LINES]; //!< Write cache.
+} block_dev_qspi_work_t;
+
+/**
+ * @brief QSPI block device.
+ */
+typedef struct
+{
+        nrf_block_dev_t               block_dev;        //!< Block device.
+        nrf_block_dev_info_strings_t  info_strings;     //!< Block device information strings.
+        block_dev_qspi_config_t       qspi_bdev_config; //!< QSPI block device config.
+        block_dev_qspi_work_t *       p_work;           //!< Internal work structure.
+} block_dev_qspi_t;
+
+/**
+ * @brief QSPI block device operations.
+ */
+extern const nrf_block_dev_ops_t block_dev_qspi_ops;
+
+/**
+ * @brief Define QSPI block device configuration.
+ *
+ * @param blk_size        Block size, @ref BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE.
+ * @param blk_flags       Block device flags, @ref BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK.
+ * @param qspi_drv_config QSPI driver config.
+ */
+#define BLOCK_DEV_QSPI_CONFIG(blk_size, blk_flags, qspi_drv_config) {  \
+                .block_size  = (blk_size),                              \
+                .flags       = (blk_flags),                             \
+                .qspi_config = qspi_drv_config                          \
+}
+
+/**
+ * @brief Define QSPI block device instance.
+ *
+ * @param name   Instance name.
+ * @param config Configuration @ref block_dev_qspi_config_t.
+ * @param info   Info strings @ref NFR_BLOCK_DEV_INFO_CONFIG.
+ */
+#define BLOCK_DEV_QSPI_DEFINE(name, config, info)                       \
+        static block_dev_qspi_work_t CONCAT_2(name, _work);             \
+        static const block_dev_qspi_t name = {                          \
+                .block_dev        = { .p_ops = &block_dev_qspi_ops },   \
+                .info_strings     = BRACKET_EXTRACT(info),              \
+                .qspi_bdev_config = config,                             \
+                .p_work           = &CONCAT_2(name, _work),             \
+        }
+
+/**
+ * @brief Complete queued requests and write all dirty cache lines back to flash.
+ *
+ * @param p_qspi_dev QSPI block device.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_qspi_cache_flush(block_dev_qspi_t const * p_qspi_dev);
+
+/**
+ * @brief Write all dirty cache lines back in the background.
+ *
+ * Work is done by @ref block_dev_qspi_process.
+ *
+ * @param p_qspi_dev QSPI block device.
+ */
+void block_dev_qspi_cache_flush_start(block_dev_qspi_t const * p_qspi_dev);
+
+/**
+ * @brief Discard the contents of a block range.
+ *
+ * Erase units lying whole in the range are dropped from the cache and erased,
+ * partially covered units at the ends are left untouched. Used before formatting
+ * so mkfs writes into erased flash.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param blk_id     First block.
+ * @param blk_count  Number of blocks.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_qspi_discard(block_dev_qspi_t const * p_qspi_dev,
+                                  uint32_t blk_id,
+                                  uint32_t blk_count);
+
+/**
+ * @brief Discard the contents of a block range in the background.
+ *
+ * Like @ref block_dev_qspi_discard, but only schedules the erase, which is done by
+ * @ref block_dev_qspi_process. Erase units known to be blank are skipped.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param blk_id     First block.
+ * @param blk_count  Number of blocks.
+ *
+ * @retval NRF_ERROR_BUSY Requests, a write-back or an erase are outstanding.
+ * @return Standard error code.
+ */
+ret_code_t block_dev_qspi_discard_start(block_dev_qspi_t const * p_qspi_dev,
+                                        uint32_t blk_id,
+                                        uint32_t blk_count);
+
+/**
+ * @brief Map a block range for direct reading through the XIP window.
+ *
+ * Queued requests are completed and dirty cache lines of the range are written
+ * back first, so the mapping shows the latest data. The pointer stays valid until
+ * the next request, discard or @ref block_dev_qspi_process call; blocks written
+ * after that are only visible through a new mapping.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param blk_id     First block.
+ * @param blk_count  Number of blocks.
+ * @param pp_data    Address of the first block in the XIP window.
+ *
+ * @retval NRF_SUCCESS              Range mapped.
+ * @retval NRF_ERROR_NOT_SUPPORTED  Range is outside the XIP window or holds a retired erase unit.
+ * @retval NRF_ERROR_BUSY           Called from a block device event handler.
+ */
+ret_code_t block_dev_qspi_map(block_dev_qspi_t const * p_qspi_dev,
+                              uint32_t blk_id,
+                              uint32_t blk_count,
+                              void const * * pp_data);
+
+/**
+ * @brief Run one step of background work.
+ *
+ * Must be called from the same context as the block device requests (main loop).
+ * One step reads at most one erase unit, programs a few pages or starts an erase.
+ *
+ * @param p_qspi_dev QSPI block device.
+ *
+ * @retval true  More background work is pending.
+ * @retval false Nothing to do, CPU can sleep.
+ */
+bool block_dev_qspi_process(block_dev_qspi_t const * p_qspi_dev);
+
+/**
+ * @brief Get transfer statistics.
+ *
+ * @param p_qspi_dev QSPI block device.
+ *
+ * @return Statistics of the block device.
+ */
+block_dev_qspi_stats_t const * block_dev_qspi_stats_get(block_dev_qspi_t const * p_qspi_dev);
+
+/**
+ * @brief Get a request latency percentile from the latency histograms.
+ *
+ * @param p_qspi_dev QSPI block device.
+ * @param write      Write requests, otherwise read requests.
+ * @param percent    Percentile, 1 to 100.
+ *
+ * @return Upper bound of the histogram bucket holding the percentile (app_timer
+ *         ticks), 0 before the first request.
+ */
+uint32_t block_dev_qspi_latency_get(block_dev_qspi_t const * p_qspi_dev, bool write, uint32_t percent);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_QSPI_H__ */
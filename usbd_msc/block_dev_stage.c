@@ -0,0 +1,634 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "block_dev_stage.h"
+#include "app_timer.h"
+#include "nrf_assert.h"
+
+#define NRF_LOG_MODULE_NAME block_dev_stage
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Directory entry of a free slot.
+ */
+#define STAGE_FREE              0xFFFFFFFF
+
+/**
+ * @brief Block not staged.
+ */
+#define STAGE_NO_SLOT           0xFFFFFFFF
+
+/**
+ * @brief End of a hash bucket chain.
+ */
+#define STAGE_NIL               0xFFFF
+
+/**
+ * @brief Most blocks in a batch.
+ */
+#define STAGE_MAX_BATCH_BLOCKS  32
+
+static void block_dev_stage_event(block_dev_stage_t const * p_stage_dev,
+                                  nrf_block_dev_event_type_t ev_type,
+                                  ret_code_t result,
+                                  nrf_block_req_t const * p_blk)
+{
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        if (!p_work->ev_handler)
+        {
+                return;
+        }
+
+        const nrf_block_dev_event_t ev = {
+                ev_type,
+                (result == NRF_SUCCESS) ? NRF_BLOCK_DEV_RESULT_SUCCESS : NRF_BLOCK_DEV_RESULT_IO_ERROR,
+                p_blk,
+                p_work->p_context
+        };
+
+        p_work->ev_handler(&p_stage_dev->block_dev, &ev);
+}
+
+static uint8_t * block_dev_stage_slot_data(block_dev_stage_work_t const * p_work, uint32_t slot)
+{
+        return p_work->p_slots + slot * p_work->geometry.blk_size;
+}
+
+/**
+ * @brief Hash bucket of a block, consecutive blocks go to different buckets.
+ */
+static uint16_t * block_dev_stage_bucket(block_dev_stage_work_t const * p_work, uint32_t blk_id)
+{
+        return &p_work->p_bucket[blk_id & p_work->bucket_mask];
+}
+
+static uint32_t block_dev_stage_find(block_dev_stage_work_t const * p_work, uint32_t blk_id)
+{
+        if (!p_work->used)
+        {
+                return STAGE_NO_SLOT;
+        }
+
+        for (uint32_t slot = *block_dev_stage_bucket(p_work, blk_id); slot != STAGE_NIL;
+             slot = p_work->p_next[slot])
+        {
+                if (p_work->p_dir[slot] == blk_id)
+                {
+                        return slot;
+                }
+        }
+
+        return STAGE_NO_SLOT;
+}
+
+/**
+ * @brief Take the next free slot after the last one taken, so that a sequential
+ *        burst fills adjacent slots.
+ */
+static uint32_t block_dev_stage_alloc(block_dev_stage_work_t * p_work, uint32_t blk_id)
+{
+        ASSERT(p_work->used < p_work->slot_count);
+
+        uint32_t slot = p_work->head;
+        while (p_work->p_dir[slot] != STAGE_FREE)
+        {
+                slot = (slot + 1) % p_work->slot_count;
+        }
+
+        uint16_t * p_bucket = block_dev_stage_bucket(p_work, blk_id);
+
+        p_work->p_dir[slot]  = blk_id;
+        p_work->p_next[slot] = *p_bucket;
+        *p_bucket            = slot;
+        p_work->head = (slot + 1) % p_work->slot_count;
+        p_work->used++;
+        p_work->stats.max_used = MAX(p_work->stats.max_used, p_work->used);
+        return slot;
+}
+
+/**
+ * @brief Free a slot in use.
+ */
+static void block_dev_stage_free(block_dev_stage_work_t * p_work, uint32_t slot)
+{
+        uint16_t * p_link = block_dev_stage_bucket(p_work, p_work->p_dir[slot]);
+
+        while (*p_link != slot)
+        {
+                p_link = &p_work->p_next[*p_link];
+        }
+
+        *p_link             = p_work->p_next[slot];
+        p_work->p_dir[slot] = STAGE_FREE;
+        p_work->used--;
+}
+
+/**
+ * @brief Write the staged blocks of the batch of the oldest slot to the lower device.
+ *
+ * Blocks stay staged when their write fails.
+ */
+static ret_code_t block_dev_stage_destage(block_dev_stage_t const * p_stage_dev)
+{
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+        uint32_t blk_size     = p_work->geometry.blk_size;
+        uint32_t batch_blocks = BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE / blk_size;
+        uint32_t slot_of[STAGE_MAX_BATCH_BLOCKS];
+
+        ASSERT(p_work->used);
+
+        while (p_work->p_dir[p_work->tail] == STAGE_FREE)
+        {
+                p_work->tail = (p_work->tail + 1) % p_work->slot_count;
+        }
+
+        uint32_t first = p_work->p_dir[p_work->tail] / batch_blocks * batch_blocks;
+
+        for (uint32_t i = 0; i < batch_blocks; ++i)
+        {
+                slot_of[i] = block_dev_stage_find(p_work, first + i);
+        }
+
+        /* Blocks held in adjacent slots go in one request */
+        uint32_t i = 0;
+        while (i < batch_blocks)
+        {
+                if (slot_of[i] == STAGE_NO_SLOT)
+                {
+                        i++;
+                        continue;
+                }
+
+                uint32_t end = i + 1;
+                while ((end < batch_blocks) && (slot_of[end] == slot_of[end - 1] + 1))
+                {
+                        end++;
+                }
+
+                nrf_block_req_t req = {
+                        .p_buff    = block_dev_stage_slot_data(p_work, slot_of[i]),
+                        .blk_id    = first + i,
+                        .blk_count = end - i,
+                };
+
+                ret_code_t ret = nrf_blk_dev_write_req(p_stage_dev->p_lower, &req);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                for (; i < end; ++i)
+                {
+                        block_dev_stage_free(p_work, slot_of[i]);
+                }
+                p_work->stats.destaged_blocks += req.blk_count;
+                p_work->stats.destage_writes++;
+        }
+
+        p_work->stats.batches++;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_stage_read(block_dev_stage_t const * p_stage_dev,
+                                       nrf_block_req_t const * p_blk)
+{
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+        uint32_t blk_size = p_work->geometry.blk_size;
+        uint32_t blk_id   = p_blk->blk_id;
+        uint32_t blk_end  = p_blk->blk_id + p_blk->blk_count;
+        uint8_t * p_buff  = p_blk->p_buff;
+
+        while (blk_id < blk_end)
+        {
+                uint32_t slot = block_dev_stage_find(p_work, blk_id);
+                if (slot != STAGE_NO_SLOT)
+                {
+                        memcpy(p_buff, block_dev_stage_slot_data(p_work, slot), blk_size);
+                        p_buff += blk_size;
+                        blk_id++;
+                        continue;
+                }
+
+                /* Gather the longest run of blocks not staged */
+                uint32_t run_end = blk_id + 1;
+                while ((run_end < blk_end) && (block_dev_stage_find(p_work, run_end) == STAGE_NO_SLOT))
+                {
+                        run_end++;
+                }
+
+                nrf_block_req_t req = {
+                        .p_buff    = p_buff,
+                        .blk_id    = blk_id,
+                        .blk_count = run_end - blk_id,
+                };
+
+                ret_code_t ret = nrf_blk_dev_read_req(p_stage_dev->p_lower, &req);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                p_buff += req.blk_count * blk_size;
+                blk_id  = run_end;
+        }
+
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_stage_write(block_dev_stage_t const * p_stage_dev,
+                                        nrf_block_req_t const * p_blk)
+{
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+        uint32_t blk_size     = p_work->geometry.blk_size;
+        uint8_t const * p_src = p_blk->p_buff;
+
+        for (uint32_t blk_id = p_blk->blk_id; blk_id < p_blk->blk_id + p_blk->blk_count; ++blk_id)
+        {
+                uint32_t slot = block_dev_stage_find(p_work, blk_id);
+                if (slot != STAGE_NO_SLOT)
+                {
+                        p_work->stats.absorbed_blocks++;
+                }
+                else
+                {
+                        if (p_work->used == p_work->slot_count)
+                        {
+                                ret_code_t ret = block_dev_stage_destage(p_stage_dev);
+                                if (ret != NRF_SUCCESS)
+                                {
+                                        return ret;
+                                }
+                                p_work->stats.stall_batches++;
+                        }
+
+                        slot = block_dev_stage_alloc(p_work, blk_id);
+                        p_work->stats.staged_blocks++;
+                }
+
+                memcpy(block_dev_stage_slot_data(p_work, slot), p_src, blk_size);
+                p_src += blk_size;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Drop the staged blocks of a range.
+ */
+static void block_dev_stage_drop(block_dev_stage_work_t * p_work, uint32_t blk_id, uint32_t blk_count)
+{
+        /* Short ranges are looked up, long ones (a whole volume) go over the slots */
+        if (blk_count < p_work->slot_count)
+        {
+                for (uint32_t i = 0; p_work->used && (i < blk_count); ++i)
+                {
+                        uint32_t slot = block_dev_stage_find(p_work, blk_id + i);
+                        if (slot != STAGE_NO_SLOT)
+                        {
+                                block_dev_stage_free(p_work, slot);
+                        }
+                }
+                return;
+        }
+
+        for (uint32_t slot = 0; p_work->used && (slot < p_work->slot_count); ++slot)
+        {
+                if ((p_work->p_dir[slot] != STAGE_FREE) && (p_work->p_dir[slot] - blk_id < blk_count))
+                {
+                        block_dev_stage_free(p_work, slot);
+                }
+        }
+}
+
+bool block_dev_stage_process(block_dev_stage_t const * p_stage_dev)
+{
+        ASSERT(p_stage_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        if (!p_work->initialized || !p_work->used)
+        {
+                p_work->draining = false;
+                return false;
+        }
+
+        /* A burst still going on keeps its blocks in RAM, unless it is filling up */
+        if (!p_work->draining &&
+            (p_work->used * 100 < p_work->slot_count * BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT) &&
+            (app_timer_cnt_diff_compute(app_timer_cnt_get(), p_work->write_ticks) <
+             APP_TIMER_TICKS(BLOCK_DEV_STAGE_CONFIG_IDLE_MS)))
+        {
+                return false;
+        }
+
+        ret_code_t ret = block_dev_stage_destage(p_stage_dev);
+        if (ret != NRF_SUCCESS)
+        {
+                NRF_LOG_WARNING("Destage failed: %u", ret);
+                return false;
+        }
+
+        return p_work->used != 0;
+}
+
+ret_code_t block_dev_stage_flush(block_dev_stage_t const * p_stage_dev)
+{
+        ASSERT(p_stage_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        if (!p_work->initialized)
+        {
+                return NRF_SUCCESS;
+        }
+
+        while (p_work->used)
+        {
+                ret_code_t ret = block_dev_stage_destage(p_stage_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        p_work->draining = false;
+        return NRF_SUCCESS;
+}
+
+void block_dev_stage_flush_start(block_dev_stage_t const * p_stage_dev)
+{
+        ASSERT(p_stage_dev);
+        p_stage_dev->p_work->draining = true;
+}
+
+block_dev_stage_stats_t const * block_dev_stage_stats_get(block_dev_stage_t const * p_stage_dev)
+{
+        ASSERT(p_stage_dev);
+        return &p_stage_dev->p_work->stats;
+}
+
+static ret_code_t block_dev_stage_init(nrf_block_dev_t const * p_blk_dev,
+                                       nrf_block_dev_ev_handler ev_handler,
+                                       void const * p_context)
+{
+        ASSERT(p_blk_dev);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        /* One user at a time, as the QSPI device */
+        if (p_work->initialized)
+        {
+                if ((ev_handler != p_work->ev_handler) || (p_context != p_work->p_context))
+                {
+                        return NRF_ERROR_INVALID_STATE;
+                }
+
+                block_dev_stage_event(p_stage_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+                return NRF_SUCCESS;
+        }
+
+        /* No handler: requests to the lower device complete before returning */
+        ret_code_t ret = nrf_blk_dev_init(p_stage_dev->p_lower, NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        nrf_block_dev_geometry_t const * p_geo = nrf_blk_dev_geometry(p_stage_dev->p_lower);
+        uint32_t slot_count = MIN(p_stage_dev->size / (p_geo->blk_size + sizeof(uint32_t) + sizeof(uint16_t)),
+                                  STAGE_NIL - 1);
+        uint32_t bucket_count = 1;
+        while (bucket_count < slot_count / 2)
+        {
+                bucket_count *= 2;
+        }
+
+        /* Index of two halfwords per slot and bucket, padded to keep the slots word aligned */
+        while (slot_count &&
+               (slot_count * (sizeof(uint32_t) + p_geo->blk_size) +
+                ALIGN_NUM(sizeof(uint32_t), (slot_count + bucket_count) * sizeof(uint16_t)) > p_stage_dev->size))
+        {
+                slot_count--;
+        }
+
+        if (((uintptr_t)p_stage_dev->p_buff % sizeof(uint32_t)) ||
+            (BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE % p_geo->blk_size) ||
+            (BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE / p_geo->blk_size > STAGE_MAX_BATCH_BLOCKS) ||
+            !slot_count)
+        {
+                UNUSED_RETURN_VALUE(nrf_blk_dev_uninit(p_stage_dev->p_lower));
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        /* Directory and index first, the slots follow word aligned */
+        p_work->p_dir       = p_stage_dev->p_buff;
+        p_work->p_next      = (uint16_t *)(p_work->p_dir + slot_count);
+        p_work->p_bucket    = p_work->p_next + slot_count;
+        p_work->bucket_mask = bucket_count - 1;
+        p_work->p_slots     = (uint8_t *)p_stage_dev->p_buff + slot_count * sizeof(uint32_t) +
+                              ALIGN_NUM(sizeof(uint32_t), (slot_count + bucket_count) * sizeof(uint16_t));
+        p_work->slot_count  = slot_count;
+        p_work->used       = 0;
+        p_work->head       = 0;
+        p_work->tail       = 0;
+        p_work->draining   = false;
+        p_work->geometry   = *p_geo;
+        memset(p_work->p_dir, 0xFF, slot_count * sizeof(uint32_t));
+        memset(p_work->p_bucket, 0xFF, bucket_count * sizeof(uint16_t));
+        memset(&p_work->stats, 0, sizeof(p_work->stats));
+
+        NRF_LOG_INFO("%u blocks staged in RAM", slot_count);
+
+        p_work->ev_handler  = ev_handler;
+        p_work->p_context   = p_context;
+        p_work->initialized = true;
+
+        block_dev_stage_event(p_stage_dev, NRF_BLOCK_DEV_EVT_INIT, NRF_SUCCESS, NULL);
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_stage_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        ret_code_t ret = block_dev_stage_flush(p_stage_dev);
+        if (ret == NRF_SUCCESS)
+        {
+                ret = nrf_blk_dev_uninit(p_stage_dev->p_lower);
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        p_work->initialized = false;
+
+        block_dev_stage_event(p_stage_dev, NRF_BLOCK_DEV_EVT_UNINIT, NRF_SUCCESS, NULL);
+        p_work->ev_handler = NULL;
+        return NRF_SUCCESS;
+}
+
+static ret_code_t block_dev_stage_read_req(nrf_block_dev_t const * p_blk_dev,
+                                           nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = block_dev_stage_read(p_stage_dev, p_blk);
+
+        block_dev_stage_event(p_stage_dev, NRF_BLOCK_DEV_EVT_BLK_READ_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_stage_write_req(nrf_block_dev_t const * p_blk_dev,
+                                            nrf_block_req_t const * p_blk)
+{
+        ASSERT(p_blk_dev);
+        ASSERT(p_blk);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        if (p_blk->blk_id + p_blk->blk_count > p_work->geometry.blk_count)
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        uint32_t start = app_timer_cnt_get();
+        ret_code_t ret = block_dev_stage_write(p_stage_dev, p_blk);
+
+        p_work->write_ticks = app_timer_cnt_get();
+
+        uint32_t ticks = app_timer_cnt_diff_compute(p_work->write_ticks, start);
+        p_work->stats.write_reqs++;
+        p_work->stats.write_ticks    += ticks;
+        p_work->stats.write_max_ticks = MAX(p_work->stats.write_max_ticks, ticks);
+
+        block_dev_stage_event(p_stage_dev, NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE, ret, p_blk);
+        return ret;
+}
+
+static ret_code_t block_dev_stage_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                        nrf_block_dev_ioctl_req_t req,
+                                        void * p_data)
+{
+        ASSERT(p_blk_dev);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+        block_dev_stage_work_t * p_work = p_stage_dev->p_work;
+
+        /* Not an SDK request value, kept out of the switch */
+        if (req == BLOCK_DEV_IOCTL_REQ_UNMAP)
+        {
+                block_dev_unmap_req_t const * p_unmap = p_data;
+
+                if (p_unmap == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                if (p_unmap->blk_id + p_unmap->blk_count > p_work->geometry.blk_count)
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                block_dev_stage_drop(p_work, p_unmap->blk_id, p_unmap->blk_count);
+                return nrf_blk_dev_ioctl(p_stage_dev->p_lower, req, p_data);
+        }
+
+        if (req == BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER)
+        {
+                block_dev_barrier_req_t const * p_barrier = p_data;
+
+                if ((p_barrier != NULL) &&
+                    (p_barrier->blk_id + p_barrier->blk_count > p_work->geometry.blk_count))
+                {
+                        return NRF_ERROR_INVALID_ADDR;
+                }
+
+                ret_code_t ret = block_dev_stage_flush(p_stage_dev);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                return nrf_blk_dev_ioctl(p_stage_dev->p_lower, req, p_data);
+        }
+
+        switch (req)
+        {
+        case NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH:
+        {
+                bool * p_flushing = p_data;
+                ret_code_t ret;
+
+                if (p_flushing && p_work->used)
+                {
+                        /* Caller polls until done, a batch per call */
+                        ret = block_dev_stage_destage(p_stage_dev);
+                        if ((ret == NRF_SUCCESS) && p_work->used)
+                        {
+                                *p_flushing = true;
+                                return NRF_SUCCESS;
+                        }
+                }
+                else
+                {
+                        ret = block_dev_stage_flush(p_stage_dev);
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                return nrf_blk_dev_ioctl(p_stage_dev->p_lower, req, p_data);
+        }
+        case NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS:
+        {
+                if (p_data == NULL)
+                {
+                        return NRF_ERROR_INVALID_PARAM;
+                }
+
+                nrf_block_dev_info_strings_t const * * pp_strings = p_data;
+                *pp_strings = &p_stage_dev->info_strings;
+                return NRF_SUCCESS;
+        }
+        default:
+                break;
+        }
+
+        return NRF_ERROR_NOT_SUPPORTED;
+}
+
+static nrf_block_dev_geometry_t const * block_dev_stage_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        ASSERT(p_blk_dev);
+        block_dev_stage_t const * p_stage_dev =
+                CONTAINER_OF(p_blk_dev, block_dev_stage_t, block_dev);
+
+        return &p_stage_dev->p_work->geometry;
+}
+
+const nrf_block_dev_ops_t block_dev_stage_ops = {
+        .init      = block_dev_stage_init,
+        .uninit    = block_dev_stage_uninit,
+        .read_req  = block_dev_stage_read_req,
+        .write_req = block_dev_stage_write_req,
+        .ioctl     = block_dev_stage_ioctl,
+        .geometry  = block_dev_stage_geometry,
+};
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_STAGE_H__
+#define BLOCK_DEV_STAGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_block_dev.h"
+#include "block_dev_unmap.h"
+#include "block_dev_barrier.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_stage RAM staging block device
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev which absorbs writes in RAM in front of another block device.
+ *
+ * A RAM region is split into a directory, a hash index of the staged blocks and
+ * block slots. A written block is copied to its slot, or to a free one, and the
+ * request completes without touching the lower device; a rewrite of a staged
+ * block replaces it in RAM. Reads are served from the slots first.
+ *
+ * Staged blocks are destaged to the lower device in batches of the blocks of one
+ * @ref BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE range, oldest slot first, so each batch
+ * lands in one erase unit of the QSPI flash. Blocks held in adjacent slots are
+ * written in one request. @ref block_dev_stage_process destages a batch once no
+ * write came for @ref BLOCK_DEV_STAGE_CONFIG_IDLE_MS, the stage is filled above
+ * @ref BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT or a flush was started; a write finding
+ * no free slot destages a batch itself.
+ *
+ * @ref NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH destages everything, a batch per call
+ * when the caller polls, then is passed on to the lower device;
+ * @ref BLOCK_DEV_IOCTL_REQ_UNMAP drops the staged blocks of the range and is passed
+ * on; @ref BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER destages everything and is passed on.
+ *
+ * Staged blocks are lost on a power loss, like a write-back cache: a write is only
+ * on flash once a flush or a barrier covering it has completed.
+ *
+ * Requests complete synchronously; the lower device is used without event handler.
+ */
+
+/**
+ * @brief Destage batch size, multiple of the lower block size.
+ */
+#ifndef BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE
+#define BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE 4096
+#endif
+
+/**
+ * @brief Time without writes before staged blocks are destaged in the background.
+ */
+#ifndef BLOCK_DEV_STAGE_CONFIG_IDLE_MS
+#define BLOCK_DEV_STAGE_CONFIG_IDLE_MS 20
+#endif
+
+/**
+ * @brief Fill level above which staged blocks are destaged while writes go on, in percent.
+ */
+#ifndef BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT
+#define BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT 75
+#endif
+
+/**
+ * @brief Staging statistics.
+ */
+typedef struct
+{
+        uint32_t write_reqs;        //!< Write requests.
+        uint32_t write_ticks;       //!< Time spent in write requests (app_timer ticks).
+        uint32_t write_max_ticks;   //!< Longest write request (app_timer ticks).
+        uint32_t staged_blocks;     //!< Blocks written to a free slot.
+        uint32_t absorbed_blocks;   //!< Rewrites of a staged block, never written to the lower device.
+        uint32_t batches;           //!< Batches destaged.
+        uint32_t destaged_blocks;   //!< Blocks destaged.
+        uint32_t destage_writes;    //!< Write requests to the lower device.
+        uint32_t stall_batches;     //!< Batches destaged by a write finding no free slot.
+        uint32_t max_used;          //!< Most slots in use.
+} block_dev_stage_stats_t;
+
+/**
+ * @brief Staging block device internal work structure.
+ */
+typedef struct
+{
+        nrf_block_dev_geometry_t geometry;      //!< Lower device geometry.
+        nrf_block_dev_ev_handler ev_handler;    //!< Block device event handler.
+        void const *             p_context;     //!< Context handle passed to event handler.
+        bool                     initialized;   //!< Device is initialized.
+        bool                     draining;      //!< Destage everything, @ref block_dev_stage_flush_start.
+        uint32_t *               p_dir;         //!< Block held by each slot.
+        uint16_t *               p_next;        //!< Next slot of the same hash bucket.
+        uint16_t *               p_bucket;      //!< First slot of each hash bucket.
+        uint32_t                 bucket_mask;   //!< Number of hash buckets less one, a power of two.
+        uint8_t *                p_slots;       //!< Slot data.
+        uint32_t                 slot_count;    //!< Number of slots.
+        uint32_t                 used;          //!< Slots in use.
+        uint32_t                 head;          //!< Where the search for a free slot starts.
+        uint32_t                 tail;          //!< Where the search for the oldest slot starts.
+        uint32_t                 write_ticks;   //!< Time of the last write (app_timer ticks).
+        block_dev_stage_stats_t  stats;         //!< Statistics.
+} block_dev_stage_work_t;
+
+/**
+ * @brief Staging block device.
+ */
+typedef struct
+{
+        nrf_block_dev_t              block_dev;     //!< Block device.
+        nrf_block_dev_info_strings_t info_strings;  //!< Block device information strings.
+        nrf_block_dev_t const *      p_lower;       //!< Underlying block device.
+        void *                       p_buff;        //!< RAM region, word aligned.
+        size_t                       size;          //!< RAM region size.
+        block_dev_stage_work_t *     p_work;        //!< Internal work structure.
+} block_dev_stage_t;
+
+/**
+ * @brief Staging block device operations.
+ */
+extern const nrf_block_dev_ops_t block_dev_stage_ops;
+
+/**
+ * @brief Define staging block device instance.
+ *
+ * @param name      Instance name.
+ * @param lower     Underlying block device (@ref nrf_block_dev_t pointer).
+ * @param buff      RAM region, word aligned.
+ * @param buff_size RAM region size.
+ * @param info      Info strings @ref NFR_BLOCK_DEV_INFO_CONFIG.
+ */
+#define BLOCK_DEV_STAGE_DEFINE(name, lower, buff, buff_size, info)      \
+        static block_dev_stage_work_t CONCAT_2(name, _work);            \
+        static const block_dev_stage_t name = {                         \
+                .block_dev    = { .p_ops = &block_dev_stage_ops },      \
+                .info_strings = BRACKET_EXTRACT(info),                  \
+                .p_lower      = (lower),                                \
+                .p_buff       = (buff),                                 \
+                .size         = (buff_size),                            \
+                .p_work       = &CONCAT_2(name, _work),                 \
+        }
+
+/**
+ * @brief Destage one batch when it is due.
+ *
+ * Call when the lower device has no work of its own.
+ *
+ * @param p_stage_dev Staging block device.
+ *
+ * @retval true More batches are due.
+ */
+bool block_dev_stage_process(block_dev_stage_t const * p_stage_dev);
+
+/**
+ * @brief Destage all staged blocks.
+ *
+ * @param p_stage_dev Staging block device.
+ *
+ * @return Standard error code.
+ */
+ret_code_t block_dev_stage_flush(block_dev_stage_t const * p_stage_dev);
+
+/**
+ * @brief Destage all staged blocks in the background.
+ *
+ * Work is done by @ref block_dev_stage_process.
+ *
+ * @param p_stage_dev Staging block device.
+ */
+void block_dev_stage_flush_start(block_dev_stage_t const * p_stage_dev);
+
+/**
+ * @brief Get staging statistics.
+ *
+ * @param p_stage_dev Staging block device.
+ */
+block_dev_stage_stats_t const * block_dev_stage_stats_get(block_dev_stage_t const * p_stage_dev);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_STAGE_H__ */
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLOCK_DEV_UNMAP_H__
+#define BLOCK_DEV_UNMAP_H__
+
+#include <stdint.h>
+
+#include "nrf_block_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup block_dev_unmap Block device unmap request
+ * @{
+ * @ingroup usbd_msc
+ * @brief @ref nrf_block_dev ioctl telling a block device that a block range is no longer used.
+ *
+ * The device may then skip copying the blocks and reclaim their space; reading
+ * them afterwards returns unspecified data until they are written again. Stacked
+ * devices forward the blocks they release to the device below. Devices which do
+ * not support it return NRF_ERROR_NOT_SUPPORTED, which callers ignore.
+ *
+ * The application issues it: before mkfs for the whole volume, and from the
+ * pre-erase pass for the clusters its FAT holds free, which also catches files
+ * the USB host deleted once the application owns the volume again. Neither the
+ * file system nor the host issue it themselves. FatFS CTRL_TRIM is disabled in
+ * the SDK ffconf.h, which ff.h includes from its own directory, and the SDK disk
+ * I/O layer does not pass it on. The SDK MSC class implements neither SCSI UNMAP
+ * nor the Block Limits VPD page which advertises it.
+ */
+
+/**
+ * @brief Unmap ioctl request, past the SDK @ref nrf_block_dev_ioctl_req_t values.
+ *
+ * The ioctl data is a @ref block_dev_unmap_req_t.
+ */
+#define BLOCK_DEV_IOCTL_REQ_UNMAP ((nrf_block_dev_ioctl_req_t)0x100)
+
+/**
+ * @brief Unmap request data.
+ */
+typedef struct
+{
+        uint32_t blk_id;    //!< First block.
+        uint32_t blk_count; //!< Number of blocks.
+} block_dev_unmap_req_t;
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEV_UNMAP_H__ */
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef CRC32_FAST_H__
+#define CRC32_FAST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup crc32_fast Slice-by-8 CRC32
+ * @{
+ * @ingroup usbd_msc
+ * @brief CRC-32 (IEEE 802.3, as zlib and the SDK crc32 module) processing 8 bytes per step.
+ *
+ * The Cortex-M4 has no CRC instruction. Eight 1 KB lookup tables in flash let each
+ * step fold two words with eight independent table loads, instead of a chain of
+ * dependent loads one byte at a time.
+ */
+
+/**
+ * @brief Compute or continue a CRC32.
+ *
+ * @param crc    0 to start, or the result for the preceding data.
+ * @param p_data Data.
+ * @param size   Data size.
+ *
+ * @return CRC32 of the data.
+ */
+uint32_t crc32_fast(uint32_t crc, void const * p_data, size_t size);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRC32_FAST_H__ */
@@ -0,0 +1,236 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+#include <stdbool.h>
+
+#include "lz_codec.h"
+
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_SHIFT  (32 - 10)
+#define LZ_NO_POS      0xFFFF
+
+/**
+ * @brief Length as stored in a token nibble.
+ */
+#define LZ_NIBBLE(len) (((len) < 15) ? (len) : 15)
+
+#if (1 << (32 - LZ_HASH_SHIFT)) != LZ_CODEC_HASH_SIZE
+#error "LZ_HASH_SHIFT does not match LZ_CODEC_HASH_SIZE"
+#endif
+
+static uint32_t lz_hash(uint8_t const * p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return (v * 2654435761u) >> LZ_HASH_SHIFT;
+}
+
+/**
+ * @brief Write the length bytes following a nibble of 15.
+ */
+static bool lz_len_put(uint8_t * * pp_out, uint8_t const * p_end, size_t len)
+{
+        while (len >= 255)
+        {
+                if (*pp_out >= p_end)
+                {
+                        return false;
+                }
+                *(*pp_out)++ = 255;
+                len -= 255;
+        }
+
+        if (*pp_out >= p_end)
+        {
+                return false;
+        }
+        *(*pp_out)++ = (uint8_t)len;
+        return true;
+}
+
+static bool lz_len_get(uint8_t const * * pp_in, uint8_t const * p_end, size_t * p_len)
+{
+        uint8_t b;
+
+        do
+        {
+                if (*pp_in >= p_end)
+                {
+                        return false;
+                }
+                b = *(*pp_in)++;
+                *p_len += b;
+        } while (b == 255);
+
+        return true;
+}
+
+/**
+ * @brief Write one sequence.
+ *
+ * @param match_len Match length, 0 for the last sequence.
+ */
+static bool lz_sequence_put(uint8_t * * pp_out, uint8_t const * p_end,
+                            uint8_t const * p_lit, size_t lit_len,
+                            size_t offset, size_t match_len)
+{
+        size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+        uint8_t * p_out = *pp_out;
+
+        if (p_out >= p_end)
+        {
+                return false;
+        }
+
+        *p_out++ = (uint8_t)((LZ_NIBBLE(lit_len) << 4) | LZ_NIBBLE(ml));
+        if ((lit_len >= 15) && !lz_len_put(&p_out, p_end, lit_len - 15))
+        {
+                return false;
+        }
+
+        if ((size_t)(p_end - p_out) < lit_len)
+        {
+                return false;
+        }
+        memcpy(p_out, p_lit, lit_len);
+        p_out += lit_len;
+
+        if (match_len)
+        {
+                if (p_end - p_out < 2)
+                {
+                        return false;
+                }
+                *p_out++ = (uint8_t)offset;
+                *p_out++ = (uint8_t)(offset >> 8);
+
+                if ((ml >= 15) && !lz_len_put(&p_out, p_end, ml - 15))
+                {
+                        return false;
+                }
+        }
+
+        *pp_out = p_out;
+        return true;
+}
+
+size_t lz_codec_compress(void const * p_src, size_t src_len,
+                         void * p_dst, size_t dst_cap,
+                         uint16_t * p_table)
+{
+        uint8_t const * p_in  = p_src;
+        uint8_t * p_out       = p_dst;
+        uint8_t const * p_end = p_out + dst_cap;
+        size_t pos    = 0;
+        size_t anchor = 0;
+
+        if (src_len > LZ_CODEC_MAX_SIZE)
+        {
+                return 0;
+        }
+
+        for (size_t i = 0; i < LZ_CODEC_HASH_SIZE; ++i)
+        {
+                p_table[i] = LZ_NO_POS;
+        }
+
+        while (pos + LZ_MIN_MATCH <= src_len)
+        {
+                uint32_t h   = lz_hash(&p_in[pos]);
+                uint32_t ref = p_table[h];
+
+                p_table[h] = (uint16_t)pos;
+                if ((ref == LZ_NO_POS) || memcmp(&p_in[ref], &p_in[pos], LZ_MIN_MATCH))
+                {
+                        pos++;
+                        continue;
+                }
+
+                size_t len = LZ_MIN_MATCH;
+                while ((pos + len < src_len) && (p_in[ref + len] == p_in[pos + len]))
+                {
+                        len++;
+                }
+
+                if (!lz_sequence_put(&p_out, p_end, &p_in[anchor], pos - anchor, pos - ref, len))
+                {
+                        return 0;
+                }
+
+                pos   += len;
+                anchor = pos;
+        }
+
+        if (!lz_sequence_put(&p_out, p_end, &p_in[anchor], src_len - anchor, 0, 0))
+        {
+                return 0;
+        }
+
+        return (size_t)(p_out - (uint8_t *)p_dst);
+}
+
+size_t lz_codec_decompress(void const * p_src, size_t src_len, void * p_dst, size_t dst_cap)
+{
+        uint8_t const * p_in     = p_src;
+        uint8_t const * p_in_end = p_in + src_len;
+        uint8_t * p_out          = p_dst;
+        uint8_t * p_out_end      = p_out + dst_cap;
+
+        while (p_in < p_in_end)
+        {
+                uint8_t token = *p_in++;
+                size_t lit = token >> 4;
+
+                if ((lit == 15) && !lz_len_get(&p_in, p_in_end, &lit))
+                {
+                        return 0;
+                }
+
+                if (((size_t)(p_in_end - p_in) < lit) || ((size_t)(p_out_end - p_out) < lit))
+                {
+                        return 0;
+                }
+                memcpy(p_out, p_in, lit);
+                p_out += lit;
+                p_in  += lit;
+
+                /* Last sequence has no match */
+                if (p_in == p_in_end)
+                {
+                        break;
+                }
+
+                if (p_in_end - p_in < 2)
+                {
+                        return 0;
+                }
+                size_t offset = p_in[0] | ((size_t)p_in[1] << 8);
+                p_in += 2;
+
+                size_t len = token & 0x0F;
+                if ((len == 15) && !lz_len_get(&p_in, p_in_end, &len))
+                {
+                        return 0;
+                }
+                len += LZ_MIN_MATCH;
+
+                if (!offset || (offset > (size_t)(p_out - (uint8_t *)p_dst)) ||
+                    ((size_t)(p_out_end - p_out) < len))
+                {
+                        return 0;
+                }
+
+                /* Byte by byte, a match may overlap its own output */
+                uint8_t const * p_ref = p_out - offset;
+                while (len--)
+                {
+                        *p_out++ = *p_ref++;
+                }
+        }
+
+        return (size_t)(p_out - (uint8_t *)p_dst);
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef LZ_CODEC_H__
+#define LZ_CODEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup lz_codec LZ77 codec
+ * @{
+ * @ingroup usbd_msc
+ * @brief Small LZ77 compressor in the LZ4 block style, for buffers up to 64 KB.
+ *
+ * A compressed buffer is a list of sequences: a token (literal length in the high
+ * nibble, match length - 4 in the low nibble, 15 meaning more length bytes follow),
+ * the literals, then a 2-byte little-endian match offset and the extra match
+ * length bytes. The last sequence has literals only.
+ *
+ * Matches are found through a single-entry hash table of 4-byte prefixes, so
+ * compression is one pass with no allocation.
+ */
+
+/**
+ * @brief Number of hash table entries.
+ */
+#define LZ_CODEC_HASH_SIZE 1024
+
+/**
+ * @brief Largest source buffer.
+ */
+#define LZ_CODEC_MAX_SIZE  0xFFFF
+
+/**
+ * @brief Compress a buffer.
+ *
+ * @param p_src   Data.
+ * @param src_len Data size, at most @ref LZ_CODEC_MAX_SIZE.
+ * @param p_dst   Compressed data.
+ * @param dst_cap Size of @p p_dst.
+ * @param p_table Hash table of @ref LZ_CODEC_HASH_SIZE entries, scratch.
+ *
+ * @return Compressed size, 0 if it does not fit in @p dst_cap.
+ */
+size_t lz_codec_compress(void const * p_src, size_t src_len,
+                         void * p_dst, size_t dst_cap,
+                         uint16_t * p_table);
+
+/**
+ * @brief Decompress a buffer.
+ *
+ * @param p_src   Compressed data.
+ * @param src_len Compressed size.
+ * @param p_dst   Data.
+ * @param dst_cap Size of @p p_dst.
+ *
+ * @return Data size, 0 if the compressed data is malformed or does not fit.
+ */
+size_t lz_codec_decompress(void const * p_src, size_t src_len, void * p_dst, size_t dst_cap);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_CODEC_H__ */
@@ -61,8 +61,15 @@
 #include "nrf_block_dev.h"
 #include "nrf_block_dev_ram.h"
 #include "nrf_block_dev_empty.h"
-#include "nrf_block_dev_qspi.h"
 #include "nrf_block_dev_sdc.h"
+#include "block_dev_qspi.h"
+#include "block_dev_ftl.h"
+#include "block_dev_lz.h"
+#include "block_dev_part.h"
+#include "block_dev_stage.h"
+#include "qspi_wear.h"
+#include "qspi_remap.h"
+#include "crc32_fast.h"
 #include "nrf_drv_usbd.h"
 #include "nrf_drv_clock.h"
 #include "nrf_gpio.h"
@@ -143,6 +150,49 @@
  */
 #define USE_FATFS_QSPI    1
 
+/**
+ * @brief Batch FatFS and host syncs into the periodic QSPI cache flush enable/disable
+ *
+ * Saves an erase per dirty erase unit and sync (FatFS syncs on every f_sync/f_close).
+ * @warning A sync is then acknowledged before its data is on flash: a reset or a
+ *          power loss within @ref CACHE_FLUSH_INTERVAL loses data that FatFS and
+ *          the host consider written.
+ */
+#define USE_DEFER_SYNC    0
+
+/**
+ * @brief Log-structured FTL between the QSPI block device and its users enable/disable
+ */
+#define USE_FTL           0
+
+/**
+ * @brief Compressing block device on top of the QSPI (or FTL) block device enable/disable
+ */
+#define USE_LZ            0
+
+/**
+ * @brief RAM staging of writes in front of the QSPI (or FTL, LZ) block device enable/disable
+ *
+ * Uses the RAM block device buffer, host copies and log bursts are absorbed in RAM
+ * and destaged while the flash is idle.
+ *
+ * Off by default: up to the whole buffer, about 190 KB, of acknowledged writes is
+ * then only in RAM until the next sync, and is lost on a reset or power loss.
+ */
+#define USE_STAGE         0
+
+/**
+ * @brief Idle-time pre-erase of the erase units FatFS holds no data in enable/disable
+ */
+#define USE_PRE_ERASE     1
+
+/**
+ * @brief Split the QSPI flash into a private FatFS partition and a USB MSC partition enable/disable
+ *
+ * The application keeps logging to its partition while the host uses the other one.
+ */
+#define USE_PARTITIONS    0
+
 /**
  * @brief Mass storage class user event handler
  */
@@ -158,9 +208,9 @@ static void msc_user_ev_handler(app_usbd_class_inst_t const * p_inst,
 #define RAM_BLOCK_DEVICE_SIZE (380 * 512)
 
 /**
- * @brief  RAM block device work buffer
+ * @brief  RAM block device work buffer, staging log with @ref USE_STAGE
  */
-static uint8_t m_block_dev_ram_buff[RAM_BLOCK_DEVICE_SIZE];
+static uint8_t m_block_dev_ram_buff[RAM_BLOCK_DEVICE_SIZE] __ALIGN(4);
 
 /**
  * @brief  RAM block device definition
@@ -182,19 +232,137 @@ NRF_BLOCK_DEV_EMPTY_DEFINE(
         );
 
 
+#if USE_DEFER_SYNC && USE_PARTITIONS
+/* The host syncs its partition, FatFS syncs are ignored by the private partition */
+#define QSPI_SYNC_FLAGS    0
+#define PRIVATE_SYNC_FLAGS BLOCK_DEV_PART_FLAG_IGNORE_SYNC
+#elif USE_DEFER_SYNC
+#define QSPI_SYNC_FLAGS    BLOCK_DEV_QSPI_FLAG_CACHE_DEFER_SYNC
+#define PRIVATE_SYNC_FLAGS 0
+#else
+#define QSPI_SYNC_FLAGS    0
+#define PRIVATE_SYNC_FLAGS 0
+#endif
+
 /**
  * @brief  QSPI block device definition
  */
-NRF_BLOCK_DEV_QSPI_DEFINE(
+BLOCK_DEV_QSPI_DEFINE(
         m_block_dev_qspi,
-        NRF_BLOCK_DEV_QSPI_CONFIG(
-                512,
-                NRF_BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK,
+        BLOCK_DEV_QSPI_CONFIG(
+                BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE,
+                BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK | QSPI_SYNC_FLAGS |
+                BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL | BLOCK_DEV_QSPI_FLAG_CRC |
+                BLOCK_DEV_QSPI_FLAG_VERIFY,
                 NRF_DRV_QSPI_DEFAULT_CONFIG
                 ),
         NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00")
         );
 
+#if USE_FATFS_QSPI && (FF_MAX_SS < BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE)
+#error "FatFS sectors smaller than the QSPI block size: raise FF_MAX_SS in ffconf.h"
+#endif
+
+#if USE_PRE_ERASE && (USE_FTL || USE_LZ)
+#error "Pre-erase maps FAT clusters to QSPI blocks directly, disable it with the FTL or LZ block device"
+#endif
+
+#if USE_FTL
+/**
+ * @brief  FTL block device definition, rewrites go out of place on the QSPI flash
+ */
+BLOCK_DEV_FTL_DEFINE(
+        m_block_dev_ftl,
+        m_block_dev_qspi,
+        NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00")
+        );
+
+#define STORAGE_BLOCKDEV NRF_BLOCKDEV_BASE_ADDR(m_block_dev_ftl, block_dev)
+#else
+#define STORAGE_BLOCKDEV NRF_BLOCKDEV_BASE_ADDR(m_block_dev_qspi, block_dev)
+#endif
+
+#if USE_LZ
+/**
+ * @brief  Compressing block device definition, stores 4 KB units compressed
+ */
+BLOCK_DEV_LZ_DEFINE(
+        m_block_dev_lz,
+        STORAGE_BLOCKDEV,
+        NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00")
+        );
+
+#undef STORAGE_BLOCKDEV
+#define STORAGE_BLOCKDEV NRF_BLOCKDEV_BASE_ADDR(m_block_dev_lz, block_dev)
+#endif
+
+#if USE_STAGE
+#if USE_SD_CARD
+#error "The RAM block device buffer holds the staging log, disable staging with the SD card LUNs"
+#endif
+
+/**
+ * @brief  Staging block device definition, writes are absorbed in RAM
+ */
+BLOCK_DEV_STAGE_DEFINE(
+        m_block_dev_stage,
+        STORAGE_BLOCKDEV,
+        m_block_dev_ram_buff,
+        sizeof(m_block_dev_ram_buff),
+        NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00")
+        );
+
+#undef STORAGE_BLOCKDEV
+#define STORAGE_BLOCKDEV NRF_BLOCKDEV_BASE_ADDR(m_block_dev_stage, block_dev)
+#endif
+
+#if USE_PARTITIONS
+#if USE_FTL || USE_LZ
+#error "Formatting the FTL or LZ block device wipes all partitions, disable them with partitions"
+#endif
+
+/**
+ * @brief Size of the private FatFS partition, at the start of the flash so that
+ *        pre-erase still maps FAT clusters to QSPI blocks directly
+ */
+#define PRIVATE_PARTITION_SIZE (1024 * 1024)
+
+/**
+ * @brief  Partitioned QSPI flash
+ */
+BLOCK_DEV_PART_DISK_DEFINE(m_storage_disk, STORAGE_BLOCKDEV);
+
+/**
+ * @brief  Private partition definition, FatFS volume of the application
+ */
+BLOCK_DEV_PART_DEFINE(
+        m_block_dev_private,
+        m_storage_disk,
+        0,
+        PRIVATE_PARTITION_SIZE / BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE,
+        PRIVATE_SYNC_FLAGS,
+        NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI LOG", "1.00")
+        );
+
+/**
+ * @brief  Export partition definition, rest of the flash as USB MSC LUN
+ */
+BLOCK_DEV_PART_DEFINE(
+        m_block_dev_export,
+        m_storage_disk,
+        PRIVATE_PARTITION_SIZE / BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE,
+        0,
+        0,
+        NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00")
+        );
+
+#define FATFS_BLOCKDEV NRF_BLOCKDEV_BASE_ADDR(m_block_dev_private, block_dev)
+#define MSC_BLOCKDEV   NRF_BLOCKDEV_BASE_ADDR(m_block_dev_export, block_dev)
+#else
+#define FATFS_BLOCKDEV STORAGE_BLOCKDEV
+#define MSC_BLOCKDEV   STORAGE_BLOCKDEV
+#endif
+
 #if USE_SD_CARD
 
 #define SDC_SCK_PIN     (27)        ///< SDC serial clock (SCK) pin.
@@ -221,13 +389,13 @@ NRF_BLOCK_DEV_SDC_DEFINE(
 #define BLOCKDEV_LIST() (                                   \
                 NRF_BLOCKDEV_BASE_ADDR(m_block_dev_ram, block_dev),     \
                 NRF_BLOCKDEV_BASE_ADDR(m_block_dev_empty, block_dev),   \
-                NRF_BLOCKDEV_BASE_ADDR(m_block_dev_qspi, block_dev),    \
+                MSC_BLOCKDEV,                                           \
                 NRF_BLOCKDEV_BASE_ADDR(m_block_dev_sdc, block_dev)      \
                 )
 
 #else
 #define BLOCKDEV_LIST() (                                       \
-                NRF_BLOCKDEV_BASE_ADDR(m_block_dev_qspi, block_dev)       \
+                MSC_BLOCKDEV                                            \
                 )
 #endif
 
@@ -238,8 +406,11 @@ NRF_BLOCK_DEV_SDC_DEFINE(
 
 /**
  * @brief Mass storage class work buffer size
+ *
+ * @note One READ(10)/WRITE(10) chunk is passed to the block device per work buffer,
+ *       so a full erase unit keeps QSPI transfers long.
  */
-#define MSC_WORKBUFFER_SIZE (1024)
+#define MSC_WORKBUFFER_SIZE (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE)
 
 /*lint -save -e26 -e64 -e123 -e505 -e651*/
 /**
@@ -264,6 +435,160 @@ static nrf_atomic_u32_t m_key_events;
  */
 static bool m_usb_connected = false;
 
+/**
+ * @brief Interval of the QSPI write cache flush
+ *
+ * Dirty erase units not synced by FatFS or the host are written back at this
+ * interval (and when USB takes over the device). With @ref USE_DEFER_SYNC this is
+ * also when synced data reaches the flash.
+ */
+#define CACHE_FLUSH_INTERVAL APP_TIMER_TICKS(2000)
+
+APP_TIMER_DEF(m_cache_flush_timer);
+
+/**
+ * @brief app_timer counter frequency, used for throughput reporting
+ */
+#define TIMER_TICKS_PER_SEC (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))
+
+/**
+ * @brief QSPI request latency percentile in microseconds
+ */
+static uint32_t qspi_latency_us(bool write, uint32_t percent)
+{
+        uint32_t ticks = block_dev_qspi_latency_get(&m_block_dev_qspi, write, percent);
+
+        return (uint32_t)((uint64_t)ticks * 1000000 / TIMER_TICKS_PER_SEC);
+}
+
+/**
+ * @brief Log QSPI block device throughput
+ */
+static void qspi_stats_log(void)
+{
+        block_dev_qspi_stats_t const * p_stats = block_dev_qspi_stats_get(&m_block_dev_qspi);
+        qspi_flash_stats_t const * p_flash = qspi_flash_stats_get();
+        uint32_t blk_size = nrf_blk_dev_geometry(NRF_BLOCKDEV_BASE_ADDR(m_block_dev_qspi, block_dev))->blk_size;
+
+        uint64_t rd_bytes = (uint64_t)p_stats->read_blocks * blk_size;
+        uint64_t wr_bytes = (uint64_t)p_stats->write_blocks * blk_size;
+        uint32_t rd_kbps = p_stats->read_ticks ?
+                           (uint32_t)(rd_bytes * TIMER_TICKS_PER_SEC / p_stats->read_ticks / 1000) : 0;
+        uint32_t wr_kbps = p_stats->write_ticks ?
+                           (uint32_t)(wr_bytes * TIMER_TICKS_PER_SEC / p_stats->write_ticks / 1000) : 0;
+
+        NRF_LOG_INFO("QSPI read:  %u KB, %u req, %u xfer, %u.%03u MB/s",
+                     (uint32_t)(rd_bytes / 1024), p_stats->read_reqs, p_flash->read_xfers,
+                     rd_kbps / 1000, rd_kbps % 1000);
+        NRF_LOG_INFO("QSPI write: %u KB, %u req, %u erase (%u KB), %u.%03u MB/s",
+                     (uint32_t)(wr_bytes / 1024), p_stats->write_reqs, p_flash->erases,
+                     p_flash->erase_bytes / 1024, wr_kbps / 1000, wr_kbps % 1000);
+        NRF_LOG_INFO("QSPI cache: %u hit, %u miss, %u flush, %u erase skipped, %u ms max step",
+                     p_stats->cache_hits, p_stats->cache_misses, p_stats->cache_flushes,
+                     p_stats->erase_skips,
+                     (uint32_t)((uint64_t)p_stats->step_ticks * 1000 / TIMER_TICKS_PER_SEC));
+        NRF_LOG_INFO("QSPI requests: read p50 < %u us, p99 < %u us; write p50 < %u us, p99 < %u us",
+                     qspi_latency_us(false, 50), qspi_latency_us(false, 99),
+                     qspi_latency_us(true, 50), qspi_latency_us(true, 99));
+        NRF_LOG_INFO("QSPI journal: %u write-backs, %u replayed",
+                     p_stats->journal_writes, p_stats->journal_replays);
+        NRF_LOG_INFO("QSPI erase suspend: %u suspends, %u reads served",
+                     p_flash->suspends, p_stats->suspend_reads);
+        NRF_LOG_INFO("QSPI streams: %u detected, %u units erased ahead, %u writes during erase",
+                     p_stats->seq_streams, p_stats->erase_aheads, p_stats->erase_writes);
+        NRF_LOG_INFO("QSPI power: %u deep power-downs, %u wake-ups, %u s powered down",
+                     p_flash->dpd_entries, p_flash->dpd_wakes, p_flash->dpd_ms / 1000);
+        NRF_LOG_INFO("QSPI CRC: %u errors, %u scrub passes",
+                     p_stats->crc_errors, p_stats->scrub_passes);
+        NRF_LOG_INFO("QSPI trim: %u blocks, %u left blank in write-backs, %u units erased",
+                     p_stats->trim_blocks, p_stats->trim_drops, p_stats->trim_erases);
+        NRF_LOG_INFO("QSPI read back: %u failed, %u units redirected, %u spares left",
+                     p_stats->verify_errors, qspi_remap_count_get(), qspi_remap_spares_get());
+
+        qspi_wear_life_t life;
+        qspi_wear_hot_spot_t hot[3];
+        size_t hot_count = qspi_wear_hot_spots_get(hot, ARRAY_SIZE(hot));
+
+        qspi_wear_life_get(&life);
+        NRF_LOG_INFO("QSPI wear: %u erases, unit %u worst (%u), %u.%u%% life used, %u MB left",
+                     life.total_erases, life.max_unit, life.max_erases,
+                     life.life_used / 10, life.life_used % 10,
+                     (uint32_t)MIN(life.eol_bytes / (1024 * 1024), UINT32_MAX));
+        for (size_t i = 0; i < hot_count; ++i)
+        {
+                NRF_LOG_INFO("QSPI hot spot: unit %u, %u erases", hot[i].eu_idx, hot[i].erases);
+        }
+        NRF_LOG_INFO("QSPI latency: program %u us avg, %u us max; erase 4K %u us avg, %u us max",
+                     qspi_wear_latency_get(QSPI_WEAR_OP_PROGRAM)->avg_us,
+                     qspi_wear_latency_get(QSPI_WEAR_OP_PROGRAM)->max_us,
+                     qspi_wear_latency_get(QSPI_WEAR_OP_ERASE_4K)->avg_us,
+                     qspi_wear_latency_get(QSPI_WEAR_OP_ERASE_4K)->max_us);
+#if USE_FTL
+        block_dev_ftl_stats_t const * p_ftl = block_dev_ftl_stats_get(&m_block_dev_ftl);
+        uint32_t waf = p_ftl->host_blocks ?
+                       (uint32_t)((uint64_t)(p_ftl->host_blocks + p_ftl->gc_blocks) * 1000 /
+                                  p_ftl->host_blocks) : 0;
+
+        NRF_LOG_INFO("FTL: %u blocks, %u copied, %u segments collected, %u erased, WAF %u.%03u",
+                     p_ftl->host_blocks, p_ftl->gc_blocks, p_ftl->gc_segments, p_ftl->erases,
+                     waf / 1000, waf % 1000);
+        NRF_LOG_INFO("FTL: %u blocks trimmed", p_ftl->trim_blocks);
+#endif
+#if USE_LZ
+        block_dev_lz_stats_t const * p_lz = block_dev_lz_stats_get(&m_block_dev_lz);
+        uint32_t ratio = p_lz->stored_bytes ?
+                         (uint32_t)((uint64_t)p_lz->host_bytes * 100 / p_lz->stored_bytes) : 0;
+        uint32_t host_kb = MAX(p_lz->host_bytes / 1024, 1);
+
+        NRF_LOG_INFO("LZ: %u units written (%u raw), ratio %u.%02u, %u blocks free, %u units trimmed",
+                     p_lz->units_written, p_lz->units_raw, ratio / 100, ratio % 100,
+                     p_lz->free_blocks, p_lz->units_trimmed);
+        NRF_LOG_INFO("LZ: compress %u us/KB, decompress %u us/unit",
+                     (uint32_t)((uint64_t)p_lz->compress_ticks * 1000000 / TIMER_TICKS_PER_SEC / host_kb),
+                     p_lz->units_read ?
+                     (uint32_t)((uint64_t)p_lz->decompress_ticks * 1000000 / TIMER_TICKS_PER_SEC /
+                                p_lz->units_read) : 0);
+#endif
+#if USE_STAGE
+        block_dev_stage_stats_t const * p_stage = block_dev_stage_stats_get(&m_block_dev_stage);
+        uint32_t per_batch = p_stage->batches ?
+                             p_stage->destaged_blocks * 100 / p_stage->batches : 0;
+
+        NRF_LOG_INFO("Stage: %u blocks staged, %u rewrites absorbed, %u slots peak, %u stalls",
+                     p_stage->staged_blocks, p_stage->absorbed_blocks, p_stage->max_used,
+                     p_stage->stall_batches);
+        NRF_LOG_INFO("Stage: write %u us avg, %u us max",
+                     p_stage->write_reqs ?
+                     (uint32_t)((uint64_t)p_stage->write_ticks * 1000000 / TIMER_TICKS_PER_SEC /
+                                p_stage->write_reqs) : 0,
+                     (uint32_t)((uint64_t)p_stage->write_max_ticks * 1000000 / TIMER_TICKS_PER_SEC));
+        NRF_LOG_INFO("Stage: %u batches, %u.%02u blocks per batch, %u lower writes",
+                     p_stage->batches, per_batch / 100, per_batch % 100, p_stage->destage_writes);
+#endif
+}
+
+static void cache_flush_evt(void * p_event_data, uint16_t event_size)
+{
+        UNUSED_PARAMETER(p_event_data);
+        UNUSED_PARAMETER(event_size);
+
+#if USE_STAGE
+        /* Destaged by the main loop, the writes land in the QSPI cache of the next flush */
+        block_dev_stage_flush_start(&m_block_dev_stage);
+#endif
+#if USE_LZ
+        /* Unit held in RAM first, its write lands in the QSPI cache flushed below */
+        UNUSED_RETURN_VALUE(block_dev_lz_flush(&m_block_dev_lz));
+#endif
+        block_dev_qspi_cache_flush_start(&m_block_dev_qspi);
+}
+
+static void cache_flush_timeout_handler(void * p_context)
+{
+        UNUSED_PARAMETER(p_context);
+        UNUSED_RETURN_VALUE(app_sched_event_put(NULL, 0, cache_flush_evt));
+}
+
 
 #if USE_FATFS_QSPI
 
@@ -272,6 +597,30 @@ static FATFS m_filesystem;
 static uint32_t record_number = 0; //Record number for stored data
 static volatile bool write_file = false;
 
+/**
+ * @brief The host owns the FatFS volume, unless it has a partition of its own
+ */
+static bool fatfs_locked(void)
+{
+        return m_usb_connected && !USE_PARTITIONS;
+}
+
+/**
+ * @brief Service the QSPI block device and logging while FatFS waits for a request
+ *
+ * USB events stay queued until the FatFS call returns to the main loop: their
+ * handlers mount and release the volume, which must not happen inside a FatFS call.
+ */
+static void fatfs_wait(void)
+{
+        UNUSED_RETURN_VALUE(block_dev_qspi_process(&m_block_dev_qspi));
+#if USE_FTL
+        UNUSED_RETURN_VALUE(block_dev_ftl_process(&m_block_dev_ftl));
+#endif
+
+        UNUSED_RETURN_VALUE(NRF_LOG_PROCESS());
+}
+
 static bool fatfs_init(void)
 {
         FRESULT ff_result;
@@ -282,7 +631,7 @@ static bool fatfs_init(void)
         // Initialize FATFS disk I/O interface by providing the block device.
         static diskio_blkdev_t drives[] =
         {
-                DISKIO_BLOCKDEV_CONFIG(NRF_BLOCKDEV_BASE_ADDR(m_block_dev_qspi, block_dev), NULL)
+                DISKIO_BLOCKDEV_CONFIG(FATFS_BLOCKDEV, fatfs_wait)
         };
 
         diskio_blockdev_register(drives, ARRAY_SIZE(drives));
@@ -317,15 +666,42 @@ static void fatfs_mkfs(void)
 {
         FRESULT ff_result;
 
-        if (m_usb_connected)
+        if (fatfs_locked())
         {
                 NRF_LOG_ERROR("Unable to operate on filesystem while USB is connected");
                 return;
         }
 
-        NRF_LOG_INFO("\r\nCreating filesystem...");
-        static uint8_t buf[512];
-        ff_result = f_mkfs("", FM_FAT, 1024, buf, sizeof(buf));
+        NRF_LOG_INFO("\r\nErasing flash...");
+        /* Down the whole stack, in volume blocks: the stage drops its blocks, a partition keeps to its range */
+        block_dev_unmap_req_t unmap = {
+                .blk_id    = 0,
+                .blk_count = nrf_blk_dev_geometry(FATFS_BLOCKDEV)->blk_count,
+        };
+        ret_code_t ret = nrf_blk_dev_ioctl(FATFS_BLOCKDEV, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap);
+#if USE_FTL
+        if (ret == NRF_SUCCESS)
+        {
+                ret = block_dev_ftl_format(&m_block_dev_ftl);
+        }
+#endif
+#if USE_LZ
+        if (ret == NRF_SUCCESS)
+        {
+                ret = block_dev_lz_format(&m_block_dev_lz);
+        }
+#endif
+        if (ret != NRF_SUCCESS)
+        {
+                NRF_LOG_ERROR("Erase failed: %u", ret);
+                return;
+        }
+
+        NRF_LOG_INFO("Creating filesystem...");
+        static uint8_t buf[BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE];
+        /* FAT32 once the volume has too many clusters for FAT16 (flash above 64 MB) */
+        ff_result = f_mkfs("", FM_FAT | FM_FAT32, MAX(1024, BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE),
+                           buf, sizeof(buf));
         if (ff_result != FR_OK)
         {
                 NRF_LOG_ERROR("Mkfs failed.");
@@ -358,7 +734,7 @@ static void test_write(void)
         ff_result = f_open(&file, "log_data.txt", FA_OPEN_APPEND | FA_OPEN_ALWAYS | FA_WRITE | FA_READ);
         if (ff_result != FR_OK)
         {
-                if(!m_usb_connected)
+                if(!fatfs_locked())
                         NRF_LOG_INFO("Unable to open or create log_data.txt: %u", ff_result);
                 NRF_LOG_FLUSH();
                 return;
@@ -387,7 +763,7 @@ static void fatfs_ls(void)
         FRESULT ff_result;
         FILINFO fno;
 
-        if (m_usb_connected)
+        if (fatfs_locked())
         {
                 NRF_LOG_ERROR("Unable to operate on filesystem while USB is connected");
                 return;
@@ -429,6 +805,7 @@ static void fatfs_ls(void)
 
 
         NRF_LOG_RAW_INFO("Entries count: %u\r\n", entries_count);
+        qspi_stats_log();
 }
 
 static void fatfs_file_create(void)
@@ -437,7 +814,7 @@ static void fatfs_file_create(void)
         FIL file;
         char filename[16];
 
-        if (m_usb_connected)
+        if (fatfs_locked())
         {
                 NRF_LOG_ERROR("Unable to operate on filesystem while USB is connected");
                 return;
@@ -471,12 +848,380 @@ static void fatfs_uninit(void)
         NRF_LOG_INFO("Un-initializing disk 0 (QSPI)...");
         UNUSED_RETURN_VALUE(disk_uninitialize(0));
 }
+
+#if USE_PRE_ERASE
+
+/**
+ * @brief Erase units checked by one pre-erase slice, a 64 KB block.
+ */
+#define PRE_ERASE_SLICE_UNITS (QSPI_FLASH_ERASE_SIZE_64K / BLOCK_DEV_QSPI_ERASE_UNIT_SIZE)
+
+#if FF_MAX_SS == FF_MIN_SS
+#define PRE_ERASE_SECTOR_SIZE FF_MAX_SS
+#else
+#define PRE_ERASE_SECTOR_SIZE m_filesystem.ssize
+#endif
+
+/**
+ * @brief FAT sectors whose content is tracked, those of a FAT32 volume of 512 byte
+ *        clusters over the whole flash. Units under the next ones are never skipped.
+ */
+#define PRE_ERASE_FAT_SECTORS (BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE / FF_MIN_SS * 4 / FF_MIN_SS)
+
+static uint32_t m_pre_erase_unit;   /**< Next erase unit of the pre-erase pass. */
+static uint32_t m_pre_erase_free;   /**< Free erase units found by the pass. */
+static uint32_t m_pre_erase_writes; /**< QSPI write requests when the last pass ended. */
+static uint32_t m_pre_erase_trims;  /**< Free clusters unmapped by the pass. */
+static WORD     m_pre_erase_fs_id;  /**< Mount the tracking below belongs to. */
+static uint8_t  m_fat_buff[FF_MAX_SS];
+
+/**
+ * @brief Erase units discarded or trimmed by a pass, skipped by the next passes
+ *        until a FAT sector of their clusters changes.
+ */
+static uint32_t m_pre_erase_done[CEIL_DIV(BLOCK_DEV_QSPI_MAX_ERASE_UNITS, 32)];
+
+/**
+ * @brief CRC32 of the FAT sectors when the units of their clusters were last checked.
+ */
+static uint32_t m_pre_erase_fat_crc[PRE_ERASE_FAT_SECTORS];
+
+static bool pre_erase_unit_done(uint32_t eu_idx)
+{
+        if (eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS)
+        {
+                return false;
+        }
+        return (m_pre_erase_done[eu_idx / 32] >> (eu_idx % 32)) & 1;
+}
+
+static void pre_erase_unit_done_set(uint32_t eu_idx, bool done)
+{
+        if (eu_idx >= BLOCK_DEV_QSPI_MAX_ERASE_UNITS)
+        {
+                return;
+        }
+        if (done)
+        {
+                m_pre_erase_done[eu_idx / 32] |= 1u << (eu_idx % 32);
+        }
+        else
+        {
+                m_pre_erase_done[eu_idx / 32] &= ~(1u << (eu_idx % 32));
+        }
+}
+
+/**
+ * @brief Forget the units handled under a FAT sector read from the disk, if it
+ *        changed since they were: clusters of them may have been used since.
+ */
+static void pre_erase_fat_changed(uint32_t sector)
+{
+        uint32_t fat_idx = sector - m_filesystem.fatbase;
+        uint32_t crc     = crc32_fast(0, m_fat_buff, PRE_ERASE_SECTOR_SIZE);
+
+        if ((fat_idx < ARRAY_SIZE(m_pre_erase_fat_crc)) && (m_pre_erase_fat_crc[fat_idx] == crc))
+        {
+                return;
+        }
+        if (fat_idx < ARRAY_SIZE(m_pre_erase_fat_crc))
+        {
+                m_pre_erase_fat_crc[fat_idx] = crc;
+        }
+
+        uint32_t sect_per_eu = BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / PRE_ERASE_SECTOR_SIZE;
+        uint32_t entries     = PRE_ERASE_SECTOR_SIZE / ((m_filesystem.fs_type == FS_FAT32) ? 4 : 2);
+        uint32_t clst_first  = MAX(fat_idx * entries, 2);
+        uint32_t clst_end    = MIN((fat_idx + 1) * entries, m_filesystem.n_fatent);
+
+        if (clst_first >= clst_end)
+        {
+                return;
+        }
+
+        uint32_t eu_first = (m_filesystem.database + (clst_first - 2) * m_filesystem.csize) / sect_per_eu;
+        uint32_t eu_last  = (m_filesystem.database + (clst_end - 2) * m_filesystem.csize - 1) / sect_per_eu;
+
+        for (uint32_t eu_idx = eu_first; eu_idx <= eu_last; ++eu_idx)
+        {
+                pre_erase_unit_done_set(eu_idx, false);
+        }
+}
+
+/**
+ * @brief Read the FAT entry of a cluster.
+ *
+ * @param clst     Cluster.
+ * @param p_sector FAT sector held in @ref m_fat_buff, updated.
+ *
+ * @return FAT entry, UINT32_MAX if the FAT could not be read.
+ */
+static uint32_t pre_erase_fat_get(uint32_t clst, uint32_t * p_sector)
+{
+        uint32_t offset = clst * ((m_filesystem.fs_type == FS_FAT32) ? 4 : 2);
+        uint32_t sector = m_filesystem.fatbase + offset / PRE_ERASE_SECTOR_SIZE;
+
+        if (sector != *p_sector)
+        {
+                if (disk_read(0, m_fat_buff, sector, 1) != RES_OK)
+                {
+                        return UINT32_MAX;
+                }
+                *p_sector = sector;
+                pre_erase_fat_changed(sector);
+        }
+
+        offset %= PRE_ERASE_SECTOR_SIZE;
+        if (m_filesystem.fs_type == FS_FAT32)
+        {
+                return uint32_decode(&m_fat_buff[offset]) & 0x0FFFFFFF;
+        }
+
+        return uint16_decode(&m_fat_buff[offset]);
+}
+
+/**
+ * @brief Check whether an erase unit lies in the data area and all its clusters are free.
+ */
+static bool pre_erase_unit_free(uint32_t eu_idx, uint32_t * p_sector)
+{
+        uint32_t sect_per_eu = BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / PRE_ERASE_SECTOR_SIZE;
+        uint32_t sect        = eu_idx * sect_per_eu;
+        uint32_t data_end    = m_filesystem.database + (m_filesystem.n_fatent - 2) * m_filesystem.csize;
+
+        if ((sect < m_filesystem.database) || (sect + sect_per_eu > data_end))
+        {
+                return false;
+        }
+
+        uint32_t clst_first = 2 + (sect - m_filesystem.database) / m_filesystem.csize;
+        uint32_t clst_last  = 2 + (sect + sect_per_eu - 1 - m_filesystem.database) / m_filesystem.csize;
+
+        for (uint32_t clst = clst_first; clst <= clst_last; ++clst)
+        {
+                if (pre_erase_fat_get(clst, p_sector) != 0)
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * @brief Check whether an earlier pass handled an erase unit under the FAT of now.
+ *
+ * Reads the FAT sectors of its first and last clusters, which holds all of its entries,
+ * so that a change there clears the done bit before it is looked at.
+ */
+static bool pre_erase_unit_skip(uint32_t eu_idx, uint32_t * p_sector)
+{
+        uint32_t sect_per_eu = BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / PRE_ERASE_SECTOR_SIZE;
+        uint32_t sect        = eu_idx * sect_per_eu;
+        uint32_t data_end    = m_filesystem.database + (m_filesystem.n_fatent - 2) * m_filesystem.csize;
+
+        if ((sect + sect_per_eu > m_filesystem.database) && (sect < data_end))
+        {
+                uint32_t first = MAX(sect, m_filesystem.database);
+                uint32_t last  = MIN(sect + sect_per_eu, data_end) - 1;
+
+                if ((pre_erase_fat_get(2 + (first - m_filesystem.database) / m_filesystem.csize,
+                                       p_sector) == UINT32_MAX) ||
+                    (pre_erase_fat_get(2 + (last - m_filesystem.database) / m_filesystem.csize,
+                                       p_sector) == UINT32_MAX))
+                {
+                        return false;
+                }
+        }
+
+        return pre_erase_unit_done(eu_idx);
+}
+
+/**
+ * @brief Unmap the free clusters lying whole in an erase unit which is partly in use.
+ *
+ * Stands in for FatFS CTRL_TRIM and SCSI UNMAP, which the SDK does not issue (see
+ * @ref block_dev_unmap): the QSPI block device then leaves these blocks blank when it
+ * erases the unit for a write-back, instead of copying their old content.
+ *
+ * @retval true All free clusters of the unit are unmapped.
+ */
+static bool pre_erase_unit_trim(uint32_t eu_idx, uint32_t * p_sector)
+{
+        uint32_t sect_per_eu = BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / PRE_ERASE_SECTOR_SIZE;
+        uint32_t data_end    = m_filesystem.database + (m_filesystem.n_fatent - 2) * m_filesystem.csize;
+        uint32_t first       = MAX(eu_idx * sect_per_eu, m_filesystem.database);
+        uint32_t end         = MIN((eu_idx + 1) * sect_per_eu, data_end);
+
+        if (first >= end)
+        {
+                return true;
+        }
+
+        uint32_t clst_end = 2 + (end - m_filesystem.database) / m_filesystem.csize;
+        bool     done     = true;
+
+        for (uint32_t clst = 2 + CEIL_DIV(first - m_filesystem.database, m_filesystem.csize);
+             clst < clst_end; ++clst)
+        {
+                uint32_t entry = pre_erase_fat_get(clst, p_sector);
+
+                if (entry == UINT32_MAX)
+                {
+                        done = false;
+                }
+                if (entry != 0)
+                {
+                        continue;
+                }
+
+                block_dev_unmap_req_t unmap = {
+                        .blk_id    = m_filesystem.database + (clst - 2) * m_filesystem.csize,
+                        .blk_count = m_filesystem.csize,
+                };
+
+                /* Through the stage, which drops what it still holds of the cluster */
+                if (nrf_blk_dev_ioctl(FATFS_BLOCKDEV, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap) == NRF_SUCCESS)
+                {
+                        m_pre_erase_trims++;
+                }
+                else
+                {
+                        done = false;
+                }
+        }
+
+        return done;
+}
+
+/**
+ * @brief Discard the next run of free erase units, checking one 64 KB block per call.
+ *
+ * Only while the application owns the volume and FatFS holds no modified FAT sector,
+ * so the FAT on the disk is the allocation. A pass over the volume starts after boot
+ * and after every write to the QSPI block device; the erase is done in the background
+ * by the QSPI block device, which skips units already blank. Free clusters of the
+ * units still in use are unmapped.
+ *
+ * A pass reads the whole FAT but only handles the units under FAT sectors changed
+ * since an earlier pass handled them, so passes after small writes are short. A
+ * cluster used and freed again between two passes is not seen until the next mount.
+ *
+ * @retval true More work is pending.
+ */
+static bool fatfs_pre_erase(void)
+{
+        uint32_t writes = block_dev_qspi_stats_get(&m_block_dev_qspi)->write_reqs;
+
+        if (fatfs_locked() || (disk_status(0) & STA_NOINIT) || m_filesystem.wflag ||
+            ((m_filesystem.fs_type != FS_FAT16) && (m_filesystem.fs_type != FS_FAT32)))
+        {
+                return false;
+        }
+
+        uint32_t sect_per_eu = BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / PRE_ERASE_SECTOR_SIZE;
+        uint32_t eu_total    = (m_filesystem.database + (m_filesystem.n_fatent - 2) * m_filesystem.csize) /
+                               sect_per_eu;
+
+        if (m_pre_erase_fs_id != m_filesystem.id)
+        {
+                /* Mounted again, the host may have written anything */
+                m_pre_erase_fs_id = m_filesystem.id;
+                memset(m_pre_erase_done, 0, sizeof(m_pre_erase_done));
+                m_pre_erase_unit   = 0;
+                m_pre_erase_free   = 0;
+                m_pre_erase_trims  = 0;
+        }
+
+        if (m_pre_erase_unit >= eu_total)
+        {
+                if (writes == m_pre_erase_writes)
+                {
+                        return false;
+                }
+
+                m_pre_erase_unit  = 0;
+                m_pre_erase_free  = 0;
+                m_pre_erase_trims = 0;
+        }
+
+        uint32_t slice_end = MIN((m_pre_erase_unit / PRE_ERASE_SLICE_UNITS + 1) * PRE_ERASE_SLICE_UNITS,
+                                 eu_total);
+        uint32_t sector    = UINT32_MAX;
+        uint32_t first     = m_pre_erase_unit;
+
+        while (first < slice_end)
+        {
+                bool skip = pre_erase_unit_skip(first, &sector);
+                bool free = pre_erase_unit_free(first, &sector);
+
+                if (free && !skip)
+                {
+                        break;
+                }
+                if (!skip)
+                {
+                        pre_erase_unit_done_set(first, pre_erase_unit_trim(first, &sector));
+                }
+                m_pre_erase_free += free;
+                first++;
+        }
+
+        uint32_t end = first;
+        while ((end < slice_end) && !pre_erase_unit_skip(end, &sector) &&
+               pre_erase_unit_free(end, &sector))
+        {
+                end++;
+        }
+
+        if (first < end)
+        {
+                block_dev_unmap_req_t unmap = {
+                        .blk_id    = first * sect_per_eu,
+                        .blk_count = (end - first) * sect_per_eu,
+                };
+
+                /* Staged blocks of the run are dropped first, a later destage would program them back */
+                ret_code_t ret = nrf_blk_dev_ioctl(FATFS_BLOCKDEV, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap);
+                if (ret == NRF_SUCCESS)
+                {
+                        ret = block_dev_qspi_discard_start(&m_block_dev_qspi, unmap.blk_id, unmap.blk_count);
+                }
+                if (ret == NRF_ERROR_BUSY)
+                {
+                        return true;
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        NRF_LOG_WARNING("Pre-erase failed: %u", ret);
+                }
+                for (uint32_t eu_idx = first; eu_idx < end; ++eu_idx)
+                {
+                        pre_erase_unit_done_set(eu_idx, ret == NRF_SUCCESS);
+                }
+                m_pre_erase_free += end - first;
+        }
+
+        m_pre_erase_unit = end;
+        if (m_pre_erase_unit >= eu_total)
+        {
+                m_pre_erase_writes = writes;
+                NRF_LOG_INFO("Pre-erase pass done: %u of %u erase units free, %u clusters trimmed",
+                             m_pre_erase_free, eu_total, m_pre_erase_trims);
+        }
+
+        return true;
+}
+#else
+#define fatfs_pre_erase()   false
+#endif
 #else //USE_FATFS_QSPI
 #define fatfs_init()        false
 #define fatfs_mkfs()        do { } while (0)
 #define fatfs_ls()          do { } while (0)
 #define fatfs_file_create() do { } while (0)
 #define fatfs_uninit()      do { } while (0)
+#define fatfs_pre_erase()   false
 #endif
 
 /**
@@ -514,21 +1259,34 @@ static void usbd_user_ev_handler(app_usbd_event_type_t event)
                 NRF_LOG_INFO("APP_USBD_EVT_STARTED");
                 break;
         case APP_USBD_EVT_STOPPED:
+#if !USE_PARTITIONS
                 UNUSED_RETURN_VALUE(fatfs_init());
+#endif
                 app_usbd_disable();
                 bsp_board_leds_off();
                 NRF_LOG_INFO("APP_USBD_EVT_STOPPED");
+                qspi_stats_log();
                 break;
         case APP_USBD_EVT_POWER_DETECTED:
                 NRF_LOG_INFO("USB power detected");
                 if (!nrf_drv_usbd_is_enabled())
                 {
+#if !USE_PARTITIONS
                         fatfs_uninit();
+#endif
                         app_usbd_enable();
                 }
                 break;
         case APP_USBD_EVT_POWER_REMOVED:
                 NRF_LOG_INFO("USB power removed");
+                /* What the host wrote does not stay in RAM only, down to the flash */
+#if USE_STAGE
+                UNUSED_RETURN_VALUE(block_dev_stage_flush(&m_block_dev_stage));
+#endif
+#if USE_LZ
+                UNUSED_RETURN_VALUE(block_dev_lz_flush(&m_block_dev_lz));
+#endif
+                UNUSED_RETURN_VALUE(block_dev_qspi_cache_flush(&m_block_dev_qspi));
                 app_usbd_stop();
                 m_usb_connected = false;
                 break;
@@ -576,7 +1334,9 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
                         {
                                 if (!nrf_drv_usbd_is_enabled())
                                 {
-                                        //fatfs_uninit();
+#if !USE_PARTITIONS
+                                        fatfs_uninit();
+#endif
                                         app_usbd_enable();
                                 }
                                 m_usb_connected = true;
@@ -675,11 +1435,13 @@ int main(void)
 
         scheduler_init();
 
+#if !USE_STAGE
         /* Fill whole RAM block device buffer */
         for (size_t i = 0; i < sizeof(m_block_dev_ram_buff); ++i)
         {
                 m_block_dev_ram_buff[i] = i;
         }
+#endif
 
         /* Configure LEDs and buttons */
         nrf_drv_clock_lfclk_request(NULL);
@@ -688,6 +1450,11 @@ int main(void)
 
         buttons_init();
 
+        ret = app_timer_create(&m_cache_flush_timer, APP_TIMER_MODE_REPEATED, cache_flush_timeout_handler);
+        APP_ERROR_CHECK(ret);
+        ret = app_timer_start(m_cache_flush_timer, CACHE_FLUSH_INTERVAL, NULL);
+        APP_ERROR_CHECK(ret);
+
         // ret = bsp_init(BSP_INIT_BUTTONS, bsp_event_callback);
         // APP_ERROR_CHECK(ret);
         bsp_board_init(BSP_INIT_LEDS);
@@ -716,6 +1483,10 @@ int main(void)
         {
                 NRF_LOG_INFO("No USB power detection enabled\r\nStarting USB now");
 
+                /* MSC initializes the device once started, FatFS gets it back when stopped */
+#if !USE_PARTITIONS
+                fatfs_uninit();
+#endif
                 app_usbd_enable();
                 app_usbd_start();
                 m_usb_connected = true;
@@ -755,6 +1526,34 @@ int main(void)
                 }
 
                 app_sched_execute();
+
+                /* Background work of the QSPI block device keeps the CPU awake */
+                if (block_dev_qspi_process(&m_block_dev_qspi))
+                {
+                        continue;
+                }
+
+#if USE_FTL
+                if (block_dev_ftl_process(&m_block_dev_ftl))
+                {
+                        continue;
+                }
+#endif
+
+#if USE_STAGE
+                /* Staged writes go to the flash once it is idle */
+                if (block_dev_stage_process(&m_block_dev_stage))
+                {
+                        continue;
+                }
+#endif
+
+                /* Free space is erased once the flash has nothing else to do */
+                if (fatfs_pre_erase())
+                {
+                        continue;
+                }
+
                 /* Sleep CPU only if there was no interrupt since last loop processing */
                 __WFE();
         }
@@ -46,6 +46,174 @@
 #ifdef USE_APP_CONFIG
 #include "app_config.h"
 #endif
+// <h> Application 
+
+//==========================================================
+// <o> BLOCK_DEV_QSPI_CONFIG_CACHE_LINES - Number of 4 KB erase units held in the QSPI block device write cache.  <1-8> 
+
+
+#ifndef BLOCK_DEV_QSPI_CONFIG_CACHE_LINES
+#define BLOCK_DEV_QSPI_CONFIG_CACHE_LINES 4
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE  - QSPI block device (FatFS and USB MSC sector) size.
+ 
+// <i> 4096 maps every sector to one erase unit. FatFS FF_MAX_SS (ffconf.h) must be at least this size.
+// <512=> 512 
+// <4096=> 4096 
+
+#ifndef BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_BLOCK_SIZE 512
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE - Number of requests queued in the QSPI block device.  <1-8> 
+
+
+#ifndef BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_QUEUE_SIZE 2
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE - Largest QSPI flash size tracked by the erased-unit bitmap (bytes). 
+#ifndef BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE
+#define BLOCK_DEV_QSPI_CONFIG_MAX_FLASH_SIZE 8388608
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS - Idle time before the QSPI flash enters deep power-down (ms), 0 to disable. 
+#ifndef BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS
+#define BLOCK_DEV_QSPI_CONFIG_DPD_IDLE_MS 1000
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S - Time between CRC scrub passes over the QSPI block device (s), 0 to disable. 
+#ifndef BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S
+#define BLOCK_DEV_QSPI_CONFIG_SCRUB_PERIOD_S 3600
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD - Erase units erased ahead of a sequential write stream, 0 to disable.  <0-7> 
+#ifndef BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD
+#define BLOCK_DEV_QSPI_CONFIG_ERASE_AHEAD 2
+#endif
+
+// <o> QSPI_FLASH_CONFIG_DPD_WAKE_US - QSPI flash wake-up time from deep power-down, tRES1 (us). 
+#ifndef QSPI_FLASH_CONFIG_DPD_WAKE_US
+#define QSPI_FLASH_CONFIG_DPD_WAKE_US 35
+#endif
+
+// <o> BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS - Journal units used by the journaled write-back. 
+#ifndef BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS
+#define BLOCK_DEV_QSPI_CONFIG_JOURNAL_UNITS 2
+#endif
+
+// <e> QSPI_FLASH_CONFIG_SFDP_ENABLED - Configure QSPI read/program instructions from the flash SFDP table
+//==========================================================
+#ifndef QSPI_FLASH_CONFIG_SFDP_ENABLED
+#define QSPI_FLASH_CONFIG_SFDP_ENABLED 1
+#endif
+// <o> QSPI_FLASH_CONFIG_SFDP_FREQUENCY  - Frequency divider used with an SFDP configuration.
+ 
+// <0=> 32MHz/1 
+// <1=> 32MHz/2 
+// <3=> 32MHz/4 
+// <7=> 32MHz/8 
+// <15=> 32MHz/16 
+
+#ifndef QSPI_FLASH_CONFIG_SFDP_FREQUENCY
+#define QSPI_FLASH_CONFIG_SFDP_FREQUENCY 1
+#endif
+
+// </e>
+
+// <e> QSPI_CALIB_CONFIG_ENABLED - Calibrate the QSPI clock and receive delay at init
+//==========================================================
+#ifndef QSPI_CALIB_CONFIG_ENABLED
+#define QSPI_CALIB_CONFIG_ENABLED 1
+#endif
+// <o> QSPI_CALIB_CONFIG_PASSES - Pattern reads per tried setting. 
+#ifndef QSPI_CALIB_CONFIG_PASSES
+#define QSPI_CALIB_CONFIG_PASSES 8
+#endif
+
+// <o> QSPI_CALIB_CONFIG_MARGIN - Passing receive delays required on each side of the selected one. 
+#ifndef QSPI_CALIB_CONFIG_MARGIN
+#define QSPI_CALIB_CONFIG_MARGIN 1
+#endif
+
+// </e>
+
+// <e> QSPI_WEAR_CONFIG_PERSIST_ENABLED - Save QSPI erase counters to a region at the end of the flash
+//==========================================================
+#ifndef QSPI_WEAR_CONFIG_PERSIST_ENABLED
+#define QSPI_WEAR_CONFIG_PERSIST_ENABLED 1
+#endif
+// <o> QSPI_WEAR_CONFIG_SAVE_ERASES - Erase units erased between two saves. 
+#ifndef QSPI_WEAR_CONFIG_SAVE_ERASES
+#define QSPI_WEAR_CONFIG_SAVE_ERASES 256
+#endif
+
+// </e>
+
+// <o> QSPI_WEAR_CONFIG_MAX_UNITS - Number of erase units with an erase counter. 
+#ifndef QSPI_WEAR_CONFIG_MAX_UNITS
+#define QSPI_WEAR_CONFIG_MAX_UNITS 2048
+#endif
+
+// <o> QSPI_WEAR_CONFIG_ENDURANCE - Rated erase cycles of the flash. 
+#ifndef QSPI_WEAR_CONFIG_ENDURANCE
+#define QSPI_WEAR_CONFIG_ENDURANCE 100000
+#endif
+
+// <o> QSPI_REMAP_CONFIG_SPARE_UNITS - Spare erase units replacing units which fail the read back. 
+#ifndef QSPI_REMAP_CONFIG_SPARE_UNITS
+#define QSPI_REMAP_CONFIG_SPARE_UNITS 8
+#endif
+
+// <o> BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE - FTL segment size (bytes), multiple of 4096. 
+#ifndef BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE
+#define BLOCK_DEV_FTL_CONFIG_SEGMENT_SIZE 32768
+#endif
+
+// <o> BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS - FTL segments kept free for garbage collection. 
+#ifndef BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS
+#define BLOCK_DEV_FTL_CONFIG_SPARE_SEGMENTS 4
+#endif
+
+// <o> BLOCK_DEV_LZ_CONFIG_UNIT_SIZE - Compression unit size (bytes), multiple of the lower block size. 
+#ifndef BLOCK_DEV_LZ_CONFIG_UNIT_SIZE
+#define BLOCK_DEV_LZ_CONFIG_UNIT_SIZE 4096
+#endif
+
+// <o> BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT - Logical capacity relative to the lower device (percent), writes can fail above 100. 
+#ifndef BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT
+#define BLOCK_DEV_LZ_CONFIG_RATIO_PERCENT 100
+#endif
+
+// <o> BLOCK_DEV_LZ_CONFIG_MAX_UNITS - Units tracked by the mapping table. 
+#ifndef BLOCK_DEV_LZ_CONFIG_MAX_UNITS
+#define BLOCK_DEV_LZ_CONFIG_MAX_UNITS 4096
+#endif
+
+// <o> BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS - Lower blocks tracked by the allocation bitmap. 
+#ifndef BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS
+#define BLOCK_DEV_LZ_CONFIG_MAX_BLOCKS 16384
+#endif
+
+// <o> BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE - Staged writes destaged together (bytes), multiple of the block size. 
+#ifndef BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE
+#define BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE 4096
+#endif
+
+// <o> BLOCK_DEV_STAGE_CONFIG_IDLE_MS - Time without writes before staged writes are destaged (ms). 
+#ifndef BLOCK_DEV_STAGE_CONFIG_IDLE_MS
+#define BLOCK_DEV_STAGE_CONFIG_IDLE_MS 20
+#endif
+
+// <o> BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT - Fill level destaged during write bursts (percent). 
+#ifndef BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT
+#define BLOCK_DEV_STAGE_CONFIG_HIGH_PERCENT 75
+#endif
+
+// </h> 
+//==========================================================
+
 // <h> nRF_Drivers 
 
 //==========================================================
@@ -0,0 +1,265 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_calib.h"
+#include "app_util.h"
+
+#define NRF_LOG_MODULE_NAME qspi_calib
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Saved record magic, "QCAL".
+ */
+#define CALIB_MAGIC          0x4C414351
+
+/**
+ * @brief Pattern location in the region, the record takes the first page.
+ */
+#define CALIB_PATTERN_OFFSET QSPI_FLASH_PAGE_SIZE
+#define CALIB_PATTERN_SIZE   1024
+
+/**
+ * @brief Saved timing.
+ */
+typedef struct
+{
+        uint32_t magic;
+        uint8_t  read_id[3];
+        uint8_t  base_freq;     //!< Configured clock the sweep started from.
+        uint8_t  sck_freq;
+        uint8_t  rx_delay;
+        uint8_t  window;
+        uint8_t  reserved;
+        uint32_t check;         //!< Inverted sum of the words above.
+} calib_record_t;
+
+STATIC_ASSERT(sizeof(calib_record_t) <= CALIB_PATTERN_OFFSET);
+
+static qspi_calib_result_t m_result;
+static uint32_t            m_buff[CALIB_PATTERN_SIZE / sizeof(uint32_t)];
+
+/**
+ * @brief Pattern word: all-zero, all-one and alternating words first, then hashed ones.
+ */
+static uint32_t calib_pattern_word(uint32_t i)
+{
+        static const uint32_t fixed[] = { 0x00000000, 0xFFFFFFFF, 0x55555555, 0xAAAAAAAA };
+
+        if (i < ARRAY_SIZE(fixed))
+        {
+                return fixed[i];
+        }
+
+        uint32_t x = i * 0x9E3779B9;
+        x ^= x >> 15;
+        x *= 0x85EBCA6B;
+        x ^= x >> 13;
+        return x;
+}
+
+static uint32_t calib_record_check(calib_record_t const * p_rec)
+{
+        uint32_t words[3];
+
+        memcpy(words, p_rec, sizeof(words));
+        return ~(words[0] + words[1] + words[2]);
+}
+
+/**
+ * @brief Read the pattern back @p passes times.
+ */
+static bool calib_verify(uint32_t region_addr, uint32_t passes)
+{
+        for (uint32_t pass = 0; pass < passes; ++pass)
+        {
+                memset(m_buff, 0, sizeof(m_buff));
+                if (qspi_flash_read(m_buff, region_addr + CALIB_PATTERN_OFFSET, sizeof(m_buff)) != NRF_SUCCESS)
+                {
+                        return false;
+                }
+
+                for (uint32_t i = 0; i < ARRAY_SIZE(m_buff); ++i)
+                {
+                        if (m_buff[i] != calib_pattern_word(i))
+                        {
+                                return false;
+                        }
+                }
+        }
+
+        return true;
+}
+
+/**
+ * @brief Erase the region and program the pattern.
+ */
+static ret_code_t calib_pattern_write(uint32_t region_addr)
+{
+        ret_code_t ret = qspi_flash_erase(region_addr, QSPI_CALIB_REGION_SIZE);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(m_buff); ++i)
+        {
+                m_buff[i] = calib_pattern_word(i);
+        }
+
+        return qspi_flash_program(m_buff, region_addr + CALIB_PATTERN_OFFSET, sizeof(m_buff));
+}
+
+/**
+ * @brief Apply the saved timing if it still matches the flash and verifies.
+ */
+static bool calib_load(uint32_t region_addr, qspi_flash_timing_t const * p_base)
+{
+        calib_record_t rec;
+
+        if ((qspi_flash_read(&rec, region_addr, sizeof(rec)) != NRF_SUCCESS) ||
+            (rec.magic != CALIB_MAGIC) || (rec.check != calib_record_check(&rec)) ||
+            memcmp(rec.read_id, qspi_flash_info_get()->read_id, sizeof(rec.read_id)) ||
+            (rec.base_freq != p_base->sck_freq))
+        {
+                return false;
+        }
+
+        m_result.timing.sck_freq = (nrf_qspi_frequency_t)rec.sck_freq;
+        m_result.timing.rx_delay = rec.rx_delay;
+        m_result.window          = rec.window;
+
+        if ((qspi_flash_timing_set(&m_result.timing) == NRF_SUCCESS) && calib_verify(region_addr, 1))
+        {
+                return true;
+        }
+
+        NRF_LOG_WARNING("Saved timing failed verification");
+        return false;
+}
+
+/**
+ * @brief Find the fastest clock with a wide enough window of receive delays.
+ *
+ * @return true if a setting faster than @p p_base was found, stored in @ref m_result.
+ */
+static bool calib_sweep(uint32_t region_addr, qspi_flash_timing_t const * p_base)
+{
+        for (uint32_t freq = NRF_QSPI_FREQ_32MDIV1; freq < p_base->sck_freq; ++freq)
+        {
+                uint32_t best_first = 0;
+                uint32_t best_len   = 0;
+                uint32_t run_len    = 0;
+
+                for (uint32_t delay = 0; delay <= QSPI_FLASH_RXDELAY_MAX; ++delay)
+                {
+                        qspi_flash_timing_t timing = { .sck_freq = (nrf_qspi_frequency_t)freq,
+                                                       .rx_delay = (uint8_t)delay };
+                        bool pass = (qspi_flash_timing_set(&timing) == NRF_SUCCESS) &&
+                                    calib_verify(region_addr, QSPI_CALIB_CONFIG_PASSES);
+
+                        run_len = pass ? run_len + 1 : 0;
+                        if (run_len > best_len)
+                        {
+                                best_len   = run_len;
+                                best_first = delay + 1 - run_len;
+                        }
+                }
+
+                NRF_LOG_DEBUG("32MHz/%u: %u delays pass from %u", freq + 1, best_len, best_first);
+
+                if (best_len >= 2 * QSPI_CALIB_CONFIG_MARGIN + 1)
+                {
+                        m_result.timing.sck_freq = (nrf_qspi_frequency_t)freq;
+                        m_result.timing.rx_delay = (uint8_t)(best_first + best_len / 2);
+                        m_result.window          = (uint8_t)best_len;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+ret_code_t qspi_calib_run(uint32_t region_addr)
+{
+        qspi_flash_timing_t base;
+        ret_code_t ret;
+
+        qspi_flash_timing_get(&base);
+        memset(&m_result, 0, sizeof(m_result));
+        m_result.timing = base;
+
+        if (region_addr % QSPI_FLASH_ERASE_UNIT_SIZE)
+        {
+                return NRF_ERROR_INVALID_PARAM;
+        }
+
+        if (calib_load(region_addr, &base))
+        {
+                m_result.cached = true;
+                NRF_LOG_INFO("QSPI 32MHz/%u, RXDELAY %u (saved)",
+                             m_result.timing.sck_freq + 1, m_result.timing.rx_delay);
+                return NRF_SUCCESS;
+        }
+
+        /* Pattern is written and the record saved at the configured timing */
+        ret = qspi_flash_timing_set(&base);
+        if (ret == NRF_SUCCESS)
+        {
+                ret = calib_pattern_write(region_addr);
+        }
+        if ((ret == NRF_SUCCESS) && !calib_verify(region_addr, QSPI_CALIB_CONFIG_PASSES))
+        {
+                ret = NRF_ERROR_INTERNAL;
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                m_result.timing = base;
+                return ret;
+        }
+
+        if (!calib_sweep(region_addr, &base))
+        {
+                m_result.timing = base;
+                m_result.window = 0;
+        }
+
+        calib_record_t rec = {
+                .magic     = CALIB_MAGIC,
+                .base_freq = (uint8_t)base.sck_freq,
+                .sck_freq  = (uint8_t)m_result.timing.sck_freq,
+                .rx_delay  = m_result.timing.rx_delay,
+                .window    = m_result.window,
+        };
+        memcpy(rec.read_id, qspi_flash_info_get()->read_id, sizeof(rec.read_id));
+        rec.check = calib_record_check(&rec);
+
+        ret = qspi_flash_timing_set(&base);
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_program(&rec, region_addr, sizeof(rec));
+        }
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_timing_set(&m_result.timing);
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                m_result.timing = base;
+                UNUSED_RETURN_VALUE(qspi_flash_timing_set(&base));
+                return ret;
+        }
+
+        NRF_LOG_INFO("QSPI calibrated: 32MHz/%u, RXDELAY %u, %u delays pass",
+                     m_result.timing.sck_freq + 1, m_result.timing.rx_delay, m_result.window);
+        return NRF_SUCCESS;
+}
+
+qspi_calib_result_t const * qspi_calib_result_get(void)
+{
+        return &m_result;
+}
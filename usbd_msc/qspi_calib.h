@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef QSPI_CALIB_H__
+#define QSPI_CALIB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+#include "qspi_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup qspi_calib QSPI interface timing calibration
+ * @{
+ * @ingroup usbd_msc
+ * @brief Boot-time search of the fastest stable QSPI clock and receive delay.
+ *
+ * A known pattern is programmed to a reserved erase unit at the configured
+ * (conservative) timing. Clock dividers faster than the configured one are then
+ * tried fastest first; at each one every receive delay (IFTIMING.RXDELAY) reads the
+ * pattern back @ref QSPI_CALIB_CONFIG_PASSES times. The first clock with a window
+ * of passing delays wide enough for @ref QSPI_CALIB_CONFIG_MARGIN on both sides of
+ * its center is used, at the center delay.
+ *
+ * The result is saved in a record at the start of the reserved unit, programmed
+ * last. Later boots apply the saved timing after one verification read of the
+ * pattern instead of sweeping, and sweep again when the verification fails, the
+ * flash changed or the configured timing changed.
+ */
+
+/**
+ * @brief Calibrate the QSPI timing at init.
+ */
+#ifndef QSPI_CALIB_CONFIG_ENABLED
+#define QSPI_CALIB_CONFIG_ENABLED 1
+#endif
+
+/**
+ * @brief Pattern reads per timing setting, all must match.
+ */
+#ifndef QSPI_CALIB_CONFIG_PASSES
+#define QSPI_CALIB_CONFIG_PASSES 8
+#endif
+
+/**
+ * @brief Passing receive delays required on each side of the selected one.
+ */
+#ifndef QSPI_CALIB_CONFIG_MARGIN
+#define QSPI_CALIB_CONFIG_MARGIN 1
+#endif
+
+/**
+ * @brief Size of the region holding the pattern and the saved timing.
+ */
+#define QSPI_CALIB_REGION_SIZE QSPI_FLASH_ERASE_UNIT_SIZE
+
+/**
+ * @brief Calibration result.
+ */
+typedef struct
+{
+        qspi_flash_timing_t timing;     //!< Timing in use.
+        uint8_t             window;     //!< Number of passing receive delays at the selected clock.
+        bool                cached;     //!< Timing taken from the saved record, no sweep done.
+} qspi_calib_result_t;
+
+/**
+ * @brief Apply the saved timing or calibrate and save the result.
+ *
+ * Must be called after @ref qspi_flash_init, with no erase in progress. On failure
+ * the configured timing stays in use.
+ *
+ * @param region_addr Address of the reserved region, erase unit aligned.
+ *
+ * @return Standard error code.
+ */
+ret_code_t qspi_calib_run(uint32_t region_addr);
+
+/**
+ * @brief Get the result of the last @ref qspi_calib_run.
+ */
+qspi_calib_result_t const * qspi_calib_result_get(void);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QSPI_CALIB_H__ */
@@ -0,0 +1,896 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_flash.h"
+#include "qspi_sfdp.h"
+#include "qspi_wear.h"
+#include "qspi_remap.h"
+#include "nrf_serial_flash_params.h"
+#include "nrf_assert.h"
+#include "app_util.h"
+#include "app_timer.h"
+#include "nrf_delay.h"
+
+#define NRF_LOG_MODULE_NAME qspi_flash
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+#define QSPI_STD_CMD_WRSR   0x01
+#define QSPI_STD_CMD_RDSR   0x05
+#define QSPI_STD_CMD_WRSR2  0x31
+#define QSPI_STD_CMD_RDSR2  0x35
+#define QSPI_STD_CMD_WRSR3E 0x3E
+#define QSPI_STD_CMD_RDSR3F 0x3F
+#define QSPI_STD_CMD_RDSFDP 0x5A
+#define QSPI_STD_CMD_RSTEN  0x66
+#define QSPI_STD_CMD_RST    0x99
+#define QSPI_STD_CMD_EN4B   0xB7
+#define QSPI_STD_CMD_RDID   0x9F
+#define QSPI_STD_CMD_DP     0xB9
+#define QSPI_STD_CMD_RDP    0xAB
+
+/**
+ * @brief Quad Enable bit of the status register (Macronix / ISSI layout).
+ */
+#define QSPI_SR_QE          0x40
+
+/**
+ * @brief JEDEC manufacturer ID of Macronix.
+ */
+#define QSPI_MFR_MACRONIX   0xC2
+
+/**
+ * @brief Fast read instruction issued by the QSPI peripheral for a READOC setting.
+ *
+ * The nRF52840 QSPI has fixed opcodes and wait states (dummy + mode clocks), a mode
+ * is usable only when the flash reports the same in SFDP.
+ */
+typedef struct
+{
+        nrf_qspi_readoc_t     readoc;
+        qspi_sfdp_read_mode_t mode;
+        uint8_t               opcode;
+        uint8_t               wait_clocks;
+        char const *          p_name;
+} qspi_flash_readoc_t;
+
+static const qspi_flash_readoc_t m_readocs[] = {
+        { NRF_QSPI_READOC_READ4IO, QSPI_SFDP_READ_1_4_4, 0xEB, 6, "READ4IO" },
+        { NRF_QSPI_READOC_READ4O,  QSPI_SFDP_READ_1_1_4, 0x6B, 8, "READ4O"  },
+        { NRF_QSPI_READOC_READ2IO, QSPI_SFDP_READ_1_2_2, 0xBB, 4, "READ2IO" },
+        { NRF_QSPI_READOC_READ2O,  QSPI_SFDP_READ_1_1_2, 0x3B, 8, "READ2O"  },
+};
+
+/**
+ * @brief app_timer counter frequency.
+ */
+#define QSPI_FLASH_TICKS_PER_SEC (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))
+
+/**
+ * @brief Size of the bounce buffer used for non word aligned user buffers.
+ */
+#define QSPI_FLASH_BOUNCE_SIZE 256
+
+static qspi_flash_info_t     m_info;
+static nrf_drv_qspi_config_t m_config;
+static uint8_t               m_be32k_opcode;
+static bool                  m_en4b_wren;
+static qspi_flash_stats_t m_stats;
+static uint32_t           m_bounce[QSPI_FLASH_BOUNCE_SIZE / sizeof(uint32_t)];
+static bool               m_erase_pending;
+static uint32_t           m_erase_ticks;
+static uint32_t           m_erase_size;
+static qspi_sfdp_suspend_t m_suspend;
+static bool               m_suspended;
+static bool               m_resumed;
+static uint32_t           m_suspend_ticks;
+static uint32_t           m_resume_ticks;
+static uint8_t            m_rx_delay;
+static bool               m_dpd;
+static uint32_t           m_dpd_ticks;
+static uint64_t           m_dpd_total;
+
+/**
+ * @brief Initialize the driver with the current configuration and receive delay.
+ */
+static ret_code_t drv_init(void)
+{
+        ret_code_t ret = nrf_drv_qspi_init(&m_config, NULL, NULL);
+        if (ret == NRF_SUCCESS)
+        {
+                NRF_QSPI->IFTIMING = (NRF_QSPI->IFTIMING & ~QSPI_IFTIMING_RXDELAY_Msk) |
+                                     ((uint32_t)m_rx_delay << QSPI_IFTIMING_RXDELAY_Pos);
+        }
+        return ret;
+}
+
+static ret_code_t cinstr_send(uint8_t opcode, nrf_qspi_cinstr_len_t len,
+                              bool wren, void const * p_tx, void * p_rx)
+{
+        nrf_qspi_cinstr_conf_t cinstr_cfg = NRF_DRV_QSPI_DEFAULT_CINSTR(opcode, len);
+        cinstr_cfg.wipwait = true;
+        cinstr_cfg.wren    = wren;
+
+        return nrf_drv_qspi_cinstr_xfer(&cinstr_cfg, p_tx, p_rx);
+}
+
+/**
+ * @brief Release the flash from deep power-down.
+ *
+ * Status polling (WIPWAIT) is not answered in deep power-down, the instruction is
+ * sent without it and followed by the tRES1 wait.
+ */
+static ret_code_t rdp_send(void)
+{
+        nrf_qspi_cinstr_conf_t cinstr_cfg = NRF_DRV_QSPI_DEFAULT_CINSTR(QSPI_STD_CMD_RDP,
+                                                                        NRF_QSPI_CINSTR_LEN_1B);
+        cinstr_cfg.wipwait = false;
+        cinstr_cfg.wren    = false;
+
+        ret_code_t ret = nrf_drv_qspi_cinstr_xfer(&cinstr_cfg, NULL, NULL);
+        nrf_delay_us(QSPI_FLASH_CONFIG_DPD_WAKE_US);
+        return ret;
+}
+
+/**
+ * @brief Account the time spent in deep power-down up to now.
+ */
+static void dpd_time_update(void)
+{
+        uint32_t now = app_timer_cnt_get();
+
+        m_dpd_total += app_timer_cnt_diff_compute(now, m_dpd_ticks);
+        m_dpd_ticks  = now;
+}
+
+/**
+ * @brief Bring the flash and the peripheral back before an access.
+ */
+static ret_code_t wake_up(void)
+{
+        if (!m_dpd)
+        {
+                return NRF_SUCCESS;
+        }
+
+        ret_code_t ret = drv_init();
+        if (ret == NRF_SUCCESS)
+        {
+                ret = rdp_send();
+        }
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        dpd_time_update();
+        m_dpd = false;
+        m_stats.dpd_wakes++;
+        return NRF_SUCCESS;
+}
+
+static void wait_ready(void)
+{
+        while (nrf_drv_qspi_mem_busy_check() == NRF_ERROR_BUSY)
+        {
+                /* Wait for WIP to clear */
+        }
+}
+
+/**
+ * @brief Report the time of a started erase once the flash is ready again.
+ */
+static void erase_done(void)
+{
+        if (m_erase_pending)
+        {
+                m_erase_pending = false;
+                qspi_wear_erase_done(app_timer_cnt_diff_compute(app_timer_cnt_get(), m_erase_ticks));
+        }
+}
+
+static bool quad_mode_used(nrf_drv_qspi_config_t const * p_config)
+{
+        return (p_config->prot_if.readoc == NRF_QSPI_READOC_READ4O)  ||
+               (p_config->prot_if.readoc == NRF_QSPI_READOC_READ4IO) ||
+               (p_config->prot_if.writeoc == NRF_QSPI_WRITEOC_PP4O)  ||
+               (p_config->prot_if.writeoc == NRF_QSPI_WRITEOC_PP4IO);
+}
+
+#if QSPI_FLASH_CONFIG_SFDP_ENABLED
+/**
+ * @brief SFDP space reader, four bytes per custom instruction.
+ */
+static ret_code_t sfdp_read(uint32_t addr, void * p_buff, size_t size)
+{
+        uint8_t * p_dst = p_buff;
+
+        while (size)
+        {
+                /* 3 address bytes, 8 dummy clocks, 4 data bytes */
+                uint8_t buf[8] = { (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+                ret_code_t ret = cinstr_send(QSPI_STD_CMD_RDSFDP, NRF_QSPI_CINSTR_LEN_9B, false, buf, buf);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                size_t chunk = MIN(size, 4);
+                memcpy(p_dst, &buf[4], chunk);
+                p_dst += chunk;
+                addr  += chunk;
+                size  -= chunk;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Set the Quad Enable bit the way the flash requires.
+ */
+static ret_code_t quad_enable(qspi_sfdp_qe_t qe)
+{
+        uint8_t sr[2] = {0};
+        ret_code_t ret;
+
+        switch (qe)
+        {
+        case QSPI_SFDP_QE_NONE:
+                return NRF_SUCCESS;
+
+        case QSPI_SFDP_QE_SR1_BIT6:
+                ret = cinstr_send(QSPI_STD_CMD_RDSR, NRF_QSPI_CINSTR_LEN_2B, false, NULL, &sr[0]);
+                if (ret != NRF_SUCCESS || (sr[0] & QSPI_SR_QE))
+                {
+                        return ret;
+                }
+                sr[0] |= QSPI_SR_QE;
+                return cinstr_send(QSPI_STD_CMD_WRSR, NRF_QSPI_CINSTR_LEN_2B, true, sr, NULL);
+
+        case QSPI_SFDP_QE_SR2_BIT1:
+        case QSPI_SFDP_QE_SR2_BIT1_NC:
+        case QSPI_SFDP_QE_SR2_BIT1_35:
+                ret = cinstr_send(QSPI_STD_CMD_RDSR, NRF_QSPI_CINSTR_LEN_2B, false, NULL, &sr[0]);
+                if (ret == NRF_SUCCESS && qe == QSPI_SFDP_QE_SR2_BIT1_35)
+                {
+                        ret = cinstr_send(QSPI_STD_CMD_RDSR2, NRF_QSPI_CINSTR_LEN_2B, false, NULL, &sr[1]);
+                }
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+                sr[1] |= 0x02;
+                return cinstr_send(QSPI_STD_CMD_WRSR, NRF_QSPI_CINSTR_LEN_3B, true, sr, NULL);
+
+        case QSPI_SFDP_QE_SR2_BIT1_31:
+                ret = cinstr_send(QSPI_STD_CMD_RDSR2, NRF_QSPI_CINSTR_LEN_2B, false, NULL, &sr[0]);
+                if (ret != NRF_SUCCESS || (sr[0] & 0x02))
+                {
+                        return ret;
+                }
+                sr[0] |= 0x02;
+                return cinstr_send(QSPI_STD_CMD_WRSR2, NRF_QSPI_CINSTR_LEN_2B, true, sr, NULL);
+
+        case QSPI_SFDP_QE_SR2_BIT7:
+                ret = cinstr_send(QSPI_STD_CMD_RDSR3F, NRF_QSPI_CINSTR_LEN_2B, false, NULL, &sr[0]);
+                if (ret != NRF_SUCCESS || (sr[0] & 0x80))
+                {
+                        return ret;
+                }
+                sr[0] |= 0x80;
+                return cinstr_send(QSPI_STD_CMD_WRSR3E, NRF_QSPI_CINSTR_LEN_2B, true, sr, NULL);
+
+        default:
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+}
+
+/**
+ * @brief Pick the fastest read and program modes the flash and the peripheral share.
+ *
+ * @param p_sfdp   Discovered flash parameters.
+ * @param mfr_id   JEDEC manufacturer ID.
+ * @param p_config QSPI configuration to update.
+ *
+ * @return Selected read mode, NULL if none of the multi-line reads is usable.
+ */
+static qspi_flash_readoc_t const * sfdp_config(qspi_sfdp_t const * p_sfdp,
+                                               uint8_t mfr_id,
+                                               nrf_drv_qspi_config_t * p_config)
+{
+        qspi_sfdp_qe_t qe = p_sfdp->qe;
+
+        /* SFDP before JESD216A has no QE description, Macronix parts use SR1 bit 6 */
+        if (qe == QSPI_SFDP_QE_UNKNOWN && mfr_id == QSPI_MFR_MACRONIX)
+        {
+                qe = QSPI_SFDP_QE_SR1_BIT6;
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(m_readocs); ++i)
+        {
+                qspi_flash_readoc_t const * p_oc = &m_readocs[i];
+                qspi_sfdp_read_t const * p_read = &p_sfdp->read[p_oc->mode];
+                bool quad = (p_oc->mode == QSPI_SFDP_READ_1_1_4) || (p_oc->mode == QSPI_SFDP_READ_1_4_4);
+
+                if ((p_read->opcode != p_oc->opcode) ||
+                    (p_read->dummy_clocks + p_read->mode_clocks != p_oc->wait_clocks))
+                {
+                        continue;
+                }
+
+                if (quad)
+                {
+                        if (qe == QSPI_SFDP_QE_UNKNOWN || quad_enable(qe) != NRF_SUCCESS)
+                        {
+                                continue;
+                        }
+
+                        /* BFPT does not describe quad program, Macronix has 4PP (1-4-4) only */
+                        p_config->prot_if.writeoc = (mfr_id == QSPI_MFR_MACRONIX) ?
+                                                    NRF_QSPI_WRITEOC_PP4IO : NRF_QSPI_WRITEOC_PP4O;
+                }
+                else
+                {
+                        p_config->prot_if.writeoc = NRF_QSPI_WRITEOC_PP;
+                }
+
+                p_config->prot_if.readoc = p_oc->readoc;
+                if (p_config->phy_if.sck_freq > QSPI_FLASH_CONFIG_SFDP_FREQUENCY)
+                {
+                        p_config->phy_if.sck_freq = QSPI_FLASH_CONFIG_SFDP_FREQUENCY;
+                }
+
+                return p_oc;
+        }
+
+        return NULL;
+}
+#endif /* QSPI_FLASH_CONFIG_SFDP_ENABLED */
+
+ret_code_t qspi_flash_init(nrf_drv_qspi_config_t const * p_config)
+{
+        ASSERT(p_config);
+
+        m_config   = *p_config;
+        m_rx_delay = QSPI_FLASH_RXDELAY_DEFAULT;
+
+        ret_code_t ret = drv_init();
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Flash ignores everything else while in deep power-down (left so before a reset) */
+        m_dpd = false;
+        ret = rdp_send();
+
+        /* Put the flash into a known state */
+        if (ret == NRF_SUCCESS)
+        {
+                ret = cinstr_send(QSPI_STD_CMD_RSTEN, NRF_QSPI_CINSTR_LEN_1B, false, NULL, NULL);
+        }
+        if (ret == NRF_SUCCESS)
+        {
+                ret = cinstr_send(QSPI_STD_CMD_RST, NRF_QSPI_CINSTR_LEN_1B, false, NULL, NULL);
+        }
+
+        uint8_t rdid[3] = {0};
+        if (ret == NRF_SUCCESS)
+        {
+                ret = cinstr_send(QSPI_STD_CMD_RDID, NRF_QSPI_CINSTR_LEN_4B, false, NULL, rdid);
+        }
+
+        if (ret != NRF_SUCCESS)
+        {
+                nrf_drv_qspi_uninit();
+                return ret;
+        }
+
+        nrf_serial_flash_params_t const * p_params = nrf_serial_flash_params_get(rdid);
+        if (p_params)
+        {
+                m_info.size         = p_params->size;
+                m_info.erase_size   = p_params->erase_size;
+                m_info.program_size = p_params->program_size;
+        }
+        else
+        {
+                memset(&m_info, 0, sizeof(m_info));
+        }
+
+        /* 64 KB block erase (0xD8) is built into the peripheral */
+        m_info.erase_sizes = QSPI_FLASH_ERASE_UNIT_SIZE | QSPI_FLASH_ERASE_SIZE_64K;
+        m_be32k_opcode     = 0;
+        m_en4b_wren        = false;
+        m_suspended        = false;
+        m_info.erase_suspend = false;
+        memset(&m_suspend, 0, sizeof(m_suspend));
+
+        /* Peripheral has to be initialized again when protocol or clock change */
+        bool reconfig = false;
+
+#if QSPI_FLASH_CONFIG_SFDP_ENABLED
+        qspi_sfdp_t sfdp;
+        qspi_flash_readoc_t const * p_readoc = NULL;
+
+        if (qspi_sfdp_parse(sfdp_read, &sfdp) == NRF_SUCCESS)
+        {
+                m_info.size         = sfdp.size;
+                m_info.program_size = sfdp.page_size;
+                m_info.erase_size   = 0;
+                m_info.erase_sizes  = 0;
+                for (size_t i = 0; i < ARRAY_SIZE(sfdp.erase); ++i)
+                {
+                        if (sfdp.erase[i].size == QSPI_FLASH_ERASE_UNIT_SIZE)
+                        {
+                                m_info.erase_size = sfdp.erase[i].size;
+                                m_info.erase_sizes |= sfdp.erase[i].size;
+                        }
+                        else if (sfdp.erase[i].size == QSPI_FLASH_ERASE_SIZE_32K)
+                        {
+                                m_be32k_opcode = sfdp.erase[i].opcode;
+                                m_info.erase_sizes |= sfdp.erase[i].size;
+                        }
+                        else if ((sfdp.erase[i].size == QSPI_FLASH_ERASE_SIZE_64K) &&
+                                 (sfdp.erase[i].opcode == 0xD8))
+                        {
+                                m_info.erase_sizes |= sfdp.erase[i].size;
+                        }
+                }
+
+                if ((m_info.size > QSPI_FLASH_ADDR24_SIZE) && !sfdp.addr_4byte)
+                {
+                        NRF_LOG_WARNING("No 4-byte addressing, using the first 16 MB");
+                        m_info.size = QSPI_FLASH_ADDR24_SIZE;
+                }
+
+                /* Methods B7 (bit 0) and WREN + B7 (bit 1) are supported */
+                m_en4b_wren = !(sfdp.enter_4byte & 0x01) && (sfdp.enter_4byte & 0x02);
+
+                m_suspend = sfdp.suspend;
+                m_info.erase_suspend = (m_suspend.suspend_opcode != 0);
+
+                p_readoc = sfdp_config(&sfdp, rdid[0], &m_config);
+                NRF_LOG_INFO("SFDP %u.%u, QE method %u", sfdp.major, sfdp.minor, sfdp.qe);
+                NRF_LOG_INFO("Read %s (0x%02X, %u wait clocks), program %s, 32MHz/%u",
+                             p_readoc ? p_readoc->p_name : "FASTREAD",
+                             p_readoc ? p_readoc->opcode : 0x0B,
+                             p_readoc ? p_readoc->wait_clocks : 8,
+                             (m_config.prot_if.writeoc == NRF_QSPI_WRITEOC_PP4IO) ? "PP4IO" :
+                             (m_config.prot_if.writeoc == NRF_QSPI_WRITEOC_PP4O)  ? "PP4O" : "PP",
+                             m_config.phy_if.sck_freq + 1);
+        }
+        else
+        {
+                NRF_LOG_WARNING("No SFDP, using static QSPI configuration");
+        }
+
+        reconfig = (p_readoc != NULL);
+#endif /* QSPI_FLASH_CONFIG_SFDP_ENABLED */
+
+        if (!reconfig && quad_mode_used(&m_config))
+        {
+                uint8_t sr = QSPI_SR_QE;
+                ret = cinstr_send(QSPI_STD_CMD_WRSR, NRF_QSPI_CINSTR_LEN_2B, true, &sr, NULL);
+                if (ret != NRF_SUCCESS)
+                {
+                        nrf_drv_qspi_uninit();
+                        return ret;
+                }
+        }
+
+        /* Parts above 16 MB are only reachable with 4-byte addresses */
+        nrf_qspi_addrmode_t addrmode = (m_info.size > QSPI_FLASH_ADDR24_SIZE) ?
+                                       NRF_QSPI_ADDRMODE_32BIT : NRF_QSPI_ADDRMODE_24BIT;
+        if (addrmode == NRF_QSPI_ADDRMODE_32BIT)
+        {
+                ret = cinstr_send(QSPI_STD_CMD_EN4B, NRF_QSPI_CINSTR_LEN_1B, m_en4b_wren, NULL, NULL);
+                if (ret != NRF_SUCCESS)
+                {
+                        nrf_drv_qspi_uninit();
+                        return ret;
+                }
+        }
+
+        if (addrmode != m_config.prot_if.addrmode)
+        {
+                m_config.prot_if.addrmode = addrmode;
+                reconfig = true;
+        }
+
+        if (reconfig)
+        {
+                nrf_drv_qspi_uninit();
+                ret = drv_init();
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        if (!m_info.size || m_info.erase_size != QSPI_FLASH_ERASE_UNIT_SIZE)
+        {
+                NRF_LOG_ERROR("Unsupported flash %02x %02x %02x", rdid[0], rdid[1], rdid[2]);
+                nrf_drv_qspi_uninit();
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        memcpy(m_info.read_id, rdid, sizeof(m_info.read_id));
+
+        NRF_LOG_INFO("Flash %02x %02x %02x, %u KB, %u-byte address",
+                     rdid[0], rdid[1], rdid[2], m_info.size / 1024,
+                     (addrmode == NRF_QSPI_ADDRMODE_32BIT) ? 4 : 3);
+        return NRF_SUCCESS;
+}
+
+void qspi_flash_uninit(void)
+{
+        /* Peripheral is already off in deep power-down */
+        if (m_dpd)
+        {
+                dpd_time_update();
+                m_dpd = false;
+                return;
+        }
+
+        nrf_drv_qspi_uninit();
+}
+
+qspi_flash_info_t const * qspi_flash_info_get(void)
+{
+        return &m_info;
+}
+
+ret_code_t qspi_flash_read(void * p_dst, uint32_t addr, size_t size)
+{
+        uint8_t * p_buff = p_dst;
+
+        if ((size % sizeof(uint32_t)) || (addr % sizeof(uint32_t)))
+        {
+                return NRF_ERROR_INVALID_LENGTH;
+        }
+
+        ret_code_t ret = wake_up();
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        while (size)
+        {
+                size_t chunk = size;
+                uint32_t phys = qspi_remap_addr(addr, &chunk);
+
+                if (is_word_aligned(p_buff))
+                {
+                        chunk = MIN(chunk, QSPI_FLASH_MAX_XFER_SIZE);
+                        ret = nrf_drv_qspi_read(p_buff, chunk, phys);
+                }
+                else
+                {
+                        chunk = MIN(chunk, sizeof(m_bounce));
+                        ret = nrf_drv_qspi_read(m_bounce, chunk, phys);
+                        memcpy(p_buff, m_bounce, chunk);
+                }
+
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                m_stats.read_xfers++;
+                m_stats.read_bytes += chunk;
+
+                p_buff += chunk;
+                addr   += chunk;
+                size   -= chunk;
+        }
+
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_program(void const * p_src, uint32_t addr, size_t size)
+{
+        uint8_t const * p_buff = p_src;
+
+        if ((size % sizeof(uint32_t)) || (addr % sizeof(uint32_t)))
+        {
+                return NRF_ERROR_INVALID_LENGTH;
+        }
+
+        ret_code_t ret = wake_up();
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        while (size)
+        {
+                size_t chunk = size;
+                uint32_t phys = qspi_remap_addr(addr, &chunk);
+                uint32_t ticks = app_timer_cnt_get();
+
+                /* Page splitting is done by the QSPI peripheral */
+                if (is_word_aligned(p_buff))
+                {
+                        chunk = MIN(chunk, QSPI_FLASH_MAX_XFER_SIZE);
+                        ret = nrf_drv_qspi_write(p_buff, chunk, phys);
+                }
+                else
+                {
+                        chunk = MIN(chunk, sizeof(m_bounce));
+                        memcpy(m_bounce, p_buff, chunk);
+                        ret = nrf_drv_qspi_write(m_bounce, chunk, phys);
+                }
+
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                wait_ready();
+                m_stats.prog_xfers++;
+                m_stats.prog_bytes += chunk;
+                qspi_wear_program_add(chunk, app_timer_cnt_diff_compute(app_timer_cnt_get(), ticks));
+
+                p_buff += chunk;
+                addr   += chunk;
+                size   -= chunk;
+        }
+
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase_start(uint32_t addr, uint32_t size)
+{
+        /* Only a single erase unit can be redirected */
+        if (size == QSPI_FLASH_ERASE_UNIT_SIZE)
+        {
+                addr = qspi_remap_addr(addr, NULL);
+        }
+        else if (!qspi_remap_clean(addr, size))
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        ret_code_t ret = wake_up();
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        m_erase_ticks = app_timer_cnt_get();
+        m_erase_size  = size;
+        m_resumed     = false;
+        if (size == m_info.size)
+        {
+                ret = nrf_drv_qspi_erase(NRF_QSPI_ERASE_LEN_ALL, 0);
+        }
+        else if (size == QSPI_FLASH_ERASE_SIZE_32K)
+        {
+                /* No 32 KB erase in the peripheral, issue it as a custom instruction */
+                ASSERT((m_info.erase_sizes & size) && ((addr % size) == 0));
+
+                uint8_t a[4];
+                size_t  n = 0;
+                if (m_config.prot_if.addrmode == NRF_QSPI_ADDRMODE_32BIT)
+                {
+                        a[n++] = (uint8_t)(addr >> 24);
+                }
+                a[n++] = (uint8_t)(addr >> 16);
+                a[n++] = (uint8_t)(addr >> 8);
+                a[n++] = (uint8_t)addr;
+                ret = cinstr_send(m_be32k_opcode, (nrf_qspi_cinstr_len_t)(NRF_QSPI_CINSTR_LEN_1B + n),
+                                  true, a, NULL);
+        }
+        else
+        {
+                ASSERT((size == QSPI_FLASH_ERASE_UNIT_SIZE) || (size == QSPI_FLASH_ERASE_SIZE_64K));
+                ASSERT((m_info.erase_sizes & size) && ((addr % size) == 0));
+
+                ret = nrf_drv_qspi_erase((size == QSPI_FLASH_ERASE_SIZE_64K) ?
+                                         NRF_QSPI_ERASE_LEN_64KB : NRF_QSPI_ERASE_LEN_4KB,
+                                         addr);
+        }
+
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        m_stats.erases++;
+        m_stats.erase_bytes += size;
+        qspi_wear_erase_add(addr, size);
+        m_erase_pending = true;
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase(uint32_t addr, uint32_t size)
+{
+        ret_code_t ret = qspi_flash_erase_start(addr, size);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        wait_ready();
+        erase_done();
+        return NRF_SUCCESS;
+}
+
+bool qspi_flash_busy(void)
+{
+        if (m_dpd)
+        {
+                return false;
+        }
+
+        if (m_suspended || (nrf_drv_qspi_mem_busy_check() == NRF_ERROR_BUSY))
+        {
+                return true;
+        }
+
+        erase_done();
+        return false;
+}
+
+ret_code_t qspi_flash_erase_suspend(void)
+{
+        if (!m_info.erase_suspend)
+        {
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+
+        if (!m_erase_pending || m_suspended)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        /* Suspend is only defined for sector and block erases, chip erase ignores it
+         * and the WIP wait of the suspend instruction would spin until it is done */
+        if ((m_erase_size != QSPI_FLASH_ERASE_UNIT_SIZE) &&
+            (m_erase_size != QSPI_FLASH_ERASE_SIZE_32K) &&
+            (m_erase_size != QSPI_FLASH_ERASE_SIZE_64K))
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        /* Erase has to progress between suspends */
+        uint32_t now = app_timer_cnt_get();
+        if (m_resumed &&
+            ((uint64_t)app_timer_cnt_diff_compute(now, m_resume_ticks) * 1000000 <
+             (uint64_t)m_suspend.resume_interval_us * QSPI_FLASH_TICKS_PER_SEC))
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        /* Returns once WIP clears: suspended, or the erase completed meanwhile */
+        ret_code_t ret = cinstr_send(m_suspend.suspend_opcode, NRF_QSPI_CINSTR_LEN_1B, false, NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        m_suspended     = true;
+        m_suspend_ticks = now;
+        m_stats.suspends++;
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase_resume(void)
+{
+        if (!m_suspended)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        /* Not waiting for WIP, the erase goes on in the background */
+        nrf_qspi_cinstr_conf_t cinstr_cfg = NRF_DRV_QSPI_DEFAULT_CINSTR(m_suspend.resume_opcode,
+                                                                        NRF_QSPI_CINSTR_LEN_1B);
+        cinstr_cfg.wipwait = false;
+        cinstr_cfg.wren    = false;
+
+        ret_code_t ret = nrf_drv_qspi_cinstr_xfer(&cinstr_cfg, NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Time spent suspended is not erase time */
+        m_resume_ticks  = app_timer_cnt_get();
+        m_erase_ticks  += app_timer_cnt_diff_compute(m_resume_ticks, m_suspend_ticks);
+        m_resumed       = true;
+        m_suspended     = false;
+        return NRF_SUCCESS;
+}
+
+void qspi_flash_timing_get(qspi_flash_timing_t * p_timing)
+{
+        p_timing->sck_freq = m_config.phy_if.sck_freq;
+        p_timing->rx_delay = m_rx_delay;
+}
+
+ret_code_t qspi_flash_timing_set(qspi_flash_timing_t const * p_timing)
+{
+        if (p_timing->rx_delay > QSPI_FLASH_RXDELAY_MAX)
+        {
+                return NRF_ERROR_INVALID_PARAM;
+        }
+
+        if (m_erase_pending)
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        ret_code_t ret = wake_up();
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        nrf_drv_qspi_uninit();
+        m_config.phy_if.sck_freq = p_timing->sck_freq;
+        m_rx_delay               = p_timing->rx_delay;
+        return drv_init();
+}
+
+void const * qspi_flash_xip_get(uint32_t addr, size_t size)
+{
+        uint32_t offset = m_config.xip_offset;
+
+        if ((addr < offset) ||
+            (addr + size > m_info.size) ||
+            (addr + size - offset > QSPI_FLASH_XIP_SIZE) ||
+            !qspi_remap_clean(addr, size) ||
+            (wake_up() != NRF_SUCCESS))
+        {
+                return NULL;
+        }
+
+        return (void const *)(uintptr_t)(QSPI_FLASH_XIP_BASE + addr - offset);
+}
+
+ret_code_t qspi_flash_power_down(void)
+{
+        if (m_dpd)
+        {
+                return NRF_SUCCESS;
+        }
+
+        if (m_suspended || qspi_flash_busy())
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        ret_code_t ret = cinstr_send(QSPI_STD_CMD_DP, NRF_QSPI_CINSTR_LEN_1B, false, NULL, NULL);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* Peripheral draws current while enabled, it is initialized again on wake */
+        nrf_drv_qspi_uninit();
+        m_dpd       = true;
+        m_dpd_ticks = app_timer_cnt_get();
+        m_stats.dpd_entries++;
+        return NRF_SUCCESS;
+}
+
+bool qspi_flash_powered_down(void)
+{
+        return m_dpd;
+}
+
+qspi_flash_stats_t const * qspi_flash_stats_get(void)
+{
+        if (m_dpd)
+        {
+                dpd_time_update();
+        }
+        m_stats.dpd_ms = (uint32_t)(m_dpd_total * 1000 / QSPI_FLASH_TICKS_PER_SEC);
+        return &m_stats;
+}
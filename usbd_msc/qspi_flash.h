@@ -0,0 +1,298 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef QSPI_FLASH_H__
+#define QSPI_FLASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdk_common.h"
+#include "nrf_drv_qspi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup qspi_flash QSPI serial NOR flash access
+ * @{
+ * @ingroup usbd_msc
+ * @brief Thin access layer over @ref nrf_drv_qspi used by the QSPI block device.
+ *
+ * All operations except @ref qspi_flash_erase_start are blocking. Transfers of any length (multiple of 4 bytes) are
+ * split into the largest chunks the QSPI EasyDMA accepts, and buffers which are
+ * not word aligned are bounced through an internal aligned buffer.
+ *
+ * With @ref QSPI_FLASH_CONFIG_SFDP_ENABLED the flash SFDP table is read at init and
+ * the fastest read/program instructions both sides support replace the static
+ * READOC/WRITEOC configuration, the clock is raised to @ref QSPI_FLASH_CONFIG_SFDP_FREQUENCY.
+ *
+ * The address mode is chosen from the detected density: parts above
+ * @ref QSPI_FLASH_ADDR24_SIZE are switched to 4-byte addressing, the configured
+ * ADDRMODE is overridden.
+ *
+ * Every erase and program is reported to @ref qspi_wear with its duration.
+ *
+ * Addresses go through @ref qspi_remap: an erase unit retired there is read,
+ * programmed and erased in its spare unit, transfers are split around it.
+ *
+ * @ref qspi_flash_power_down puts the flash in deep power-down and disables the
+ * peripheral; the next access wakes both, paying @ref QSPI_FLASH_CONFIG_DPD_WAKE_US.
+ *
+ * The QSPI block device reaches the flash only through this interface, so a flash
+ * model can stand in for this file off target. It has to keep the NOR behavior the
+ * block device relies on: a program only clears bits (1->0 changes are programmed
+ * in place), an erase sets the range to 0xFF, and after @ref qspi_flash_erase_start
+ * @ref qspi_flash_busy stays true until the erase is done. A model also has to
+ * translate addresses through @ref qspi_remap, or retired erase units stay in use.
+ */
+
+/**
+ * @brief Configure the QSPI interface from the flash SFDP table.
+ */
+#ifndef QSPI_FLASH_CONFIG_SFDP_ENABLED
+#define QSPI_FLASH_CONFIG_SFDP_ENABLED 1
+#endif
+
+/**
+ * @brief Clock divider (@ref nrf_qspi_frequency_t) used with an SFDP configuration.
+ */
+#ifndef QSPI_FLASH_CONFIG_SFDP_FREQUENCY
+#define QSPI_FLASH_CONFIG_SFDP_FREQUENCY NRF_QSPI_FREQ_32MDIV2
+#endif
+
+/**
+ * @brief Wake-up time from deep power-down (tRES1) in microseconds.
+ */
+#ifndef QSPI_FLASH_CONFIG_DPD_WAKE_US
+#define QSPI_FLASH_CONFIG_DPD_WAKE_US 35
+#endif
+
+/**
+ * @brief Erase unit size of the serial flash (sector erase).
+ */
+#define QSPI_FLASH_ERASE_UNIT_SIZE 4096
+
+/**
+ * @brief Block erase sizes. Chip erase is requested with the flash size.
+ */
+#define QSPI_FLASH_ERASE_SIZE_32K  0x8000
+#define QSPI_FLASH_ERASE_SIZE_64K  0x10000
+
+/**
+ * @brief Address space reachable with 3-byte addresses.
+ */
+#define QSPI_FLASH_ADDR24_SIZE     0x1000000
+
+/**
+ * @brief Program page size of the serial flash.
+ */
+#define QSPI_FLASH_PAGE_SIZE       256
+
+/**
+ * @brief Largest single QSPI EasyDMA transfer (READ.CNT / WRITE.CNT are 18 bit, word multiple).
+ */
+#define QSPI_FLASH_MAX_XFER_SIZE   0x3FFFC
+
+/**
+ * @brief Execute-in-place window of the QSPI flash in the CPU address space.
+ */
+#define QSPI_FLASH_XIP_BASE        0x12000000
+#define QSPI_FLASH_XIP_SIZE        0x08000000
+
+/**
+ * @brief Receive delay (IFTIMING.RXDELAY) after reset, and the largest setting.
+ */
+#define QSPI_FLASH_RXDELAY_DEFAULT 2
+#define QSPI_FLASH_RXDELAY_MAX     7
+
+/**
+ * @brief Interface timing.
+ */
+typedef struct
+{
+        nrf_qspi_frequency_t sck_freq;  //!< Clock divider.
+        uint8_t              rx_delay;  //!< Sampling delay of read data in 64 MHz cycles.
+} qspi_flash_timing_t;
+
+/**
+ * @brief Serial flash device information.
+ */
+typedef struct
+{
+        uint8_t  read_id[3];    //!< JEDEC identification (0x9F) result.
+        uint32_t size;          //!< Memory size in bytes.
+        uint32_t erase_size;    //!< Erase unit size in bytes.
+        uint32_t erase_sizes;   //!< Supported erase sizes, OR of the sizes in bytes.
+        uint32_t program_size;  //!< Program page size in bytes.
+        bool     erase_suspend; //!< Erase suspend/resume supported (described in SFDP).
+} qspi_flash_info_t;
+
+/**
+ * @brief Flash operation counters.
+ */
+typedef struct
+{
+        uint32_t read_xfers;    //!< Number of QSPI read transactions.
+        uint32_t read_bytes;    //!< Number of bytes read.
+        uint32_t prog_xfers;    //!< Number of QSPI write transactions.
+        uint32_t prog_bytes;    //!< Number of bytes programmed.
+        uint32_t erases;        //!< Number of erase commands.
+        uint32_t erase_bytes;   //!< Number of bytes erased.
+        uint32_t suspends;      //!< Number of erase suspends.
+        uint32_t dpd_entries;   //!< Number of deep power-down entries.
+        uint32_t dpd_wakes;     //!< Number of wake-ups from deep power-down.
+        uint32_t dpd_ms;        //!< Time spent in deep power-down in milliseconds.
+} qspi_flash_stats_t;
+
+/**
+ * @brief Initialize the QSPI peripheral and identify the attached flash.
+ *
+ * @param p_config QSPI driver configuration.
+ *
+ * @retval NRF_SUCCESS               Flash is ready.
+ * @retval NRF_ERROR_NOT_SUPPORTED   Unknown flash or unsupported erase unit size.
+ */
+ret_code_t qspi_flash_init(nrf_drv_qspi_config_t const * p_config);
+
+/**
+ * @brief Release the QSPI peripheral.
+ */
+void qspi_flash_uninit(void);
+
+/**
+ * @brief Get information about the detected flash.
+ *
+ * @return Flash information, valid after a successful @ref qspi_flash_init.
+ */
+qspi_flash_info_t const * qspi_flash_info_get(void);
+
+/**
+ * @brief Read from flash.
+ *
+ * @param p_dst Destination buffer.
+ * @param addr  Flash address (word aligned).
+ * @param size  Number of bytes (multiple of 4).
+ */
+ret_code_t qspi_flash_read(void * p_dst, uint32_t addr, size_t size);
+
+/**
+ * @brief Program erased flash.
+ *
+ * @param p_src Source buffer.
+ * @param addr  Flash address (word aligned).
+ * @param size  Number of bytes (multiple of 4).
+ */
+ret_code_t qspi_flash_program(void const * p_src, uint32_t addr, size_t size);
+
+/**
+ * @brief Erase flash.
+ *
+ * @param addr Address, aligned to @p size.
+ * @param size @ref QSPI_FLASH_ERASE_UNIT_SIZE, a block size from
+ *             @ref qspi_flash_info_t::erase_sizes, or the flash size for chip erase.
+ *
+ * @retval NRF_ERROR_INVALID_ADDR A block or chip erase covers a redirected erase unit.
+ */
+ret_code_t qspi_flash_erase(uint32_t addr, uint32_t size);
+
+/**
+ * @brief Start an erase and return without waiting for it.
+ *
+ * The flash must not be accessed until @ref qspi_flash_busy returns false.
+ *
+ * @param addr See @ref qspi_flash_erase.
+ * @param size See @ref qspi_flash_erase.
+ */
+ret_code_t qspi_flash_erase_start(uint32_t addr, uint32_t size);
+
+/**
+ * @brief Check whether the flash is still busy with an erase or program.
+ *
+ * A suspended erase counts as busy.
+ */
+bool qspi_flash_busy(void);
+
+/**
+ * @brief Suspend the erase in progress, so the flash can be read.
+ *
+ * Only 4 KB, 32 KB and 64 KB erases are suspended.
+ * Returns once the flash is suspended. Only reads are allowed until
+ * @ref qspi_flash_erase_resume, and not from the unit being erased.
+ *
+ * @retval NRF_SUCCESS              Erase suspended (or completed while suspending).
+ * @retval NRF_ERROR_NOT_SUPPORTED  Flash does not describe erase suspend in SFDP.
+ * @retval NRF_ERROR_INVALID_STATE  No erase started, or already suspended.
+ * @retval NRF_ERROR_BUSY           Chip erase in progress, which cannot be suspended, or too
+ *                                  early after the last resume, the erase would not progress.
+ */
+ret_code_t qspi_flash_erase_suspend(void);
+
+/**
+ * @brief Resume a suspended erase.
+ */
+ret_code_t qspi_flash_erase_resume(void);
+
+/**
+ * @brief Get the interface timing in use.
+ */
+void qspi_flash_timing_get(qspi_flash_timing_t * p_timing);
+
+/**
+ * @brief Change the interface timing. The peripheral is initialized again.
+ *
+ * @retval NRF_SUCCESS              Timing applied.
+ * @retval NRF_ERROR_INVALID_PARAM  Receive delay out of range.
+ * @retval NRF_ERROR_BUSY           Erase in progress.
+ */
+ret_code_t qspi_flash_timing_set(qspi_flash_timing_t const * p_timing);
+
+/**
+ * @brief Get the execute-in-place address of a flash range.
+ *
+ * Reads through the pointer are served by the QSPI peripheral (READOC instruction)
+ * and must not overlap an erase or program in progress.
+ *
+ * @param addr Flash address.
+ * @param size Number of bytes.
+ *
+ * @return Pointer into the XIP window, NULL if the range is not mapped (below the
+ *         configured XIP offset or beyond the window) or holds a redirected erase unit.
+ */
+void const * qspi_flash_xip_get(uint32_t addr, size_t size);
+
+/**
+ * @brief Put the flash in deep power-down and disable the peripheral.
+ *
+ * Any later access (read, program, erase, XIP mapping) wakes the flash first.
+ *
+ * @retval NRF_SUCCESS     Flash is in deep power-down.
+ * @retval NRF_ERROR_BUSY  Erase or program in progress.
+ */
+ret_code_t qspi_flash_power_down(void);
+
+/**
+ * @brief Check whether the flash is in deep power-down.
+ */
+bool qspi_flash_powered_down(void);
+
+/**
+ * @brief Get operation counters.
+ *
+ * Also accounts the deep power-down time up to now; call it at least once per
+ * app_timer counter period while powered down.
+ */
+qspi_flash_stats_t const * qspi_flash_stats_get(void);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QSPI_FLASH_H__ */
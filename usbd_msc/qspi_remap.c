@@ -0,0 +1,263 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_remap.h"
+#include "qspi_flash.h"
+#include "app_util.h"
+
+#define NRF_LOG_MODULE_NAME qspi_remap
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+STATIC_ASSERT(QSPI_REMAP_CONFIG_SPARE_UNITS >= 1);
+
+/**
+ * @brief Saved copy magic, "RMAP".
+ */
+#define REMAP_MAGIC         0x50414D52
+
+/**
+ * @brief Number of table copies at the start of the region.
+ */
+#define REMAP_TABLE_UNITS   2
+
+/**
+ * @brief Header of a saved copy, followed by the entries.
+ */
+typedef struct
+{
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t spare_units;   //!< @ref QSPI_REMAP_CONFIG_SPARE_UNITS of the region.
+        uint32_t count;         //!< Number of entries.
+        uint32_t spares_used;   //!< Spares handed out, including failed ones.
+        uint32_t check;         //!< Inverted sum of the words above.
+} remap_header_t;
+
+/**
+ * @brief Redirected erase unit.
+ */
+typedef struct
+{
+        uint32_t eu_idx;    //!< Retired erase unit.
+        uint32_t spare;     //!< Spare unit in its place.
+} remap_entry_t;
+
+STATIC_ASSERT(sizeof(remap_header_t) + QSPI_REMAP_CONFIG_SPARE_UNITS * sizeof(remap_entry_t) <=
+              QSPI_FLASH_ERASE_UNIT_SIZE);
+
+static remap_header_t m_hdr;
+static remap_entry_t  m_entries[QSPI_REMAP_CONFIG_SPARE_UNITS];
+static uint32_t       m_region_addr;
+static bool           m_enabled;
+
+static uint32_t remap_check(remap_header_t const * p_hdr)
+{
+        return ~(p_hdr->magic + p_hdr->seq + p_hdr->spare_units + p_hdr->count + p_hdr->spares_used);
+}
+
+static uint32_t remap_spare_addr(uint32_t spare)
+{
+        return m_region_addr + (REMAP_TABLE_UNITS + spare) * QSPI_FLASH_ERASE_UNIT_SIZE;
+}
+
+/**
+ * @brief Load the newest complete copy of the table.
+ */
+static ret_code_t remap_load(void)
+{
+        remap_header_t hdr;
+        remap_header_t best;
+        uint32_t best_addr = 0;
+        bool found = false;
+
+        for (uint32_t slot = 0; slot < REMAP_TABLE_UNITS; ++slot)
+        {
+                uint32_t addr = m_region_addr + slot * QSPI_FLASH_ERASE_UNIT_SIZE;
+                ret_code_t ret = qspi_flash_read(&hdr, addr, sizeof(hdr));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if ((hdr.magic == REMAP_MAGIC) && (hdr.check == remap_check(&hdr)) &&
+                    (hdr.spare_units == QSPI_REMAP_CONFIG_SPARE_UNITS) &&
+                    (hdr.count <= hdr.spares_used) && (hdr.spares_used <= QSPI_REMAP_CONFIG_SPARE_UNITS) &&
+                    (!found || hdr.seq > best.seq))
+                {
+                        best      = hdr;
+                        best_addr = addr;
+                        found     = true;
+                }
+        }
+
+        if (!found)
+        {
+                return NRF_SUCCESS;
+        }
+
+        if (best.count)
+        {
+                ret_code_t ret = qspi_flash_read(m_entries, best_addr + sizeof(best),
+                                                 best.count * sizeof(remap_entry_t));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        m_hdr = best;
+        if (m_hdr.count)
+        {
+                NRF_LOG_WARNING("%u erase units redirected, %u spares left",
+                                m_hdr.count, QSPI_REMAP_CONFIG_SPARE_UNITS - m_hdr.spares_used);
+        }
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Save the table over the older copy.
+ */
+static ret_code_t remap_save(void)
+{
+        uint32_t addr = m_region_addr + ((m_hdr.seq + 1) % REMAP_TABLE_UNITS) * QSPI_FLASH_ERASE_UNIT_SIZE;
+
+        ret_code_t ret = qspi_flash_erase(addr, QSPI_FLASH_ERASE_UNIT_SIZE);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        m_hdr.magic       = REMAP_MAGIC;
+        m_hdr.seq        += 1;
+        m_hdr.spare_units = QSPI_REMAP_CONFIG_SPARE_UNITS;
+        m_hdr.check       = remap_check(&m_hdr);
+
+        ret = qspi_flash_program(m_entries, addr + sizeof(m_hdr), m_hdr.count * sizeof(remap_entry_t));
+        if (ret == NRF_SUCCESS)
+        {
+                /* Header last, it validates the copy */
+                ret = qspi_flash_program(&m_hdr, addr, sizeof(m_hdr));
+        }
+
+        return ret;
+}
+
+uint32_t qspi_remap_region_size(void)
+{
+        return (REMAP_TABLE_UNITS + QSPI_REMAP_CONFIG_SPARE_UNITS) * QSPI_FLASH_ERASE_UNIT_SIZE;
+}
+
+ret_code_t qspi_remap_init(uint32_t region_addr, uint32_t region_size)
+{
+        memset(&m_hdr, 0, sizeof(m_hdr));
+        m_region_addr = region_addr;
+        m_enabled     = false;
+
+        if (!region_size)
+        {
+                return NRF_SUCCESS;
+        }
+
+        if ((region_size < qspi_remap_region_size()) ||
+            (region_addr % QSPI_FLASH_ERASE_UNIT_SIZE))
+        {
+                return NRF_ERROR_INVALID_PARAM;
+        }
+
+        m_enabled = true;
+        return remap_load();
+}
+
+uint32_t qspi_remap_addr(uint32_t addr, size_t * p_size)
+{
+        uint32_t eu_idx = addr / QSPI_FLASH_ERASE_UNIT_SIZE;
+        uint32_t next   = UINT32_MAX;
+
+        for (uint32_t i = 0; i < m_hdr.count; ++i)
+        {
+                if (m_entries[i].eu_idx == eu_idx)
+                {
+                        uint32_t offset = addr % QSPI_FLASH_ERASE_UNIT_SIZE;
+
+                        if (p_size)
+                        {
+                                *p_size = MIN(*p_size, QSPI_FLASH_ERASE_UNIT_SIZE - offset);
+                        }
+                        return remap_spare_addr(m_entries[i].spare) + offset;
+                }
+
+                if ((m_entries[i].eu_idx > eu_idx) && (m_entries[i].eu_idx < next))
+                {
+                        next = m_entries[i].eu_idx;
+                }
+        }
+
+        /* Up to the next redirected unit */
+        if (p_size && (next != UINT32_MAX))
+        {
+                *p_size = MIN(*p_size, (uint64_t)next * QSPI_FLASH_ERASE_UNIT_SIZE - addr);
+        }
+
+        return addr;
+}
+
+bool qspi_remap_clean(uint32_t addr, size_t size)
+{
+        uint32_t eu_first = addr / QSPI_FLASH_ERASE_UNIT_SIZE;
+        uint32_t eu_end   = (uint32_t)CEIL_DIV((uint64_t)addr + size, QSPI_FLASH_ERASE_UNIT_SIZE);
+
+        for (uint32_t i = 0; i < m_hdr.count; ++i)
+        {
+                if ((m_entries[i].eu_idx >= eu_first) && (m_entries[i].eu_idx < eu_end))
+                {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+ret_code_t qspi_remap_retire(uint32_t eu_idx)
+{
+        if (!m_enabled)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        if (m_hdr.spares_used == QSPI_REMAP_CONFIG_SPARE_UNITS)
+        {
+                NRF_LOG_ERROR("No spare left for erase unit %u", eu_idx);
+                return NRF_ERROR_NO_MEM;
+        }
+
+        uint32_t i = 0;
+        while ((i < m_hdr.count) && (m_entries[i].eu_idx != eu_idx))
+        {
+                i++;
+        }
+
+        m_entries[i].eu_idx = eu_idx;
+        m_entries[i].spare  = m_hdr.spares_used++;
+        if (i == m_hdr.count)
+        {
+                m_hdr.count++;
+        }
+
+        NRF_LOG_WARNING("Erase unit %u redirected to spare %u", eu_idx, m_entries[i].spare);
+        return remap_save();
+}
+
+uint32_t qspi_remap_count_get(void)
+{
+        return m_hdr.count;
+}
+
+uint32_t qspi_remap_spares_get(void)
+{
+        return m_enabled ? QSPI_REMAP_CONFIG_SPARE_UNITS - m_hdr.spares_used : 0;
+}
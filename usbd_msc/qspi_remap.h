@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef QSPI_REMAP_H__
+#define QSPI_REMAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup qspi_remap QSPI flash bad erase unit remapping
+ * @{
+ * @ingroup usbd_msc
+ * @brief Redirects retired erase units to spare units.
+ *
+ * The owner of the flash retires an erase unit which failed to erase or program
+ * with @ref qspi_remap_retire; from then on @ref qspi_flash reads, programs and
+ * erases a spare unit in its place. The table of retired units is saved to a
+ * reserved region holding two copies written alternately, the header of a copy
+ * last, followed by the spare units. A copy torn by a power loss is ignored and
+ * the previous one is loaded.
+ *
+ * Block erases and XIP mappings cannot be redirected, they are refused for ranges
+ * holding a retired unit (@ref qspi_remap_clean).
+ */
+
+/**
+ * @brief Number of spare erase units, at least 1.
+ */
+#ifndef QSPI_REMAP_CONFIG_SPARE_UNITS
+#define QSPI_REMAP_CONFIG_SPARE_UNITS 8
+#endif
+
+/**
+ * @brief Size of the region holding the table copies and the spare units.
+ */
+uint32_t qspi_remap_region_size(void);
+
+/**
+ * @brief Attach the table to a region and load the last saved copy.
+ *
+ * @param region_addr Address of the region, erase unit aligned.
+ * @param region_size Size of the region, 0 to disable remapping.
+ */
+ret_code_t qspi_remap_init(uint32_t region_addr, uint32_t region_size);
+
+/**
+ * @brief Translate a flash address.
+ *
+ * @param addr   Flash address.
+ * @param p_size Size of the access, reduced to the part translated contiguously.
+ *               NULL for an access within one erase unit.
+ *
+ * @return Address to access.
+ */
+uint32_t qspi_remap_addr(uint32_t addr, size_t * p_size);
+
+/**
+ * @brief Check that a flash range holds no retired erase unit.
+ *
+ * @param addr Flash address.
+ * @param size Number of bytes.
+ */
+bool qspi_remap_clean(uint32_t addr, size_t size);
+
+/**
+ * @brief Redirect an erase unit to the next free spare and save the table.
+ *
+ * The spare is not erased. A unit already redirected gets a new spare, the failed
+ * one is not reused. Blocks for the erase of one table copy.
+ *
+ * @param eu_idx Erase unit index.
+ *
+ * @retval NRF_SUCCESS             Unit redirected.
+ * @retval NRF_ERROR_NO_MEM        No spare left.
+ * @retval NRF_ERROR_INVALID_STATE Remapping is disabled.
+ */
+ret_code_t qspi_remap_retire(uint32_t eu_idx);
+
+/**
+ * @brief Get the number of redirected erase units.
+ */
+uint32_t qspi_remap_count_get(void);
+
+/**
+ * @brief Get the number of spare units left.
+ */
+uint32_t qspi_remap_spares_get(void);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QSPI_REMAP_H__ */
@@ -0,0 +1,212 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_sfdp.h"
+
+/**
+ * @brief "SFDP" signature, little endian.
+ */
+#define SFDP_SIGNATURE      0x50444653
+
+/**
+ * @brief Parameter ID of the Basic Flash Parameter Table.
+ */
+#define SFDP_BFPT_ID        0xFF00
+
+/**
+ * @brief Number of BFPT DWORDs defined by JESD216B.
+ */
+#define SFDP_BFPT_DWORDS    16
+
+/**
+ * @brief Number of parameter headers looked at.
+ */
+#define SFDP_MAX_HEADERS    8
+
+/**
+ * @brief Extract bits [hi:lo] of a DWORD.
+ */
+#define SFDP_BITS(dw, hi, lo) (((dw) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+
+/**
+ * @brief BFPT DWORD n (1-based, as in JESD216).
+ */
+#define BFPT(n) (bfpt[(n) - 1])
+
+static uint32_t sfdp_u24(uint8_t const * p)
+{
+        return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+static void sfdp_read_set(qspi_sfdp_read_t * p_read, uint32_t field)
+{
+        /* Field layout: dummy [4:0], mode [7:5], opcode [15:8] */
+        p_read->dummy_clocks = SFDP_BITS(field, 4, 0);
+        p_read->mode_clocks  = SFDP_BITS(field, 7, 5);
+        p_read->opcode       = SFDP_BITS(field, 15, 8);
+}
+
+static void sfdp_erase_set(qspi_sfdp_erase_t * p_erase, uint32_t field)
+{
+        /* Field layout: size exponent [7:0], opcode [15:8] */
+        uint32_t exp = SFDP_BITS(field, 7, 0);
+
+        p_erase->size   = (exp && exp < 32) ? (1u << exp) : 0;
+        p_erase->opcode = SFDP_BITS(field, 15, 8);
+}
+
+ret_code_t qspi_sfdp_parse(qspi_sfdp_read_fn_t read_fn, qspi_sfdp_t * p_sfdp)
+{
+        uint8_t hdr[8];
+        ret_code_t ret;
+
+        memset(p_sfdp, 0, sizeof(*p_sfdp));
+        p_sfdp->qe = QSPI_SFDP_QE_UNKNOWN;
+
+        ret = read_fn(0, hdr, sizeof(hdr));
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        uint32_t signature = hdr[0] | ((uint32_t)hdr[1] << 8) |
+                             ((uint32_t)hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+        if (signature != SFDP_SIGNATURE)
+        {
+                return NRF_ERROR_NOT_FOUND;
+        }
+
+        p_sfdp->minor = hdr[4];
+        p_sfdp->major = hdr[5];
+        uint32_t nph = (uint32_t)hdr[6] + 1;
+
+        /* Pick the newest Basic Flash Parameter Table revision */
+        uint32_t bfpt_ptr = 0;
+        uint32_t bfpt_len = 0;
+        uint16_t bfpt_rev = 0;
+
+        for (uint32_t i = 0; i < nph && i < SFDP_MAX_HEADERS; ++i)
+        {
+                uint8_t ph[8];
+
+                ret = read_fn(8 + 8 * i, ph, sizeof(ph));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                uint16_t id  = ph[0] | ((uint16_t)ph[7] << 8);
+                uint16_t rev = ((uint16_t)ph[2] << 8) | ph[1];
+
+                if ((id == SFDP_BFPT_ID) && (!bfpt_ptr || rev >= bfpt_rev))
+                {
+                        bfpt_len = ph[3];
+                        bfpt_ptr = sfdp_u24(&ph[4]);
+                        bfpt_rev = rev;
+                }
+        }
+
+        if (!bfpt_ptr)
+        {
+                return NRF_ERROR_NOT_FOUND;
+        }
+
+        /* JESD216 mandates at least 9 DWORDs */
+        if (bfpt_len < 9)
+        {
+                return NRF_ERROR_INVALID_DATA;
+        }
+
+        uint32_t bfpt[SFDP_BFPT_DWORDS];
+        memset(bfpt, 0, sizeof(bfpt));
+        if (bfpt_len > SFDP_BFPT_DWORDS)
+        {
+                bfpt_len = SFDP_BFPT_DWORDS;
+        }
+
+        ret = read_fn(bfpt_ptr, bfpt, bfpt_len * sizeof(uint32_t));
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* DWORD 2: density */
+        if (BFPT(2) & (1u << 31))
+        {
+                uint32_t exp = SFDP_BITS(BFPT(2), 30, 0);
+                if (exp < 3 || exp > 34)
+                {
+                        return NRF_ERROR_INVALID_DATA;
+                }
+                p_sfdp->size = (uint32_t)((1ull << exp) / 8);
+        }
+        else
+        {
+                p_sfdp->size = (uint32_t)(((uint64_t)BFPT(2) + 1) / 8);
+        }
+
+        /* DWORD 1: address bytes, 3-byte only (0), 3 or 4 (1), 4-byte only (2) */
+        p_sfdp->addr_4byte = SFDP_BITS(BFPT(1), 18, 17) != 0;
+
+        /* DWORD 1: supported fast reads, DWORD 3/4: their instructions */
+        if (BFPT(1) & (1u << 16))
+        {
+                sfdp_read_set(&p_sfdp->read[QSPI_SFDP_READ_1_1_2], BFPT(4));
+        }
+        if (BFPT(1) & (1u << 20))
+        {
+                sfdp_read_set(&p_sfdp->read[QSPI_SFDP_READ_1_2_2], BFPT(4) >> 16);
+        }
+        if (BFPT(1) & (1u << 22))
+        {
+                sfdp_read_set(&p_sfdp->read[QSPI_SFDP_READ_1_1_4], BFPT(3) >> 16);
+        }
+        if (BFPT(1) & (1u << 21))
+        {
+                sfdp_read_set(&p_sfdp->read[QSPI_SFDP_READ_1_4_4], BFPT(3));
+        }
+
+        /* DWORD 8/9: erase types */
+        sfdp_erase_set(&p_sfdp->erase[0], BFPT(8));
+        sfdp_erase_set(&p_sfdp->erase[1], BFPT(8) >> 16);
+        sfdp_erase_set(&p_sfdp->erase[2], BFPT(9));
+        sfdp_erase_set(&p_sfdp->erase[3], BFPT(9) >> 16);
+
+        /* DWORD 11 (JESD216A): page size, 256 bytes before that */
+        p_sfdp->page_size = 256;
+        if (bfpt_len >= 11)
+        {
+                p_sfdp->page_size = 1u << SFDP_BITS(BFPT(11), 7, 4);
+        }
+
+        /* DWORD 12/13 (JESD216A): erase suspend/resume, bit 31 set when not supported */
+        if ((bfpt_len >= 13) && !(BFPT(12) & (1u << 31)))
+        {
+                static const uint32_t latency_unit_ns[] = { 128, 1000, 8000, 64000 };
+                uint32_t latency_ns = (SFDP_BITS(BFPT(12), 28, 24) + 1) *
+                                      latency_unit_ns[SFDP_BITS(BFPT(12), 30, 29)];
+
+                p_sfdp->suspend.suspend_opcode     = SFDP_BITS(BFPT(13), 31, 24);
+                p_sfdp->suspend.resume_opcode      = SFDP_BITS(BFPT(13), 23, 16);
+                p_sfdp->suspend.suspend_latency_us = (latency_ns + 999) / 1000;
+                p_sfdp->suspend.resume_interval_us = (SFDP_BITS(BFPT(12), 23, 20) + 1) * 64;
+        }
+
+        /* DWORD 15 (JESD216A): Quad Enable requirement */
+        if (bfpt_len >= 15)
+        {
+                p_sfdp->qe = (qspi_sfdp_qe_t)SFDP_BITS(BFPT(15), 22, 20);
+        }
+
+        /* DWORD 16 (JESD216B): how to enter 4-byte addressing */
+        if (bfpt_len >= 16)
+        {
+                p_sfdp->enter_4byte = SFDP_BITS(BFPT(16), 31, 24);
+        }
+
+        return NRF_SUCCESS;
+}
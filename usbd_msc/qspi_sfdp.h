@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef QSPI_SFDP_H__
+#define QSPI_SFDP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup qspi_sfdp JEDEC SFDP parser
+ * @{
+ * @ingroup usbd_msc
+ * @brief Parser of the JESD216 Serial Flash Discoverable Parameters.
+ *
+ * Only the Basic Flash Parameter Table is interpreted. The parser does not touch
+ * hardware; SFDP space is accessed through a read callback, so it can be fed
+ * from the flash or from a captured dump.
+ */
+
+/**
+ * @brief Fast read modes (command-address-data lines).
+ */
+typedef enum
+{
+        QSPI_SFDP_READ_1_1_2,   //!< Dual output.
+        QSPI_SFDP_READ_1_2_2,   //!< Dual I/O.
+        QSPI_SFDP_READ_1_1_4,   //!< Quad output.
+        QSPI_SFDP_READ_1_4_4,   //!< Quad I/O.
+        QSPI_SFDP_READ_COUNT
+} qspi_sfdp_read_mode_t;
+
+/**
+ * @brief Quad Enable requirement (BFPT DWORD 15, bits 22:20).
+ */
+typedef enum
+{
+        QSPI_SFDP_QE_NONE        = 0, //!< No QE bit, or quad mode always available.
+        QSPI_SFDP_QE_SR2_BIT1    = 1, //!< QE is SR2 bit 1, written with 0x01 (two bytes).
+        QSPI_SFDP_QE_SR1_BIT6    = 2, //!< QE is SR1 bit 6, written with 0x01 (one byte).
+        QSPI_SFDP_QE_SR2_BIT7    = 3, //!< QE is SR2 bit 7, read with 0x3F, written with 0x3E.
+        QSPI_SFDP_QE_SR2_BIT1_NC = 4, //!< As @ref QSPI_SFDP_QE_SR2_BIT1, one byte write does not clear SR2.
+        QSPI_SFDP_QE_SR2_BIT1_35 = 5, //!< QE is SR2 bit 1, read with 0x35, written with 0x01 (two bytes).
+        QSPI_SFDP_QE_SR2_BIT1_31 = 6, //!< QE is SR2 bit 1, read with 0x35, written with 0x31.
+        QSPI_SFDP_QE_UNKNOWN     = 0xFF
+} qspi_sfdp_qe_t;
+
+/**
+ * @brief Fast read instruction description.
+ */
+typedef struct
+{
+        uint8_t opcode;         //!< Instruction, 0 if the mode is not supported.
+        uint8_t dummy_clocks;   //!< Dummy clocks.
+        uint8_t mode_clocks;    //!< Mode bit clocks.
+} qspi_sfdp_read_t;
+
+/**
+ * @brief Erase type description.
+ */
+typedef struct
+{
+        uint32_t size;          //!< Erase size in bytes, 0 if not supported.
+        uint8_t  opcode;        //!< Erase instruction.
+} qspi_sfdp_erase_t;
+
+/**
+ * @brief Erase suspend/resume description.
+ */
+typedef struct
+{
+        uint8_t  suspend_opcode;        //!< Erase suspend instruction, 0 if not supported.
+        uint8_t  resume_opcode;         //!< Erase resume instruction.
+        uint32_t suspend_latency_us;    //!< Longest time until an erase is suspended.
+        uint32_t resume_interval_us;    //!< Shortest time from a resume to the next suspend.
+} qspi_sfdp_suspend_t;
+
+/**
+ * @brief Flash parameters discovered from SFDP.
+ */
+typedef struct
+{
+        uint8_t           major;                        //!< SFDP major revision.
+        uint8_t           minor;                        //!< SFDP minor revision.
+        uint32_t          size;                         //!< Memory size in bytes.
+        uint32_t          page_size;                    //!< Program page size in bytes.
+        qspi_sfdp_read_t  read[QSPI_SFDP_READ_COUNT];   //!< Supported fast reads.
+        qspi_sfdp_erase_t erase[4];                     //!< Supported erase types.
+        qspi_sfdp_qe_t    qe;                           //!< Quad Enable requirement.
+        bool              addr_4byte;                   //!< 4-byte addressing supported.
+        uint8_t           enter_4byte;                  //!< Enter 4-byte addressing methods (BFPT DWORD 16 bits 31:24), 0 if not described.
+        qspi_sfdp_suspend_t suspend;                    //!< Erase suspend/resume.
+} qspi_sfdp_t;
+
+/**
+ * @brief Read from the SFDP address space.
+ *
+ * @param addr   SFDP address.
+ * @param p_buff Destination.
+ * @param size   Number of bytes.
+ */
+typedef ret_code_t (* qspi_sfdp_read_fn_t)(uint32_t addr, void * p_buff, size_t size);
+
+/**
+ * @brief Discover flash parameters.
+ *
+ * @param read_fn SFDP space reader.
+ * @param p_sfdp  Discovered parameters.
+ *
+ * @retval NRF_SUCCESS             Parameters discovered.
+ * @retval NRF_ERROR_NOT_FOUND     No SFDP signature or no Basic Flash Parameter Table.
+ * @retval NRF_ERROR_INVALID_DATA  Basic Flash Parameter Table is malformed.
+ */
+ret_code_t qspi_sfdp_parse(qspi_sfdp_read_fn_t read_fn, qspi_sfdp_t * p_sfdp);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QSPI_SFDP_H__ */
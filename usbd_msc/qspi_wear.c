@@ -0,0 +1,322 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_wear.h"
+#include "qspi_flash.h"
+#include "app_timer.h"
+#include "app_util.h"
+
+#define NRF_LOG_MODULE_NAME qspi_wear
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+/**
+ * @brief Saved copy magic, "WEAR".
+ */
+#define WEAR_MAGIC          0x52414557
+
+/**
+ * @brief Offset of the counters in a saved copy, the header takes the first page.
+ */
+#define WEAR_COUNTERS_OFFSET QSPI_FLASH_PAGE_SIZE
+
+/**
+ * @brief app_timer counter frequency.
+ */
+#define WEAR_TICKS_PER_SEC  (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))
+
+/**
+ * @brief Header of a saved copy.
+ */
+typedef struct
+{
+        uint32_t            magic;
+        uint32_t            seq;
+        uint32_t            unit_count;
+        uint32_t            total_erases;
+        uint32_t            prog_bytes_lo;
+        uint32_t            prog_bytes_hi;
+        qspi_wear_latency_t latency[QSPI_WEAR_OP_COUNT];
+} wear_header_t;
+
+STATIC_ASSERT(sizeof(wear_header_t) <= WEAR_COUNTERS_OFFSET);
+
+static uint32_t            m_counts[QSPI_WEAR_CONFIG_MAX_UNITS];
+static wear_header_t       m_hdr;
+static uint32_t            m_unit_count;
+static uint32_t            m_region_addr;
+static uint32_t            m_slot_size;
+static uint32_t            m_unsaved;
+static qspi_wear_op_t      m_erase_op;
+
+static uint32_t wear_ticks_to_us(uint32_t ticks)
+{
+        return (uint32_t)((uint64_t)ticks * 1000000 / WEAR_TICKS_PER_SEC);
+}
+
+static void wear_latency_add(qspi_wear_op_t op, uint32_t ticks)
+{
+        qspi_wear_latency_t * p_lat = &m_hdr.latency[op];
+        uint32_t us = wear_ticks_to_us(ticks);
+
+        if (!p_lat->count++)
+        {
+                p_lat->avg_us = us;
+        }
+        else
+        {
+                p_lat->avg_us = (uint32_t)((int32_t)p_lat->avg_us + ((int32_t)us - (int32_t)p_lat->avg_us) / 8);
+        }
+
+        if (us > p_lat->max_us)
+        {
+                p_lat->max_us = us;
+        }
+}
+
+static uint32_t wear_slot_size(uint32_t unit_count)
+{
+        uint32_t size = WEAR_COUNTERS_OFFSET + MIN(unit_count, QSPI_WEAR_CONFIG_MAX_UNITS) * sizeof(uint32_t);
+
+        return CEIL_DIV(size, QSPI_FLASH_ERASE_UNIT_SIZE) * QSPI_FLASH_ERASE_UNIT_SIZE;
+}
+
+/**
+ * @brief Load the newest complete copy of the save region.
+ */
+static ret_code_t wear_load(void)
+{
+        wear_header_t hdr;
+        uint32_t best_addr = 0;
+        uint32_t best_seq  = 0;
+
+        for (uint32_t slot = 0; slot < 2; ++slot)
+        {
+                uint32_t addr = m_region_addr + slot * m_slot_size;
+                ret_code_t ret = qspi_flash_read(&hdr, addr, sizeof(hdr));
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+
+                if ((hdr.magic == WEAR_MAGIC) && (hdr.unit_count == m_unit_count) &&
+                    (hdr.seq != 0xFFFFFFFF) && (!best_addr || hdr.seq > best_seq))
+                {
+                        best_addr = addr;
+                        best_seq  = hdr.seq;
+                }
+        }
+
+        if (!best_addr)
+        {
+                NRF_LOG_INFO("No saved wear counters");
+                return NRF_SUCCESS;
+        }
+
+        ret_code_t ret = qspi_flash_read(&m_hdr, best_addr, sizeof(m_hdr));
+        if (ret == NRF_SUCCESS)
+        {
+                ret = qspi_flash_read(m_counts, best_addr + WEAR_COUNTERS_OFFSET,
+                                      MIN(m_unit_count, QSPI_WEAR_CONFIG_MAX_UNITS) * sizeof(uint32_t));
+        }
+
+        return ret;
+}
+
+uint32_t qspi_wear_region_size(uint32_t unit_count)
+{
+        return 2 * wear_slot_size(unit_count);
+}
+
+ret_code_t qspi_wear_init(uint32_t unit_count, uint32_t region_addr, uint32_t region_size)
+{
+        /* Counters of the same flash survive uninit/init without a save region */
+        if (unit_count != m_unit_count)
+        {
+                memset(m_counts, 0, sizeof(m_counts));
+                memset(&m_hdr, 0, sizeof(m_hdr));
+                m_unit_count = unit_count;
+        }
+
+        m_region_addr = region_addr;
+        m_slot_size   = 0;
+        m_unsaved     = 0;
+
+        if (!region_size)
+        {
+                return NRF_SUCCESS;
+        }
+
+        if ((region_size < qspi_wear_region_size(unit_count)) ||
+            (region_addr % QSPI_FLASH_ERASE_UNIT_SIZE))
+        {
+                return NRF_ERROR_INVALID_PARAM;
+        }
+
+        m_slot_size = wear_slot_size(unit_count);
+        return wear_load();
+}
+
+void qspi_wear_erase_add(uint32_t addr, uint32_t size)
+{
+        uint32_t first = addr / QSPI_FLASH_ERASE_UNIT_SIZE;
+        uint32_t end   = MIN((addr + size) / QSPI_FLASH_ERASE_UNIT_SIZE, m_unit_count);
+
+        switch (size)
+        {
+        case QSPI_FLASH_ERASE_UNIT_SIZE:
+                m_erase_op = QSPI_WEAR_OP_ERASE_4K;
+                break;
+        case QSPI_FLASH_ERASE_SIZE_32K:
+                m_erase_op = QSPI_WEAR_OP_ERASE_32K;
+                break;
+        case QSPI_FLASH_ERASE_SIZE_64K:
+                m_erase_op = QSPI_WEAR_OP_ERASE_64K;
+                break;
+        default:
+                m_erase_op = QSPI_WEAR_OP_ERASE_CHIP;
+                break;
+        }
+
+        for (uint32_t i = first; i < MIN(end, QSPI_WEAR_CONFIG_MAX_UNITS); ++i)
+        {
+                m_counts[i]++;
+        }
+
+        m_hdr.total_erases += end - MIN(first, end);
+        m_unsaved          += end - MIN(first, end);
+}
+
+void qspi_wear_erase_done(uint32_t ticks)
+{
+        wear_latency_add(m_erase_op, ticks);
+}
+
+void qspi_wear_program_add(uint32_t size, uint32_t ticks)
+{
+        uint64_t bytes = ((uint64_t)m_hdr.prog_bytes_hi << 32 | m_hdr.prog_bytes_lo) + size;
+
+        m_hdr.prog_bytes_lo = (uint32_t)bytes;
+        m_hdr.prog_bytes_hi = (uint32_t)(bytes >> 32);
+        wear_latency_add(QSPI_WEAR_OP_PROGRAM, ticks);
+}
+
+bool qspi_wear_save_due(void)
+{
+        return m_slot_size && (m_unsaved >= QSPI_WEAR_CONFIG_SAVE_ERASES);
+}
+
+bool qspi_wear_unsaved(void)
+{
+        return m_slot_size && m_unsaved;
+}
+
+ret_code_t qspi_wear_save(void)
+{
+        if (!m_slot_size)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        /* Overwrite the older copy */
+        uint32_t addr = m_region_addr + ((m_hdr.seq + 1) % 2) * m_slot_size;
+        ret_code_t ret;
+
+        for (uint32_t off = 0; off < m_slot_size; off += QSPI_FLASH_ERASE_UNIT_SIZE)
+        {
+                ret = qspi_flash_erase(addr + off, QSPI_FLASH_ERASE_UNIT_SIZE);
+                if (ret != NRF_SUCCESS)
+                {
+                        return ret;
+                }
+        }
+
+        m_hdr.magic      = WEAR_MAGIC;
+        m_hdr.seq       += 1;
+        m_hdr.unit_count = m_unit_count;
+        m_unsaved        = 0;
+
+        ret = qspi_flash_program(m_counts, addr + WEAR_COUNTERS_OFFSET,
+                                 MIN(m_unit_count, QSPI_WEAR_CONFIG_MAX_UNITS) * sizeof(uint32_t));
+        if (ret == NRF_SUCCESS)
+        {
+                /* Header last, it validates the copy */
+                ret = qspi_flash_program(&m_hdr, addr, sizeof(m_hdr));
+        }
+
+        return ret;
+}
+
+uint32_t qspi_wear_count_get(uint32_t eu_idx)
+{
+        return (eu_idx < MIN(m_unit_count, QSPI_WEAR_CONFIG_MAX_UNITS)) ? m_counts[eu_idx] : 0;
+}
+
+size_t qspi_wear_hot_spots_get(qspi_wear_hot_spot_t * p_spots, size_t count)
+{
+        size_t found = 0;
+
+        for (uint32_t i = 0; i < MIN(m_unit_count, QSPI_WEAR_CONFIG_MAX_UNITS); ++i)
+        {
+                if (!m_counts[i] || (found == count && m_counts[i] <= p_spots[count - 1].erases))
+                {
+                        continue;
+                }
+
+                /* Insertion into the sorted list, dropping the last entry when full */
+                size_t pos = (found < count) ? found++ : count - 1;
+                while (pos && p_spots[pos - 1].erases < m_counts[i])
+                {
+                        p_spots[pos] = p_spots[pos - 1];
+                        pos--;
+                }
+
+                p_spots[pos].eu_idx = i;
+                p_spots[pos].erases = m_counts[i];
+        }
+
+        return found;
+}
+
+void qspi_wear_life_get(qspi_wear_life_t * p_life)
+{
+        memset(p_life, 0, sizeof(*p_life));
+
+        for (uint32_t i = 0; i < MIN(m_unit_count, QSPI_WEAR_CONFIG_MAX_UNITS); ++i)
+        {
+                if (m_counts[i] > p_life->max_erases)
+                {
+                        p_life->max_erases = m_counts[i];
+                        p_life->max_unit   = i;
+                }
+        }
+
+        p_life->total_erases = m_hdr.total_erases;
+        p_life->prog_bytes   = (uint64_t)m_hdr.prog_bytes_hi << 32 | m_hdr.prog_bytes_lo;
+        p_life->life_used    = (uint32_t)((uint64_t)p_life->max_erases * 1000 / QSPI_WEAR_CONFIG_ENDURANCE);
+
+        if (!p_life->max_erases)
+        {
+                p_life->eol_bytes = UINT64_MAX;
+        }
+        else if (p_life->max_erases >= QSPI_WEAR_CONFIG_ENDURANCE)
+        {
+                p_life->eol_bytes = 0;
+        }
+        else
+        {
+                /* Remaining cycles of the most worn unit at the bytes-per-erase seen so far */
+                p_life->eol_bytes = p_life->prog_bytes *
+                                    (QSPI_WEAR_CONFIG_ENDURANCE - p_life->max_erases) /
+                                    p_life->max_erases;
+        }
+}
+
+qspi_wear_latency_t const * qspi_wear_latency_get(qspi_wear_op_t op)
+{
+        return (op < QSPI_WEAR_OP_COUNT) ? &m_hdr.latency[op] : NULL;
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef QSPI_WEAR_H__
+#define QSPI_WEAR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup qspi_wear QSPI flash wear telemetry
+ * @{
+ * @ingroup usbd_msc
+ * @brief Per erase unit erase counters and program/erase latency statistics.
+ *
+ * @ref qspi_flash reports every erase and program here. The counters are kept in
+ * RAM, one word per erase unit, and saved to a reserved region at the end of the
+ * flash after @ref QSPI_WEAR_CONFIG_SAVE_ERASES erases. The region holds two copies
+ * written alternately; the header of a copy is programmed last, so a copy torn by
+ * a power loss is ignored and the previous one is loaded.
+ */
+
+/**
+ * @brief Save the counters to flash. Without it they start from zero after every reset.
+ */
+#ifndef QSPI_WEAR_CONFIG_PERSIST_ENABLED
+#define QSPI_WEAR_CONFIG_PERSIST_ENABLED 1
+#endif
+
+/**
+ * @brief Number of erase units with a counter.
+ */
+#ifndef QSPI_WEAR_CONFIG_MAX_UNITS
+#define QSPI_WEAR_CONFIG_MAX_UNITS 2048
+#endif
+
+/**
+ * @brief Rated erase cycles of an erase unit, used for the end-of-life projection.
+ */
+#ifndef QSPI_WEAR_CONFIG_ENDURANCE
+#define QSPI_WEAR_CONFIG_ENDURANCE 100000
+#endif
+
+/**
+ * @brief Number of erase units erased between two saves.
+ */
+#ifndef QSPI_WEAR_CONFIG_SAVE_ERASES
+#define QSPI_WEAR_CONFIG_SAVE_ERASES 256
+#endif
+
+/**
+ * @brief Timed flash operations.
+ */
+typedef enum
+{
+        QSPI_WEAR_OP_PROGRAM,   //!< Program transfer.
+        QSPI_WEAR_OP_ERASE_4K,  //!< Sector erase.
+        QSPI_WEAR_OP_ERASE_32K, //!< 32 KB block erase.
+        QSPI_WEAR_OP_ERASE_64K, //!< 64 KB block erase.
+        QSPI_WEAR_OP_ERASE_CHIP,//!< Chip erase.
+        QSPI_WEAR_OP_COUNT
+} qspi_wear_op_t;
+
+/**
+ * @brief Latency of an operation.
+ */
+typedef struct
+{
+        uint32_t count;     //!< Number of operations.
+        uint32_t avg_us;    //!< Moving average (1/8 weight of the last sample) in microseconds.
+        uint32_t max_us;    //!< Longest operation in microseconds.
+} qspi_wear_latency_t;
+
+/**
+ * @brief Erase unit with its erase count.
+ */
+typedef struct
+{
+        uint32_t eu_idx;    //!< Erase unit index.
+        uint32_t erases;    //!< Number of erases.
+} qspi_wear_hot_spot_t;
+
+/**
+ * @brief Wear summary and end-of-life projection.
+ */
+typedef struct
+{
+        uint32_t total_erases;  //!< Erase units erased, all units together.
+        uint32_t max_erases;    //!< Erase count of the most worn unit.
+        uint32_t max_unit;      //!< Most worn erase unit.
+        uint32_t life_used;     //!< Rated endurance used by the most worn unit, per mille.
+        uint64_t prog_bytes;    //!< Bytes programmed.
+        uint64_t eol_bytes;     //!< Bytes which can still be programmed until the most worn unit
+                                //!< reaches @ref QSPI_WEAR_CONFIG_ENDURANCE, at the wear rate so far.
+                                //!< UINT64_MAX if nothing was erased yet.
+} qspi_wear_life_t;
+
+/**
+ * @brief Size of the region the counters of a flash are saved to.
+ *
+ * @param unit_count Number of erase units of the flash.
+ */
+uint32_t qspi_wear_region_size(uint32_t unit_count);
+
+/**
+ * @brief Attach the counters to a flash and load the last saved copy.
+ *
+ * @param unit_count  Number of erase units of the flash.
+ * @param region_addr Address of the save region, erase unit aligned.
+ * @param region_size Size of the save region, 0 to keep the counters in RAM only.
+ */
+ret_code_t qspi_wear_init(uint32_t unit_count, uint32_t region_addr, uint32_t region_size);
+
+/**
+ * @brief Account an erase command.
+ *
+ * @param addr Erased address.
+ * @param size Erase size, the flash size for chip erase.
+ */
+void qspi_wear_erase_add(uint32_t addr, uint32_t size);
+
+/**
+ * @brief Account the completion of the last erase.
+ *
+ * @param ticks Erase time in app_timer ticks.
+ */
+void qspi_wear_erase_done(uint32_t ticks);
+
+/**
+ * @brief Account a program transfer.
+ *
+ * @param size  Bytes programmed.
+ * @param ticks Transfer time in app_timer ticks.
+ */
+void qspi_wear_program_add(uint32_t size, uint32_t ticks);
+
+/**
+ * @brief Check whether enough erases were done since the last save.
+ */
+bool qspi_wear_save_due(void);
+
+/**
+ * @brief Check whether anything was erased since the last save.
+ */
+bool qspi_wear_unsaved(void);
+
+/**
+ * @brief Save the counters to flash. Blocks for the erase of one copy.
+ */
+ret_code_t qspi_wear_save(void);
+
+/**
+ * @brief Get the erase count of an erase unit.
+ */
+uint32_t qspi_wear_count_get(uint32_t eu_idx);
+
+/**
+ * @brief Get the most erased units.
+ *
+ * @param p_spots Most erased units, highest count first.
+ * @param count   Size of @p p_spots.
+ *
+ * @return Number of entries filled, only units erased at least once are reported.
+ */
+size_t qspi_wear_hot_spots_get(qspi_wear_hot_spot_t * p_spots, size_t count);
+
+/**
+ * @brief Get the wear summary and end-of-life projection.
+ */
+void qspi_wear_life_get(qspi_wear_life_t * p_life);
+
+/**
+ * @brief Get latency statistics of an operation.
+ */
+qspi_wear_latency_t const * qspi_wear_latency_get(qspi_wear_op_t op);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QSPI_WEAR_H__ */
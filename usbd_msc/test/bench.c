@@ -0,0 +1,1079 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "app_timer.h"
+#include "blk_test.h"
+#include "block_dev_ftl.h"
+#include "block_dev_lz.h"
+#include "block_dev_part.h"
+#include "block_dev_qspi.h"
+#include "block_dev_stage.h"
+#include "lz_codec.h"
+#include "crc32_fast.h"
+#include "qspi_wear.h"
+
+/* Throughput, wear and latency of the block device stack on the flash simulator,
+ * with the flags of main.c. Times are simulated flash times: CPU time is not
+ * modeled beyond 1 us per app_timer counter read.
+ *
+ * Runs the scenarios named on the command line, all of them without arguments.
+ * The Makefile builds the bench again with other compile-time configurations and
+ * runs the scenarios they change with each, BENCH_CONFIG names the configuration
+ * in the results. */
+
+#define FLASH_SIZE      (2 * 1024 * 1024)
+#define EU_COUNT        (FLASH_SIZE / QSPI_FLASH_ERASE_UNIT_SIZE)
+#define BENCH_BYTES     (1024 * 1024)
+#define REQ_BLOCKS      (4096 / BLK_TEST_BLOCK_SIZE)
+#define TICKS_PER_SEC   (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))
+
+#define APPEND_RECORDS  2000
+#define APPEND_RECORD   50
+#define APPEND_CLUSTER  1024
+#define APPEND_FAT_BLK  1
+#define APPEND_DIR_BLK  33
+#define APPEND_DATA_BLK 65
+
+#define READ_MAX_BLOCKS 64
+
+#define ERASE_READS     64
+#define ERASE_READ_MS   10
+
+#define IDLE_READS      60
+#define IDLE_READ_MS    2000
+
+#define CODEC_RUNS      2000
+#define CRC_RUNS        2000
+
+#define STREAM_GAP_MS   20
+
+#define PRE_ERASE_MS    5000
+
+#define LOG_PART_BYTES  (256 * 1024)
+
+#define WEAK_UNITS      4
+
+#define BURSTS          16
+#define BURST_REQS      16
+#define BURST_IDLE_MS   2000
+#define STAGE_SIZE      (380 * 512)
+
+#ifndef BENCH_CONFIG
+#define BENCH_CONFIG    "default"
+#endif
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_FTL_DEFINE(m_ftl, m_qspi, NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_LZ_DEFINE(m_lz,
+                    NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev),
+                    NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+/* RAM staging buffer of main.c */
+static uint32_t m_stage_buff[STAGE_SIZE / sizeof(uint32_t)];
+
+BLOCK_DEV_STAGE_DEFINE(m_stage,
+                       NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev),
+                       m_stage_buff, sizeof(m_stage_buff),
+                       NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_PART_DISK_DEFINE(m_disk, NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev));
+
+BLOCK_DEV_PART_DEFINE(m_part_log, m_disk, 0, LOG_PART_BYTES / BLK_TEST_BLOCK_SIZE, 0,
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI LOG", "1.00"));
+
+BLOCK_DEV_PART_DEFINE(m_part_user, m_disk, LOG_PART_BYTES / BLK_TEST_BLOCK_SIZE, 0, 0,
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI USER", "1.00"));
+
+/**
+ * @brief State of a run: device under test and counters at its start.
+ */
+typedef struct
+{
+        nrf_block_dev_t const * p_dev;
+        uint64_t                start_us;
+        uint32_t                erases[EU_COUNT];
+} bench_run_t;
+
+/**
+ * @brief Scenario selected by name on the command line.
+ */
+typedef struct
+{
+        char const * p_name;
+        void      (* run)(void);
+} bench_scenario_t;
+
+static bench_run_t m_run;
+static uint32_t    m_buff[MAX(REQ_BLOCKS, 2) * BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+static uint8_t     m_file[APPEND_RECORDS * APPEND_RECORD + BLK_TEST_BLOCK_SIZE];
+static uint32_t    m_req_us[BURSTS * BURST_REQS];
+static uint32_t    m_read_buff[READ_MAX_BLOCKS * BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+static uint32_t bench_ticks_to_us(uint32_t ticks)
+{
+        return (uint32_t)((uint64_t)ticks * 1000000 / TICKS_PER_SEC);
+}
+
+/**
+ * @brief Erased flash, the device initialized over freshly cleared RAM.
+ */
+static void bench_boot(nrf_block_dev_t const * p_dev)
+{
+        flash_sim_reset(FLASH_SIZE, 1);
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_ftl.p_work, 0, sizeof(*m_ftl.p_work));
+        memset(m_lz.p_work, 0, sizeof(*m_lz.p_work));
+        memset(m_stage.p_work, 0, sizeof(*m_stage.p_work));
+        memset(m_part_log.p_work, 0, sizeof(*m_part_log.p_work));
+        memset(m_part_user.p_work, 0, sizeof(*m_part_user.p_work));
+        m_disk_users = 0;
+        CHECK_EQ(nrf_blk_dev_init(p_dev, NULL, NULL), NRF_SUCCESS);
+
+        if (p_dev == &m_ftl.block_dev)
+        {
+                CHECK_EQ(block_dev_ftl_format(&m_ftl), NRF_SUCCESS);
+        }
+        if (p_dev == &m_lz.block_dev)
+        {
+                CHECK_EQ(block_dev_lz_format(&m_lz), NRF_SUCCESS);
+        }
+        m_run.p_dev = p_dev;
+}
+
+static void bench_start(void)
+{
+        for (uint32_t eu = 0; eu < EU_COUNT; ++eu)
+        {
+                m_run.erases[eu] = flash_sim_erase_count(eu);
+        }
+        m_run.start_us = flash_sim_time_us();
+}
+
+/**
+ * @brief Print a result line: throughput, erases and QSPI request latency.
+ *
+ * Latency percentiles are those of the QSPI device requests, which the FTL and
+ * the compressing device issue for the host requests.
+ *
+ * @param write Write latency, otherwise read latency.
+ */
+static void bench_report(char const * p_name, uint32_t bytes, bool write)
+{
+        uint64_t us    = flash_sim_time_us() - m_run.start_us;
+        uint32_t total = 0;
+        uint32_t max   = 0;
+
+        for (uint32_t eu = 0; eu < EU_COUNT; ++eu)
+        {
+                uint32_t erases = flash_sim_erase_count(eu) - m_run.erases[eu];
+                total += erases;
+                max    = MAX(max, erases);
+        }
+
+        qspi_wear_latency_t const * p_program = qspi_wear_latency_get(QSPI_WEAR_OP_PROGRAM);
+        qspi_wear_latency_t const * p_erase   = qspi_wear_latency_get(QSPI_WEAR_OP_ERASE_4K);
+
+        printf("%-12s %-22s %8.4f MB/s %6u erases (max %3u/unit)  %s p50/p90/p99 %6u/%6u/%6u us"
+               "  prog avg %4u us  erase avg %5u us\n",
+               BENCH_CONFIG, p_name,
+               us ? (double)bytes / us : 0.0,
+               total, max, write ? "wr" : "rd",
+               bench_ticks_to_us(block_dev_qspi_latency_get(&m_qspi, write, 50)),
+               bench_ticks_to_us(block_dev_qspi_latency_get(&m_qspi, write, 90)),
+               bench_ticks_to_us(block_dev_qspi_latency_get(&m_qspi, write, 99)),
+               p_program->avg_us, p_erase->avg_us);
+}
+
+static void bench_write(uint32_t blk_id, uint32_t version)
+{
+        for (uint32_t i = 0; i < REQ_BLOCKS; ++i)
+        {
+                blk_test_pattern((uint8_t *)m_buff + i * BLK_TEST_BLOCK_SIZE, blk_id + i, version);
+        }
+        blk_test_write(m_run.p_dev, m_buff, blk_id, REQ_BLOCKS);
+}
+
+/**
+ * @brief Sequential 4 KB writes over the first megabyte, then a barrier.
+ */
+static void bench_seq_write(char const * p_name, nrf_block_dev_t const * p_dev)
+{
+        bench_boot(p_dev);
+        bench_start();
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+}
+
+/**
+ * @brief Sequential 4 KB reads of the first megabyte, written before.
+ */
+static void bench_seq_read(char const * p_name, nrf_block_dev_t const * p_dev)
+{
+        bench_boot(p_dev);
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+
+        bench_start();
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                blk_test_read(p_dev, m_buff, blk_id, REQ_BLOCKS);
+        }
+        bench_report(p_name, BENCH_BYTES, false);
+}
+
+/**
+ * @brief Aligned 4 KB writes at random over the whole device, filled before,
+ *        a barrier every 16 writes as FatFS syncs.
+ */
+static void bench_random_write(char const * p_name, nrf_block_dev_t const * p_dev)
+{
+        bench_boot(p_dev);
+        uint32_t reqs = nrf_blk_dev_geometry(p_dev)->blk_count / REQ_BLOCKS;
+
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+
+        srand(1);
+        bench_start();
+        for (uint32_t i = 0; i < BENCH_BYTES / (REQ_BLOCKS * BLK_TEST_BLOCK_SIZE); ++i)
+        {
+                bench_write((rand() % reqs) * REQ_BLOCKS, 2 + i);
+                if (i % 16 == 15)
+                {
+                        blk_test_barrier(p_dev);
+                }
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+}
+
+/**
+ * @brief The writes of test_write() in main.c: a 50 byte record appended to a file,
+ *        then the file closed, on a small FAT16 volume laid out as f_mkfs does.
+ *
+ * Each record rewrites the last block of the file and the block of its directory
+ * entry, each new 1 KB cluster a FAT block, in three different erase units, and
+ * the close syncs. Bytes past the end of the file are stale, not erased.
+ */
+static void bench_append(void)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+        uint8_t               * p_fat = (uint8_t *)m_buff;
+        uint8_t               * p_dir = p_fat + BLK_TEST_BLOCK_SIZE;
+
+        bench_boot(p_dev);
+        memset(m_buff, 0, sizeof(m_buff));
+        memset(m_file, 0, sizeof(m_file));
+        memcpy(p_dir, "LOG_DATATXT", 11);
+
+        bench_start();
+        for (uint32_t rec = 0; rec < APPEND_RECORDS; ++rec)
+        {
+                uint32_t pos   = rec * APPEND_RECORD;
+                uint32_t first = pos / BLK_TEST_BLOCK_SIZE;
+                uint32_t last  = (pos + APPEND_RECORD - 1) / BLK_TEST_BLOCK_SIZE;
+
+                snprintf((char *)&m_file[pos], APPEND_RECORD + 1,
+                         "1234567890123456789012345678901234567890%u\r\n", 10000000u + rec);
+                blk_test_write(p_dev, &m_file[first * BLK_TEST_BLOCK_SIZE],
+                               APPEND_DATA_BLK + first, last - first + 1);
+
+                uint32_t cluster = (pos + APPEND_RECORD - 1) / APPEND_CLUSTER;
+                if (rec == 0 || cluster != (pos - 1) / APPEND_CLUSTER)
+                {
+                        /* Clusters from 2 on, the new one ends the chain */
+                        uint16_t * p_entry = (uint16_t *)p_fat + 2 + cluster;
+                        p_entry[0] = 0xFFFF;
+                        if (cluster)
+                        {
+                                p_entry[-1] = 2 + cluster;
+                        }
+                        blk_test_write(p_dev, p_fat, APPEND_FAT_BLK, 1);
+                }
+
+                uint32_t size = pos + APPEND_RECORD;
+                memcpy(&p_dir[28], &size, sizeof(size));
+                blk_test_write(p_dev, p_dir, APPEND_DIR_BLK, 1);
+
+                CHECK_EQ(nrf_blk_dev_ioctl(p_dev, NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH, NULL),
+                         NRF_SUCCESS);
+        }
+        bench_report("qspi append 50B+sync", APPEND_RECORDS * APPEND_RECORD, true);
+}
+
+/**
+ * @brief Let the main loop of main.c run the background work for a while.
+ */
+static void bench_idle(uint32_t ms)
+{
+        uint64_t end = flash_sim_time_us() + (uint64_t)ms * 1000;
+
+        while (flash_sim_time_us() < end)
+        {
+                if (!block_dev_qspi_process(&m_qspi) && !block_dev_stage_process(&m_stage))
+                {
+                        flash_sim_idle(1000);
+                }
+        }
+}
+
+static int bench_cmp_u32(void const * p_a, void const * p_b)
+{
+        uint32_t a = *(uint32_t const *)p_a;
+        uint32_t b = *(uint32_t const *)p_b;
+
+        return (a > b) - (a < b);
+}
+
+/**
+ * @brief Bursts of 64 KB written in 4 KB requests over a written megabyte, as a
+ *        host copying a file, each followed by 2 s of idle time, then a barrier.
+ *
+ * Latency is that of the host requests. The copy of a request into the stage is
+ * not modeled, only flash time. The idle time lets the stage drain; with less of
+ * it the stage fills up and its writes wait for the flash as without it.
+ */
+static void bench_burst(char const * p_name, nrf_block_dev_t const * p_dev)
+{
+        bench_boot(p_dev);
+        for (uint32_t req = 0; req < BURSTS * BURST_REQS; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+        bench_idle(BURST_IDLE_MS);
+
+        bench_start();
+        for (uint32_t req = 0; req < BURSTS * BURST_REQS; ++req)
+        {
+                uint64_t start = flash_sim_time_us();
+
+                bench_write(req * REQ_BLOCKS, 2);
+                m_req_us[req] = (uint32_t)(flash_sim_time_us() - start);
+                if (req % BURST_REQS == BURST_REQS - 1)
+                {
+                        bench_idle(BURST_IDLE_MS);
+                }
+        }
+        blk_test_barrier(p_dev);
+
+        uint32_t total = 0;
+        for (uint32_t eu = 0; eu < EU_COUNT; ++eu)
+        {
+                total += flash_sim_erase_count(eu) - m_run.erases[eu];
+        }
+
+        qsort(m_req_us, ARRAY_SIZE(m_req_us), sizeof(m_req_us[0]), bench_cmp_u32);
+        printf("%-12s %-22s host wr p50/p99/max %6u/%6u/%6u us  %6u erases\n",
+               BENCH_CONFIG, p_name,
+               m_req_us[ARRAY_SIZE(m_req_us) * 50 / 100],
+               m_req_us[ARRAY_SIZE(m_req_us) * 99 / 100],
+               m_req_us[ARRAY_SIZE(m_req_us) - 1], total);
+}
+
+static void bench_bursts(void)
+{
+        bench_burst("qspi burst write", &m_qspi.block_dev);
+        bench_burst("stage burst write", &m_stage.block_dev);
+}
+
+static void bench_stack(void)
+{
+        bench_seq_write("qspi seq write", &m_qspi.block_dev);
+        bench_seq_read("qspi seq read", &m_qspi.block_dev);
+        bench_random_write("qspi random 4K write", &m_qspi.block_dev);
+        bench_seq_write("ftl seq write", &m_ftl.block_dev);
+        bench_random_write("ftl random 4K write", &m_ftl.block_dev);
+        bench_seq_write("lz seq write", &m_lz.block_dev);
+        bench_random_write("lz random 4K write", &m_lz.block_dev);
+}
+
+/**
+ * @brief Reads of the first megabyte in requests of 1, 8 and 64 blocks: a request
+ *        is one burst transfer per run of blocks the cache does not hold, single
+ *        block requests are what reading block by block costs.
+ */
+static void bench_reads(void)
+{
+        static const uint32_t sizes[] = { 1, REQ_BLOCKS, READ_MAX_BLOCKS };
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(sizes); ++i)
+        {
+                char name[32];
+
+                /* With 4 KB blocks a request of 4 KB is a single block one */
+                if (i && (sizes[i] == sizes[i - 1]))
+                {
+                        continue;
+                }
+
+                bench_boot(p_dev);
+                for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+                {
+                        bench_write(blk_id, 1);
+                }
+                blk_test_barrier(p_dev);
+
+                bench_start();
+                for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += sizes[i])
+                {
+                        blk_test_read(p_dev, m_read_buff, blk_id, sizes[i]);
+                }
+                snprintf(name, sizeof(name), "qspi read %uB reqs", sizes[i] * BLK_TEST_BLOCK_SIZE);
+                bench_report(name, BENCH_BYTES, false);
+        }
+}
+
+/**
+ * @brief A megabyte discarded, discarded again as a second mkfs or pre-erase pass
+ *        does, then written: with the blank unit bitmap the second discard skips
+ *        the units and the write programs them without reading them first.
+ *
+ * @param bitmap Keep the bitmap, otherwise clear it after the first discard.
+ */
+static void bench_blank(char const * p_name, bool bitmap)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+
+        bench_boot(p_dev);
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+        CHECK_EQ(block_dev_qspi_discard(&m_qspi, 0, BENCH_BYTES / BLK_TEST_BLOCK_SIZE), NRF_SUCCESS);
+        if (!bitmap)
+        {
+                memset(m_qspi.p_work->erased, 0, sizeof(m_qspi.p_work->erased));
+        }
+
+        bench_start();
+        CHECK_EQ(block_dev_qspi_discard(&m_qspi, 0, BENCH_BYTES / BLK_TEST_BLOCK_SIZE), NRF_SUCCESS);
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 2);
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+}
+
+static void bench_blanks(void)
+{
+        bench_blank("qspi discard+write", true);
+        bench_blank("no bitmap disc+write", false);
+}
+
+/**
+ * @brief A written megabyte rewritten with content which only clears bits, as a
+ *        flag or counter area is updated, and with new content: the first is
+ *        programmed in place, the second needs erases.
+ *
+ * @param clear Clear the low bit of every word, otherwise write a new version.
+ */
+static void bench_rewrite(char const * p_name, bool clear)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+
+        bench_boot(p_dev);
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+
+        bench_start();
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+        {
+                for (uint32_t i = 0; i < REQ_BLOCKS; ++i)
+                {
+                        blk_test_pattern((uint8_t *)m_buff + i * BLK_TEST_BLOCK_SIZE, blk_id + i,
+                                         clear ? 1 : 2);
+                }
+                for (uint32_t i = 0; clear && (i < ARRAY_SIZE(m_buff)); ++i)
+                {
+                        m_buff[i] &= ~1u;
+                }
+                blk_test_write(p_dev, m_buff, blk_id, REQ_BLOCKS);
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+}
+
+static void bench_rewrites(void)
+{
+        bench_rewrite("qspi rewrite 1->0", true);
+        bench_rewrite("qspi rewrite new", false);
+}
+
+/**
+ * @brief The whole device written, then discarded as fatfs_mkfs() in main.c does
+ *        before formatting, with the erase sizes of the flash and with 4 KB only.
+ *
+ * @param erase_sizes Erase sizes the flash reports, 0 for those of the simulator.
+ */
+static void bench_mkfs(char const * p_name, uint32_t erase_sizes)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+
+        bench_boot(p_dev);
+        uint32_t blk_count = nrf_blk_dev_geometry(p_dev)->blk_count;
+
+        if (erase_sizes)
+        {
+                flash_sim_info()->erase_sizes = erase_sizes;
+        }
+        for (uint32_t blk_id = 0; blk_id + REQ_BLOCKS <= blk_count; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+
+        bench_start();
+        CHECK_EQ(block_dev_qspi_discard(&m_qspi, 0, blk_count), NRF_SUCCESS);
+        bench_report(p_name, blk_count * BLK_TEST_BLOCK_SIZE, true);
+}
+
+static void bench_mkfses(void)
+{
+        bench_mkfs("qspi discard all", 0);
+        bench_mkfs("4K erase discard all", QSPI_FLASH_ERASE_UNIT_SIZE);
+}
+
+/**
+ * @brief Random 4 KB reads of the first megabyte while the rest of the device is
+ *        discarded in the background, 10 ms apart, with and without erase suspend.
+ *
+ * Latency is that of the host requests, as in bench_burst().
+ *
+ * @param suspend The flash reports erase suspend.
+ */
+static void bench_erase_read(char const * p_name, bool suspend)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+
+        bench_boot(p_dev);
+        flash_sim_info()->erase_suspend = suspend;
+        uint32_t blk_count = nrf_blk_dev_geometry(p_dev)->blk_count;
+        uint32_t reqs      = BENCH_BYTES / BLK_TEST_BLOCK_SIZE / REQ_BLOCKS;
+
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+        CHECK_EQ(block_dev_qspi_discard_start(&m_qspi, BENCH_BYTES / BLK_TEST_BLOCK_SIZE,
+                                              blk_count - BENCH_BYTES / BLK_TEST_BLOCK_SIZE),
+                 NRF_SUCCESS);
+
+        srand(1);
+        for (uint32_t i = 0; i < ERASE_READS; ++i)
+        {
+                uint64_t start = flash_sim_time_us();
+
+                blk_test_read(p_dev, m_buff, (rand() % reqs) * REQ_BLOCKS, REQ_BLOCKS);
+                m_req_us[i] = (uint32_t)(flash_sim_time_us() - start);
+                bench_idle(ERASE_READ_MS);
+        }
+
+        qsort(m_req_us, ERASE_READS, sizeof(m_req_us[0]), bench_cmp_u32);
+        printf("%-12s %-22s host rd p50/p99/max %6u/%6u/%6u us  %6u suspends\n",
+               BENCH_CONFIG, p_name,
+               m_req_us[ERASE_READS * 50 / 100], m_req_us[ERASE_READS * 99 / 100],
+               m_req_us[ERASE_READS - 1], qspi_flash_stats_get()->suspends);
+}
+
+static void bench_erase_reads(void)
+{
+        bench_erase_read("qspi erase read", true);
+        bench_erase_read("no suspend erase read", false);
+}
+
+/**
+ * @brief Random 4 KB reads of the first megabyte, each followed by 2 s of idle time
+ *        as a host polling a file: time the flash spends in deep power-down and the
+ *        latency of the reads which wake it.
+ */
+static void bench_idle_reads(void)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+        uint32_t                reqs  = BENCH_BYTES / BLK_TEST_BLOCK_SIZE / REQ_BLOCKS;
+
+        bench_boot(p_dev);
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+        bench_idle(IDLE_READ_MS);
+
+        uint64_t start  = flash_sim_time_us();
+        uint32_t dpd_ms = qspi_flash_stats_get()->dpd_ms;
+
+        srand(1);
+        for (uint32_t i = 0; i < IDLE_READS; ++i)
+        {
+                uint64_t req_start = flash_sim_time_us();
+
+                blk_test_read(p_dev, m_buff, (rand() % reqs) * REQ_BLOCKS, REQ_BLOCKS);
+                m_req_us[i] = (uint32_t)(flash_sim_time_us() - req_start);
+                bench_idle(IDLE_READ_MS);
+        }
+
+        uint32_t total_ms = (uint32_t)((flash_sim_time_us() - start) / 1000);
+
+        qsort(m_req_us, IDLE_READS, sizeof(m_req_us[0]), bench_cmp_u32);
+        printf("%-12s %-22s host rd p50/p99/max %6u/%6u/%6u us  %3u%% in deep power-down\n",
+               BENCH_CONFIG, "qspi idle 4K read",
+               m_req_us[IDLE_READS * 50 / 100], m_req_us[IDLE_READS * 99 / 100],
+               m_req_us[IDLE_READS - 1],
+               (qspi_flash_stats_get()->dpd_ms - dpd_ms) * 100 / total_ms);
+}
+
+/**
+ * @brief Host CPU time in nanoseconds.
+ */
+static uint64_t bench_cpu_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Compress and decompress one unit of the compressing device many times.
+ *
+ * Reports the stored size and the host CPU throughput of both directions; the
+ * throughput only compares inputs and codec changes, the target is a Cortex-M4.
+ */
+static void bench_codec(char const * p_name, uint8_t const * p_unit)
+{
+        static uint8_t  packed[BLOCK_DEV_LZ_CONFIG_UNIT_SIZE];
+        static uint8_t  unpacked[BLOCK_DEV_LZ_CONFIG_UNIT_SIZE];
+        static uint16_t table[LZ_CODEC_HASH_SIZE];
+        size_t          size = 0;
+
+        uint64_t start = bench_cpu_ns();
+        for (uint32_t run = 0; run < CODEC_RUNS; ++run)
+        {
+                size = lz_codec_compress(p_unit, BLOCK_DEV_LZ_CONFIG_UNIT_SIZE, packed, sizeof(packed),
+                                         table);
+        }
+        uint64_t compress_ns = bench_cpu_ns() - start;
+
+        start = bench_cpu_ns();
+        for (uint32_t run = 0; size && (run < CODEC_RUNS); ++run)
+        {
+                CHECK_EQ(lz_codec_decompress(packed, size, unpacked, sizeof(unpacked)),
+                         BLOCK_DEV_LZ_CONFIG_UNIT_SIZE);
+        }
+        uint64_t decompress_ns = bench_cpu_ns() - start;
+        CHECK(!size || (memcmp(p_unit, unpacked, BLOCK_DEV_LZ_CONFIG_UNIT_SIZE) == 0));
+
+        printf("%-12s %-22s stored %3u%%  host compress %7.1f MB/s  decompress %7.1f MB/s\n",
+               BENCH_CONFIG, p_name,
+               (uint32_t)((size ? size : BLOCK_DEV_LZ_CONFIG_UNIT_SIZE) * 100 /
+                          BLOCK_DEV_LZ_CONFIG_UNIT_SIZE),
+               compress_ns ? (double)BLOCK_DEV_LZ_CONFIG_UNIT_SIZE * CODEC_RUNS * 1000 / compress_ns : 0.0,
+               (size && decompress_ns) ?
+               (double)BLOCK_DEV_LZ_CONFIG_UNIT_SIZE * CODEC_RUNS * 1000 / decompress_ns : 0.0);
+}
+
+/**
+ * @brief The codec on the bench patterns, on the log of test_write() and on
+ *        random data, then the device itself against the plain QSPI device.
+ */
+static void bench_lz(void)
+{
+        static uint8_t unit[BLOCK_DEV_LZ_CONFIG_UNIT_SIZE];
+
+        for (uint32_t i = 0; i < sizeof(unit) / BLK_TEST_BLOCK_SIZE; ++i)
+        {
+                blk_test_pattern(&unit[i * BLK_TEST_BLOCK_SIZE], i, 1);
+        }
+        bench_codec("lz codec pattern", unit);
+
+        for (uint32_t pos = 0; pos < sizeof(unit); pos += APPEND_RECORD)
+        {
+                char record[APPEND_RECORD + 1];
+
+                snprintf(record, sizeof(record), "1234567890123456789012345678901234567890%u\r\n",
+                         10000000u + pos / APPEND_RECORD);
+                memcpy(&unit[pos], record, MIN(APPEND_RECORD, sizeof(unit) - pos));
+        }
+        bench_codec("lz codec log records", unit);
+
+        srand(1);
+        for (uint32_t i = 0; i < sizeof(unit); ++i)
+        {
+                unit[i] = (uint8_t)rand();
+        }
+        bench_codec("lz codec random", unit);
+
+        bench_seq_write("qspi seq write", &m_qspi.block_dev);
+        bench_seq_write("lz seq write", &m_lz.block_dev);
+        printf("%-12s %-22s stored %3u%% of the host bytes\n", BENCH_CONFIG, "lz stored",
+               (uint32_t)((uint64_t)block_dev_lz_stats_get(&m_lz)->stored_bytes * 100 /
+                          block_dev_lz_stats_get(&m_lz)->host_bytes));
+}
+
+/**
+ * @brief CRC32 one bit at a time, as crc32_compute() of the SDK.
+ */
+static uint32_t bench_crc32_bitwise(uint32_t crc, uint8_t const * p_data, size_t size)
+{
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i)
+        {
+                crc ^= p_data[i];
+                for (uint32_t bit = 0; bit < 8; ++bit)
+                {
+                        crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+                }
+        }
+        return ~crc;
+}
+
+/**
+ * @brief CRC of an erase unit of data by crc32_fast()
+ *        and by the bitwise loop it replaced; both must agree.
+ */
+static void bench_crcs(void)
+{
+        static uint8_t data[QSPI_FLASH_ERASE_UNIT_SIZE];
+        uint32_t       fast    = 0;
+        uint32_t       bitwise = 0;
+
+        for (uint32_t i = 0; i < sizeof(data) / BLK_TEST_BLOCK_SIZE; ++i)
+        {
+                blk_test_pattern(&data[i * BLK_TEST_BLOCK_SIZE], i, 2);
+        }
+
+        uint64_t start = bench_cpu_ns();
+        for (uint32_t run = 0; run < CRC_RUNS; ++run)
+        {
+                fast = crc32_fast(fast, data, sizeof(data));
+        }
+        uint64_t fast_ns = bench_cpu_ns() - start;
+
+        start = bench_cpu_ns();
+        for (uint32_t run = 0; run < CRC_RUNS; ++run)
+        {
+                bitwise = bench_crc32_bitwise(bitwise, data, sizeof(data));
+        }
+        uint64_t bitwise_ns = bench_cpu_ns() - start;
+        CHECK_EQ(fast, bitwise);
+
+        printf("%-12s %-22s host %8.1f MB/s\n", BENCH_CONFIG, "crc32 slice-by-8",
+               fast_ns ? (double)sizeof(data) * CRC_RUNS * 1000 / fast_ns : 0.0);
+        printf("%-12s %-22s host %8.1f MB/s\n", BENCH_CONFIG, "crc32 bitwise",
+               bitwise_ns ? (double)sizeof(data) * CRC_RUNS * 1000 / bitwise_ns : 0.0);
+}
+
+/**
+ * @brief A written megabyte freed by the file system, then written again as a
+ *        stream of 4 KB requests with a host gap after each, as a file copied
+ *        over USB: the gaps give the device time to erase ahead of the stream.
+ */
+static void bench_stream(void)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+        block_dev_unmap_req_t   unmap = { .blk_id = 0, .blk_count = BENCH_BYTES / BLK_TEST_BLOCK_SIZE };
+        uint32_t                reqs  = BENCH_BYTES / (REQ_BLOCKS * BLK_TEST_BLOCK_SIZE);
+        uint64_t                busy  = 0;
+
+        bench_boot(p_dev);
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+        CHECK_EQ(nrf_blk_dev_ioctl(p_dev, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap), NRF_SUCCESS);
+        bench_idle(STREAM_GAP_MS);
+
+        bench_start();
+        uint32_t aheads = block_dev_qspi_stats_get(&m_qspi)->erase_aheads;
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                uint64_t start = flash_sim_time_us();
+
+                bench_write(req * REQ_BLOCKS, 2);
+                m_req_us[req] = (uint32_t)(flash_sim_time_us() - start);
+                busy         += m_req_us[req];
+                bench_idle(STREAM_GAP_MS);
+        }
+        uint64_t start = flash_sim_time_us();
+        blk_test_barrier(p_dev);
+        busy += flash_sim_time_us() - start;
+
+        qsort(m_req_us, reqs, sizeof(m_req_us[0]), bench_cmp_u32);
+        printf("%-12s %-22s %8.4f MB/s busy  host wr p50/p99/max %6u/%6u/%6u us  %4u erased ahead\n",
+               BENCH_CONFIG, "qspi stream write", (double)BENCH_BYTES / busy,
+               m_req_us[reqs * 50 / 100], m_req_us[reqs * 99 / 100], m_req_us[reqs - 1],
+               block_dev_qspi_stats_get(&m_qspi)->erase_aheads - aheads);
+}
+
+/**
+ * @brief A deleted megabyte written again by the host, as after fatfs_pre_erase() in
+ *        main.c discarded its free units while the device was idle, and without.
+ *
+ * The pass itself reads the FAT through FatFS, which the bench does not build: the
+ * unmap and the background discard it ends with stand in for it.
+ */
+static void bench_pre_erase(char const * p_name, bool pre_erase)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+        block_dev_unmap_req_t   unmap = { .blk_id = 0, .blk_count = BENCH_BYTES / BLK_TEST_BLOCK_SIZE };
+
+        bench_boot(p_dev);
+        for (uint32_t blk_id = 0; blk_id < unmap.blk_count; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 1);
+        }
+        blk_test_barrier(p_dev);
+        if (pre_erase)
+        {
+                CHECK_EQ(nrf_blk_dev_ioctl(p_dev, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap), NRF_SUCCESS);
+                CHECK_EQ(block_dev_qspi_discard_start(&m_qspi, unmap.blk_id, unmap.blk_count), NRF_SUCCESS);
+        }
+        bench_idle(PRE_ERASE_MS);
+
+        bench_start();
+        for (uint32_t blk_id = 0; blk_id < unmap.blk_count; blk_id += REQ_BLOCKS)
+        {
+                bench_write(blk_id, 2);
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+}
+
+static void bench_pre_erases(void)
+{
+        bench_pre_erase("qspi pre-erased write", true);
+        bench_pre_erase("qspi used write", false);
+}
+
+/**
+ * @brief Random 4 KB writes to the first half of a full FTL device, with the
+ *        second half unmapped first, as a file system freeing it, and without:
+ *        garbage collection copies only the blocks still mapped.
+ */
+static void bench_ftl_trim(char const * p_name, bool trim)
+{
+        nrf_block_dev_t const * p_dev = &m_ftl.block_dev;
+
+        bench_boot(p_dev);
+        uint32_t reqs = nrf_blk_dev_geometry(p_dev)->blk_count / REQ_BLOCKS;
+
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                bench_write(req * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_dev);
+        if (trim)
+        {
+                block_dev_unmap_req_t unmap = {
+                        .blk_id    = reqs / 2 * REQ_BLOCKS,
+                        .blk_count = (reqs - reqs / 2) * REQ_BLOCKS,
+                };
+
+                CHECK_EQ(nrf_blk_dev_ioctl(p_dev, BLOCK_DEV_IOCTL_REQ_UNMAP, &unmap), NRF_SUCCESS);
+        }
+
+        srand(1);
+        bench_start();
+        uint32_t gc_blocks = block_dev_ftl_stats_get(&m_ftl)->gc_blocks;
+        for (uint32_t i = 0; i < BENCH_BYTES / (REQ_BLOCKS * BLK_TEST_BLOCK_SIZE); ++i)
+        {
+                bench_write((rand() % (reqs / 2)) * REQ_BLOCKS, 2 + i);
+                if (i % 16 == 15)
+                {
+                        blk_test_barrier(p_dev);
+                }
+        }
+        blk_test_barrier(p_dev);
+        bench_report(p_name, BENCH_BYTES, true);
+        printf("%-12s %-22s %6u blocks copied by gc\n", BENCH_CONFIG, p_name,
+               block_dev_ftl_stats_get(&m_ftl)->gc_blocks - gc_blocks);
+}
+
+static void bench_ftl_trims(void)
+{
+        bench_ftl_trim("ftl trimmed write", true);
+        bench_ftl_trim("ftl full write", false);
+}
+
+/**
+ * @brief Reads of the user partition while the log partition takes a 4 KB write
+ *        after every read, as the device logs while the host reads its files; the
+ *        log wraps around its partition.
+ */
+static void bench_part_reads(void)
+{
+        nrf_block_dev_t const * p_user = &m_part_user.block_dev;
+        nrf_block_dev_t const * p_log  = &m_part_log.block_dev;
+        uint32_t                reqs   = BENCH_BYTES / (REQ_BLOCKS * BLK_TEST_BLOCK_SIZE);
+        uint32_t                log    = LOG_PART_BYTES / (REQ_BLOCKS * BLK_TEST_BLOCK_SIZE);
+
+        bench_boot(p_user);
+        CHECK_EQ(nrf_blk_dev_init(p_log, NULL, NULL), NRF_SUCCESS);
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                m_run.p_dev = p_user;
+                bench_write(req * REQ_BLOCKS, 1);
+                m_run.p_dev = p_log;
+                bench_write(req % log * REQ_BLOCKS, 1);
+        }
+        blk_test_barrier(p_user);
+
+        bench_start();
+        for (uint32_t req = 0; req < reqs; ++req)
+        {
+                uint64_t start = flash_sim_time_us();
+
+                blk_test_read(p_user, m_buff, req * REQ_BLOCKS, REQ_BLOCKS);
+                m_req_us[req] = (uint32_t)(flash_sim_time_us() - start);
+                bench_write(req % log * REQ_BLOCKS, 2 + req);
+        }
+        blk_test_barrier(p_log);
+
+        qsort(m_req_us, reqs, sizeof(m_req_us[0]), bench_cmp_u32);
+        printf("%-12s %-22s host rd p50/p99/max %6u/%6u/%6u us\n", BENCH_CONFIG, "part read + log write",
+               m_req_us[reqs * 50 / 100], m_req_us[reqs * 99 / 100], m_req_us[reqs - 1]);
+}
+
+/**
+ * @brief A partition against the QSPI device under it, then both partitions in use.
+ */
+static void bench_parts(void)
+{
+        bench_seq_write("qspi seq write", &m_qspi.block_dev);
+        bench_seq_write("part seq write", &m_part_user.block_dev);
+        bench_seq_read("qspi seq read", &m_qspi.block_dev);
+        bench_seq_read("part seq read", &m_part_user.block_dev);
+        bench_part_reads();
+}
+
+/**
+ * @brief Sequential writes of a megabyte in which some units fail the read back,
+ *        then the megabyte written again once they are retired, against healthy
+ *        flash: retiring costs the failed write-back again on a spare, a retired
+ *        unit costs nothing after that.
+ *
+ * @param weak Number of units of the megabyte made weak.
+ */
+static void bench_remap(char const * p_name, uint32_t weak)
+{
+        nrf_block_dev_t const * p_dev = &m_qspi.block_dev;
+        char                    name[32];
+
+        bench_boot(p_dev);
+        for (uint32_t i = 0; i < weak; ++i)
+        {
+                flash_sim_weak_set((i + 1) * (BENCH_BYTES / QSPI_FLASH_ERASE_UNIT_SIZE) / (weak + 1), true);
+        }
+
+        for (uint32_t version = 1; version <= 2; ++version)
+        {
+                uint32_t errors = block_dev_qspi_stats_get(&m_qspi)->verify_errors;
+
+                bench_start();
+                for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; blk_id += REQ_BLOCKS)
+                {
+                        bench_write(blk_id, version);
+                }
+                blk_test_barrier(p_dev);
+                snprintf(name, sizeof(name), "%s %s", p_name, (version == 1) ? "write" : "rewrite");
+                bench_report(name, BENCH_BYTES, true);
+                printf("%-12s %-22s %6u units retired\n", BENCH_CONFIG, name,
+                       block_dev_qspi_stats_get(&m_qspi)->verify_errors - errors);
+        }
+
+        for (uint32_t blk_id = 0; blk_id < BENCH_BYTES / BLK_TEST_BLOCK_SIZE; ++blk_id)
+        {
+                blk_test_read(p_dev, m_buff, blk_id, 1);
+                blk_test_pattern(m_read_buff, blk_id, 2);
+                CHECK(memcmp(m_buff, m_read_buff, BLK_TEST_BLOCK_SIZE) == 0);
+        }
+}
+
+static void bench_remaps(void)
+{
+        bench_remap("qspi weak", WEAK_UNITS);
+        bench_remap("qspi healthy", 0);
+}
+
+static bench_scenario_t const m_scenarios[] =
+{
+        { "stack",   bench_stack       },
+        { "read",    bench_reads       },
+        { "blank",   bench_blanks      },
+        { "clear",   bench_rewrites    },
+        { "mkfs",    bench_mkfses      },
+        { "suspend", bench_erase_reads },
+        { "dpd",     bench_idle_reads  },
+        { "lz",      bench_lz          },
+        { "crc",     bench_crcs        },
+        { "append",  bench_append      },
+        { "burst",   bench_bursts      },
+        { "stream",  bench_stream      },
+        { "pre",     bench_pre_erases  },
+        { "trim",    bench_ftl_trims   },
+        { "part",    bench_parts       },
+        { "remap",   bench_remaps      },
+};
+
+int main(int argc, char ** argv)
+{
+        if (argc < 2)
+        {
+                for (uint32_t i = 0; i < ARRAY_SIZE(m_scenarios); ++i)
+                {
+                        m_scenarios[i].run();
+                }
+                return 0;
+        }
+
+        for (int arg = 1; arg < argc; ++arg)
+        {
+                uint32_t i = 0;
+                while (i < ARRAY_SIZE(m_scenarios) && strcmp(argv[arg], m_scenarios[i].p_name))
+                {
+                        ++i;
+                }
+                if (i == ARRAY_SIZE(m_scenarios))
+                {
+                        fprintf(stderr, "unknown scenario %s\n", argv[arg]);
+                        return 1;
+                }
+                m_scenarios[i].run();
+        }
+        return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BLK_TEST_H__
+#define BLK_TEST_H__
+
+/* Block device helpers of the power-loss tests: synchronous requests, block
+ * patterns, and the expected content of every block across power cuts */
+
+#include <setjmp.h>
+#include <string.h>
+
+#include "test.h"
+#include "flash_sim.h"
+#include "nrf_block_dev.h"
+#include "block_dev_barrier.h"
+#include "block_dev_unmap.h"
+
+/* Block size of the devices under test, the bench also runs with 4 KB blocks */
+#ifndef BLK_TEST_BLOCK_SIZE
+#define BLK_TEST_BLOCK_SIZE 512
+#endif
+
+/**
+ * @brief Versions of one block: the durable one and the one written since the last sync.
+ */
+typedef struct
+{
+        uint16_t durable;       //!< Version on flash at the last sync, 0 for never written.
+        uint16_t pending;       //!< Version written since, 0 for none.
+        bool     trimmed;       //!< Durable version unmapped, any content is valid until a
+                                //!< pending version is found on flash.
+} blk_test_state_t;
+
+static inline void blk_test_write(nrf_block_dev_t const * p_dev, void const * p_buff,
+                                  uint32_t blk_id, uint32_t blk_count)
+{
+        nrf_block_req_t req = { .p_buff = (void *)p_buff, .blk_id = blk_id, .blk_count = blk_count };
+
+        CHECK_EQ(nrf_blk_dev_write_req(p_dev, &req), NRF_SUCCESS);
+}
+
+static inline void blk_test_read(nrf_block_dev_t const * p_dev, void * p_buff,
+                                 uint32_t blk_id, uint32_t blk_count)
+{
+        nrf_block_req_t req = { .p_buff = p_buff, .blk_id = blk_id, .blk_count = blk_count };
+
+        CHECK_EQ(nrf_blk_dev_read_req(p_dev, &req), NRF_SUCCESS);
+}
+
+static inline void blk_test_barrier(nrf_block_dev_t const * p_dev)
+{
+        CHECK_EQ(nrf_blk_dev_ioctl(p_dev, BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER, NULL), NRF_SUCCESS);
+}
+
+static inline void blk_test_unmap(nrf_block_dev_t const * p_dev, uint32_t blk_id, uint32_t blk_count)
+{
+        block_dev_unmap_req_t req = { .blk_id = blk_id, .blk_count = blk_count };
+
+        CHECK_EQ(nrf_blk_dev_ioctl(p_dev, BLOCK_DEV_IOCTL_REQ_UNMAP, &req), NRF_SUCCESS);
+}
+
+/**
+ * @brief Fill a block with the pattern of a version; its second half is a repeated
+ *        record so that the pattern compresses to about half.
+ */
+static inline void blk_test_pattern(void * p_buff, uint32_t blk_id, uint32_t version)
+{
+        uint32_t * p_words = p_buff;
+        uint32_t   x       = (blk_id * 0x9E3779B9) ^ (version * 0x85EBCA6B) ^ 0x5BD1E995;
+
+        for (uint32_t i = 0; i < BLK_TEST_BLOCK_SIZE / sizeof(uint32_t); ++i)
+        {
+                if (i >= BLK_TEST_BLOCK_SIZE / sizeof(uint32_t) / 2)
+                {
+                        p_words[i] = (blk_id << 16) | version;
+                        continue;
+                }
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                p_words[i] = x;
+        }
+}
+
+/**
+ * @brief Check that a block read back holds one of the versions allowed by its state.
+ */
+static inline bool blk_test_match(void const * p_buff, uint32_t blk_id, blk_test_state_t const * p_state)
+{
+        uint32_t expect[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        if (p_state->trimmed)
+        {
+                return true;
+        }
+
+        if (p_state->durable)
+        {
+                blk_test_pattern(expect, blk_id, p_state->durable);
+        }
+        else
+        {
+                memset(expect, 0xFF, sizeof(expect));
+        }
+        if (memcmp(p_buff, expect, sizeof(expect)) == 0)
+        {
+                return true;
+        }
+
+        if (p_state->pending)
+        {
+                blk_test_pattern(expect, blk_id, p_state->pending);
+                return memcmp(p_buff, expect, sizeof(expect)) == 0;
+        }
+        return false;
+}
+
+/**
+ * @brief Write a new version of a block, pending until the next sync.
+ */
+static inline void blk_test_update(nrf_block_dev_t const * p_dev, blk_test_state_t * p_states,
+                                   uint32_t blk_id, uint16_t version)
+{
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        /* One pending version per block, a sync in between otherwise */
+        CHECK(p_states[blk_id].pending == 0);
+        blk_test_pattern(buff, blk_id, version);
+        blk_test_write(p_dev, buff, blk_id, 1);
+        p_states[blk_id].pending = version;
+}
+
+/**
+ * @brief Record a completed sync: pending versions are durable.
+ */
+static inline void blk_test_synced(blk_test_state_t * p_states, uint32_t blk_count)
+{
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                if (p_states[i].pending)
+                {
+                        p_states[i].durable = p_states[i].pending;
+                        p_states[i].pending = 0;
+                        p_states[i].trimmed = false;
+                }
+        }
+}
+
+/**
+ * @brief Record an unmap: the blocks may read anything until written again.
+ */
+static inline void blk_test_trimmed(nrf_block_dev_t const * p_dev, blk_test_state_t * p_states,
+                                    uint32_t blk_id, uint32_t blk_count)
+{
+        blk_test_unmap(p_dev, blk_id, blk_count);
+        for (uint32_t i = blk_id; i < blk_id + blk_count; ++i)
+        {
+                CHECK(p_states[i].pending == 0);
+                p_states[i].trimmed = true;
+        }
+}
+
+/**
+ * @brief Read every block back and check it against its state.
+ */
+static inline void blk_test_verify(nrf_block_dev_t const * p_dev, blk_test_state_t const * p_states,
+                                   uint32_t blk_count)
+{
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                blk_test_read(p_dev, buff, i, 1);
+                if (!blk_test_match(buff, i, &p_states[i]))
+                {
+                        fprintf(stderr, "block %u: not version %u or %u\n",
+                                i, p_states[i].durable, p_states[i].pending);
+                        exit(1);
+                }
+        }
+}
+
+/**
+ * @brief After a reboot, each block keeps the version it was found with.
+ */
+static inline void blk_test_settle(nrf_block_dev_t const * p_dev, blk_test_state_t * p_states,
+                                   uint32_t blk_count)
+{
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t expect[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        for (uint32_t i = 0; i < blk_count; ++i)
+        {
+                if (p_states[i].pending)
+                {
+                        blk_test_read(p_dev, buff, i, 1);
+                        blk_test_pattern(expect, i, p_states[i].pending);
+                        if (memcmp(buff, expect, sizeof(buff)) == 0)
+                        {
+                                p_states[i].durable = p_states[i].pending;
+                                p_states[i].trimmed = false;
+                        }
+                        p_states[i].pending = 0;
+                }
+        }
+}
+
+/**
+ * @brief Run a workload with the power cut at its @p cut-th flash command.
+ *
+ * @retval true  The power was cut, the stack has to be booted again.
+ * @retval false The workload completed before.
+ */
+static inline bool blk_test_cut_run(void (* workload)(void), uint32_t cut)
+{
+        static jmp_buf jump;
+
+        if (setjmp(jump))
+        {
+                return true;
+        }
+
+        flash_sim_cut_arm(cut, &jump);
+        workload();
+        flash_sim_cut_arm(0, NULL);
+        return false;
+}
+
+/**
+ * @brief Number of flash commands of a workload.
+ */
+static inline uint32_t blk_test_ops(void (* workload)(void))
+{
+        uint32_t ops = flash_sim_ops_get();
+
+        workload();
+        return flash_sim_ops_get() - ops;
+}
+
+/**
+ * @brief Cut points spread over the commands of a workload, one per run.
+ */
+static inline uint32_t blk_test_cut_point(uint32_t run, uint32_t runs, uint32_t ops)
+{
+        return 1 + (uint32_t)((uint64_t)(ops - 3) * run / runs) + (run % 3);
+}
+
+#endif /* BLK_TEST_H__ */
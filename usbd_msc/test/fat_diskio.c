@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include "ff.h"
+#include "diskio.h"
+
+#include "fat_diskio.h"
+#include "block_dev_unmap.h"
+#include "qspi_flash.h"
+
+static nrf_block_dev_t const * mp_dev;
+static DSTATUS                 m_status = STA_NOINIT;
+
+void fat_diskio_set(nrf_block_dev_t const * p_dev)
+{
+        mp_dev   = p_dev;
+        m_status = STA_NOINIT;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+        if (pdrv || !mp_dev)
+        {
+                return STA_NOINIT;
+        }
+
+        m_status = (nrf_blk_dev_init(mp_dev, NULL, NULL) == NRF_SUCCESS) ? 0 : STA_NOINIT;
+        return m_status;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+        return pdrv ? STA_NOINIT : m_status;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE * buff, DWORD sector, UINT count)
+{
+        nrf_block_req_t req = { .p_buff = buff, .blk_id = sector, .blk_count = count };
+
+        if (pdrv || m_status)
+        {
+                return RES_NOTRDY;
+        }
+        return (nrf_blk_dev_read_req(mp_dev, &req) == NRF_SUCCESS) ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_write(BYTE pdrv, BYTE const * buff, DWORD sector, UINT count)
+{
+        nrf_block_req_t req = { .p_buff = (void *)buff, .blk_id = sector, .blk_count = count };
+
+        if (pdrv || m_status)
+        {
+                return RES_NOTRDY;
+        }
+        return (nrf_blk_dev_write_req(mp_dev, &req) == NRF_SUCCESS) ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff)
+{
+        nrf_block_dev_geometry_t const * p_geo;
+
+        if (pdrv || m_status)
+        {
+                return RES_NOTRDY;
+        }
+
+        p_geo = nrf_blk_dev_geometry(mp_dev);
+        switch (cmd)
+        {
+        case CTRL_SYNC:
+                return (nrf_blk_dev_ioctl(mp_dev, NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH, NULL) ==
+                        NRF_SUCCESS) ? RES_OK : RES_ERROR;
+        case GET_SECTOR_COUNT:
+                *(DWORD *)buff = p_geo->blk_count;
+                return RES_OK;
+        case GET_SECTOR_SIZE:
+                *(WORD *)buff = p_geo->blk_size;
+                return RES_OK;
+        case GET_BLOCK_SIZE:
+                /* Erase unit in sectors, f_mkfs aligns the data area to it */
+                *(DWORD *)buff = QSPI_FLASH_ERASE_UNIT_SIZE / p_geo->blk_size;
+                return RES_OK;
+#if FF_USE_TRIM
+        case CTRL_TRIM:
+        {
+                DWORD const * p_range = buff;
+                block_dev_unmap_req_t req = {
+                        .blk_id    = p_range[0],
+                        .blk_count = p_range[1] - p_range[0] + 1,
+                };
+
+                return (nrf_blk_dev_ioctl(mp_dev, BLOCK_DEV_IOCTL_REQ_UNMAP, &req) ==
+                        NRF_SUCCESS) ? RES_OK : RES_ERROR;
+        }
+#endif
+        default:
+                return RES_PARERR;
+        }
+}
+
+#if !FF_FS_NORTC && !FF_FS_READONLY
+DWORD get_fattime(void)
+{
+        /* 2020-01-01 00:00:00 */
+        return ((DWORD)(2020 - 1980) << 25) | (1u << 21) | (1u << 16);
+}
+#endif
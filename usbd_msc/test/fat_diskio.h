@@ -0,0 +1,21 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef FAT_DISKIO_H__
+#define FAT_DISKIO_H__
+
+/* FatFS disk I/O of the host tests: drive 0 is a block device of the stack */
+
+#include "nrf_block_dev.h"
+
+/**
+ * @brief Set the block device of drive 0.
+ *
+ * disk_initialize initializes it without event handler, so that requests complete
+ * before returning, as the SDK diskio_blkdev port waits for them on the target.
+ */
+void fat_diskio_set(nrf_block_dev_t const * p_dev);
+
+#endif /* FAT_DISKIO_H__ */
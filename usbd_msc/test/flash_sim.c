@@ -0,0 +1,645 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash_sim.h"
+#include "qspi_flash.h"
+#include "qspi_remap.h"
+#include "qspi_wear.h"
+#include "app_timer.h"
+
+/**
+ * @brief JEDEC ID reported, MX25R6435F.
+ */
+#define SIM_READ_ID             { 0xC2, 0x28, 0x17 }
+
+/**
+ * @brief Time charged for an app_timer counter read, so that polling loops progress.
+ */
+#define SIM_CNT_READ_NS         1000
+
+#define SIM_TICKS_PER_SEC       (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))
+
+static const flash_sim_timing_t m_default_timing = {
+        .read_ns_per_byte = 125,
+        .cmd_ns           = 1000,
+        .poll_ns          = 2000,
+        .page_program_us  = 850,
+        .erase_4k_us      = 40000,
+        .erase_32k_us     = 120000,
+        .erase_64k_us     = 150000,
+        .erase_chip_us    = 35000000,
+        .suspend_us       = 20,
+        .wake_us          = 35,
+};
+
+static uint8_t *           m_mem;
+static uint32_t *          m_erase_counts;
+static uint8_t *           m_weak;
+static qspi_flash_info_t   m_info;
+static qspi_flash_stats_t  m_stats;
+static flash_sim_stats_t   m_sim_stats;
+static flash_sim_timing_t  m_timing;
+static qspi_flash_timing_t m_if_timing;
+static uint64_t            m_now_ns;
+static uint32_t            m_seed;
+
+static bool                m_powered;
+static bool                m_dpd;
+static uint64_t            m_dpd_ns;
+static uint64_t            m_dpd_total_ns;
+
+static bool                m_erase_pending;
+static bool                m_suspended;
+static uint32_t            m_erase_addr;
+static uint32_t            m_erase_size;
+static uint64_t            m_erase_start_ns;
+static uint64_t            m_erase_end_ns;
+static uint64_t            m_erase_left_ns;
+
+static uint32_t            m_ops;
+static uint32_t            m_cut_at;
+static jmp_buf *           m_p_jump;
+
+static void sim_fatal(char const * p_what, uint32_t addr, size_t size)
+{
+        fprintf(stderr, "flash_sim: %s at 0x%x size 0x%zx\n", p_what, addr, size);
+        abort();
+}
+
+static uint32_t sim_random(void)
+{
+        /* xorshift32 */
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 17;
+        m_seed ^= m_seed << 5;
+        return m_seed;
+}
+
+static void sim_advance(uint64_t ns)
+{
+        m_now_ns += ns;
+}
+
+static uint32_t sim_ticks(uint64_t ns)
+{
+        return (uint32_t)(ns * SIM_TICKS_PER_SEC / 1000000000ull);
+}
+
+/**
+ * @brief Transfer time of @p size bytes at the configured clock divider.
+ */
+static uint64_t sim_xfer_ns(size_t size)
+{
+        return m_timing.cmd_ns +
+               (uint64_t)size * m_timing.read_ns_per_byte * (m_if_timing.sck_freq + 1) / 2;
+}
+
+static void sim_erase_finish(void)
+{
+        memset(m_mem + m_erase_addr, 0xFF, m_erase_size);
+        for (uint32_t i = 0; i < m_erase_size / QSPI_FLASH_ERASE_UNIT_SIZE; ++i)
+        {
+                m_erase_counts[m_erase_addr / QSPI_FLASH_ERASE_UNIT_SIZE + i]++;
+        }
+
+        m_erase_pending = false;
+        m_suspended     = false;
+        m_sim_stats.busy_us += (m_erase_end_ns - m_erase_start_ns) / 1000;
+        qspi_wear_erase_done(sim_ticks(m_erase_end_ns - m_erase_start_ns));
+}
+
+/**
+ * @brief Cut the power: tear the running erase and leave through the caller's jmp_buf.
+ */
+static void sim_power_cut(void)
+{
+        if (m_erase_pending)
+        {
+                for (uint32_t i = 0; i < m_erase_size; ++i)
+                {
+                        m_mem[m_erase_addr + i] |= (uint8_t)sim_random();
+                }
+                m_erase_pending = false;
+                m_suspended     = false;
+                m_sim_stats.torn_erases++;
+        }
+
+        jmp_buf * p_jump = m_p_jump;
+
+        m_cut_at  = 0;
+        m_p_jump  = NULL;
+        m_powered = false;
+        m_sim_stats.cuts++;
+        longjmp(*p_jump, 1);
+}
+
+/**
+ * @brief Count a program or erase command, true if the power is to be cut at it.
+ */
+static bool sim_op_cut(void)
+{
+        m_ops++;
+        return m_cut_at && (m_ops == m_cut_at);
+}
+
+static void sim_wake(void)
+{
+        if (m_dpd)
+        {
+                sim_advance(m_timing.wake_us * 1000ull);
+                m_dpd_total_ns += m_now_ns - m_dpd_ns;
+                m_dpd = false;
+                m_stats.dpd_wakes++;
+        }
+}
+
+/**
+ * @brief Check an access against the flash state; the stack must not touch a busy flash.
+ */
+static ret_code_t sim_access_check(uint32_t addr, size_t size, bool read)
+{
+        if ((size % sizeof(uint32_t)) || (addr % sizeof(uint32_t)))
+        {
+                return NRF_ERROR_INVALID_LENGTH;
+        }
+        if (!m_powered)
+        {
+                return NRF_ERROR_INTERNAL;
+        }
+        if ((uint64_t)addr + size > m_info.size)
+        {
+                sim_fatal("access past the end", addr, size);
+        }
+        if (m_erase_pending && !(read && m_suspended))
+        {
+                sim_fatal("access during an erase", addr, size);
+        }
+        if (m_erase_pending &&
+            (addr < m_erase_addr + m_erase_size) && (addr + size > m_erase_addr))
+        {
+                sim_fatal("read of the suspended erase range", addr, size);
+        }
+
+        sim_wake();
+        return NRF_SUCCESS;
+}
+
+void flash_sim_reset(uint32_t size, uint32_t seed)
+{
+        if ((size % QSPI_FLASH_ERASE_SIZE_64K) || (size > QSPI_FLASH_ADDR24_SIZE))
+        {
+                sim_fatal("unsupported size", 0, size);
+        }
+
+        free(m_mem);
+        free(m_erase_counts);
+        free(m_weak);
+        m_mem          = malloc(size);
+        m_erase_counts = calloc(size / QSPI_FLASH_ERASE_UNIT_SIZE, sizeof(uint32_t));
+        m_weak         = calloc(size / QSPI_FLASH_ERASE_UNIT_SIZE, 1);
+        if (!m_mem || !m_erase_counts || !m_weak)
+        {
+                sim_fatal("out of memory", 0, size);
+        }
+        memset(m_mem, 0xFF, size);
+
+        m_info = (qspi_flash_info_t) {
+                .read_id       = SIM_READ_ID,
+                .size          = size,
+                .erase_size    = QSPI_FLASH_ERASE_UNIT_SIZE,
+                .erase_sizes   = QSPI_FLASH_ERASE_UNIT_SIZE | QSPI_FLASH_ERASE_SIZE_32K |
+                                 QSPI_FLASH_ERASE_SIZE_64K,
+                .program_size  = QSPI_FLASH_PAGE_SIZE,
+                .erase_suspend = true,
+        };
+
+        memset(&m_stats, 0, sizeof(m_stats));
+        memset(&m_sim_stats, 0, sizeof(m_sim_stats));
+        m_timing       = m_default_timing;
+        m_now_ns       = 0;
+        m_seed         = seed ? seed : 1;
+        m_ops          = 0;
+        m_cut_at       = 0;
+        m_p_jump       = NULL;
+        m_dpd_total_ns = 0;
+        flash_sim_power_on();
+}
+
+flash_sim_timing_t const * flash_sim_timing_get(void)
+{
+        return &m_timing;
+}
+
+void flash_sim_timing_set(flash_sim_timing_t const * p_timing)
+{
+        m_timing = *p_timing;
+}
+
+uint64_t flash_sim_time_us(void)
+{
+        return m_now_ns / 1000;
+}
+
+void flash_sim_idle(uint32_t us)
+{
+        sim_advance(us * 1000ull);
+}
+
+uint32_t flash_sim_ops_get(void)
+{
+        return m_ops;
+}
+
+void flash_sim_cut_arm(uint32_t ops, jmp_buf * p_jump)
+{
+        m_cut_at = ops ? m_ops + ops : 0;
+        m_p_jump = ops ? p_jump : NULL;
+}
+
+void flash_sim_power_on(void)
+{
+        m_powered       = true;
+        m_dpd           = false;
+        m_erase_pending = false;
+        m_suspended     = false;
+}
+
+void flash_sim_weak_set(uint32_t eu_idx, bool weak)
+{
+        m_weak[eu_idx] = weak;
+}
+
+uint32_t flash_sim_erase_count(uint32_t eu_idx)
+{
+        return m_erase_counts[eu_idx];
+}
+
+flash_sim_stats_t const * flash_sim_stats_get(void)
+{
+        return &m_sim_stats;
+}
+
+uint8_t * flash_sim_mem(void)
+{
+        return m_mem;
+}
+
+qspi_flash_info_t * flash_sim_info(void)
+{
+        return &m_info;
+}
+
+uint32_t app_timer_cnt_get(void)
+{
+        sim_advance(SIM_CNT_READ_NS);
+        return sim_ticks(m_now_ns) & APP_TIMER_MAX_CNT_VAL;
+}
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from)
+{
+        return (ticks_to - ticks_from) & APP_TIMER_MAX_CNT_VAL;
+}
+
+ret_code_t qspi_flash_init(nrf_drv_qspi_config_t const * p_config)
+{
+        if (!m_mem || !m_powered)
+        {
+                return NRF_ERROR_INTERNAL;
+        }
+
+        /* The last erase of a previous session completes before the ID is read */
+        if (m_erase_pending)
+        {
+                sim_advance(m_erase_end_ns > m_now_ns ? m_erase_end_ns - m_now_ns : 0);
+                sim_erase_finish();
+        }
+
+        m_if_timing.sck_freq = p_config->phy_if.sck_freq;
+        m_if_timing.rx_delay = QSPI_FLASH_RXDELAY_DEFAULT;
+        m_dpd                = false;
+        return NRF_SUCCESS;
+}
+
+void qspi_flash_uninit(void)
+{
+        if (m_erase_pending && !m_suspended)
+        {
+                sim_advance(m_erase_end_ns > m_now_ns ? m_erase_end_ns - m_now_ns : 0);
+                sim_erase_finish();
+        }
+}
+
+qspi_flash_info_t const * qspi_flash_info_get(void)
+{
+        return &m_info;
+}
+
+ret_code_t qspi_flash_read(void * p_dst, uint32_t addr, size_t size)
+{
+        uint8_t * p_buff = p_dst;
+
+        ret_code_t ret = sim_access_check(addr, size, true);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        while (size)
+        {
+                size_t chunk = MIN(size, QSPI_FLASH_MAX_XFER_SIZE);
+                uint32_t phys = qspi_remap_addr(addr, &chunk);
+
+                memcpy(p_buff, m_mem + phys, chunk);
+                sim_advance(sim_xfer_ns(chunk));
+                m_stats.read_xfers++;
+                m_stats.read_bytes += chunk;
+
+                p_buff += chunk;
+                addr   += chunk;
+                size   -= chunk;
+        }
+
+        return NRF_SUCCESS;
+}
+
+/**
+ * @brief Program time of @p size bytes within a page: an eighth fixed, the rest per byte.
+ */
+static uint64_t sim_program_ns(size_t size)
+{
+        uint64_t page_ns = m_timing.page_program_us * 1000ull;
+
+        return page_ns / 8 + page_ns * 7 / 8 * size / QSPI_FLASH_PAGE_SIZE;
+}
+
+ret_code_t qspi_flash_program(void const * p_src, uint32_t addr, size_t size)
+{
+        uint8_t const * p_buff = p_src;
+
+        ret_code_t ret = sim_access_check(addr, size, false);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        /* A cut stops the transfer part way, the last byte half programmed */
+        bool   cut  = sim_op_cut();
+        size_t torn = cut ? sim_random() % size : size;
+
+        while (size)
+        {
+                size_t chunk = MIN(size, QSPI_FLASH_MAX_XFER_SIZE);
+                uint32_t phys = qspi_remap_addr(addr, &chunk);
+                uint64_t busy_ns = 0;
+
+                /* The peripheral splits the transfer at page boundaries */
+                for (size_t done = 0; done < chunk; )
+                {
+                        size_t page_left = QSPI_FLASH_PAGE_SIZE - ((phys + done) % QSPI_FLASH_PAGE_SIZE);
+                        size_t n = MIN(page_left, chunk - done);
+
+                        busy_ns += sim_program_ns(n);
+                        done    += n;
+                }
+
+                bool weak = m_weak[phys / QSPI_FLASH_ERASE_UNIT_SIZE];
+                for (size_t i = 0; i < chunk; ++i)
+                {
+                        uint8_t data = p_buff[i];
+
+                        if (i == torn)
+                        {
+                                m_mem[phys + i] &= data | (uint8_t)sim_random();
+                                m_sim_stats.torn_programs++;
+                                sim_power_cut();
+                        }
+                        m_mem[phys + i] &= weak ? (data | 0x01) : data;
+                }
+
+                sim_advance(sim_xfer_ns(chunk) + busy_ns);
+                m_sim_stats.busy_us += busy_ns / 1000;
+                m_sim_stats.programs++;
+                m_sim_stats.weak_programs += weak;
+                m_stats.prog_xfers++;
+                m_stats.prog_bytes += chunk;
+                qspi_wear_program_add(chunk, sim_ticks(busy_ns));
+
+                p_buff += chunk;
+                addr   += chunk;
+                size   -= chunk;
+                torn   -= MIN(torn, chunk);
+        }
+
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase_start(uint32_t addr, uint32_t size)
+{
+        uint64_t erase_us;
+
+        /* Only a single erase unit can be redirected */
+        if (size == QSPI_FLASH_ERASE_UNIT_SIZE)
+        {
+                addr = qspi_remap_addr(addr, NULL);
+        }
+        else if (!qspi_remap_clean(addr, size))
+        {
+                return NRF_ERROR_INVALID_ADDR;
+        }
+
+        if (!m_powered)
+        {
+                return NRF_ERROR_INTERNAL;
+        }
+        if (m_erase_pending)
+        {
+                sim_fatal("erase during an erase", addr, size);
+        }
+
+        switch (size)
+        {
+                case QSPI_FLASH_ERASE_UNIT_SIZE:
+                        erase_us = m_timing.erase_4k_us;
+                        break;
+
+                case QSPI_FLASH_ERASE_SIZE_32K:
+                        erase_us = m_timing.erase_32k_us;
+                        break;
+
+                case QSPI_FLASH_ERASE_SIZE_64K:
+                        erase_us = m_timing.erase_64k_us;
+                        break;
+
+                default:
+                        if (size != m_info.size)
+                        {
+                                sim_fatal("unsupported erase size", addr, size);
+                        }
+                        erase_us = m_timing.erase_chip_us;
+                        break;
+        }
+        if ((addr % size) || ((uint64_t)addr + size > m_info.size))
+        {
+                sim_fatal("misaligned erase", addr, size);
+        }
+
+        sim_wake();
+        sim_advance(sim_xfer_ns(0));
+        m_erase_pending  = true;
+        m_suspended      = false;
+        m_erase_addr     = addr;
+        m_erase_size     = size;
+        m_erase_start_ns = m_now_ns;
+        m_erase_end_ns   = m_now_ns + erase_us * 1000;
+        m_stats.erases++;
+        m_stats.erase_bytes += size;
+        qspi_wear_erase_add(addr, size);
+
+        if (sim_op_cut())
+        {
+                sim_power_cut();
+        }
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase(uint32_t addr, uint32_t size)
+{
+        ret_code_t ret = qspi_flash_erase_start(addr, size);
+        if (ret != NRF_SUCCESS)
+        {
+                return ret;
+        }
+
+        while (qspi_flash_busy())
+        {
+                /* Wait for WIP to clear */
+        }
+        return NRF_SUCCESS;
+}
+
+bool qspi_flash_busy(void)
+{
+        if (m_dpd || !m_powered)
+        {
+                return false;
+        }
+        if (m_suspended)
+        {
+                return true;
+        }
+
+        sim_advance(m_timing.poll_ns);
+        if (m_erase_pending && (m_now_ns >= m_erase_end_ns))
+        {
+                sim_erase_finish();
+        }
+        return m_erase_pending;
+}
+
+ret_code_t qspi_flash_erase_suspend(void)
+{
+        if (!m_info.erase_suspend)
+        {
+                return NRF_ERROR_NOT_SUPPORTED;
+        }
+        if (!m_erase_pending || m_suspended)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+        if ((m_erase_size != QSPI_FLASH_ERASE_UNIT_SIZE) &&
+            (m_erase_size != QSPI_FLASH_ERASE_SIZE_32K) &&
+            (m_erase_size != QSPI_FLASH_ERASE_SIZE_64K))
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        /* Suspended, or the erase completed meanwhile and the resume is a no-op */
+        sim_advance(m_timing.suspend_us * 1000ull);
+        m_suspended     = true;
+        m_erase_left_ns = (m_erase_end_ns > m_now_ns) ? m_erase_end_ns - m_now_ns : 0;
+        m_stats.suspends++;
+        return NRF_SUCCESS;
+}
+
+ret_code_t qspi_flash_erase_resume(void)
+{
+        if (!m_suspended)
+        {
+                return NRF_ERROR_INVALID_STATE;
+        }
+
+        /* Time spent suspended is not erase time */
+        sim_advance(sim_xfer_ns(0));
+        m_erase_start_ns += m_now_ns - (m_erase_end_ns - m_erase_left_ns);
+        m_erase_end_ns    = m_now_ns + m_erase_left_ns;
+        m_suspended       = false;
+        return NRF_SUCCESS;
+}
+
+void qspi_flash_timing_get(qspi_flash_timing_t * p_timing)
+{
+        *p_timing = m_if_timing;
+}
+
+ret_code_t qspi_flash_timing_set(qspi_flash_timing_t const * p_timing)
+{
+        if (p_timing->rx_delay > QSPI_FLASH_RXDELAY_MAX)
+        {
+                return NRF_ERROR_INVALID_PARAM;
+        }
+        if (m_erase_pending)
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        m_if_timing = *p_timing;
+        return NRF_SUCCESS;
+}
+
+void const * qspi_flash_xip_get(uint32_t addr, size_t size)
+{
+        if (((uint64_t)addr + size > m_info.size) || !qspi_remap_clean(addr, size) || !m_powered)
+        {
+                return NULL;
+        }
+
+        sim_wake();
+        return m_mem + addr;
+}
+
+ret_code_t qspi_flash_power_down(void)
+{
+        if (m_dpd)
+        {
+                return NRF_SUCCESS;
+        }
+        if (m_suspended || qspi_flash_busy())
+        {
+                return NRF_ERROR_BUSY;
+        }
+
+        sim_advance(sim_xfer_ns(0));
+        m_dpd    = true;
+        m_dpd_ns = m_now_ns;
+        m_stats.dpd_entries++;
+        return NRF_SUCCESS;
+}
+
+bool qspi_flash_powered_down(void)
+{
+        return m_dpd;
+}
+
+qspi_flash_stats_t const * qspi_flash_stats_get(void)
+{
+        uint64_t dpd_ns = m_dpd_total_ns + (m_dpd ? m_now_ns - m_dpd_ns : 0);
+
+        m_stats.dpd_ms = (uint32_t)(dpd_ns / 1000000);
+        return &m_stats;
+}
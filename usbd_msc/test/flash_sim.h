@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef FLASH_SIM_H__
+#define FLASH_SIM_H__
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "qspi_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@file
+ *
+ * @defgroup flash_sim Host NOR flash simulator
+ * @{
+ * @brief RAM-backed serial NOR flash implementing @ref qspi_flash for host tests.
+ *
+ * Linked in place of qspi_flash.c, below the real qspi_remap, qspi_wear and
+ * qspi_calib modules. Reads, programs and erases go through @ref qspi_remap like
+ * on the target. A program only clears bits (the stored byte is ANDed with the
+ * data), an erase sets the whole range to 0xFF.
+ *
+ * Time is simulated: every command advances a clock by the transfer time at the
+ * QSPI clock plus the flash operation time (@ref flash_sim_timing_t). An erase runs
+ * in the background until @ref qspi_flash_busy has been polled past its end, and
+ * can be suspended and resumed. The app_timer counter is derived from that clock.
+ *
+ * Power loss is simulated with @ref flash_sim_cut_arm: the n-th program or erase
+ * from then on is torn (a program stops part way through a byte, an erase leaves
+ * the range with random bits set), any erase still running is torn the same way,
+ * and the simulator longjmps to the caller's jmp_buf, so no code of the stack runs
+ * after the cut, as on the target. @ref flash_sim_power_on then starts the flash
+ * again with its content kept; the caller clears the RAM of the modules under test
+ * and initializes them again.
+ *
+ * Weak erase units, whose programs leave some bits set, are simulated with
+ * @ref flash_sim_weak_set to exercise the read back and the retirement of units.
+ */
+
+/**
+ * @brief Operation times, typical values of the MX25R6435F in high performance mode.
+ */
+typedef struct
+{
+        uint32_t read_ns_per_byte;      //!< Quad read at 16 MHz SCK.
+        uint32_t cmd_ns;                //!< Command and address phase of a transfer.
+        uint32_t poll_ns;               //!< One status register read.
+        uint32_t page_program_us;       //!< Program of a full page, scaled to the bytes programmed.
+        uint32_t erase_4k_us;           //!< Sector erase.
+        uint32_t erase_32k_us;          //!< 32 KB block erase.
+        uint32_t erase_64k_us;          //!< 64 KB block erase.
+        uint32_t erase_chip_us;         //!< Chip erase.
+        uint32_t suspend_us;            //!< Erase suspend latency.
+        uint32_t wake_us;               //!< Deep power-down release.
+} flash_sim_timing_t;
+
+/**
+ * @brief Simulator counters, on top of the @ref qspi_flash_stats_t counters.
+ */
+typedef struct
+{
+        uint64_t busy_us;               //!< Time the flash was busy programming or erasing.
+        uint32_t programs;              //!< Number of program transfers.
+        uint32_t cuts;                  //!< Number of power cuts.
+        uint32_t torn_programs;         //!< Programs interrupted by a cut.
+        uint32_t torn_erases;           //!< Erases interrupted by a cut.
+        uint32_t weak_programs;         //!< Programs of a weak unit.
+} flash_sim_stats_t;
+
+/**
+ * @brief Start with an erased flash and cleared counters.
+ *
+ * @param size Flash size in bytes, a multiple of 64 KB.
+ * @param seed Seed of the torn operation patterns.
+ */
+void flash_sim_reset(uint32_t size, uint32_t seed);
+
+/**
+ * @brief Get the operation times, for changes with @ref flash_sim_timing_set.
+ */
+flash_sim_timing_t const * flash_sim_timing_get(void);
+
+/**
+ * @brief Set the operation times.
+ */
+void flash_sim_timing_set(flash_sim_timing_t const * p_timing);
+
+/**
+ * @brief Get the simulated time in microseconds.
+ */
+uint64_t flash_sim_time_us(void);
+
+/**
+ * @brief Let time pass without flash commands, such as the host idling between requests.
+ */
+void flash_sim_idle(uint32_t us);
+
+/**
+ * @brief Get the number of program and erase commands issued since the reset.
+ */
+uint32_t flash_sim_ops_get(void);
+
+/**
+ * @brief Cut the power at a program or erase command.
+ *
+ * @param ops    Command to cut at, 1 for the next one. 0 disarms.
+ * @param p_jump Where the simulator jumps to once the power is cut, set with setjmp
+ *               by the caller and valid until the cut or the disarm.
+ */
+void flash_sim_cut_arm(uint32_t ops, jmp_buf * p_jump);
+
+/**
+ * @brief Power the flash up again after a cut: the content stays, the state is reset.
+ */
+void flash_sim_power_on(void);
+
+/**
+ * @brief Make an erase unit weak: its programs leave a bit of the first word set.
+ *
+ * @param eu_idx Physical erase unit index.
+ * @param weak   Weak or healthy again.
+ */
+void flash_sim_weak_set(uint32_t eu_idx, bool weak);
+
+/**
+ * @brief Get the number of erases of a physical erase unit since the reset.
+ */
+uint32_t flash_sim_erase_count(uint32_t eu_idx);
+
+/**
+ * @brief Get the simulator counters.
+ */
+flash_sim_stats_t const * flash_sim_stats_get(void);
+
+/**
+ * @brief Direct access to the flash array, for checks and corruption.
+ */
+uint8_t * flash_sim_mem(void);
+
+/**
+ * @brief Direct access to the parameters the flash reports, to model parts without
+ *        some erase sizes or without erase suspend. Reset by @ref flash_sim_reset.
+ */
+qspi_flash_info_t * flash_sim_info(void);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLASH_SIM_H__ */
@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef APP_TIMER_H__
+#define APP_TIMER_H__
+
+/* Host build shim: the app_timer counter, a 24-bit RTC count at 32768 Hz divided by
+ * APP_TIMER_CONFIG_RTC_FREQUENCY + 1. The flash simulator (flash_sim.c) implements
+ * it on its own clock. */
+
+#include "sdk_common.h"
+
+#define APP_TIMER_CLOCK_FREQ    32768
+#define APP_TIMER_MAX_CNT_VAL   0x00FFFFFF
+
+#define APP_TIMER_TICKS(MS)                                                     \
+        ((uint32_t)ROUNDED_DIV((MS) * (uint64_t)APP_TIMER_CLOCK_FREQ,           \
+                               1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)))
+
+uint32_t app_timer_cnt_get(void);
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from);
+
+#endif /* APP_TIMER_H__ */
@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef APP_UTIL_H__
+#define APP_UTIL_H__
+
+/* Host build shim: the app_util.h macros used by the modules under test */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATIC_ASSERT(expr)             _Static_assert(expr, #expr)
+
+#define CONCAT_2(p1, p2)                CONCAT_2_(p1, p2)
+#define CONCAT_2_(p1, p2)               p1##p2
+
+#define BRACKET_EXTRACT(a)              BRACKET_EXTRACT_(a)
+#define BRACKET_EXTRACT_(a)             BRACKET_EXTRACT__ a
+#define BRACKET_EXTRACT__(...)          __VA_ARGS__
+
+#define CONTAINER_OF(ptr, type, member) \
+        ((type *)(((char *)(ptr)) - offsetof(type, member)))
+
+#define ARRAY_SIZE(arr)                 (sizeof(arr) / sizeof((arr)[0]))
+#define CEIL_DIV(a, b)                  (((a) + (b) - 1) / (b))
+#define ROUNDED_DIV(a, b)               (((a) + ((b) / 2)) / (b))
+#define IS_POWER_OF_TWO(a)              (((a) != 0) && ((((a) - 1) & (a)) == 0))
+#define ALIGN_NUM(alignment, number)    (((number) - 1) + (alignment) - (((number) - 1) % (alignment)))
+
+#ifndef MIN
+#define MIN(a, b)                       (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b)                       (((a) < (b)) ? (b) : (a))
+#endif
+
+#define UNUSED_VARIABLE(x)              (void)(x)
+#define UNUSED_PARAMETER(x)             (void)(x)
+#define UNUSED_RETURN_VALUE(x)          (void)(x)
+
+static inline bool is_word_aligned(void const * p)
+{
+        return ((uintptr_t)p & 0x03) == 0;
+}
+
+#endif /* APP_UTIL_H__ */
@@ -0,0 +1,25 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef NRF_ASSERT_H__
+#define NRF_ASSERT_H__
+
+/* Host build shim: a failed assertion ends the test program */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ASSERT(expr)                                                            \
+        do                                                                      \
+        {                                                                       \
+                if (!(expr))                                                    \
+                {                                                               \
+                        fprintf(stderr, "%s:%d: ASSERT(%s) failed\n",           \
+                                __FILE__, __LINE__, #expr);                     \
+                        abort();                                                \
+                }                                                               \
+        } while (0)
+
+#endif /* NRF_ASSERT_H__ */
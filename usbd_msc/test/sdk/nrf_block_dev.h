@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef NRF_BLOCK_DEV_H__
+#define NRF_BLOCK_DEV_H__
+
+/* Host build shim: the SDK nrf_block_dev interface, same types and inline calls */
+
+#include "sdk_common.h"
+
+typedef struct
+{
+        uint32_t blk_id;
+        uint32_t blk_count;
+        void *   p_buff;
+} nrf_block_req_t;
+
+typedef enum
+{
+        NRF_BLOCK_DEV_EVT_INIT,
+        NRF_BLOCK_DEV_EVT_UNINIT,
+        NRF_BLOCK_DEV_EVT_BLK_READ_DONE,
+        NRF_BLOCK_DEV_EVT_BLK_WRITE_DONE,
+} nrf_block_dev_event_type_t;
+
+typedef enum
+{
+        NRF_BLOCK_DEV_RESULT_SUCCESS = 0,
+        NRF_BLOCK_DEV_RESULT_IO_ERROR,
+        NRF_BLOCK_DEV_RESULT_TIMEOUT,
+} nrf_block_dev_result_t;
+
+typedef struct nrf_block_dev_s nrf_block_dev_t;
+
+typedef struct
+{
+        nrf_block_dev_event_type_t ev_type;
+        nrf_block_dev_result_t     result;
+        nrf_block_req_t const *    p_blk_req;
+        void const *               p_context;
+} nrf_block_dev_event_t;
+
+typedef void (* nrf_block_dev_ev_handler)(nrf_block_dev_t const * p_blk_dev,
+                                          nrf_block_dev_event_t const * p_event);
+
+typedef enum
+{
+        NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH = 0,
+        NRF_BLOCK_DEV_IOCTL_REQ_INFO_STRINGS,
+} nrf_block_dev_ioctl_req_t;
+
+typedef struct
+{
+        const char * p_vendor;
+        const char * p_product;
+        const char * p_revision;
+} nrf_block_dev_info_strings_t;
+
+#define NFR_BLOCK_DEV_INFO_CONFIG(vendor, product, revision) ( {        \
+                .p_vendor   = vendor,                                   \
+                .p_product  = product,                                  \
+                .p_revision = revision,                                 \
+        })
+
+typedef struct
+{
+        uint32_t blk_count;
+        uint32_t blk_size;
+} nrf_block_dev_geometry_t;
+
+typedef struct nrf_block_dev_ops_s
+{
+        ret_code_t (*init)(nrf_block_dev_t const * p_blk_dev,
+                           nrf_block_dev_ev_handler ev_handler,
+                           void const * p_context);
+        ret_code_t (*uninit)(nrf_block_dev_t const * p_blk_dev);
+        ret_code_t (*read_req)(nrf_block_dev_t const * p_blk_dev, nrf_block_req_t const * p_blk);
+        ret_code_t (*write_req)(nrf_block_dev_t const * p_blk_dev, nrf_block_req_t const * p_blk);
+        ret_code_t (*ioctl)(nrf_block_dev_t const * p_blk_dev, nrf_block_dev_ioctl_req_t req, void * p_data);
+        nrf_block_dev_geometry_t const * (*geometry)(nrf_block_dev_t const * p_blk_dev);
+} nrf_block_dev_ops_t;
+
+struct nrf_block_dev_s
+{
+        nrf_block_dev_ops_t const * p_ops;
+};
+
+#define NRF_BLOCKDEV_BASE_ADDR(instance, member) &(instance).member
+
+static inline ret_code_t nrf_blk_dev_init(nrf_block_dev_t const * p_blk_dev,
+                                          nrf_block_dev_ev_handler ev_handler,
+                                          void const * p_context)
+{
+        return p_blk_dev->p_ops->init(p_blk_dev, ev_handler, p_context);
+}
+
+static inline ret_code_t nrf_blk_dev_uninit(nrf_block_dev_t const * p_blk_dev)
+{
+        return p_blk_dev->p_ops->uninit(p_blk_dev);
+}
+
+static inline ret_code_t nrf_blk_dev_read_req(nrf_block_dev_t const * p_blk_dev,
+                                              nrf_block_req_t const * p_blk)
+{
+        return p_blk_dev->p_ops->read_req(p_blk_dev, p_blk);
+}
+
+static inline ret_code_t nrf_blk_dev_write_req(nrf_block_dev_t const * p_blk_dev,
+                                               nrf_block_req_t const * p_blk)
+{
+        return p_blk_dev->p_ops->write_req(p_blk_dev, p_blk);
+}
+
+static inline ret_code_t nrf_blk_dev_ioctl(nrf_block_dev_t const * p_blk_dev,
+                                           nrf_block_dev_ioctl_req_t req,
+                                           void * p_data)
+{
+        return p_blk_dev->p_ops->ioctl(p_blk_dev, req, p_data);
+}
+
+static inline nrf_block_dev_geometry_t const * nrf_blk_dev_geometry(nrf_block_dev_t const * p_blk_dev)
+{
+        return p_blk_dev->p_ops->geometry(p_blk_dev);
+}
+
+#endif /* NRF_BLOCK_DEV_H__ */
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef NRF_DRV_QSPI_H__
+#define NRF_DRV_QSPI_H__
+
+/* Host build shim: the QSPI driver configuration types. There is no driver on the
+ * host, the flash simulator (flash_sim.c) stands in for qspi_flash.c. */
+
+#include "sdk_common.h"
+
+typedef enum
+{
+        NRF_QSPI_FREQ_32MDIV1,
+        NRF_QSPI_FREQ_32MDIV2,
+        NRF_QSPI_FREQ_32MDIV3,
+        NRF_QSPI_FREQ_32MDIV4,
+        NRF_QSPI_FREQ_32MDIV5,
+        NRF_QSPI_FREQ_32MDIV6,
+        NRF_QSPI_FREQ_32MDIV7,
+        NRF_QSPI_FREQ_32MDIV8,
+        NRF_QSPI_FREQ_32MDIV9,
+        NRF_QSPI_FREQ_32MDIV10,
+        NRF_QSPI_FREQ_32MDIV11,
+        NRF_QSPI_FREQ_32MDIV12,
+        NRF_QSPI_FREQ_32MDIV13,
+        NRF_QSPI_FREQ_32MDIV14,
+        NRF_QSPI_FREQ_32MDIV15,
+        NRF_QSPI_FREQ_32MDIV16,
+} nrf_qspi_frequency_t;
+
+typedef enum
+{
+        NRF_QSPI_READOC_FASTREAD,
+        NRF_QSPI_READOC_READ2O,
+        NRF_QSPI_READOC_READ2IO,
+        NRF_QSPI_READOC_READ4O,
+        NRF_QSPI_READOC_READ4IO,
+} nrf_qspi_readoc_t;
+
+typedef enum
+{
+        NRF_QSPI_WRITEOC_PP,
+        NRF_QSPI_WRITEOC_PP2O,
+        NRF_QSPI_WRITEOC_PP4O,
+        NRF_QSPI_WRITEOC_PP4IO,
+} nrf_qspi_writeoc_t;
+
+typedef enum
+{
+        NRF_QSPI_ADDRMODE_24BIT,
+        NRF_QSPI_ADDRMODE_32BIT,
+} nrf_qspi_addrmode_t;
+
+typedef struct
+{
+        nrf_qspi_readoc_t   readoc;
+        nrf_qspi_writeoc_t  writeoc;
+        nrf_qspi_addrmode_t addrmode;
+        bool                dpmconfig;
+} nrf_qspi_prot_conf_t;
+
+typedef struct
+{
+        uint8_t              sck_delay;
+        bool                 dpmen;
+        nrf_qspi_frequency_t sck_freq;
+} nrf_qspi_phy_conf_t;
+
+typedef struct
+{
+        uint32_t             xip_offset;
+        nrf_qspi_prot_conf_t prot_if;
+        nrf_qspi_phy_conf_t  phy_if;
+        uint8_t              irq_priority;
+} nrf_drv_qspi_config_t;
+
+#define NRF_DRV_QSPI_DEFAULT_CONFIG                                             \
+{                                                                               \
+        .xip_offset = 0,                                                        \
+        .prot_if    = {                                                         \
+                .readoc   = NRF_QSPI_READOC_READ4IO,                            \
+                .writeoc  = NRF_QSPI_WRITEOC_PP4IO,                             \
+                .addrmode = NRF_QSPI_ADDRMODE_24BIT,                            \
+        },                                                                      \
+        .phy_if     = {                                                         \
+                .sck_delay = 1,                                                 \
+                .sck_freq  = NRF_QSPI_FREQ_32MDIV2,                             \
+        },                                                                      \
+        .irq_priority = 6,                                                      \
+}
+
+#endif /* NRF_DRV_QSPI_H__ */
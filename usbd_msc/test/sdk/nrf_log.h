@@ -0,0 +1,29 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef NRF_LOG_H__
+#define NRF_LOG_H__
+
+/* Host build shim: logging compiles to nothing, the arguments are still evaluated
+ * for warnings. Build with -DNRF_LOG_HOST_PRINT to get the messages on stderr. */
+
+#include <stdio.h>
+
+#define NRF_LOG_MODULE_REGISTER() extern int CONCAT_2(nrf_log_, NRF_LOG_MODULE_NAME)
+
+#ifdef NRF_LOG_HOST_PRINT
+#define NRF_LOG_HOST(...)       do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
+#else
+#define NRF_LOG_HOST(...)       do { if (0) { fprintf(stderr, __VA_ARGS__); } } while (0)
+#endif
+
+#define NRF_LOG_ERROR(...)      NRF_LOG_HOST(__VA_ARGS__)
+#define NRF_LOG_WARNING(...)    NRF_LOG_HOST(__VA_ARGS__)
+#define NRF_LOG_INFO(...)       NRF_LOG_HOST(__VA_ARGS__)
+#define NRF_LOG_DEBUG(...)      NRF_LOG_HOST(__VA_ARGS__)
+#define NRF_LOG_RAW_INFO(...)   NRF_LOG_HOST(__VA_ARGS__)
+#define NRF_LOG_FLUSH()         do { } while (0)
+
+#endif /* NRF_LOG_H__ */
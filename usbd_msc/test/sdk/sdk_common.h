@@ -0,0 +1,19 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef SDK_COMMON_H__
+#define SDK_COMMON_H__
+
+/* Host build shim: sdk_common.h pulls in the configuration and the utility macros */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sdk_config.h"
+#include "sdk_errors.h"
+#include "app_util.h"
+
+#endif /* SDK_COMMON_H__ */
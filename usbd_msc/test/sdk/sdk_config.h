@@ -0,0 +1,15 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef SDK_CONFIG_H__
+#define SDK_CONFIG_H__
+
+/* Host build shim: only the SDK settings the modules read without a default of
+ * their own, with the values of pca10056/blank/config/sdk_config.h. The module
+ * settings keep the defaults of their headers. */
+
+#define APP_TIMER_CONFIG_RTC_FREQUENCY 1
+
+#endif /* SDK_CONFIG_H__ */
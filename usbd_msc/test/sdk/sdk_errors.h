@@ -0,0 +1,30 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef SDK_ERRORS_H__
+#define SDK_ERRORS_H__
+
+/* Host build shim: nRF5 SDK error codes used by the modules under test */
+
+#include <stdint.h>
+
+typedef uint32_t ret_code_t;
+
+#define NRF_SUCCESS                 0
+#define NRF_ERROR_INTERNAL          3
+#define NRF_ERROR_NO_MEM            4
+#define NRF_ERROR_NOT_FOUND         5
+#define NRF_ERROR_NOT_SUPPORTED     6
+#define NRF_ERROR_INVALID_PARAM     7
+#define NRF_ERROR_INVALID_STATE     8
+#define NRF_ERROR_INVALID_LENGTH    9
+#define NRF_ERROR_INVALID_DATA      11
+#define NRF_ERROR_DATA_SIZE         12
+#define NRF_ERROR_TIMEOUT           13
+#define NRF_ERROR_FORBIDDEN         15
+#define NRF_ERROR_INVALID_ADDR      16
+#define NRF_ERROR_BUSY              17
+
+#endif /* SDK_ERRORS_H__ */
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef TEST_H__
+#define TEST_H__
+
+/* Minimal host test harness: a failed check ends the test program */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond)                                                             \
+        do                                                                      \
+        {                                                                       \
+                if (!(cond))                                                    \
+                {                                                               \
+                        fprintf(stderr, "%s:%d: CHECK(%s) failed\n",            \
+                                __FILE__, __LINE__, #cond);                     \
+                        exit(1);                                                \
+                }                                                               \
+        } while (0)
+
+#define CHECK_EQ(a, b)                                                          \
+        do                                                                      \
+        {                                                                       \
+                unsigned long long _a = (a);                                    \
+                unsigned long long _b = (b);                                    \
+                if (_a != _b)                                                   \
+                {                                                               \
+                        fprintf(stderr, "%s:%d: %s == 0x%llx, expected 0x%llx\n", \
+                                __FILE__, __LINE__, #a, _a, _b);                \
+                        exit(1);                                                \
+                }                                                               \
+        } while (0)
+
+#define TEST_RUN(fn)                                                            \
+        do                                                                      \
+        {                                                                       \
+                fn();                                                           \
+                printf("  %s ok\n", #fn);                                       \
+        } while (0)
+
+#endif /* TEST_H__ */
@@ -0,0 +1,308 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "blk_test.h"
+#include "block_dev_part.h"
+#include "block_dev_qspi.h"
+#include "fat_diskio.h"
+
+/* FatFS of the SDK on the QSPI block device, with the flags of main.c, on the
+ * flash simulator, directly and on the private partition of USE_PARTITIONS: the
+ * log of test_write() in main.c and a file rewritten in place, with the power cut
+ * throughout. After every cut the volume mounts, both files open and read back
+ * what their last f_close synced, and the volume takes new records.
+ *
+ * Built when the SDK is found, see SDK_ROOT in the Makefile. */
+
+#define FLASH_SIZE     (2 * 1024 * 1024)
+#define PART_SIZE      (1024 * 1024)
+#define RECORD_SIZE    50
+#define RECORDS        240
+#define STATE_PERIOD   8
+#define CUT_RUNS       48
+#define LOG_FILE       "log_data.txt"
+#define STATE_FILE     "state.bin"
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_PART_DISK_DEFINE(m_disk, NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev));
+
+BLOCK_DEV_PART_DEFINE(m_part, m_disk, 0, PART_SIZE / BLK_TEST_BLOCK_SIZE, 0,
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI LOG", "1.00"));
+
+/**
+ * @brief Expected content of the files.
+ *
+ * Record n of the log is at offset n * RECORD_SIZE. Records a cut left unsynced
+ * may be lost or torn, they are not checked once the log grew past them again.
+ */
+typedef struct
+{
+        uint32_t written;       //!< Records appended.
+        uint32_t synced;        //!< Records appended and closed.
+        uint32_t lost_first;    //!< First record not checked.
+        uint32_t lost_end;      //!< End of the records not checked.
+        uint32_t state_written; //!< Last value written to the state file.
+        uint32_t state_synced;  //!< Last value written and closed.
+} fat_expect_t;
+
+static nrf_block_dev_t const * mp_dev;
+static FATFS                   m_fs;
+static fat_expect_t            m_expect;
+static uint8_t                 m_work[FF_MAX_SS];
+static char                    m_read[RECORDS * 2 * RECORD_SIZE];
+
+/**
+ * @brief Record of test_write() in main.c.
+ */
+static void fat_record(char * p_record, uint32_t rec)
+{
+        char buff[RECORD_SIZE + 1];
+
+        snprintf(buff, sizeof(buff), "1234567890123456789012345678901234567890%u\r\n",
+                 10000000u + rec);
+        memcpy(p_record, buff, RECORD_SIZE);
+}
+
+/**
+ * @brief Power the stack up as after a reset: RAM cleared, flash content kept, then
+ *        mount as fatfs_init() in main.c.
+ */
+static void fat_boot(void)
+{
+        flash_sim_power_on();
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_part.p_work, 0, sizeof(*m_part.p_work));
+        m_disk_users = 0;
+        memset(&m_fs, 0, sizeof(m_fs));
+        fat_diskio_set(mp_dev);
+        CHECK_EQ(f_mount(&m_fs, "", 1), FR_OK);
+}
+
+/**
+ * @brief Fresh flash formatted as fatfs_mkfs() in main.c does.
+ */
+static void fat_setup(nrf_block_dev_t const * p_dev)
+{
+        mp_dev = p_dev;
+        flash_sim_reset(FLASH_SIZE, 1);
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_part.p_work, 0, sizeof(*m_part.p_work));
+        m_disk_users = 0;
+        fat_diskio_set(mp_dev);
+        CHECK_EQ(f_mkfs("", FM_FAT | FM_FAT32, MAX(1024, BLK_TEST_BLOCK_SIZE), m_work, sizeof(m_work)),
+                 FR_OK);
+        fat_boot();
+        memset(&m_expect, 0, sizeof(m_expect));
+}
+
+/**
+ * @brief Append a record and close the log, as test_write() in main.c.
+ */
+static void fat_append(void)
+{
+        FIL  file;
+        UINT num;
+        char record[RECORD_SIZE];
+
+        CHECK_EQ(f_open(&file, LOG_FILE, FA_OPEN_APPEND | FA_OPEN_ALWAYS | FA_WRITE), FR_OK);
+        CHECK_EQ(f_tell(&file), m_expect.written * RECORD_SIZE);
+
+        fat_record(record, m_expect.written);
+        CHECK_EQ(f_write(&file, record, sizeof(record), &num), FR_OK);
+        CHECK_EQ(num, sizeof(record));
+        m_expect.written++;
+
+        CHECK_EQ(f_close(&file), FR_OK);
+        m_expect.synced = m_expect.written;
+}
+
+/**
+ * @brief Rewrite the state file in place.
+ */
+static void fat_state(uint32_t value)
+{
+        FIL  file;
+        UINT num;
+
+        CHECK_EQ(f_open(&file, STATE_FILE, FA_OPEN_ALWAYS | FA_WRITE), FR_OK);
+        m_expect.state_written = value;
+        CHECK_EQ(f_write(&file, &value, sizeof(value), &num), FR_OK);
+        CHECK_EQ(num, sizeof(value));
+        CHECK_EQ(f_close(&file), FR_OK);
+        m_expect.state_synced = value;
+}
+
+static void fat_work(void)
+{
+        for (uint32_t i = 0; i < RECORDS; ++i)
+        {
+                fat_append();
+                if (m_expect.written % STATE_PERIOD == 0)
+                {
+                        fat_state(m_expect.written);
+                }
+        }
+}
+
+/**
+ * @brief Open and read both files back, and check them against what was synced.
+ */
+static void fat_check(void)
+{
+        FIL  file;
+        UINT num;
+
+        FRESULT ret = f_open(&file, LOG_FILE, FA_READ);
+        if (ret == FR_NO_FILE)
+        {
+                CHECK_EQ(m_expect.synced, 0);
+        }
+        else
+        {
+                CHECK_EQ(ret, FR_OK);
+
+                /* The directory entry holds the size of the last close, or of a later
+                 * one the cut interrupted */
+                FSIZE_t size = f_size(&file);
+                CHECK_EQ(size % RECORD_SIZE, 0);
+                CHECK(size >= m_expect.synced * RECORD_SIZE);
+                CHECK(size <= m_expect.written * RECORD_SIZE);
+                CHECK(size <= sizeof(m_read));
+
+                /* Only the synced part has its clusters linked for sure */
+                CHECK_EQ(f_read(&file, m_read, m_expect.synced * RECORD_SIZE, &num), FR_OK);
+                CHECK_EQ(num, m_expect.synced * RECORD_SIZE);
+                CHECK_EQ(f_close(&file), FR_OK);
+
+                for (uint32_t rec = 0; rec < m_expect.synced; ++rec)
+                {
+                        char record[RECORD_SIZE];
+
+                        if ((rec >= m_expect.lost_first) && (rec < m_expect.lost_end))
+                        {
+                                continue;
+                        }
+                        fat_record(record, rec);
+                        if (memcmp(&m_read[rec * RECORD_SIZE], record, RECORD_SIZE))
+                        {
+                                fprintf(stderr, "record %u of %u synced differs\n",
+                                        rec, m_expect.synced);
+                                exit(1);
+                        }
+                }
+        }
+
+        ret = f_open(&file, STATE_FILE, FA_READ);
+        if (ret == FR_NO_FILE)
+        {
+                CHECK_EQ(m_expect.state_synced, 0);
+        }
+        else
+        {
+                uint32_t value = 0;
+
+                CHECK_EQ(ret, FR_OK);
+                CHECK_EQ(f_read(&file, &value, sizeof(value), &num), FR_OK);
+                CHECK_EQ(f_close(&file), FR_OK);
+                if (m_expect.state_synced)
+                {
+                        CHECK_EQ(num, sizeof(value));
+                        CHECK((value == m_expect.state_synced) || (value == m_expect.state_written));
+                }
+        }
+
+        DWORD   free_clusters;
+        FATFS * p_fs;
+        CHECK_EQ(f_getfree("", &free_clusters, &p_fs), FR_OK);
+}
+
+/**
+ * @brief After a cut, continue from the log size found: the records between the
+ *        last synced one and that size are not checked any more.
+ */
+static void fat_settle(void)
+{
+        FIL file;
+
+        if (f_open(&file, LOG_FILE, FA_READ) == FR_OK)
+        {
+                uint32_t found = f_size(&file) / RECORD_SIZE;
+
+                CHECK_EQ(f_close(&file), FR_OK);
+                if (found > m_expect.synced)
+                {
+                        m_expect.lost_first = m_expect.synced;
+                        m_expect.lost_end   = found;
+                }
+                m_expect.written = found;
+                m_expect.synced  = found;
+        }
+        else
+        {
+                m_expect.written = 0;
+        }
+
+        if (m_expect.state_written != m_expect.state_synced)
+        {
+                m_expect.state_synced = 0;
+        }
+}
+
+static void fat_cut_runs(nrf_block_dev_t const * p_dev)
+{
+        fat_setup(p_dev);
+        uint32_t ops = blk_test_ops(fat_work);
+        fat_check();
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                fat_setup(p_dev);
+                CHECK(blk_test_cut_run(fat_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                fat_boot();
+                fat_check();
+
+                /* The volume keeps taking records, they survive a clean reboot */
+                fat_settle();
+                for (uint32_t i = 0; i < 20; ++i)
+                {
+                        fat_append();
+                }
+                fat_state(m_expect.written);
+                fat_boot();
+                fat_check();
+                CHECK_EQ(block_dev_qspi_stats_get(&m_qspi)->crc_errors, 0);
+        }
+}
+
+static void test_fat_cut_qspi(void)
+{
+        fat_cut_runs(&m_qspi.block_dev);
+}
+
+static void test_fat_cut_part(void)
+{
+        fat_cut_runs(&m_part.block_dev);
+}
+
+int main(void)
+{
+        TEST_RUN(test_fat_cut_qspi);
+        TEST_RUN(test_fat_cut_part);
+        return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blk_test.h"
+#include "block_dev_ftl.h"
+#include "block_dev_qspi.h"
+
+/* FTL on the QSPI block device with the flags of main.c, on the flash simulator:
+ * synced blocks survive power cuts during appends, summaries and collection */
+
+#define FLASH_SIZE  (2 * 1024 * 1024)
+#define MAX_BLOCKS  4096
+#define CUT_RUNS    48
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_FTL_DEFINE(m_ftl, m_qspi, NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+static nrf_block_dev_t const * const mp_dev = &m_ftl.block_dev;
+static blk_test_state_t              m_states[MAX_BLOCKS];
+static uint32_t                      m_blocks;
+static uint16_t                      m_version;
+
+/**
+ * @brief Power the stack up as after a reset: RAM cleared, flash content kept.
+ */
+static void ftl_boot(void)
+{
+        flash_sim_power_on();
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_ftl.p_work, 0, sizeof(*m_ftl.p_work));
+        CHECK_EQ(nrf_blk_dev_init(mp_dev, NULL, NULL), NRF_SUCCESS);
+
+        m_blocks = nrf_blk_dev_geometry(mp_dev)->blk_count;
+        CHECK(m_blocks <= MAX_BLOCKS);
+}
+
+static void ftl_idle(void)
+{
+        while (block_dev_ftl_process(&m_ftl) || block_dev_qspi_process(&m_qspi))
+        {
+        }
+}
+
+static void ftl_sync(void)
+{
+        blk_test_barrier(mp_dev);
+        blk_test_synced(m_states, m_blocks);
+}
+
+/**
+ * @brief Fresh flash with every logical block written once, so that rewrites collect.
+ */
+static void ftl_setup(uint32_t seed)
+{
+        flash_sim_reset(FLASH_SIZE, seed);
+        ftl_boot();
+        CHECK_EQ(block_dev_ftl_format(&m_ftl), NRF_SUCCESS);
+
+        memset(m_states, 0, sizeof(m_states));
+        m_version = 1;
+        for (uint32_t i = 0; i < m_blocks; ++i)
+        {
+                blk_test_update(mp_dev, m_states, i, m_version);
+        }
+        ftl_sync();
+        ftl_idle();
+        srand(seed);
+}
+
+/**
+ * @brief Random rewrites synced every 48 blocks, collection running in between.
+ */
+static void ftl_random_work(void)
+{
+        for (uint32_t round = 0; round < 8; ++round)
+        {
+                m_version++;
+                for (uint32_t i = 0; i < 48; ++i)
+                {
+                        uint32_t blk_id = rand() % m_blocks;
+
+                        if (!m_states[blk_id].pending)
+                        {
+                                blk_test_update(mp_dev, m_states, blk_id, m_version);
+                        }
+                        if (i % 8 == 0)
+                        {
+                                UNUSED_RETURN_VALUE(block_dev_ftl_process(&m_ftl));
+                        }
+                }
+                ftl_sync();
+        }
+}
+
+/**
+ * @brief Synced blocks keep their version across a cut, written ones are old or new.
+ */
+static void test_ftl_cut(void)
+{
+        ftl_setup(1);
+        uint32_t ops = blk_test_ops(ftl_random_work);
+        CHECK(block_dev_ftl_stats_get(&m_ftl)->gc_segments > 0);
+        blk_test_verify(mp_dev, m_states, m_blocks);
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                ftl_setup(1);
+                CHECK(blk_test_cut_run(ftl_random_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                ftl_boot();
+                blk_test_verify(mp_dev, m_states, m_blocks);
+                CHECK_EQ(block_dev_qspi_stats_get(&m_qspi)->crc_errors, 0);
+
+                /* The mapping found after the cut stays valid through more rewrites */
+                blk_test_settle(mp_dev, m_states, m_blocks);
+                ftl_random_work();
+                ftl_idle();
+                ftl_boot();
+                blk_test_verify(mp_dev, m_states, m_blocks);
+        }
+}
+
+/**
+ * @brief Trimmed blocks are not copied by collection.
+ */
+static void test_ftl_trim(void)
+{
+        ftl_setup(2);
+
+        /* Half of the blocks deleted, the rest rewritten until every segment was collected */
+        blk_test_trimmed(mp_dev, m_states, 0, m_blocks / 2);
+        for (uint32_t pass = 0; pass < 4; ++pass)
+        {
+                m_version++;
+                for (uint32_t i = m_blocks / 2; i < m_blocks; ++i)
+                {
+                        blk_test_update(mp_dev, m_states, i, m_version);
+                }
+                ftl_sync();
+        }
+
+        block_dev_ftl_stats_t const * p_stats = block_dev_ftl_stats_get(&m_ftl);
+        CHECK_EQ(p_stats->trim_blocks, m_blocks / 2);
+        CHECK(p_stats->gc_blocks < m_blocks / 2);
+        blk_test_verify(mp_dev, m_states, m_blocks);
+}
+
+int main(void)
+{
+        TEST_RUN(test_ftl_cut);
+        TEST_RUN(test_ftl_trim);
+        return 0;
+}
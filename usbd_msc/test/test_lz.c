@@ -0,0 +1,205 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blk_test.h"
+#include "block_dev_ftl.h"
+#include "block_dev_lz.h"
+#include "block_dev_qspi.h"
+
+/* Compressing device on the QSPI block device, directly and through the FTL, with
+ * the flags of main.c, on the flash simulator: a unit reads back its old or its new
+ * copy after a power cut, synced units their last one */
+
+#define FLASH_SIZE  (2 * 1024 * 1024)
+#define TEST_BLOCKS 1024
+#define BLK_PER_UNIT (BLOCK_DEV_LZ_CONFIG_UNIT_SIZE / BLK_TEST_BLOCK_SIZE)
+#define CUT_RUNS    48
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_FTL_DEFINE(m_ftl, m_qspi, NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_LZ_DEFINE(m_lz_qspi,
+                    NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev),
+                    NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_LZ_DEFINE(m_lz_ftl,
+                    NRF_BLOCKDEV_BASE_ADDR(m_ftl, block_dev),
+                    NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+static block_dev_lz_t const * mp_lz;
+static blk_test_state_t       m_states[TEST_BLOCKS];
+static uint16_t               m_version;
+
+/**
+ * @brief Power the stack up as after a reset: RAM cleared, flash content kept.
+ */
+static void lz_boot(void)
+{
+        flash_sim_power_on();
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_ftl.p_work, 0, sizeof(*m_ftl.p_work));
+        memset(mp_lz->p_work, 0, sizeof(*mp_lz->p_work));
+        CHECK_EQ(nrf_blk_dev_init(&mp_lz->block_dev, NULL, NULL), NRF_SUCCESS);
+        CHECK(nrf_blk_dev_geometry(&mp_lz->block_dev)->blk_count >= TEST_BLOCKS);
+}
+
+static void lz_idle(void)
+{
+        while (block_dev_ftl_process(&m_ftl) || block_dev_qspi_process(&m_qspi))
+        {
+        }
+}
+
+static void lz_sync(void)
+{
+        blk_test_barrier(&mp_lz->block_dev);
+        blk_test_synced(m_states, TEST_BLOCKS);
+}
+
+/**
+ * @brief Fresh flash with the first version of every test block on it.
+ */
+static void lz_setup(block_dev_lz_t const * p_lz, uint32_t seed)
+{
+        mp_lz = p_lz;
+        flash_sim_reset(FLASH_SIZE, seed);
+        lz_boot();
+        if (mp_lz == &m_lz_ftl)
+        {
+                CHECK_EQ(block_dev_ftl_format(&m_ftl), NRF_SUCCESS);
+        }
+        CHECK_EQ(block_dev_lz_format(mp_lz), NRF_SUCCESS);
+
+        memset(m_states, 0, sizeof(m_states));
+        m_version = 1;
+        for (uint32_t i = 0; i < TEST_BLOCKS; ++i)
+        {
+                blk_test_update(&mp_lz->block_dev, m_states, i, m_version);
+        }
+        lz_sync();
+        lz_idle();
+        srand(seed);
+}
+
+/**
+ * @brief Rounds of short random runs, each unmapping a unit and ending with a sync.
+ */
+static void lz_random_work(void)
+{
+        for (uint32_t round = 0; round < 6; ++round)
+        {
+                uint32_t unit = rand() % (TEST_BLOCKS / BLK_PER_UNIT);
+
+                blk_test_trimmed(&mp_lz->block_dev, m_states, unit * BLK_PER_UNIT, BLK_PER_UNIT);
+
+                m_version++;
+                for (uint32_t run = 0; run < 12; ++run)
+                {
+                        uint32_t blk_id = rand() % TEST_BLOCKS;
+                        uint32_t count  = 1 + rand() % BLK_PER_UNIT;
+
+                        for (uint32_t i = blk_id; i < MIN(blk_id + count, TEST_BLOCKS); ++i)
+                        {
+                                if (!m_states[i].pending)
+                                {
+                                        blk_test_update(&mp_lz->block_dev, m_states, i, m_version);
+                                }
+                        }
+                        if (run % 4 == 0)
+                        {
+                                UNUSED_RETURN_VALUE(block_dev_ftl_process(&m_ftl));
+                        }
+                }
+                lz_sync();
+        }
+}
+
+/**
+ * @brief Cut the power throughout the random work, then check and keep using the device.
+ */
+static void lz_cut_runs(block_dev_lz_t const * p_lz)
+{
+        lz_setup(p_lz, 1);
+        uint32_t ops = blk_test_ops(lz_random_work);
+        blk_test_verify(&mp_lz->block_dev, m_states, TEST_BLOCKS);
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                lz_setup(p_lz, 1);
+                CHECK(blk_test_cut_run(lz_random_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                lz_boot();
+                blk_test_verify(&mp_lz->block_dev, m_states, TEST_BLOCKS);
+                CHECK_EQ(block_dev_qspi_stats_get(&m_qspi)->crc_errors, 0);
+
+                /* Blocks released before the cut are free again, not lost */
+                blk_test_settle(&mp_lz->block_dev, m_states, TEST_BLOCKS);
+                lz_random_work();
+                lz_idle();
+                lz_boot();
+                blk_test_verify(&mp_lz->block_dev, m_states, TEST_BLOCKS);
+        }
+}
+
+static void test_lz_cut_qspi(void)
+{
+        lz_cut_runs(&m_lz_qspi);
+}
+
+static void test_lz_cut_ftl(void)
+{
+        lz_cut_runs(&m_lz_ftl);
+}
+
+/**
+ * @brief Units rewritten over and over compress, and neither run the device out of
+ *        blocks nor leak them.
+ */
+static void test_lz_rewrite(void)
+{
+        lz_setup(&m_lz_qspi, 2);
+        uint32_t free_blocks = block_dev_lz_stats_get(mp_lz)->free_blocks;
+
+        for (uint32_t pass = 0; pass < 16; ++pass)
+        {
+                m_version++;
+                for (uint32_t i = 0; i < TEST_BLOCKS; ++i)
+                {
+                        blk_test_update(&mp_lz->block_dev, m_states, i, m_version);
+                }
+                lz_sync();
+        }
+
+        /* Half of every block pattern is a repeated record */
+        block_dev_lz_stats_t const * p_stats = block_dev_lz_stats_get(mp_lz);
+        CHECK(p_stats->units_written > p_stats->units_raw);
+        CHECK(p_stats->stored_bytes < p_stats->host_bytes);
+
+        /* Replaced copies are held until a table barrier, then released */
+        CHECK_EQ(p_stats->free_blocks + mp_lz->p_work->release_count * BLK_PER_UNIT, free_blocks);
+        lz_boot();
+        CHECK_EQ(block_dev_lz_stats_get(mp_lz)->free_blocks, free_blocks);
+        blk_test_verify(&mp_lz->block_dev, m_states, TEST_BLOCKS);
+}
+
+int main(void)
+{
+        TEST_RUN(test_lz_cut_qspi);
+        TEST_RUN(test_lz_cut_ftl);
+        TEST_RUN(test_lz_rewrite);
+        return 0;
+}
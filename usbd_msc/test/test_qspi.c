@@ -0,0 +1,468 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blk_test.h"
+#include "block_dev_qspi.h"
+#include "qspi_remap.h"
+
+/* QSPI block device on the flash simulator: power cuts at every kind of flash
+ * command, with and without journal, in-place programs, retirement of weak units
+ * and trimming */
+
+#define FLASH_SIZE  (2 * 1024 * 1024)
+#define TEST_BLOCKS 512
+#define BLK_PER_EU  (BLOCK_DEV_QSPI_ERASE_UNIT_SIZE / BLK_TEST_BLOCK_SIZE)
+#define CUT_RUNS    48
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi_journal,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi_plain,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi_verify,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+static block_dev_qspi_t const * mp_qspi;
+static blk_test_state_t         m_states[TEST_BLOCKS];
+static uint16_t                 m_version;
+static uint32_t                 m_trim_blocks;
+
+/**
+ * @brief Power the stack up as after a reset: RAM cleared, flash content kept.
+ */
+static void qspi_boot(void)
+{
+        flash_sim_power_on();
+        memset(mp_qspi->p_work, 0, sizeof(*mp_qspi->p_work));
+        CHECK_EQ(nrf_blk_dev_init(&mp_qspi->block_dev, NULL, NULL), NRF_SUCCESS);
+        CHECK(nrf_blk_dev_geometry(&mp_qspi->block_dev)->blk_count >= TEST_BLOCKS);
+}
+
+static void qspi_idle(void)
+{
+        while (block_dev_qspi_process(mp_qspi))
+        {
+        }
+}
+
+static void qspi_flush(void)
+{
+        CHECK_EQ(block_dev_qspi_cache_flush(mp_qspi), NRF_SUCCESS);
+        blk_test_synced(m_states, TEST_BLOCKS);
+}
+
+static void qspi_verify(void)
+{
+        blk_test_verify(&mp_qspi->block_dev, m_states, TEST_BLOCKS);
+}
+
+/**
+ * @brief Fresh flash with the first version of every test block on it.
+ *
+ * @param weak Make erase units 2 to 5 weak.
+ */
+static void qspi_setup(uint32_t seed, bool weak)
+{
+        flash_sim_reset(FLASH_SIZE, seed);
+        for (uint32_t eu_idx = 2; weak && (eu_idx < 6); ++eu_idx)
+        {
+                flash_sim_weak_set(eu_idx, true);
+        }
+        qspi_boot();
+        qspi_idle();
+
+        memset(m_states, 0, sizeof(m_states));
+        m_version = 1;
+        for (uint32_t i = 0; i < TEST_BLOCKS; ++i)
+        {
+                blk_test_update(&mp_qspi->block_dev, m_states, i, m_version);
+        }
+        qspi_flush();
+        qspi_idle();
+        srand(seed);
+}
+
+/**
+ * @brief Random rewrites in rounds ended by a cache flush, background work in between.
+ */
+static void qspi_random_rounds(uint32_t rounds)
+{
+        for (uint32_t round = 0; round < rounds; ++round)
+        {
+                m_version++;
+                for (uint32_t i = 0; i < 24; ++i)
+                {
+                        uint32_t blk_id = rand() % TEST_BLOCKS;
+
+                        if (!m_states[blk_id].pending)
+                        {
+                                blk_test_update(&mp_qspi->block_dev, m_states, blk_id, m_version);
+                        }
+                        UNUSED_RETURN_VALUE(block_dev_qspi_process(mp_qspi));
+                }
+                qspi_flush();
+        }
+}
+
+static void qspi_random_work(void)
+{
+        qspi_random_rounds(6);
+}
+
+/**
+ * @brief Journal and CRC log: after a cut in any write-back, every block holds its
+ *        old or its new version, and no block fails its CRC.
+ */
+static void test_qspi_cut_journal(void)
+{
+        mp_qspi = &m_qspi_journal;
+        qspi_setup(1, false);
+        uint32_t ops = blk_test_ops(qspi_random_work);
+        CHECK(block_dev_qspi_stats_get(mp_qspi)->journal_writes > 0);
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                qspi_setup(1, false);
+                CHECK(blk_test_cut_run(qspi_random_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                qspi_boot();
+                qspi_verify();
+                CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+
+                /* Keeps working, and the CRC log still matches after a clean remount */
+                blk_test_settle(&mp_qspi->block_dev, m_states, TEST_BLOCKS);
+                qspi_random_rounds(2);
+                qspi_idle();
+                CHECK_EQ(nrf_blk_dev_uninit(&mp_qspi->block_dev), NRF_SUCCESS);
+                qspi_boot();
+                qspi_verify();
+                CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+        }
+}
+
+/**
+ * @brief Version of a block whose rewrites only clear bits: version 1 of
+ *        blk_test_pattern(), each later one clears one more low bit of every word.
+ */
+static void qspi_clear_pattern(uint32_t * p_words, uint32_t blk_id, uint32_t version)
+{
+        blk_test_pattern(p_words, blk_id, 1);
+        for (uint32_t i = 0; i < BLK_TEST_BLOCK_SIZE / sizeof(uint32_t); ++i)
+        {
+                p_words[i] &= UINT32_MAX << (version - 1);
+        }
+}
+
+static void qspi_clear_update(uint32_t blk_id, uint16_t version)
+{
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        CHECK(m_states[blk_id].pending == 0);
+        qspi_clear_pattern(buff, blk_id, version);
+        blk_test_write(&mp_qspi->block_dev, buff, blk_id, 1);
+        m_states[blk_id].pending = version;
+}
+
+/**
+ * @brief Random rewrites which only clear bits, so every write-back programs in place.
+ */
+static void qspi_clear_work(void)
+{
+        for (uint32_t round = 0; round < 8; ++round)
+        {
+                for (uint32_t i = 0; i < 24; ++i)
+                {
+                        uint32_t blk_id = rand() % TEST_BLOCKS;
+
+                        if (!m_states[blk_id].pending)
+                        {
+                                qspi_clear_update(blk_id, m_states[blk_id].durable + 1);
+                        }
+                        UNUSED_RETURN_VALUE(block_dev_qspi_process(mp_qspi));
+                }
+                qspi_flush();
+        }
+}
+
+/**
+ * @brief Check every block against its versions.
+ *
+ * A block with a pending version reads its old version, its new one, or any mix of
+ * their bits a torn program leaves: all bits of the new one cleared, none outside
+ * the old one. A block without holds its durable version.
+ *
+ * @return Number of blocks holding such a mix.
+ */
+static uint32_t qspi_clear_verify(void)
+{
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t old_words[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t new_words[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t torn = 0;
+
+        for (uint32_t blk_id = 0; blk_id < TEST_BLOCKS; ++blk_id)
+        {
+                blk_test_state_t const * p_state = &m_states[blk_id];
+
+                blk_test_read(&mp_qspi->block_dev, buff, blk_id, 1);
+                qspi_clear_pattern(old_words, blk_id, p_state->durable);
+                qspi_clear_pattern(new_words, blk_id,
+                                   p_state->pending ? p_state->pending : p_state->durable);
+
+                for (uint32_t i = 0; i < ARRAY_SIZE(buff); ++i)
+                {
+                        if ((buff[i] & ~old_words[i]) || (new_words[i] & ~buff[i]))
+                        {
+                                fprintf(stderr, "block %u: not between version %u and %u\n",
+                                        blk_id, p_state->durable, p_state->pending);
+                                exit(1);
+                        }
+                }
+                torn += memcmp(buff, old_words, sizeof(buff)) && memcmp(buff, new_words, sizeof(buff));
+        }
+
+        return torn;
+}
+
+/**
+ * @brief Programs in place are not journaled: a cut in one leaves the blocks of the
+ *        write-back between their old and new versions, a later rewrite repairs them,
+ *        and no committed CRC covers the torn content.
+ */
+static void test_qspi_cut_in_place(void)
+{
+        uint32_t torn = 0;
+
+        mp_qspi = &m_qspi_journal;
+        qspi_setup(13, false);
+        uint32_t journal_writes = block_dev_qspi_stats_get(mp_qspi)->journal_writes;
+        uint32_t ops = blk_test_ops(qspi_clear_work);
+        CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->journal_writes, journal_writes);
+        CHECK(block_dev_qspi_stats_get(mp_qspi)->erase_skips > 0);
+        CHECK_EQ(qspi_clear_verify(), 0);
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                qspi_setup(13, false);
+                CHECK(blk_test_cut_run(qspi_clear_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                qspi_boot();
+                torn += qspi_clear_verify();
+                CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+
+                /* Rewriting every block clears bits again and leaves no mix behind */
+                for (uint32_t blk_id = 0; blk_id < TEST_BLOCKS; ++blk_id)
+                {
+                        uint16_t version = MAX(m_states[blk_id].durable, m_states[blk_id].pending) + 1;
+
+                        m_states[blk_id].pending = 0;
+                        qspi_clear_update(blk_id, version);
+                }
+                qspi_flush();
+                qspi_idle();
+                CHECK_EQ(nrf_blk_dev_uninit(&mp_qspi->block_dev), NRF_SUCCESS);
+                qspi_boot();
+                CHECK_EQ(qspi_clear_verify(), 0);
+                CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+        }
+
+        /* The cuts did tear programs in place */
+        CHECK(torn > 0);
+}
+
+/**
+ * @brief A block changed on flash behind the device fails its CRC, on read and in the scrub.
+ */
+static void test_qspi_crc_detect(void)
+{
+        uint8_t buff[BLK_TEST_BLOCK_SIZE];
+
+        mp_qspi = &m_qspi_journal;
+        qspi_setup(7, false);
+
+        /* Low bit of the version in block 21 programmed, as a disturb would */
+        flash_sim_mem()[21 * BLK_TEST_BLOCK_SIZE + 300] &= 0xFE;
+        blk_test_read(&mp_qspi->block_dev, buff, 21, 1);
+        CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 1);
+
+        /* Idle calls a minute apart, within the 24-bit app_timer counter range */
+        uint32_t passes = block_dev_qspi_stats_get(mp_qspi)->scrub_passes;
+        while (block_dev_qspi_stats_get(mp_qspi)->scrub_passes == passes)
+        {
+                flash_sim_idle(60 * 1000000);
+                qspi_idle();
+        }
+        CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 2);
+}
+
+/**
+ * @brief Sequential writes from block 64 over trimmed blocks, 96 blocks long.
+ */
+static void qspi_stream_work(void)
+{
+        static uint32_t buff[4 * BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        blk_test_trimmed(&mp_qspi->block_dev, m_states, 64, m_trim_blocks);
+        for (uint32_t blk_id = 64; blk_id < 64 + 96; blk_id += 4)
+        {
+                for (uint32_t i = 0; i < 4; ++i)
+                {
+                        blk_test_pattern((uint8_t *)buff + i * BLK_TEST_BLOCK_SIZE, blk_id + i, 2);
+                        m_states[blk_id + i].pending = 2;
+                }
+                blk_test_write(&mp_qspi->block_dev, buff, blk_id, 4);
+
+                /* Host gap between requests, the erase ahead runs here */
+                for (uint32_t i = 0; i < 8; ++i)
+                {
+                        UNUSED_RETURN_VALUE(block_dev_qspi_process(mp_qspi));
+                }
+        }
+        qspi_flush();
+}
+
+/**
+ * @brief Erase ahead only erases trimmed units: without journal, a cut during a
+ *        stream never loses a block holding data, whether the units after the
+ *        stream are trimmed or not.
+ */
+static void test_qspi_cut_erase_ahead(void)
+{
+        static const uint32_t trims[] = { 96, 96 + 4 * BLK_PER_EU };
+
+        mp_qspi = &m_qspi_plain;
+        for (uint32_t t = 0; t < ARRAY_SIZE(trims); ++t)
+        {
+                m_trim_blocks = trims[t];
+                qspi_setup(3, false);
+                uint32_t ops = blk_test_ops(qspi_stream_work);
+                CHECK(block_dev_qspi_stats_get(mp_qspi)->erase_aheads > 0);
+                qspi_verify();
+
+                for (uint32_t run = 0; run < CUT_RUNS; ++run)
+                {
+                        qspi_setup(3, false);
+                        CHECK(blk_test_cut_run(qspi_stream_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                        /* Blocks of the stream were trimmed, all the others have to be intact */
+                        qspi_boot();
+                        qspi_verify();
+                }
+        }
+}
+
+static void qspi_remap_work(void)
+{
+        qspi_random_rounds(4);
+        m_version++;
+        for (uint32_t i = 2 * BLK_PER_EU; i < 6 * BLK_PER_EU; ++i)
+        {
+                if (!m_states[i].pending)
+                {
+                        blk_test_update(&mp_qspi->block_dev, m_states, i, m_version);
+                }
+        }
+        qspi_flush();
+}
+
+/**
+ * @brief Units whose programs do not hold are retired to spares; the data survives
+ *        a remount and cuts during the retirement.
+ */
+static void test_qspi_remap(void)
+{
+        mp_qspi = &m_qspi_verify;
+        qspi_setup(5, true);
+        uint32_t ops = blk_test_ops(qspi_remap_work);
+
+        CHECK_EQ(qspi_remap_count_get(), 4);
+        CHECK(block_dev_qspi_stats_get(mp_qspi)->verify_errors >= 4);
+        qspi_verify();
+        CHECK_EQ(nrf_blk_dev_uninit(&mp_qspi->block_dev), NRF_SUCCESS);
+        qspi_boot();
+        CHECK_EQ(qspi_remap_count_get(), 4);
+        qspi_verify();
+        CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+
+        for (uint32_t run = 0; run < CUT_RUNS; ++run)
+        {
+                qspi_setup(5, true);
+                CHECK(blk_test_cut_run(qspi_remap_work, blk_test_cut_point(run, CUT_RUNS, ops)));
+
+                qspi_boot();
+                qspi_verify();
+                CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->crc_errors, 0);
+                CHECK(qspi_remap_count_get() <= 4);
+        }
+}
+
+/**
+ * @brief A write-back leaves trimmed blocks blank, and units trimmed whole are erased
+ *        in the background, so deleted data is not copied around.
+ */
+static void test_qspi_trim(void)
+{
+        qspi_flash_stats_t const * p_flash = qspi_flash_stats_get();
+
+        mp_qspi = &m_qspi_plain;
+        qspi_setup(11, false);
+
+        /* Unit 1: seven blocks deleted, the eighth rewritten */
+        blk_test_trimmed(&mp_qspi->block_dev, m_states, BLK_PER_EU + 1, BLK_PER_EU - 1);
+        blk_test_update(&mp_qspi->block_dev, m_states, BLK_PER_EU, 2);
+        uint32_t prog_bytes = p_flash->prog_bytes;
+        qspi_flush();
+        CHECK_EQ(p_flash->prog_bytes - prog_bytes, BLK_TEST_BLOCK_SIZE);
+        CHECK_EQ(block_dev_qspi_stats_get(mp_qspi)->trim_drops, BLK_PER_EU - 1);
+
+        /* Unit 3 deleted whole */
+        blk_test_trimmed(&mp_qspi->block_dev, m_states, 3 * BLK_PER_EU, BLK_PER_EU);
+        qspi_idle();
+        CHECK(block_dev_qspi_stats_get(mp_qspi)->trim_erases >= 1);
+        for (uint32_t i = 0; i < BLOCK_DEV_QSPI_ERASE_UNIT_SIZE; ++i)
+        {
+                CHECK_EQ(flash_sim_mem()[3 * BLOCK_DEV_QSPI_ERASE_UNIT_SIZE + i], 0xFF);
+        }
+
+        /* Rewriting it programs without an erase */
+        uint32_t erases = p_flash->erases;
+        for (uint32_t i = 3 * BLK_PER_EU; i < 4 * BLK_PER_EU; ++i)
+        {
+                blk_test_update(&mp_qspi->block_dev, m_states, i, 3);
+        }
+        qspi_flush();
+        CHECK_EQ(p_flash->erases, erases);
+        qspi_verify();
+}
+
+int main(void)
+{
+        TEST_RUN(test_qspi_cut_journal);
+        TEST_RUN(test_qspi_cut_in_place);
+        TEST_RUN(test_qspi_crc_detect);
+        TEST_RUN(test_qspi_cut_erase_ahead);
+        TEST_RUN(test_qspi_remap);
+        TEST_RUN(test_qspi_trim);
+        return 0;
+}
@@ -0,0 +1,227 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include "qspi_sfdp.h"
+#include "test.h"
+
+/* Little endian DWORD as SFDP space bytes */
+#define DW(x) (uint8_t)(x), (uint8_t)((x) >> 8), (uint8_t)((x) >> 16), (uint8_t)((x) >> 24)
+
+/**
+ * SFDP space of the Macronix MX25R6435F (64 Mbit, 3-byte addresses): SFDP 1.6
+ * header, JEDEC BFPT 1.6 of 16 DWORDs at 0x30 and a Macronix table, as listed in
+ * the SFDP table of the datasheet.
+ */
+static const uint8_t m_mx25r6435f[] = {
+        /* 0x00: SFDP header, 2 parameter headers */
+        'S', 'F', 'D', 'P', 0x06, 0x01, 0x01, 0xFF,
+        /* 0x08: BFPT 1.6, 16 DWORDs at 0x30 */
+        0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF,
+        /* 0x10: Macronix table 1.0, 4 DWORDs at 0x110 */
+        0xC2, 0x00, 0x01, 0x04, 0x10, 0x01, 0x00, 0xFF,
+        /* 0x18: unused */
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        /* 0x30: BFPT */
+        DW(0xFFF120E5), DW(0x03FFFFFF), DW(0x6B08EB44), DW(0xBB043B08),
+        DW(0xFFFFFFFE), DW(0xFF00FFFF), DW(0xFF00FFFF), DW(0x520F200C),
+        DW(0xFF00D810), DW(0x00A60236), DW(0xEA14C281), DW(0x38D73CF4),
+        DW(0xB030B030), DW(0xF77DFFFF), DW(0x5C236000), DW(0x0000F0FF),
+};
+
+/**
+ * SFDP space of the Winbond W25Q256JV (256 Mbit, 3- or 4-byte addresses): SFDP 1.6
+ * header and JEDEC BFPT 1.6 of 16 DWORDs at 0x80, as listed in the datasheet.
+ */
+static const uint8_t m_w25q256jv[] = {
+        /* 0x00: SFDP header, 1 parameter header */
+        'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+        /* 0x08: BFPT 1.6, 16 DWORDs at 0x80 */
+        0x00, 0x06, 0x01, 0x10, 0x80, 0x00, 0x00, 0xFF,
+        [0x10 ... 0x7F] = 0xFF,
+        /* 0x80: BFPT */
+        DW(0xFFF320E5), DW(0x0FFFFFFF), DW(0x6B08EB44), DW(0xBB423B08),
+        DW(0xFFFFFFFE), DW(0xFF00FFFF), DW(0xEB40FFFF), DW(0x520F200C),
+        DW(0xFF00D810), DW(0x00A60236), DW(0x0072F581), DW(0x33F68C00),
+        DW(0x757A7A75), DW(0xF7A2D55C), DW(0x004CF619), DW(0x0130F0FF),
+};
+
+/**
+ * JESD216 (rev 1.0) table of 9 DWORDs and a newer 16 DWORD one, listed first.
+ */
+static const uint8_t m_two_bfpt[] = {
+        'S', 'F', 'D', 'P', 0x00, 0x01, 0x01, 0xFF,
+        /* BFPT 1.6 at 0x20 */
+        0x00, 0x06, 0x01, 0x10, 0x20, 0x00, 0x00, 0xFF,
+        /* BFPT 1.0 at 0x60 */
+        0x00, 0x00, 0x01, 0x09, 0x60, 0x00, 0x00, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        /* 0x20: 4 Gbit, bit 31 of DWORD 2 gives the size as a power of two */
+        DW(0xFFF320E5), DW(0x80000020), DW(0x6B08EB44), DW(0xBB423B08),
+        DW(0xFFFFFFFE), DW(0xFF00FFFF), DW(0xFF00FFFF), DW(0x520F200C),
+        DW(0xFF00D810), DW(0x00A60236), DW(0x000000A1), DW(0x80000000),
+        DW(0x00000000), DW(0x00000000), DW(0x00500000), DW(0x00000000),
+        /* 0x60: 1 Mbit, 4 KB erase only */
+        DW(0xFF0120E5), DW(0x000FFFFF), DW(0xFFFFFFFF), DW(0xFFFFFFFF),
+        DW(0xFFFFFFFE), DW(0xFF00FFFF), DW(0xFF00FFFF), DW(0x0000200C),
+        DW(0x00000000),
+};
+
+static uint8_t const * m_image;
+static size_t m_image_size;
+
+/**
+ * Reads past the end of the image return 0xFF, like unprogrammed SFDP space.
+ */
+static ret_code_t image_read(uint32_t addr, void * p_buff, size_t size)
+{
+        uint8_t * p_dst = p_buff;
+
+        for (size_t i = 0; i < size; ++i)
+        {
+                p_dst[i] = (addr + i < m_image_size) ? m_image[addr + i] : 0xFF;
+        }
+        return NRF_SUCCESS;
+}
+
+static ret_code_t parse(uint8_t const * p_image, size_t size, qspi_sfdp_t * p_sfdp)
+{
+        m_image      = p_image;
+        m_image_size = size;
+        return qspi_sfdp_parse(image_read, p_sfdp);
+}
+
+static void test_mx25r6435f(void)
+{
+        qspi_sfdp_t sfdp;
+
+        CHECK_EQ(parse(m_mx25r6435f, sizeof(m_mx25r6435f), &sfdp), NRF_SUCCESS);
+        CHECK_EQ(sfdp.major, 1);
+        CHECK_EQ(sfdp.minor, 6);
+        CHECK_EQ(sfdp.size, 8 * 1024 * 1024);
+        CHECK_EQ(sfdp.page_size, 256);
+        CHECK(!sfdp.addr_4byte);
+        CHECK_EQ(sfdp.enter_4byte, 0);
+
+        CHECK_EQ(sfdp.erase[0].size, 4096);
+        CHECK_EQ(sfdp.erase[0].opcode, 0x20);
+        CHECK_EQ(sfdp.erase[1].size, 32768);
+        CHECK_EQ(sfdp.erase[1].opcode, 0x52);
+        CHECK_EQ(sfdp.erase[2].size, 65536);
+        CHECK_EQ(sfdp.erase[2].opcode, 0xD8);
+        CHECK_EQ(sfdp.erase[3].size, 0);
+
+        CHECK_EQ(sfdp.qe, QSPI_SFDP_QE_SR1_BIT6);
+
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_4_4].opcode, 0xEB);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_4_4].dummy_clocks, 4);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_4_4].mode_clocks, 2);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_1_4].opcode, 0x6B);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_1_4].dummy_clocks, 8);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_1_2].opcode, 0x3B);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_2_2].opcode, 0xBB);
+
+        CHECK_EQ(sfdp.suspend.suspend_opcode, 0xB0);
+        CHECK_EQ(sfdp.suspend.resume_opcode, 0x30);
+        CHECK_EQ(sfdp.suspend.suspend_latency_us, 25);
+        CHECK_EQ(sfdp.suspend.resume_interval_us, 14 * 64);
+}
+
+static void test_w25q256jv(void)
+{
+        qspi_sfdp_t sfdp;
+
+        CHECK_EQ(parse(m_w25q256jv, sizeof(m_w25q256jv), &sfdp), NRF_SUCCESS);
+        CHECK_EQ(sfdp.size, 32 * 1024 * 1024);
+        CHECK_EQ(sfdp.page_size, 256);
+        CHECK(sfdp.addr_4byte);
+        CHECK_EQ(sfdp.enter_4byte, 0x01);
+
+        CHECK_EQ(sfdp.erase[0].size, 4096);
+        CHECK_EQ(sfdp.erase[0].opcode, 0x20);
+        CHECK_EQ(sfdp.erase[1].size, 32768);
+        CHECK_EQ(sfdp.erase[1].opcode, 0x52);
+        CHECK_EQ(sfdp.erase[2].size, 65536);
+        CHECK_EQ(sfdp.erase[2].opcode, 0xD8);
+        CHECK_EQ(sfdp.erase[3].size, 0);
+
+        CHECK_EQ(sfdp.qe, QSPI_SFDP_QE_SR2_BIT1_NC);
+
+        CHECK_EQ(sfdp.suspend.suspend_opcode, 0x75);
+        CHECK_EQ(sfdp.suspend.resume_opcode, 0x7A);
+        CHECK_EQ(sfdp.suspend.suspend_latency_us, 20);
+}
+
+static void test_newest_bfpt(void)
+{
+        qspi_sfdp_t sfdp;
+
+        CHECK_EQ(parse(m_two_bfpt, sizeof(m_two_bfpt), &sfdp), NRF_SUCCESS);
+        CHECK_EQ(sfdp.size, 512u * 1024 * 1024);
+        CHECK_EQ(sfdp.page_size, 1024);
+        CHECK_EQ(sfdp.qe, QSPI_SFDP_QE_SR2_BIT1_35);
+        CHECK_EQ(sfdp.suspend.suspend_opcode, 0);
+}
+
+static void test_jesd216_rev_a(void)
+{
+        static uint8_t image[sizeof(m_two_bfpt)];
+        qspi_sfdp_t sfdp;
+
+        /* Only the 9 DWORD table left */
+        memcpy(image, m_two_bfpt, sizeof(image));
+        image[6] = 0x00;
+        memcpy(&image[8], &m_two_bfpt[16], 8);
+
+        CHECK_EQ(parse(image, sizeof(image), &sfdp), NRF_SUCCESS);
+        CHECK_EQ(sfdp.size, 128 * 1024);
+        CHECK_EQ(sfdp.page_size, 256);
+        CHECK_EQ(sfdp.qe, QSPI_SFDP_QE_UNKNOWN);
+        CHECK_EQ(sfdp.erase[0].size, 4096);
+        CHECK_EQ(sfdp.erase[1].size, 0);
+        CHECK_EQ(sfdp.read[QSPI_SFDP_READ_1_4_4].opcode, 0);
+        CHECK_EQ(sfdp.suspend.suspend_opcode, 0);
+}
+
+static void test_malformed(void)
+{
+        static uint8_t image[sizeof(m_mx25r6435f)];
+        qspi_sfdp_t sfdp;
+
+        memcpy(image, m_mx25r6435f, sizeof(image));
+        image[0] = 'X';
+        CHECK_EQ(parse(image, sizeof(image), &sfdp), NRF_ERROR_NOT_FOUND);
+
+        /* No BFPT header, only the vendor table */
+        memcpy(image, m_mx25r6435f, sizeof(image));
+        image[6] = 0x00;
+        memcpy(&image[8], &m_mx25r6435f[16], 8);
+        CHECK_EQ(parse(image, sizeof(image), &sfdp), NRF_ERROR_NOT_FOUND);
+
+        /* BFPT shorter than the 9 mandatory DWORDs */
+        memcpy(image, m_mx25r6435f, sizeof(image));
+        image[11] = 8;
+        CHECK_EQ(parse(image, sizeof(image), &sfdp), NRF_ERROR_INVALID_DATA);
+
+        /* Density exponent out of range */
+        memcpy(image, m_mx25r6435f, sizeof(image));
+        image[0x30 + 4 + 3] = 0x80;
+        image[0x30 + 4 + 0] = 0x40;
+        CHECK_EQ(parse(image, sizeof(image), &sfdp), NRF_ERROR_INVALID_DATA);
+}
+
+int main(void)
+{
+        printf("qspi_sfdp\n");
+        TEST_RUN(test_mx25r6435f);
+        TEST_RUN(test_w25q256jv);
+        TEST_RUN(test_newest_bfpt);
+        TEST_RUN(test_jesd216_rev_a);
+        TEST_RUN(test_malformed);
+        return 0;
+}
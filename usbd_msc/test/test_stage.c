@@ -0,0 +1,350 @@
+/**
+ * Copyright (c) 2020 Jimmy Wong
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blk_test.h"
+#include "block_dev_qspi.h"
+#include "block_dev_stage.h"
+
+/* RAM staging device on the QSPI block device, with the flags of main.c, on the
+ * flash simulator: staged blocks read back, rewrites and unmaps stay in RAM, a
+ * write finding no free slot destages inline, flushes and barriers put the
+ * staged blocks on flash, and a device has one user at a time */
+
+#define FLASH_SIZE   (2 * 1024 * 1024)
+#define TEST_BLOCKS  256
+#define STAGE_SIZE   (16 * 1024)
+#define BATCH_BLOCKS (BLOCK_DEV_STAGE_CONFIG_BATCH_SIZE / BLK_TEST_BLOCK_SIZE)
+
+BLOCK_DEV_QSPI_DEFINE(m_qspi,
+                      BLOCK_DEV_QSPI_CONFIG(BLK_TEST_BLOCK_SIZE,
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_WRITEBACK |
+                                            BLOCK_DEV_QSPI_FLAG_CACHE_JOURNAL |
+                                            BLOCK_DEV_QSPI_FLAG_CRC |
+                                            BLOCK_DEV_QSPI_FLAG_VERIFY,
+                                            NRF_DRV_QSPI_DEFAULT_CONFIG),
+                      NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+static uint32_t m_stage_buff[STAGE_SIZE / sizeof(uint32_t)];
+
+BLOCK_DEV_STAGE_DEFINE(m_stage,
+                       NRF_BLOCKDEV_BASE_ADDR(m_qspi, block_dev),
+                       m_stage_buff, sizeof(m_stage_buff),
+                       NFR_BLOCK_DEV_INFO_CONFIG("Nordic", "QSPI", "1.00"));
+
+static blk_test_state_t m_states[TEST_BLOCKS];
+
+/**
+ * @brief Power the stack up as after a reset: RAM cleared, flash content kept.
+ */
+static void stage_boot(void)
+{
+        flash_sim_power_on();
+        memset(m_qspi.p_work, 0, sizeof(*m_qspi.p_work));
+        memset(m_stage.p_work, 0, sizeof(*m_stage.p_work));
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, NULL, NULL), NRF_SUCCESS);
+        CHECK(nrf_blk_dev_geometry(&m_stage.block_dev)->blk_count >= TEST_BLOCKS);
+        CHECK(m_stage.p_work->slot_count > BATCH_BLOCKS);
+}
+
+/**
+ * @brief Fresh flash with the first version of every test block on it.
+ */
+static void stage_setup(void)
+{
+        flash_sim_reset(FLASH_SIZE, 1);
+        stage_boot();
+
+        memset(m_states, 0, sizeof(m_states));
+        for (uint32_t i = 0; i < TEST_BLOCKS; ++i)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 1);
+        }
+        blk_test_barrier(&m_stage.block_dev);
+        blk_test_synced(m_states, TEST_BLOCKS);
+        memset(&m_stage.p_work->stats, 0, sizeof(m_stage.p_work->stats));
+}
+
+/**
+ * @brief Check the blocks held by the QSPI device, under the stage.
+ */
+static void stage_verify_lower(void)
+{
+        blk_test_verify(&m_qspi.block_dev, m_states, TEST_BLOCKS);
+}
+
+/**
+ * @brief Staged blocks read back from RAM, alone and within runs of blocks the
+ *        lower device holds, and do not reach the flash.
+ */
+static void test_stage_read_write(void)
+{
+        stage_setup();
+        uint32_t ops = flash_sim_ops_get();
+
+        for (uint32_t i = 10; i < 10 + BATCH_BLOCKS; i += 2)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 2);
+        }
+        CHECK_EQ(flash_sim_ops_get(), ops);
+        CHECK_EQ(m_stage.p_work->used, BATCH_BLOCKS / 2);
+
+        /* Staged and lower blocks interleaved in one request */
+        uint32_t buff[2 * BATCH_BLOCKS * BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t expect[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        blk_test_read(&m_stage.block_dev, buff, 8, 2 * BATCH_BLOCKS);
+        for (uint32_t i = 0; i < 2 * BATCH_BLOCKS; ++i)
+        {
+                uint32_t blk_id = 8 + i;
+
+                blk_test_pattern(expect, blk_id, m_states[blk_id].pending ? 2 : 1);
+                CHECK(memcmp(&buff[i * BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)], expect,
+                             sizeof(expect)) == 0);
+        }
+
+        /* The flash still holds the first versions */
+        for (uint32_t i = 0; i < TEST_BLOCKS; ++i)
+        {
+                blk_test_read(&m_qspi.block_dev, expect, i, 1);
+                CHECK(blk_test_match(expect, i, &(blk_test_state_t){ .durable = 1 }));
+        }
+        blk_test_verify(&m_stage.block_dev, m_states, TEST_BLOCKS);
+}
+
+/**
+ * @brief Rewrites of a staged block replace it in RAM, only its last version is destaged.
+ */
+static void test_stage_absorb(void)
+{
+        stage_setup();
+
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+
+        for (uint16_t version = 2; version < 10; ++version)
+        {
+                blk_test_pattern(buff, 40, version);
+                blk_test_write(&m_stage.block_dev, buff, 40, 1);
+        }
+        m_states[40].pending = 9;
+
+        block_dev_stage_stats_t const * p_stats = block_dev_stage_stats_get(&m_stage);
+        CHECK_EQ(p_stats->staged_blocks, 1);
+        CHECK_EQ(p_stats->absorbed_blocks, 7);
+        CHECK_EQ(m_stage.p_work->used, 1);
+
+        blk_test_barrier(&m_stage.block_dev);
+        blk_test_synced(m_states, TEST_BLOCKS);
+        CHECK_EQ(p_stats->destaged_blocks, 1);
+        CHECK_EQ(p_stats->destage_writes, 1);
+        stage_verify_lower();
+}
+
+/**
+ * @brief An unmap drops the staged blocks of its range, they never reach the lower
+ *        device, and is passed on.
+ */
+static void test_stage_unmap(void)
+{
+        stage_setup();
+
+        for (uint32_t i = 64; i < 64 + BATCH_BLOCKS; ++i)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 2);
+        }
+        blk_test_update(&m_stage.block_dev, m_states, 200, 2);
+
+        m_states[64 + 1].pending = 0;
+        m_states[64 + 2].pending = 0;
+        blk_test_trimmed(&m_stage.block_dev, m_states, 64 + 1, 2);
+        CHECK_EQ(m_stage.p_work->used, BATCH_BLOCKS - 1);
+
+        /* Whole device, over the slots */
+        blk_test_unmap(&m_stage.block_dev, 128, TEST_BLOCKS - 128);
+        CHECK_EQ(m_stage.p_work->used, BATCH_BLOCKS - 2);
+        m_states[200].pending = 0;
+        for (uint32_t i = 128; i < TEST_BLOCKS; ++i)
+        {
+                m_states[i].trimmed = true;
+        }
+
+        blk_test_barrier(&m_stage.block_dev);
+        blk_test_synced(m_states, TEST_BLOCKS);
+        CHECK_EQ(block_dev_stage_stats_get(&m_stage)->destaged_blocks, BATCH_BLOCKS - 2);
+        stage_verify_lower();
+
+        /* Passed on: the QSPI device holds the unmapped blocks as trimmed */
+        CHECK_EQ(block_dev_qspi_stats_get(&m_qspi)->trim_blocks, 2 + TEST_BLOCKS - 128);
+}
+
+/**
+ * @brief A write finding every slot in use destages the oldest batch before it
+ *        completes, and loses nothing.
+ */
+static void test_stage_stall(void)
+{
+        stage_setup();
+        uint32_t slots = m_stage.p_work->slot_count;
+
+        CHECK(slots + 1 <= TEST_BLOCKS);
+        for (uint32_t i = 0; i < slots; ++i)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 2);
+        }
+        block_dev_stage_stats_t const * p_stats = block_dev_stage_stats_get(&m_stage);
+        CHECK_EQ(p_stats->stall_batches, 0);
+        CHECK_EQ(m_stage.p_work->used, slots);
+
+        blk_test_update(&m_stage.block_dev, m_states, slots, 2);
+        uint32_t destaged = p_stats->destaged_blocks;
+        CHECK_EQ(p_stats->stall_batches, 1);
+        CHECK(destaged && (destaged <= BATCH_BLOCKS));
+        CHECK_EQ(m_stage.p_work->used, slots - destaged + 1);
+
+        /* One batch went to the lower device, the other blocks stay staged */
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t found = 0;
+        uint32_t batch = UINT32_MAX;
+        for (uint32_t i = 0; i < slots; ++i)
+        {
+                blk_test_read(&m_qspi.block_dev, buff, i, 1);
+                if (blk_test_match(buff, i, &(blk_test_state_t){ .durable = 2 }))
+                {
+                        CHECK((batch == UINT32_MAX) || (batch == i / BATCH_BLOCKS));
+                        batch = i / BATCH_BLOCKS;
+                        found++;
+                }
+        }
+        CHECK_EQ(found, destaged);
+        blk_test_verify(&m_stage.block_dev, m_states, TEST_BLOCKS);
+}
+
+/**
+ * @brief Cache flushes, polled or not, and barriers put every staged block on
+ *        flash; blocks staged after them are lost on a power loss.
+ */
+static void test_stage_flush(void)
+{
+        stage_setup();
+
+        /* Polled flush, a batch per call */
+        for (uint32_t i = 0; i < 3 * BATCH_BLOCKS; ++i)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 2);
+        }
+        bool     flushing = true;
+        uint32_t calls    = 0;
+        while (flushing)
+        {
+                CHECK_EQ(nrf_blk_dev_ioctl(&m_stage.block_dev, NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH,
+                                           &flushing), NRF_SUCCESS);
+                calls++;
+        }
+        CHECK(calls >= 3);
+        while (block_dev_qspi_process(&m_qspi))
+        {
+        }
+        CHECK_EQ(m_stage.p_work->used, 0);
+        blk_test_synced(m_states, TEST_BLOCKS);
+
+        /* Flush at once */
+        for (uint32_t i = 50; i < 60; ++i)
+        {
+                blk_test_update(&m_stage.block_dev, m_states, i, 3);
+        }
+        CHECK_EQ(nrf_blk_dev_ioctl(&m_stage.block_dev, NRF_BLOCK_DEV_IOCTL_REQ_CACHE_FLUSH, NULL),
+                 NRF_SUCCESS);
+        CHECK_EQ(m_stage.p_work->used, 0);
+        blk_test_synced(m_states, TEST_BLOCKS);
+
+        /* Barrier of a range destages everything */
+        blk_test_update(&m_stage.block_dev, m_states, 70, 4);
+        blk_test_update(&m_stage.block_dev, m_states, 200, 4);
+        block_dev_barrier_req_t barrier = { .blk_id = 70, .blk_count = 1 };
+        CHECK_EQ(nrf_blk_dev_ioctl(&m_stage.block_dev, BLOCK_DEV_IOCTL_REQ_WRITE_BARRIER, &barrier),
+                 NRF_SUCCESS);
+        CHECK_EQ(m_stage.p_work->used, 0);
+        m_states[70].durable = 4;
+        m_states[70].pending = 0;
+
+        /* Destaged in the background once writes stop, kept in RAM before */
+        blk_test_update(&m_stage.block_dev, m_states, 120, 4);
+        CHECK(!block_dev_stage_process(&m_stage));
+        CHECK_EQ(m_stage.p_work->used, 1);
+        flash_sim_idle(BLOCK_DEV_STAGE_CONFIG_IDLE_MS * 1000 * 2);
+        CHECK(!block_dev_stage_process(&m_stage));
+        CHECK_EQ(m_stage.p_work->used, 0);
+
+        /* Staged, never flushed */
+        blk_test_update(&m_stage.block_dev, m_states, 130, 5);
+
+        stage_boot();
+        blk_test_verify(&m_stage.block_dev, m_states, TEST_BLOCKS);
+
+        uint32_t buff[BLK_TEST_BLOCK_SIZE / sizeof(uint32_t)];
+        blk_test_read(&m_stage.block_dev, buff, 130, 1);
+        CHECK(blk_test_match(buff, 130, &(blk_test_state_t){ .durable = 1 }));
+}
+
+static uint32_t m_init_events;
+
+static void stage_ev_handler(nrf_block_dev_t const * p_blk_dev,
+                             nrf_block_dev_event_t const * p_event)
+{
+        (void)p_blk_dev;
+        if (p_event->ev_type == NRF_BLOCK_DEV_EVT_INIT)
+        {
+                m_init_events++;
+        }
+}
+
+/**
+ * @brief A second user of an initialized device is refused, its own user may
+ *        initialize it again, and another user gets it once uninitialized.
+ */
+static void test_stage_users(void)
+{
+        stage_setup();
+
+        /* The stage holds the QSPI device without handler */
+        CHECK_EQ(nrf_blk_dev_init(&m_qspi.block_dev, stage_ev_handler, NULL),
+                 NRF_ERROR_INVALID_STATE);
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, stage_ev_handler, NULL),
+                 NRF_ERROR_INVALID_STATE);
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, NULL, &m_init_events),
+                 NRF_ERROR_INVALID_STATE);
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, NULL, NULL), NRF_SUCCESS);
+        CHECK(m_stage.p_work->ev_handler == NULL);
+        CHECK(m_qspi.p_work->ev_handler == NULL);
+
+        /* Handed over through an uninit, as from FatFS to MSC in main.c */
+        blk_test_update(&m_stage.block_dev, m_states, 5, 2);
+        CHECK_EQ(nrf_blk_dev_uninit(&m_stage.block_dev), NRF_SUCCESS);
+        blk_test_synced(m_states, TEST_BLOCKS);
+
+        m_init_events = 0;
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, stage_ev_handler, NULL), NRF_SUCCESS);
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, stage_ev_handler, NULL), NRF_SUCCESS);
+        CHECK_EQ(m_init_events, 2);
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, NULL, NULL), NRF_ERROR_INVALID_STATE);
+        CHECK_EQ(nrf_blk_dev_uninit(&m_stage.block_dev), NRF_SUCCESS);
+
+        CHECK_EQ(nrf_blk_dev_init(&m_stage.block_dev, NULL, NULL), NRF_SUCCESS);
+        blk_test_verify(&m_stage.block_dev, m_states, TEST_BLOCKS);
+}
+
+int main(void)
+{
+        TEST_RUN(test_stage_read_write);
+        TEST_RUN(test_stage_absorb);
+        TEST_RUN(test_stage_unmap);
+        TEST_RUN(test_stage_stall);
+        TEST_RUN(test_stage_flush);
+        TEST_RUN(test_stage_users);
+        return 0;
+}